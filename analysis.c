@@ -43,11 +43,17 @@
 #include <time.h>
 #include <assert.h>
 #include <math.h>
-#include <gsl/gsl_errno.h>
-#include <gsl/gsl_fft_real.h>
-#include <gsl/gsl_fft_halfcomplex.h>
 #include "gjay.h"
 #include "analysis.h"
+#include "decoder.h"
+#include "bpm.h"
+#include "bpm_sad.h"
+#include "spectrum.h"
+#include "pcm_ring.h"
+#include "pcm_cache.h"
+#include "tags.h"
+#include "stats.h"
+#include "work_pool.h"
 #include "ipc.h"
 #include "i18n.h"
 
@@ -55,7 +61,19 @@
 #define SHARED_BUF_SIZE sizeof(short int) * BPM_BUF_SIZE
 #define SLEEP_WHILE_IDLE 500
 
-#define BROKEN_VAL 100000000000000.0
+/* Blocks of SHARED_BUF_SIZE the decoder thread may get ahead by */
+#define PCM_RING_BLOCKS 4
+
+/* Seconds between rewrites of the daemon statistics */
+#define STATS_INTERVAL 10
+
+/* Milliseconds between progress updates to the UI */
+#define PROGRESS_INTERVAL 100
+
+/* Sampled analysis looks at this many parts of this many seconds,
+   spread evenly over songs at least twice as long as all of them */
+#define SAMPLE_SEGMENTS 6
+#define SAMPLE_SECONDS  15
 
 /* Multiplier for the frequency magnitude. 2.0 is close to the orginal value
  * 5.0 gives a brighter display
@@ -64,11 +82,70 @@
 
 typedef struct {
     FILE * f;
+    GjayDecoder * decoder; /* In-process decoder; if NULL we read f */
+    gboolean is_pipe;      /* f is an external decoder */
+    GjayPcmRing * ring;    /* If not NULL, a thread decodes ahead into it */
     waveheaderstruct header;
-    long int freq_seek, seek;
-    char buffer[SHARED_BUF_SIZE];
+    long int seek;         /* Bytes handed to the analysis */
+    /* Decode throughput */
+    guint64 decoded_bytes;
+    gint64  decode_usec;
+    /* Sampled analysis only reads segments of the song, which the
+       analysis sees as one stream of data_length bytes */
+    guint   segments;       /* 0 to read the whole song */
+    guint   segment;        /* Next segment to start */
+    guint64 segment_bytes;
+    guint64 segment_left;   /* Bytes left of the current segment */
+    guint64 song_bytes;     /* Length of the whole decoded song */
+    guint64 position;       /* Where we are in the whole decoded song */
 } wav_file;
 
+struct analysis_worker;
+
+/* run_analysis() works on the decode ring's blocks in place */
+typedef struct {
+    wav_file * wsfile;
+    struct analysis_worker * worker;
+    const gchar * block;    /* Ring block being analyzed, NULL if none */
+    glong     block_start;  /* Its first frame */
+    glong     block_frames;
+    gboolean  eof;
+    gint16  * staging;      /* For windows which aren't inside one block */
+    /* BPM envelope, filled in as the blocks go by */
+    unsigned char * audio;
+    unsigned long   audiosize;
+    long      pos;
+    /* If not NULL, audio only holds the current block's envelope,
+       which is fed to this */
+    BpmStream * stream;
+    /* Envelope bytes a resumed stream has had already, not fed again */
+    guint64   stream_skip;
+} block_reader;
+
+/* Long songs are checkpointed as they are analyzed, see
+   store_checkpoint() */
+typedef struct {
+    gchar   * key;          /* NULL if the song isn't checkpointed */
+    glong     frame;        /* Where the analysis starts, 0 unless resumed */
+    long      pos;          /* The BPM envelope is filled in up to here */
+    BpmStream * stream;     /* Resuming a streamed song, its tempo so far */
+    gint64    stored;       /* When the last checkpoint was stored */
+} analysis_checkpoint;
+
+struct daemon_data;
+
+/* Each worker thread analyzes one song at a time off the shared queue */
+struct analysis_worker {
+  struct daemon_data *ddata;
+  guint         id;
+  GThread       *thread;
+  GjaySong      *analyze_song; /* Protected by ddata->status_lock */
+  volatile gint percent;       /* Only used with g_atomic_int_*() */
+  gdouble       last_bpm;      /* Tempo of the last song, a hint for the next */
+  guint         threads;       /* To split the song being analyzed over */
+  GjayStats     stats;         /* Where the time went on the last song */
+};
+
 /* Sturcture to ferry data around */
 struct daemon_data {
   guint			verbosity;
@@ -79,22 +156,36 @@ struct daemon_data {
   GjayIPC		*ipc;
   GMainLoop   * loop;
   time_t        last_ping;
-  gboolean		in_analysis;
-  GjaySong      *analyze_song;
 
+  guint         workers;
+  struct analysis_worker *worker;
+  GjayWorkPool  *pool;       /* Threads for the one song split at a time,
+                                started the first time a song is */
+  GMutex        queue_lock;  /* Protects the queue, running and quit */
+  GCond         queue_cond;  /* Signalled when there may be work */
+  gboolean      running;     /* Workers may take songs off the queue */
+  gboolean      quit;
+  GMutex        status_lock; /* Protects what the workers report */
+  guint         busy;        /* Workers analyzing a song */
+  gint          percent;     /* Last percentage sent to the UI */
+  GjayStats     stats;       /* All songs so far, under the status lock */
+  gboolean      stats_dirty; /* Ditto, not yet written out */
+  time_t        stats_time;  /* When they last were */
+  GMutex        append_lock; /* Appending to the daemon data file */
+
+  gboolean      external_decoders; /* Don't decode in-process */
+  gboolean      sampled;           /* Quick first pass over new songs */
+  guint64       pcm_cache_bytes;   /* Analysis cache size, 0 for none */
+  gboolean      write_tags;        /* Keep the results in the songs' tags */
+  bpm_engine    bpm_engine;
+  spectrum_engine spectrum_engine;
+  GMutex        decoder_lock;      /* Looking for the decoder programs */
   gchar * mp3_decoder;
   gchar * ogg_decoder;
   gchar * flac_decoder;
 };
 
 
-#define AUDIO_RATE 2756UL      /* Author states that 11025 is perfect
-                                  measure, but we can tolerate more
-                                  lossiness for the sake of speed */
-#define START_BPM 120UL
-#define STOP_BPM 160UL
-
-
 /* Spectrum globals */
 #define MAX_FREQ 22500
 #define START_FREQ 100
@@ -102,36 +193,129 @@ struct daemon_data {
 #define WINDOW_SIZE 1024
 #define STEP_SIZE 1024
 
-static char       * read_buffer;
-static int          read_buffer_size;
-static long         read_buffer_start;
-static long         read_buffer_end; /* same as file position */
-static GList      * queue = NULL; 
+/* Windows each thread takes at a time when a song is split over threads */
+#define SPECTRUM_CHUNK 64
+
+/* Whole songs at least this long are checkpointed every
+   CHECKPOINT_INTERVAL seconds, so a daemon stopped part way through
+   carries on from the last one rather than the start of the song */
+#define CHECKPOINT_MIN_SECONDS 1200
+#define CHECKPOINT_INTERVAL    30
+
+/* Songs at least this long, or of unknown length, have their tempo
+   found as they are decoded rather than from an envelope of the whole
+   song, so they take the same memory however long they are */
+#define BPM_STREAM_MIN_SECONDS 3600
+
+/* The analysis of standard input, a WAV stream */
+#define STDIN_NAME "-"
+
+/* The queue files are journals. Each line is a song added to the queue
+ * or, after QUEUE_DONE, one taken off it, or after QUEUE_PROMOTE a file
+ * or directory moved to the head, so finishing or promoting a song is
+ * one short append. A file is rewritten with only the songs still
+ * queued when there are more of the other lines than songs left, and
+ * at least QUEUE_COMPACT_MIN, which keeps the work per song constant. */
+#define QUEUE_DONE        '-'
+#define QUEUE_PROMOTE     '+'
+#define QUEUE_COMPACT_MIN 256
+
+/* Songs to analyze, taken from the head. Songs the user is looking at
+   are promoted to the head, so they are analyzed next. The hashes map
+   each song to its link in the queue, or to QUEUE_IN_PROGRESS once a
+   worker has taken it. */
+#define QUEUE_IN_PROGRESS ((gpointer) 1)
+static GQueue       queue = G_QUEUE_INIT;
 static GHashTable * queue_hash = NULL;
+static GList      * active = NULL; /* Songs being analyzed */
+/* Songs which only had a sampled analysis, redone in full when there
+   is nothing else to do */
+static GQueue       upgrade = G_QUEUE_INIT;
+static GHashTable * upgrade_hash = NULL;
+static GList      * upgrading = NULL; /* Being redone */
+/* Songs taken off each queue since its file was last rewritten */
+static guint        queue_done = 0;
+static guint        upgrade_done = 0;
 
 static FILE *     inflate_to_wav (struct daemon_data *ddata,
 							  const gchar * path, 
                               const song_file_type type);
+static gsize         wav_ring_fill    ( gpointer user_data,
+                                        gchar * buf,
+                                        const gsize len );
+static gboolean      wav_skip_to      ( wav_file * wsfile,
+                                        const guint64 position );
+static size_t        wav_read         ( wav_file * wsfile,
+                                        void * buf,
+                                        const size_t len );
+static void          wav_close        ( wav_file * wsfile );
+static void wav_header_from_decoder   ( waveheaderstruct * header,
+                                        const GjayDecoder * dec );
 
 static int           run_analysis     ( struct daemon_data *ddata,
+                                 struct analysis_worker *worker,
 								 wav_file * wsfile,
-                                 gdouble * freq_results,
-                                 gdouble * volume_diff,
-                                 gdouble * bpm_result );
-static unsigned long bpm_phasefit     ( const long i,
-    const unsigned char const *audio,
-    const unsigned long audiosize);
-static int           freq_read_frames ( wav_file * wsfile, 
-                                 int start, 
-                                 int length, 
-                                 void *data );
-static void          send_ui_percent        ( const int fd, int percent );
-static void          send_analyze_song_name ( const int fd, GjaySong *song; );
+                                 analysis_checkpoint * checkpoint,
+                                 const gboolean stream_bpm,
+                                 GjayAnalysisSignal * signal );
+static void          store_checkpoint ( analysis_checkpoint * checkpoint,
+                                        block_reader * reader,
+                                        const glong next,
+                                        gdouble * total_mags,
+                                        const gdouble sum,
+                                        const gdouble max_frame_sum,
+                                        const long num_frames );
+static void          finish_analysis  ( struct daemon_data *ddata,
+                                        struct analysis_worker *worker,
+                                        const GjayAnalysisSignal * signal,
+                                        gdouble * freq_results,
+                                        gdouble * volume_diff,
+                                        gdouble * bpm_result );
+static void          bpm_progress     ( gpointer user_data,
+                                        const gint percent );
+static gboolean      next_block       ( block_reader * reader );
+static void          copy_frames      ( block_reader * reader,
+                                        gint16 * dest,
+                                        const glong start,
+                                        const glong n,
+                                        const glong last );
+static const gint16 * window_frames   ( block_reader * reader,
+                                        const glong start,
+                                        const glong last );
+static void          add_window_mags  ( const gdouble * mags,
+                                        gdouble * total_mags,
+                                        gdouble * sum,
+                                        gdouble * max_frame_sum,
+                                        long * num_frames );
+static void          spectrum_parallel ( struct daemon_data *ddata,
+                                        block_reader * reader,
+                                        analysis_checkpoint * checkpoint,
+                                        const glong first,
+                                        glong last,
+                                        GjayWorkPool * pool,
+                                        gdouble * total_mags,
+                                        gdouble * sum,
+                                        gdouble * max_frame_sum,
+                                        long * num_frames );
+static GjayWorkPool *worker_pool            ( struct analysis_worker *worker );
+static gboolean      split_crowded          ( struct daemon_data *ddata );
+static void          set_percent            ( struct analysis_worker *worker,
+                                              int percent );
+static gboolean      forward_percent        ( gpointer data );
+static void          send_analyze_song_name ( struct analysis_worker *worker,
+                                              GjaySong *song );
+static guint         worker_set_song        ( struct analysis_worker *worker,
+                                              GjaySong *song );
 static void   write_queue       ( void );
 static void kill_signal (int sig);
 static void analysis_daemon(struct daemon_data *data);
 gboolean      daemon_idle       ( gpointer data );
-static void analyze( struct daemon_data *data, const char * fname, const gboolean result_to_stdout);
+static gboolean daemon_watchdog ( gpointer data );
+static void     publish_stats   ( struct daemon_data *ddata,
+                                  const gboolean now );
+static gpointer analysis_worker_thread ( gpointer data );
+static gint    decode_song ( struct analysis_worker *worker, const char * fname, const song_file_type type, GjaySong * song, const guint segments, GjayAnalysisSignal * signal );
+static gboolean analyze( struct analysis_worker *worker, const char * fname, const gboolean result_to_stdout, const gboolean sampled);
 static struct daemon_data *create_daemon_data(GjayApp *gjay);
 gboolean ui_pipe_input (GIOChannel *source,
                         GIOCondition condition,
@@ -141,16 +325,25 @@ void
 run_as_analyze_detached  (GjayApp *gjay,  const char * analyze_detached_fname)
 {
   struct daemon_data *data;
+  struct analysis_worker worker;
 
-  if (access(analyze_detached_fname, R_OK) != 0)
+  if (strcmp(analyze_detached_fname, STDIN_NAME) != 0 &&
+      access(analyze_detached_fname, R_OK) != 0)
   {
     fprintf(stderr, _("Song file %s not found\n"), analyze_detached_fname);
     exit(1);
   }
   if ( (data = create_daemon_data(gjay))==NULL)
 	exit(1);
+  create_gjay_ipc(&(data->ipc));
   data->mode = ANALYZE_DETACHED;
-  analyze(data, analyze_detached_fname, TRUE);
+  memset(&worker, 0x00, sizeof(struct analysis_worker));
+  worker.ddata = data;
+  worker.percent = -1;
+  /* Someone is waiting for this one song */
+  worker.threads = data->workers;
+  analyze(&worker, analyze_detached_fname, TRUE, data->sampled);
+  gjay_work_pool_free(data->pool);
   destroy_gjay_ipc(data->ipc);
 }
 
@@ -177,6 +370,7 @@ void run_as_daemon(GjayApp *gjay, gjay_mode mode)
     
   if ( (data = create_daemon_data(gjay))==NULL)
 	exit(1);
+  create_gjay_ipc(&(data->ipc));
   data->mode = mode;
   analysis_daemon(data);
   destroy_gjay_ipc(data->ipc);
@@ -196,6 +390,7 @@ static void kill_signal (int sig) {
   exit(0);
 }
 
+/* Call with the queue lock held */
 static void add_file_to_queue ( char * fname, const int verbosity) {
     char queue_fname[BUFFER_SIZE], buffer[BUFFER_SIZE], * str;
     FILE * f_queue, * f_add;
@@ -213,8 +408,8 @@ static void add_file_to_queue ( char * fname, const int verbosity) {
             read_line(f_add, buffer, BUFFER_SIZE);
             if (!g_hash_table_lookup(queue_hash, buffer)) {
                 str = g_strdup(buffer);
-                queue = g_list_append(queue, str);
-                g_hash_table_insert(queue_hash, str, (void *) 1);
+                g_queue_push_tail(&queue, str);
+                g_hash_table_insert(queue_hash, str, queue.tail);
                 fprintf(f_queue, "%s\n", str);
             }
         }
@@ -225,19 +420,28 @@ static void add_file_to_queue ( char * fname, const int verbosity) {
 
 
 
-static void write_queue (void) {
+/* Call with the queue lock held. Compacts a queue file down to the songs
+   still queued. Songs still being analyzed are kept so they are picked
+   up again if the daemon dies */
+static void write_queue_file (const char * name,
+                              GList * in_progress, GList * pending) {
     char fname[BUFFER_SIZE], fname_temp[BUFFER_SIZE];
     FILE * f;
     GList * llist;
     
     snprintf(fname, BUFFER_SIZE, "%s/%s/%s", getenv("HOME"), 
-             GJAY_DIR, GJAY_QUEUE);
+             GJAY_DIR, name);
     snprintf(fname_temp, BUFFER_SIZE, "%s_temp", fname);
     
-    if (queue) {
+    if (pending || in_progress) {
         f = fopen(fname_temp, "w");
         if (f) {
-            for (llist = g_list_first(queue);
+            for (llist = g_list_first(in_progress);
+                 llist;
+                 llist = g_list_next(llist)) {
+                fprintf(f, "%s\n", (char *) llist->data);
+            }
+            for (llist = g_list_first(pending);
                  llist;
                  llist = g_list_next(llist)) {
                 fprintf(f, "%s\n", (char *) llist->data);
@@ -250,6 +454,152 @@ static void write_queue (void) {
     }
 }
 
+static void write_queue (void) {
+    write_queue_file(GJAY_QUEUE, active, queue.head);
+    queue_done = 0;
+}
+
+static void write_upgrade_queue (void) {
+    write_queue_file(GJAY_UPGRADE_QUEUE, upgrading, upgrade.head);
+    upgrade_done = 0;
+}
+
+/* Call with the queue lock held. Journal a song added to a queue or,
+   with QUEUE_DONE or QUEUE_PROMOTE as mark, taken off or promoted */
+static void append_queue_file (const char * name, const char * file,
+                               const char mark) {
+    char fname[BUFFER_SIZE];
+    FILE * f;
+
+    snprintf(fname, BUFFER_SIZE, "%s/%s/%s", getenv("HOME"), 
+             GJAY_DIR, name);
+    f = fopen(fname, "a");
+    if (f) {
+        if (mark)
+            fputc(mark, f);
+        fprintf(f, "%s\n", file);
+        fclose(f);
+    }
+}
+
+/* Call with the queue lock held, once file is out of queue_hash */
+static void queue_file_done (const char * file) {
+    append_queue_file(GJAY_QUEUE, file, QUEUE_DONE);
+    if (++queue_done > MAX(QUEUE_COMPACT_MIN, g_hash_table_size(queue_hash)))
+        write_queue();
+}
+
+/* Call with the queue lock held, once path has been promoted */
+static void queue_file_promoted (const char * path) {
+    append_queue_file(GJAY_QUEUE, path, QUEUE_PROMOTE);
+    if (++queue_done > MAX(QUEUE_COMPACT_MIN, g_hash_table_size(queue_hash)))
+        write_queue();
+}
+
+/* Call with the queue lock held, once file is out of upgrade_hash */
+static void upgrade_file_done (const char * file) {
+    append_queue_file(GJAY_UPGRADE_QUEUE, file, QUEUE_DONE);
+    if (++upgrade_done > MAX(QUEUE_COMPACT_MIN,
+                             g_hash_table_size(upgrade_hash)))
+        write_upgrade_queue();
+}
+
+
+/* Call with the queue lock held. A song which has just had a full
+   analysis doesn't need upgrading any more. */
+static void drop_upgrade (const char * file) {
+    GList * llist;
+
+    llist = g_hash_table_lookup(upgrade_hash, file);
+    if (llist == NULL || llist == QUEUE_IN_PROGRESS)
+        return; /* Not queued, or being upgraded right now */
+    g_hash_table_remove(upgrade_hash, file);
+    upgrade_file_done(file);
+    g_free(llist->data);
+    g_queue_delete_link(&upgrade, llist);
+}
+
+
+/**
+ * Call with the queue lock held. Move the songs in list which are path,
+ * or are somewhere under it if it is a directory, to the head of it,
+ * keeping their order. Returns how many there were. A song is found
+ * from its link in hash; only a directory needs the whole list.
+ */
+static gint promote_in_queue (GQueue * list, GHashTable * hash,
+                              const char * path) {
+    GQueue promoted = G_QUEUE_INIT;
+    GList * llist, * next;
+    const char * file;
+    gsize len;
+    gint n;
+
+    llist = g_hash_table_lookup(hash, path);
+    if (llist == QUEUE_IN_PROGRESS)
+        return 0;
+    if (llist) {
+        g_queue_unlink(list, llist);
+        g_queue_push_head_link(list, llist);
+        return 1;
+    }
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    for (llist = list->head; llist; llist = next) {
+        next = llist->next;
+        file = llist->data;
+        if (strncmp(file, path, len) == 0 &&
+            (file[len] == '\0' || file[len] == '/')) {
+            g_queue_unlink(list, llist);
+            g_queue_push_tail_link(&promoted, llist);
+        }
+    }
+    n = g_queue_get_length(&promoted);
+    while ((llist = g_queue_pop_tail_link(&promoted)) != NULL)
+        g_queue_push_head_link(list, llist);
+    return n;
+}
+
+
+/* Replay a queue file onto the end of list. Returns how many songs it
+   has taken off or promoted in the queue, to count towards the next
+   compaction. */
+static guint read_queue_file (const char * name, GQueue * list,
+                              GHashTable * hash) {
+    char buffer[BUFFER_SIZE];
+    gchar * file;
+    FILE * f;
+    GList * llist;
+    guint done = 0;
+
+    snprintf(buffer, BUFFER_SIZE, "%s/%s/%s", getenv("HOME"), 
+             GJAY_DIR, name);
+    f = fopen(buffer, "r");
+    if (f) {
+        while (!feof(f)) {
+            read_line(f, buffer, BUFFER_SIZE);
+            if (buffer[0] == QUEUE_DONE) {
+                done++;
+                llist = g_hash_table_lookup(hash, buffer + 1);
+                if (llist) {
+                    g_hash_table_remove(hash, buffer + 1);
+                    g_free(llist->data);
+                    g_queue_delete_link(list, llist);
+                }
+            } else if (buffer[0] == QUEUE_PROMOTE) {
+                done++;
+                promote_in_queue(list, hash, buffer + 1);
+            } else if (strlen(buffer) &&!g_hash_table_lookup(hash, buffer)) {
+                file = g_strdup(buffer);
+                g_queue_push_tail(list, file);
+                g_hash_table_insert(hash, file, list->tail);
+            }
+        }
+        fclose(f);
+    }
+    return done;
+}
+
 
 
 gboolean ui_pipe_input (GIOChannel *source,
@@ -258,6 +608,7 @@ gboolean ui_pipe_input (GIOChannel *source,
     GList * list;
     char buffer[BUFFER_SIZE], * file;
     int len, k, l;
+    guint w;
     ipc_type ipc;
 	struct daemon_data *ddata = (struct daemon_data*)user_data;
 
@@ -297,13 +648,26 @@ gboolean ui_pipe_input (GIOChannel *source,
                  GJAY_DIR, GJAY_QUEUE);
         if (ddata->verbosity > 1)
             printf(_("Daemon is clearing out analysis queue, deleting file '%s'\n"), buffer);
+        g_mutex_lock(&ddata->queue_lock);
         unlink(buffer);
-        for (list = g_list_first(queue); list; list = g_list_next(list)) 
+        for (list = queue.head; list; list = g_list_next(list)) 
             g_free(list->data);
-        g_list_free(queue);
-        queue = NULL;
+        g_queue_clear(&queue);
         g_hash_table_destroy(queue_hash);
         queue_hash = g_hash_table_new(g_str_hash, g_str_equal);
+        /* Songs being analyzed are still owned by their workers */
+        for (list = g_list_first(active); list; list = g_list_next(list))
+            g_hash_table_insert(queue_hash, list->data, QUEUE_IN_PROGRESS);
+        /* Sampled songs keep their tag, so queueing them again redoes
+           them */
+        for (list = upgrade.head; list; list = g_list_next(list)) {
+            g_hash_table_remove(upgrade_hash, list->data);
+            g_free(list->data);
+        }
+        g_queue_clear(&upgrade);
+        queue_done = 0;
+        write_upgrade_queue();
+        g_mutex_unlock(&ddata->queue_lock);
         break;
     case QUEUE_FILE:
         /* If the file is not already in the queue, enqueue the file and
@@ -312,10 +676,23 @@ gboolean ui_pipe_input (GIOChannel *source,
         file = buffer + sizeof(ipc_type);
         if (ddata->verbosity > 1) 
             printf(_("Daemon queuing song file '%s'\n"), file);
+        g_mutex_lock(&ddata->queue_lock);
         add_file_to_queue(file, ddata->verbosity);
+        g_mutex_unlock(&ddata->queue_lock);
         g_idle_add (daemon_idle, ddata);
         unlink(file);
         break;
+    case PROMOTE:
+        buffer[len] = '\0';
+        file = buffer + sizeof(ipc_type);
+        g_mutex_lock(&ddata->queue_lock);
+        k = promote_in_queue(&queue, queue_hash, file);
+        if (k > 0)
+            queue_file_promoted(file);
+        g_mutex_unlock(&ddata->queue_lock);
+        if (ddata->verbosity > 1 && k > 0)
+            printf(_("Daemon analyzing %d songs in '%s' next\n"), k, file);
+        break;
     case DETACH: 
         if (ddata->mode == DAEMON) {
             if (ddata->verbosity)
@@ -329,8 +706,12 @@ gboolean ui_pipe_input (GIOChannel *source,
             if (ddata->verbosity)
                 printf(_("Attaching to daemon\n"));
             ddata->mode = DAEMON;
-            if(ddata->in_analysis && ddata->analyze_song)
-                send_analyze_song_name(ddata->ipc->daemon_fifo, ddata->analyze_song);
+            g_mutex_lock(&ddata->status_lock);
+            for (w = 0; w < ddata->workers; w++)
+                if (ddata->worker[w].analyze_song)
+                    send_analyze_song_name(&ddata->worker[w],
+                                           ddata->worker[w].analyze_song);
+            g_mutex_unlock(&ddata->status_lock);
         }
         
         break;
@@ -350,139 +731,417 @@ gboolean ui_pipe_input (GIOChannel *source,
 
 
 
-static void
-analyze(struct daemon_data *ddata,
-	    const char * fname,            /* File to analyze */
-        const gboolean result_to_stdout) /* Write result to stdout? */
+/**
+ * Decode fname and run the analysis over it, filling in signal.
+ * Returns -1 if the song can't be decoded at all, otherwise whether the
+ * analysis worked.
+ */
+static gint
+decode_song(struct analysis_worker *worker,
+            const char * fname,
+            const song_file_type type,
+            GjaySong * song,
+            const guint segments,          /* 0 for the whole song */
+            GjayAnalysisSignal * signal)
 {
+    struct daemon_data *ddata = worker->ddata;
     FILE * f;
-    gchar * utf8;
     wav_file wsfile;
-    int result, i;
+    int result;
     char buffer[BUFFER_SIZE];
+    const gchar * decoder_name;
+    GjayPcmRingStats ring_stats;
+    guint64 start;
+    analysis_checkpoint checkpoint;
+    gchar * variant, * stream_data;
+    gsize stream_size;
+    guint64 frame, pos, bpm_nsec;
+    gboolean stream_bpm, resumable;
+
+    start = gjay_stats_now();
+    memset(&wsfile, 0x00, sizeof(wav_file));
+    memset(&checkpoint, 0x00, sizeof(analysis_checkpoint));
+    if (!ddata->external_decoders && strcmp(fname, STDIN_NAME) != 0)
+        wsfile.decoder = gjay_decoder_open(fname, type, ddata->verbosity);
+
+    if (wsfile.decoder) {
+        wav_header_from_decoder(&wsfile.header, wsfile.decoder);
+        decoder_name = wsfile.decoder->backend->name;
+    } else {
+        /* No in-process decoder, fall back to the helper programs */
+        if (strcmp(fname, STDIN_NAME) == 0)
+            f = stdin;
+        else if ( (f = inflate_to_wav(ddata, fname, type)) == NULL)
+        {
+          if (ddata->verbosity)
+            g_warning(_("Unable to inflate song '%s'.\n"), fname);
+          return -1;
+        }
+        wsfile.f = f;
+        wsfile.is_pipe = (type != WAV || f == stdin);
+        decoder_name = wsfile.is_pipe ? _("external decoder") : _("WAV file");
+        if (fread(&wsfile.header, sizeof(waveheaderstruct), 1, f) < 1) {
+            g_warning(_("Unable to read WAV header '%s'.\n"), fname);
+            wav_close(&wsfile);
+            return -1;
+        }
+        /* Check to see if the decoder really decoded */
+        if (wsfile.header.main_chunk[0] == '\0') {
+          if (ddata->verbosity)
+            g_warning(_("Decoding of song '%s' failed, bad wav header.\n"), fname);
+          wav_close(&wsfile);
+          return -1;
+        }
+        wav_header_swab(&wsfile.header);
+    }
+    gjay_stats_span_end(&worker->stats, GJAY_SPAN_INFLATE, start);
+    stream_bpm = (segments == 0 &&
+                  (song->length <= 0 || song->length >= BPM_STREAM_MIN_SECONDS));
+    if (song->length <= 0)
+        /* Analyzed to the end, wherever that is */
+        wsfile.header.data_length = 0;
+    else
+        wsfile.header.data_length = (MAX(1, song->length - 1)) * wsfile.header.byte_p_sec;
+    if (segments) {
+        /* The analysis only sees the segments, one after the other */
+        wsfile.segments = segments;
+        wsfile.segment_bytes = (guint64) SAMPLE_SECONDS * wsfile.header.byte_p_sec;
+        wsfile.song_bytes = wsfile.header.data_length;
+        wsfile.header.data_length = segments * wsfile.segment_bytes;
+    } else if ((stream_bpm || song->length >= CHECKPOINT_MIN_SECONDS) &&
+               strcmp(fname, STDIN_NAME) != 0) {
+        /* Standard input gets no key, as it can't be looked at again */
+        variant = g_strdup_printf("checkpoint %s",
+                                  spectrum_engine_name(ddata->spectrum_engine));
+        checkpoint.key = gjay_pcm_cache_key(fname, variant);
+        g_free(variant);
+    }
+
+    /* Carry on from where a stopped daemon got to */
+    signal->bins = WINDOW_SIZE / 2;
+    if (checkpoint.key &&
+        gjay_pcm_checkpoint_load(checkpoint.key, signal, &frame, &pos,
+                                 &stream_data, &stream_size)) {
+        checkpoint.frame = frame;
+        checkpoint.pos = pos;
+        if (stream_bpm) {
+            /* The tempo so far in place of an envelope, and a song of
+               unknown length could end anywhere */
+            if (stream_data && signal->audio == NULL)
+                checkpoint.stream = bpm_stream_load(stream_data,
+                                                    stream_size);
+            resumable = (checkpoint.stream != NULL &&
+                         pos <= bpm_stream_fed(checkpoint.stream) &&
+                         (wsfile.header.data_length == 0 ||
+                          checkpoint.frame * wsfile.header.byte_p_spl <
+                              wsfile.header.data_length));
+        } else {
+            resumable = (stream_data == NULL &&
+                         signal->audiosize == wsfile.header.data_length /
+                                              (4 * (44100 / AUDIO_RATE)) &&
+                         checkpoint.frame * wsfile.header.byte_p_spl <
+                             wsfile.header.data_length);
+        }
+        g_free(stream_data);
+        if (signal->modus != wsfile.header.modus ||
+            checkpoint.frame <= 0 || !resumable) {
+            gjay_analysis_signal_clear(signal);
+            bpm_stream_free(checkpoint.stream);
+            checkpoint.stream = NULL;
+            checkpoint.frame = 0;
+            checkpoint.pos = 0;
+        } else if (!wav_skip_to(&wsfile, (guint64) checkpoint.frame *
+                                         wsfile.header.byte_p_spl)) {
+            g_warning(_("Unable to resume the analysis of '%s'\n"), fname);
+            gjay_analysis_signal_clear(signal);
+            bpm_stream_free(checkpoint.stream);
+            gjay_pcm_checkpoint_drop(checkpoint.key);
+            g_free(checkpoint.key);
+            wav_close(&wsfile);
+            return -1;
+        } else {
+            wsfile.seek = (guint64) checkpoint.frame * wsfile.header.byte_p_spl;
+            if (ddata->verbosity)
+                printf(_("Resuming the analysis of '%s' at %ld seconds\n"),
+                       fname, (long) (checkpoint.frame /
+                                      MAX(1, wsfile.header.sample_fq)));
+        }
+    }
+
+    /* Decode in another thread while this one analyzes */
+    wsfile.ring = gjay_pcm_ring_new(PCM_RING_BLOCKS, SHARED_BUF_SIZE,
+                                    wav_ring_fill, &wsfile);
+    start = gjay_stats_now();
+    bpm_nsec = worker->stats.nsec[GJAY_SPAN_BPM_COARSE];
+    result = run_analysis(ddata, worker, &wsfile, &checkpoint, stream_bpm,
+                          signal);
+    start = gjay_stats_now() - start;
+    /* Less any tempo found on the way */
+    bpm_nsec = worker->stats.nsec[GJAY_SPAN_BPM_COARSE] - bpm_nsec;
+    start -= MIN(start, bpm_nsec);
+    /* Done with, one way or the other */
+    if (checkpoint.key) {
+        gjay_pcm_checkpoint_drop(checkpoint.key);
+        g_free(checkpoint.key);
+    }
+    bpm_stream_free(checkpoint.stream);
+
+    /* Finish reading rest of output */
+    while (wav_read(&wsfile, buffer, BUFFER_SIZE))
+        ;
+    gjay_pcm_ring_stats(wsfile.ring, &ring_stats);
+    gjay_pcm_ring_free(wsfile.ring);
+    wsfile.ring = NULL;
+    /* The spectrum is what run_analysis() did, less waiting for decoding */
+    gjay_stats_add_span(&worker->stats, GJAY_SPAN_SPECTRUM,
+        start - MIN(start, (guint64) ring_stats.consumer_stall_usec * 1000));
+    gjay_stats_add_span(&worker->stats, GJAY_SPAN_DECODE,
+                        (guint64) wsfile.decode_usec * 1000);
+    worker->stats.bytes_decoded += wsfile.decoded_bytes;
+    worker->stats.frames += (stream_bpm ? wsfile.seek :
+                             wsfile.header.data_length) /
+        MAX(1, wsfile.header.byte_p_spl);
+    if (ddata->verbosity > 1 && ring_stats.blocks > 0)
+        printf(_("Decode ring: %u blocks, mean depth %.2f (max %u), "
+                 "decoder waited %.2f seconds, analysis waited %.2f seconds\n"),
+               PCM_RING_BLOCKS,
+               ring_stats.depth_sum / (gdouble) ring_stats.blocks,
+               ring_stats.depth_max,
+               ring_stats.producer_stall_usec / (gdouble) G_USEC_PER_SEC,
+               ring_stats.consumer_stall_usec / (gdouble) G_USEC_PER_SEC);
+    if (ddata->verbosity && wsfile.decode_usec > 0)
+        printf(_("Decoded %.1f MB in %.2f seconds (%.2f MB/s) using %s\n"),
+               wsfile.decoded_bytes / 1048576.0,
+               wsfile.decode_usec / (gdouble) G_USEC_PER_SEC,
+               (wsfile.decoded_bytes / 1048576.0) /
+               (wsfile.decode_usec / (gdouble) G_USEC_PER_SEC),
+               decoder_name);
+    wav_close(&wsfile);
+    return result;
+}
+
+
+/**
+ * Analyze fname and store the result. With sampled, only parts of a
+ * long song are analyzed. Returns TRUE if the stored result is from a
+ * sampled analysis, so the song wants doing again in full some time.
+ */
+static gboolean
+analyze(struct analysis_worker *worker,
+	    const char * fname,            /* File to analyze */
+        const gboolean result_to_stdout, /* Write result to stdout? */
+        const gboolean sampled)        /* Only look at parts of the song? */
+{
+    struct daemon_data *ddata = worker->ddata;
+    gchar * utf8;
+    int result, i;
     gdouble freq[NUM_FREQ_SAMPLES], volume_diff, analyze_bpm;
     gboolean is_song;
     song_file_type type;
     time_t t=0;
-
-    ddata->analyze_song = NULL;
-    ddata->in_analysis = TRUE;
-    
-    send_ui_percent(ddata->ipc->daemon_fifo, 0);
+    GjaySong * song;
+    gboolean sampled_result;
+    guint segments = 0;
+    GjayAnalysisSignal signal;
+    gchar * cache_key = NULL, * variant = NULL;
+    gboolean cached = FALSE, from_tags, tagged = FALSE;
+    GjayTags tags;
+    struct stat buf;
+    guint64 start;
+    gboolean from_stdin;
+
+    memset(&worker->stats, 0x00, sizeof(GjayStats));
+    set_percent(worker, 0);
     if (fname == NULL || fname[0] == '\0') {
-      ddata->in_analysis = FALSE;
-      return;
+      return FALSE;
     }
+    from_stdin = (strcmp(fname, STDIN_NAME) == 0);
     
-    if (access(fname, R_OK) != 0) {
+    if (!from_stdin && access(fname, R_OK) != 0) {
         /* File ain't there! The UI thread will check for non-existant
            files periodically. */
         if (ddata->verbosity)
             g_warning(_("analyze(): File '%s' cannot be read\n"),fname);
-        ddata->in_analysis = FALSE;
-        return;
+        return FALSE;
     }
 
-    ddata->analyze_song = create_song();
+    song = create_song();
 
     utf8 = strdup_to_utf8(fname);
-    song_set_path(ddata->analyze_song, utf8);
+    song_set_path(song, utf8);
     g_free(utf8);
 
-    file_info(ddata->verbosity,
-			  ddata->ogg_supported, ddata->flac_supported,
-			  ddata->analyze_song->path, 
-              &is_song, 
-              &ddata->analyze_song->inode,
-              &ddata->analyze_song->dev,
-              &ddata->analyze_song->length,
-              &ddata->analyze_song->title,
-              &ddata->analyze_song->artist,
-              &ddata->analyze_song->album, 
-              &type);
+    if (from_stdin) {
+        /* A WAV stream, as long as it is */
+        is_song = TRUE;
+        type = WAV;
+        memset(&tags, 0x00, sizeof(GjayTags));
+    } else {
+        file_info(ddata->verbosity,
+                  ddata->ogg_supported, ddata->flac_supported,
+                  song->path,
+                  &is_song,
+                  &song->inode,
+                  &song->dev,
+                  &song->length,
+                  &song->title,
+                  &song->artist,
+                  &song->album,
+                  &type,
+                  &tags);
+    }
 
     if (!is_song) {
         if (ddata->verbosity)
           g_warning(_("File '%s' is not a recognised song.\n"),fname);
-        ddata->in_analysis = FALSE;
-		delete_song(ddata->analyze_song);
-        return;
+		delete_song(song);
+        return FALSE;
     }
     
-    send_analyze_song_name(ddata->ipc->daemon_fifo, ddata->analyze_song);
-    send_ipc_text(ddata->ipc->daemon_fifo, ANIMATE_START, ddata->analyze_song->path);
-
-    if ( (f = inflate_to_wav(ddata, fname, type)) == NULL)
-    {
-      if (ddata->verbosity)
-        g_warning(_("Unable to inflate song '%s'.\n"), fname);
-      ddata->in_analysis = FALSE;
-	  delete_song(ddata->analyze_song);
-      return;
-    }
-    memset(&wsfile, 0x00, sizeof(wav_file));
-    wsfile.f = f;
-    if (fread(&wsfile.header, sizeof(waveheaderstruct), 1, f) < 1) {
-        g_warning(_("Unable to read WAV header '%s'.\n"), fname);
-        ddata->in_analysis = FALSE;
-        delete_song(ddata->analyze_song);
-        return;
+    worker_set_song(worker, song);
+    send_ipc_text(ddata->ipc->daemon_fifo, ANIMATE_START, song->path);
+    if (!from_stdin)
+        song->fingerprint = file_fingerprint(fname);
+
+    /* Analyzed before, here or somewhere else */
+    from_tags = ((tags.found & GJAY_TAGS_ALL) == GJAY_TAGS_ALL);
+
+    if (!from_tags && sampled &&
+        song->length >= 2 * SAMPLE_SEGMENTS * SAMPLE_SECONDS)
+        segments = SAMPLE_SEGMENTS;
+
+    memset(&signal, 0x00, sizeof(GjayAnalysisSignal));
+    signal.bins = WINDOW_SIZE / 2;
+    if (!from_tags && !from_stdin && ddata->pcm_cache_bytes > 0) {
+        /* The spectra differ a little between engines */
+        variant = g_strdup_printf("%s %u",
+                                  spectrum_engine_name(ddata->spectrum_engine),
+                                  segments);
+        cache_key = gjay_pcm_cache_key(fname, variant);
+        if (cache_key)
+            cached = gjay_pcm_cache_load(cache_key, &signal);
     }
-	/* Check to see if the decoder really decoded */
-	if (wsfile.header.main_chunk[0] == '\0') {
-	  if (ddata->verbosity)
-		g_warning(_("Decoding of song '%s' failed, bad wav header.\n"), fname);
-	  ddata->in_analysis = FALSE;
-	  delete_song(ddata->analyze_song);
-	  return;
-	}
-    wav_header_swab(&wsfile.header);
-    wsfile.header.data_length = (MAX(1, ddata->analyze_song->length - 1)) * wsfile.header.byte_p_sec;
 
     if (ddata->verbosity) {
-        printf(_("Analyzing song file '%s'\n"), fname);
+        if (from_tags)
+            printf(_("Using the analysis in the tags of '%s'\n"), fname);
+        else if (cached)
+            printf(_("Analyzing song file '%s' from the analysis cache\n"),
+                   fname);
+        else if (segments)
+            printf(_("Analyzing %u x %u seconds of song file '%s'\n"),
+                   segments, SAMPLE_SECONDS, fname);
+        else
+            printf(_("Analyzing song file '%s'\n"), fname);
         t = time(NULL);
     }
 
-    result = run_analysis(ddata, &wsfile, freq, &volume_diff, &analyze_bpm); 
+    if (from_tags) {
+        result = TRUE;
+        for (i = 0; i < NUM_FREQ_SAMPLES; i++)
+            freq[i] = tags.freq[i];
+        volume_diff = tags.volume_diff;
+        analyze_bpm = tags.bpm;
+    } else {
+        if (cached) {
+            result = TRUE;
+        } else {
+            result = decode_song(worker, fname, type, song, segments, &signal);
+            if (result < 0) {
+                worker_set_song(worker, NULL);
+                delete_song(song);
+                g_free(cache_key);
+                g_free(variant);
+                return FALSE;
+            }
+        }
+        if (result)
+            finish_analysis(ddata, worker, &signal, freq, &volume_diff,
+                            &analyze_bpm);
+    }
 
     if (ddata->verbosity) 
-        printf(_("Analysis took %ld seconds\n"), time(NULL) - t);
+        printf(_("Analysis of '%s' took %ld seconds\n"), fname, time(NULL) - t);
     
-    send_ui_percent(ddata->ipc->daemon_fifo, 0);
+    set_percent(worker, 0);
 
-    if (result && ddata->analyze_song) {
+    if (result) {
         for (i = 0; i < NUM_FREQ_SAMPLES; i++) 
-            ddata->analyze_song->freq[i] = freq[i];
-        ddata->analyze_song->bpm = analyze_bpm;
-        if (isinf(ddata->analyze_song->bpm) || (ddata->analyze_song->bpm < MIN_BPM)) {
-            ddata->analyze_song->bpm_undef = TRUE;
+            song->freq[i] = freq[i];
+        song->bpm = analyze_bpm;
+        if (isinf(song->bpm) || (song->bpm < MIN_BPM)) {
+            song->bpm_undef = TRUE;
         } else {
-            ddata->analyze_song->bpm_undef = FALSE;
+            song->bpm_undef = FALSE;
+            worker->last_bpm = song->bpm;
         }
-        ddata->analyze_song->volume_diff = volume_diff;
-        ddata->analyze_song->no_data = FALSE;
+        song->volume_diff = volume_diff;
+        song->no_data = FALSE;
+        song->sampled = (segments > 0);
     } 
 
-    /* Finish reading rest of output */
-    while ((result = fread(buffer, 1,  BUFFER_SIZE, f)))
-        ;
-    fclose(f);
+    /* Only full analyses go in the tags, so they are never redone */
+    if (result && !from_tags && !from_stdin && segments == 0 &&
+        ddata->write_tags) {
+        tagged = gjay_tags_write(fname, type, song);
+        if (tagged) {
+            /* The file may have been replaced and its start has changed */
+            if (stat(fname, &buf) == 0) {
+                song->inode = buf.st_ino;
+                song->dev = buf.st_dev;
+            }
+            g_free(song->fingerprint);
+            song->fingerprint = file_fingerprint(fname);
+        } else if (ddata->verbosity) {
+            g_warning(_("Unable to write the analysis to the tags of '%s'\n"),
+                      fname);
+        }
+    }
 
-    send_ipc(ddata->ipc->daemon_fifo, ANIMATE_STOP);
-    send_ipc_text(ddata->ipc->daemon_fifo, STATUS_TEXT, "Idle");
+    /* After any tagging, which changes the file the key is made from.
+       A tempo found as the song went by is kept in place of an
+       envelope. */
+    if (result && cache_key && (!cached || tagged)) {
+        if (tagged) {
+            g_free(cache_key);
+            cache_key = gjay_pcm_cache_key(fname, variant);
+        }
+        if (cache_key)
+            gjay_pcm_cache_store(cache_key, &signal, ddata->pcm_cache_bytes);
+    }
+    g_free(cache_key);
+    g_free(variant);
+    gjay_analysis_signal_clear(&signal);
+
+    /* Only go idle when the last busy worker is done */
+    if (worker_set_song(worker, NULL) == 0) {
+        send_ipc(ddata->ipc->daemon_fifo, ANIMATE_STOP);
+        send_ipc_text(ddata->ipc->daemon_fifo, STATUS_TEXT, "Idle");
+    }
 
+    /* The UI reads the new entry from where it was appended, so keep
+       the append and the message together */
+    start = gjay_stats_now();
+    g_mutex_lock(&ddata->append_lock);
     if (result_to_stdout) {
-        write_song_data(stdout, ddata->analyze_song);
+        write_song_data(stdout, song);
+        result = 0;
     } else {
-        result = append_daemon_file(ddata->analyze_song);
+        result = append_daemon_file(song);
     }
     if (result >= 0) 
         send_ipc_int(ddata->ipc->daemon_fifo, ADDED_FILE, result);
-    delete_song(ddata->analyze_song);
-    ddata->in_analysis = FALSE;
-    ddata->analyze_song = NULL;
-    return;
+    g_mutex_unlock(&ddata->append_lock);
+    gjay_stats_span_end(&worker->stats, GJAY_SPAN_APPEND, start);
+
+    worker->stats.songs = 1;
+    g_mutex_lock(&ddata->status_lock);
+    gjay_stats_add(&ddata->stats, &worker->stats);
+    ddata->stats_dirty = TRUE;
+    g_mutex_unlock(&ddata->status_lock);
+    sampled_result = !song->no_data && song->sampled;
+    delete_song(song);
+    return sampled_result;
 }
 
 static void
@@ -508,8 +1167,10 @@ inflate_to_wav (struct daemon_data *ddata, const gchar * path, const song_file_t
   FILE *fp;
 
   quoted_path = g_shell_quote(path);
+  g_mutex_lock(&ddata->decoder_lock);
   if (ddata->mp3_decoder == NULL)
     check_decoders(ddata);
+  g_mutex_unlock(&ddata->decoder_lock);
 
   switch (type) {
     case OGG:
@@ -559,6 +1220,167 @@ inflate_to_wav (struct daemon_data *ddata, const gchar * path, const song_file_t
 }
 
 
+/* Read len bytes of PCM, from either the in-process decoder or the
+   (possibly popen'ed) file. Like fread, only returns short at the end
+   of the stream. */
+static size_t
+wav_read_stream (wav_file * wsfile, void * buf, const size_t len)
+{
+    size_t count = 0;
+    glong result;
+
+    if (wsfile->decoder) {
+        while (count < len) {
+            result = gjay_decoder_read(wsfile->decoder,
+                                       (gchar *) buf + count, len - count);
+            if (result <= 0)
+                break;
+            count += result;
+        }
+    } else {
+        count = fread(buf, 1, len, wsfile->f);
+    }
+    wsfile->position += count;
+    wsfile->decoded_bytes += count;
+    return count;
+}
+
+
+/* Move the stream on to byte position of the decoded song. Seeks if the
+   decoder or file can, otherwise reads and throws away. */
+static gboolean
+wav_skip_to (wav_file * wsfile, const guint64 position)
+{
+    char scratch[4096];
+    size_t count;
+
+    if (position == wsfile->position)
+        return TRUE;
+    if (wsfile->decoder) {
+        if (gjay_decoder_seek(wsfile->decoder,
+                              position / wsfile->header.byte_p_spl)) {
+            wsfile->position = position;
+            return TRUE;
+        }
+    } else if (!wsfile->is_pipe) {
+        if (fseek(wsfile->f, sizeof(waveheaderstruct) + position,
+                  SEEK_SET) == 0) {
+            wsfile->position = position;
+            return TRUE;
+        }
+    }
+    while (wsfile->position < position) {
+        count = wav_read_stream(wsfile, scratch,
+                                MIN(sizeof(scratch), position - wsfile->position));
+        if (count == 0)
+            return FALSE;
+    }
+    return wsfile->position == position;
+}
+
+
+/**
+ * Decode len bytes of PCM. For a sampled analysis this reads the
+ * segments one after the other, as if there was nothing in between.
+ * Like fread, only returns short at the end. Time spent here is counted
+ * as decode time.
+ */
+static size_t
+wav_decode (wav_file * wsfile, void * buf, const size_t len)
+{
+    size_t count = 0, want, got;
+    guint64 start_at;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    if (wsfile->segments == 0) {
+        count = wav_read_stream(wsfile, buf, len);
+    } else {
+        while (count < len) {
+            if (wsfile->segment_left == 0) {
+                if (wsfile->segment == wsfile->segments)
+                    break;
+                /* Segment k is in the middle of the k-th of equal parts */
+                start_at = (2 * wsfile->segment + 1) * wsfile->song_bytes /
+                    (2 * wsfile->segments) - wsfile->segment_bytes / 2;
+                start_at -= start_at % wsfile->header.byte_p_spl;
+                wsfile->segment++;
+                if (!wav_skip_to(wsfile, start_at))
+                    break;
+                wsfile->segment_left = wsfile->segment_bytes;
+            }
+            want = MIN(len - count, wsfile->segment_left);
+            got = wav_read_stream(wsfile, (char *) buf + count, want);
+            count += got;
+            wsfile->segment_left -= got;
+            if (got < want)
+                break;
+        }
+    }
+    wsfile->decode_usec += g_get_monotonic_time() - start;
+    return count;
+}
+
+
+/* The decoder thread's side of wsfile->ring */
+static gsize
+wav_ring_fill (gpointer user_data, gchar * buf, const gsize len)
+{
+    return wav_decode((wav_file *) user_data, buf, len);
+}
+
+
+/* Read len bytes of PCM, from the decoder thread if there is one */
+static size_t
+wav_read (wav_file * wsfile, void * buf, const size_t len)
+{
+    if (wsfile->ring)
+        return gjay_pcm_ring_read(wsfile->ring, buf, len);
+    return wav_decode(wsfile, buf, len);
+}
+
+
+static void
+wav_close (wav_file * wsfile)
+{
+    /* Stop the decoder thread before taking the decoder away */
+    gjay_pcm_ring_free(wsfile->ring);
+    wsfile->ring = NULL;
+    if (wsfile->decoder) {
+        gjay_decoder_close(wsfile->decoder);
+        wsfile->decoder = NULL;
+    }
+    if (wsfile->f) {
+        if (wsfile->f == stdin)
+            ;
+        else if (wsfile->is_pipe)
+            pclose(wsfile->f);
+        else
+            fclose(wsfile->f);
+        wsfile->f = NULL;
+    }
+}
+
+
+/* In-process decoders hand us raw PCM; make up the header an external
+   decoder would have written */
+static void
+wav_header_from_decoder (waveheaderstruct * header, const GjayDecoder * dec)
+{
+    memcpy(header->main_chunk, "RIFF", 4);
+    memcpy(header->chunk_type, "WAVE", 4);
+    memcpy(header->sub_chunk, "fmt ", 4);
+    memcpy(header->data_chunk, "data", 4);
+    header->length_chunk = 16;
+    header->format = 1;
+    header->modus = dec->channels;
+    header->sample_fq = dec->rate;
+    header->byte_p_spl = 2 * dec->channels;
+    header->byte_p_sec = dec->rate * header->byte_p_spl;
+    header->bit_p_spl = 16;
+}
+
+
 /* Swap the byte order of wav header. Wavs are stored little-endian, so this
    is necessary when using on big-endian (e.g. PPC) machines */
 void
@@ -588,21 +1410,21 @@ wav_header_swab(waveheaderstruct * header)
  */
 static int
 run_analysis  (struct daemon_data *ddata,
+                   struct analysis_worker *worker,
 				   wav_file * wsfile,
-                   gdouble * freq_results,
-                   gdouble * volume_diff,
-                   gdouble * bpm_result )
+                   analysis_checkpoint * checkpoint,
+                   const gboolean stream_bpm,
+                   GjayAnalysisSignal * signal )
 {
-    int16_t *freq_data;
-    double *ch1 = NULL, *ch2 = NULL, *mags = NULL;
-    long i, j, k, bin;
+    const gint16 *frames;
+    double *mags = NULL, *mags2 = NULL;
+    spectrum_plan *plan;
+    block_reader reader;
+    GjayWorkPool *pool;
+    long i, first, last;
     double *total_mags;
-    double sum, frame_sum, max_frame_sum, g_factor, freq, g_freq;
-    signed short buffer[BPM_BUF_SIZE];
-    long count, pos, h, redux, num_frames;
-    unsigned long startshift = 0, stopshift = 0;
-    unsigned char *audio;
-    unsigned long audiosize;
+    double sum, max_frame_sum;
+    long num_frames;
 
     if (wsfile->header.modus != 1 && wsfile->header.modus != 2) {
       if (ddata->verbosity > 2)
@@ -618,136 +1440,344 @@ run_analysis  (struct daemon_data *ddata,
         return FALSE;
     }
 
-    /* Spectrum set-up */    
-    read_buffer_size = WINDOW_SIZE*4;
-    read_buffer = malloc(read_buffer_size);
-    read_buffer_start = 0;
-    read_buffer_end = read_buffer_size;
-    freq_data = (int16_t*) g_malloc0 (WINDOW_SIZE * wsfile->header.byte_p_spl);
-    mags = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
-    total_mags = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
-    //memset (total_mags, 0x00, WINDOW_SIZE / 2 * sizeof (double));
-    memset (freq_results, 0x00, NUM_FREQ_SAMPLES * sizeof(double));
-    ch1 = (double*) g_malloc0 (WINDOW_SIZE * sizeof (double));
-    if (wsfile->header.modus == 2)
-        ch2 = (double*) g_malloc0 (WINDOW_SIZE * sizeof (double));
-    num_frames = 0;
-    max_frame_sum = 0;
-    sum = 0;
+    memset(&reader, 0x00, sizeof(block_reader));
+    reader.wsfile = wsfile;
+    reader.worker = worker;
 
     /* BPM set-up */
-    audiosize = wsfile->header.data_length;
-    audiosize/=(4*(44100/AUDIO_RATE));
-    audio= g_malloc0(audiosize+1);
-    assert(audio);
-    pos=0;
-
-    /* Read the first chunk of the file into the shared buffer */
-    if (fread(wsfile->buffer, 1, SHARED_BUF_SIZE, wsfile->f) < 1) {
+    reader.audiosize = wsfile->header.data_length;
+    reader.audiosize/=(4*(44100/AUDIO_RATE));
+    if (checkpoint->frame > 0) {
+        /* The decoder is at the checkpoint, which has the rest */
+        if (checkpoint->stream) {
+            /* Which has fed the stream a little past it */
+            reader.stream = checkpoint->stream;
+            checkpoint->stream = NULL;
+            reader.stream_skip = bpm_stream_fed(reader.stream) -
+                                 checkpoint->pos;
+            reader.audiosize = SHARED_BUF_SIZE / (4*(44100/AUDIO_RATE));
+            reader.audio = g_malloc0(reader.audiosize+1);
+        } else {
+            reader.audio = signal->audio;
+            reader.pos = checkpoint->pos;
+        }
+        reader.block_start = checkpoint->frame;
+        total_mags = signal->total_mags;
+        sum = signal->sum;
+        max_frame_sum = signal->max_frame_sum;
+        num_frames = signal->num_frames;
+        signal->audio = NULL;
+        signal->total_mags = NULL;
+        first = checkpoint->frame;
+    } else if (stream_bpm) {
+        /* One block's worth, as it goes */
+        reader.stream = bpm_stream_new();
+        reader.audiosize = SHARED_BUF_SIZE / (4*(44100/AUDIO_RATE));
+        reader.audio = g_malloc0(reader.audiosize+1);
+        total_mags = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
+        num_frames = 0;
+        max_frame_sum = 0;
+        sum = 0;
+        first = -WINDOW_SIZE;
+    } else {
+        reader.audio= g_malloc0(reader.audiosize+1);
+        total_mags = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
+        num_frames = 0;
+        max_frame_sum = 0;
+        sum = 0;
+        first = -WINDOW_SIZE;
+    }
+
+    /* Take the first block off the decode ring */
+    if (!next_block(&reader)) {
       if (ddata->verbosity > 2)
         g_warning(_("Cannot load WAV file first chunk"));
-        return FALSE;
+      g_free(reader.audio);
+      g_free(total_mags);
+      bpm_stream_free(reader.stream);
+      return FALSE;
     }
-    wsfile->seek = SHARED_BUF_SIZE;
-
-    /* Copy the first bit of this into the freq. analysis buffer */
-    memcpy(read_buffer, wsfile->buffer, read_buffer_size);
-    wsfile->freq_seek = read_buffer_size;
-
-    /* In this main loop, we read the entire file. Most of this loop 
-     * represents the spectrum algorithm; the marked tight loop is the bpm
-     * algorithm. */
-    for (i = -WINDOW_SIZE; i < WINDOW_SIZE + (int)(wsfile->header.data_length / wsfile->header.byte_p_spl); i += STEP_SIZE) {
-
-        freq_read_frames (wsfile, i, WINDOW_SIZE, (char *)freq_data);
-
-        if (wsfile->freq_seek == SHARED_BUF_SIZE) {
-            /* At end of buffer. Read some more data. */
-            count = fread(wsfile->buffer, 1, SHARED_BUF_SIZE, wsfile->f);
-            memcpy(buffer, wsfile->buffer, SHARED_BUF_SIZE);
-            wsfile->freq_seek = 0;
-            wsfile->seek += count;
-            
-            /* Update status bar. This chunk takes ~70% of the time  */
-            send_ui_percent(ddata->ipc->daemon_fifo, wsfile->seek/(wsfile->header.data_length / 70));
-            
-            /* BPM loop */
-            for (h=0;h<count/2;h+=2*(44100/AUDIO_RATE))
-            {
-                signed long int left, right,mean;
-                left=abs(buffer[h]);
-                right=abs(buffer[h+1]);
-                mean=(left+right)/2;
-                redux=abs(mean)/128;
-                if (pos+h/(2*(44100/AUDIO_RATE))>=audiosize) break;
-                assert(pos+h/(2*(44100/AUDIO_RATE))<audiosize);
-                audio[pos+h/(2*(44100/AUDIO_RATE))]=(unsigned char)redux;
-            }
-            pos+=count/(4*(44100/AUDIO_RATE));
-        }
-        
-        /* The rest of this loop is spectrum analysis */
-        if (wsfile->header.modus == 1) {
-            for (j = 0; j < WINDOW_SIZE; j++)
-                ch1 [j] = (int16_t)le16_to_cpu(freq_data[j]);
-            gsl_fft_real_radix2_transform (ch1, 1, WINDOW_SIZE);
-            
-        } else {
-            for (j = 0, k = 0; k < WINDOW_SIZE; k++, j+=2) {
-                ch1[k] = (double)((int16_t)le16_to_cpu(freq_data[j]));
-                ch2[k] = (double)((int16_t)le16_to_cpu(freq_data[j+1]));
-            } 
-            gsl_fft_real_radix2_transform (ch1, 1, WINDOW_SIZE);
-            gsl_fft_real_radix2_transform (ch2, 1, WINDOW_SIZE);
+
+    /* Spectrum set-up */    
+    reader.staging = g_malloc (WINDOW_SIZE * wsfile->header.byte_p_spl);
+    mags = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
+    if (wsfile->header.modus == 2)
+        mags2 = (double*) g_malloc0 (WINDOW_SIZE / 2 * sizeof (double));
+    plan = spectrum_plan_new(ddata->spectrum_engine, WINDOW_SIZE);
+
+    /* In this main loop, we read the entire file. Each window is
+     * analyzed where it sits in the decode ring; the BPM envelope is
+     * filled in by next_block() as the windows move on to a new block.
+     * A streamed song goes on until the decoder stops, and last is
+     * only known then. */
+    if (stream_bpm)
+        last = G_MAXLONG / 2;
+    else
+        last = wsfile->header.data_length / wsfile->header.byte_p_spl;
+    if ((pool = worker_pool(worker)) != NULL) {
+        spectrum_parallel(ddata, &reader, checkpoint, first, last,
+                          pool, total_mags, &sum, &max_frame_sum,
+                          &num_frames);
+    } else {
+        for (i = first; i < WINDOW_SIZE + last; i += STEP_SIZE) {
+
+            store_checkpoint(checkpoint, &reader, i, total_mags, sum,
+                             max_frame_sum, num_frames);
+            frames = window_frames(&reader, i, last);
+            if (reader.stream && reader.eof)
+                last = MIN(last, reader.block_start);
+
+            /* The rest of this loop is spectrum analysis */
+            spectrum_window(plan, frames, wsfile->header.modus, mags, mags2);
+
+            add_window_mags(mags, total_mags, &sum, &max_frame_sum,
+                            &num_frames);
+            if (wsfile->header.modus == 2)
+                add_window_mags(mags2, total_mags, &sum, &max_frame_sum,
+                                &num_frames);
         }
-        
-//        mags [0] = fabs (ch1 [0]);
-        
-        for (j = 0; j < WINDOW_SIZE / 2; j++) {
-	    double square_this = ch1 [j] * ch1 [j] + ch1 [WINDOW_SIZE - j] * ch1 [WINDOW_SIZE - j];
-	    if (square_this > 0.0 && square_this < BROKEN_VAL)
-        	mags [j] = sqrt (square_this);
-    	    else
-    		mags [j] = 0;
+    }
+
+    /* The rest of the song isn't needed here */
+    if (reader.block)
+        gjay_pcm_ring_release(wsfile->ring);
+
+    /* Everything else is worked out from these */
+    signal->modus = wsfile->header.modus;
+    signal->bins = WINDOW_SIZE / 2;
+    signal->total_mags = total_mags;
+    signal->sum = sum;
+    signal->max_frame_sum = max_frame_sum;
+    signal->num_frames = num_frames;
+    if (reader.stream) {
+        signal->bpm = bpm_stream_finish(reader.stream, &signal->tempo_curve);
+        bpm_stream_free(reader.stream);
+        g_free(reader.audio);
+    } else {
+        signal->audio = reader.audio;
+        signal->audiosize = reader.audiosize;
+    }
+
+    g_free (reader.staging);
+    g_free (mags);
+    g_free (mags2);
+    spectrum_plan_free(plan);
+    return TRUE;
+}
+
+
+/**
+ * Store a checkpoint of a long song, if it is time for one, with the
+ * windows before next done. The current block is decimated into the
+ * BPM envelope already, so the checkpoint's envelope goes back to where
+ * next is in it. Resuming decodes from next, which fills the rest in
+ * again the same.
+ */
+static void
+store_checkpoint (analysis_checkpoint * checkpoint, block_reader * reader,
+                  const glong next, gdouble * total_mags, const gdouble sum,
+                  const gdouble max_frame_sum, const long num_frames)
+{
+    GjayAnalysisSignal partial;
+    gchar * stream = NULL;
+    gsize stream_size = 0;
+    guint64 pos;
+    gint64 now;
+    glong end;
+
+    if (checkpoint->key == NULL || reader->block == NULL || next <= 0)
+        return;
+    end = reader->block_start + reader->block_frames;
+    if (next > end)
+        return;
+    now = g_get_monotonic_time();
+    if (checkpoint->stored == 0)
+        checkpoint->stored = now;
+    if (now - checkpoint->stored < CHECKPOINT_INTERVAL * G_USEC_PER_SEC)
+        return;
+    checkpoint->stored = now;
+
+    memset(&partial, 0x00, sizeof(GjayAnalysisSignal));
+    partial.modus = reader->wsfile->header.modus;
+    partial.bins = WINDOW_SIZE / 2;
+    partial.total_mags = total_mags;
+    partial.sum = sum;
+    partial.max_frame_sum = max_frame_sum;
+    partial.num_frames = num_frames;
+    pos = ((end - next) * reader->wsfile->header.byte_p_spl) /
+          (4 * (44100 / AUDIO_RATE));
+    if (reader->stream) {
+        /* The stream has had all of the block, and any it is ahead */
+        stream = bpm_stream_save(reader->stream, &stream_size);
+        pos = bpm_stream_fed(reader->stream) - reader->stream_skip - pos;
+    } else {
+        partial.audio = reader->audio;
+        partial.audiosize = reader->audiosize;
+        pos = reader->pos - pos;
+    }
+    gjay_pcm_checkpoint_store(checkpoint->key, &partial, next, pos,
+                              stream, stream_size);
+    g_free(stream);
+}
+
+
+/* Add one channel of one window to the totals */
+static void
+add_window_mags (const gdouble * mags, gdouble * total_mags, gdouble * sum,
+                 gdouble * max_frame_sum, long * num_frames)
+{
+    gdouble frame_sum;
+    long k;
+
+    for (frame_sum = 0, k = 0; k < WINDOW_SIZE / 2; k++) {
+        total_mags[k] += mags[k];
+        frame_sum += mags[k];
+    }
+
+    *max_frame_sum = MAX(frame_sum, *max_frame_sum);
+    *sum += frame_sum;
+    (*num_frames)++;
+}
+
+
+/* SPECTRUM_CHUNK windows of a song, with their own share of the totals */
+typedef struct {
+    spectrum_plan * plan;
+    guint     channels;
+    const gint16 * frames;  /* Where the first window starts */
+    glong     windows;
+    gdouble * mags;
+    gdouble * mags2;
+    gdouble * total_mags;
+    gdouble   sum;
+    gdouble   max_frame_sum;
+    long      num_frames;
+} spectrum_chunk;
+
+static gpointer
+spectrum_chunk_run (gpointer data)
+{
+    spectrum_chunk * chunk = (spectrum_chunk *) data;
+    glong w;
+
+    memset(chunk->total_mags, 0x00, WINDOW_SIZE / 2 * sizeof(gdouble));
+    chunk->sum = 0;
+    chunk->max_frame_sum = 0;
+    chunk->num_frames = 0;
+    for (w = 0; w < chunk->windows; w++) {
+        spectrum_window(chunk->plan,
+                        chunk->frames + w * STEP_SIZE * chunk->channels,
+                        chunk->channels, chunk->mags, chunk->mags2);
+        add_window_mags(chunk->mags, chunk->total_mags, &chunk->sum,
+                        &chunk->max_frame_sum, &chunk->num_frames);
+        if (chunk->channels == 2)
+            add_window_mags(chunk->mags2, chunk->total_mags, &chunk->sum,
+                            &chunk->max_frame_sum, &chunk->num_frames);
+    }
+    return NULL;
+}
+
+/**
+ * The spectrum loop of run_analysis(), split over the pool's threads
+ * for when one song is wanted quickly. The windows are copied out of
+ * the decode ring threads * SPECTRUM_CHUNK at a time, and each thread
+ * does one chunk. The chunks' totals are added up in song order, so the
+ * result is the same whatever the number of threads, though it can
+ * differ from the one thread loop's in the last bits. Once other songs
+ * come along the chunks are all done on this thread, so the song only
+ * has the threads while the other workers have nothing to do.
+ */
+static void
+spectrum_parallel (struct daemon_data *ddata, block_reader * reader,
+                   analysis_checkpoint * checkpoint, const glong first,
+                   glong last, GjayWorkPool * pool,
+                   gdouble * total_mags, gdouble * sum,
+                   gdouble * max_frame_sum, long * num_frames)
+{
+    const guint threads = gjay_work_pool_threads(pool);
+    const guint bps = reader->wsfile->header.byte_p_spl;
+    const guint channels = reader->wsfile->header.modus;
+    const glong overlap = MAX(0, WINDOW_SIZE - STEP_SIZE);
+    spectrum_chunk * chunk;
+    gint16 * batch;
+    glong i, n, have, batch_windows, windows, k;
+    guint c, nchunks;
+    gboolean alone;
+
+    batch_windows = threads * SPECTRUM_CHUNK;
+    batch = g_malloc(((batch_windows - 1) * STEP_SIZE + WINDOW_SIZE) * bps);
+    chunk = g_new0(spectrum_chunk, threads);
+    for (c = 0; c < threads; c++) {
+        chunk[c].plan = spectrum_plan_new(ddata->spectrum_engine, WINDOW_SIZE);
+        chunk[c].channels = channels;
+        chunk[c].mags = g_malloc(WINDOW_SIZE / 2 * sizeof(gdouble));
+        if (channels == 2)
+            chunk[c].mags2 = g_malloc(WINDOW_SIZE / 2 * sizeof(gdouble));
+        chunk[c].total_mags = g_malloc(WINDOW_SIZE / 2 * sizeof(gdouble));
+    }
+
+    /* The same windows as the one thread loop. Where windows overlap,
+       the end of one batch is kept as the start of the next. */
+    have = 0;
+    for (i = first; i < WINDOW_SIZE + last;
+         i += batch_windows * STEP_SIZE) {
+        if (have == 0)
+            store_checkpoint(checkpoint, reader, i, total_mags, *sum,
+                             *max_frame_sum, *num_frames);
+        windows = MIN(batch_windows,
+                      (WINDOW_SIZE + last - i + STEP_SIZE - 1) / STEP_SIZE);
+        n = (windows - 1) * STEP_SIZE + WINDOW_SIZE;
+        copy_frames(reader, batch + have * channels, i + have, n - have, last);
+        if (reader->stream && reader->eof && last > reader->block_start) {
+            /* The end of a streamed song; the rest of batch is silence */
+            last = reader->block_start;
+            windows = MIN(windows,
+                          (WINDOW_SIZE + last - i + STEP_SIZE - 1) / STEP_SIZE);
+            n = (windows - 1) * STEP_SIZE + WINDOW_SIZE;
         }
 
-        /* Add magnitudes */
-        for (frame_sum = 0, k = 0; k < WINDOW_SIZE / 2; k++) {
-            total_mags[k] += mags[k];
-            frame_sum += mags[k];
+        nchunks = (windows + SPECTRUM_CHUNK - 1) / SPECTRUM_CHUNK;
+        alone = !split_crowded(ddata);
+        for (c = 0; c < nchunks; c++) {
+            chunk[c].frames = batch + c * SPECTRUM_CHUNK * STEP_SIZE * channels;
+            chunk[c].windows = MIN(SPECTRUM_CHUNK,
+                                   windows - (glong) c * SPECTRUM_CHUNK);
+            if (c > 0 && alone)
+                gjay_work_pool_push(pool, spectrum_chunk_run, &chunk[c]);
+        }
+        for (c = 0; c < (alone ? 1 : nchunks); c++)
+            spectrum_chunk_run(&chunk[c]);
+        gjay_work_pool_wait(pool);
+        for (c = 0; c < nchunks; c++) {
+            for (k = 0; k < WINDOW_SIZE / 2; k++)
+                total_mags[k] += chunk[c].total_mags[k];
+            *sum += chunk[c].sum;
+            *max_frame_sum = MAX(*max_frame_sum, chunk[c].max_frame_sum);
+            *num_frames += chunk[c].num_frames;
         }
 
-        max_frame_sum = MAX(frame_sum, max_frame_sum);
-        sum += frame_sum;
-        num_frames++;
-
-        if (wsfile->header.modus == 2) {
-            for (j = 0; j < WINDOW_SIZE / 2; j++) {
-		double square_this = ch2 [j] * ch2 [j] + ch2 [WINDOW_SIZE - j] * ch2 [WINDOW_SIZE - j];
-		if ( square_this > 0 && square_this < BROKEN_VAL)
-        	    mags [j] = sqrt (square_this);
-    		else
-    		    mags [j] = 0;
-            }
+        have = MIN(overlap, n);
+        memmove(batch, batch + (n - have) * channels, have * bps);
+    }
 
-            /* Add magnitudes */            
-            for (frame_sum = 0, k = 0; k < WINDOW_SIZE / 2; k++) {
-                total_mags[k] += mags[k];
-                frame_sum += mags[k];
-            }
-        
-            max_frame_sum = MAX(frame_sum, max_frame_sum);
-            sum += frame_sum;
-            num_frames++;
-        }
+    for (c = 0; c < threads; c++) {
+        spectrum_plan_free(chunk[c].plan);
+        g_free(chunk[c].mags);
+        g_free(chunk[c].mags2);
+        g_free(chunk[c].total_mags);
     }
+    g_free(chunk);
+    g_free(batch);
+}
 
-    /* Finish analysis... */
-    *volume_diff =  max_frame_sum / (sum / (gdouble) num_frames);
 
-    for (k = 0; k < WINDOW_SIZE / 2; k++) 
-        total_mags[k] = (total_mags[k] / sum) * MAGS_MULTIPLIER;
-    
+/* Which of the NUM_FREQ_SAMPLES bands each spectrum bin goes into */
+static void
+freq_bands (gint * band)
+{
+    double g_factor, freq, g_freq;
+    long k, bin;
+
     g_freq = START_FREQ;
     g_factor = exp( log(MAX_FREQ/START_FREQ) / NUM_FREQ_SAMPLES);
     bin = 0;
@@ -758,8 +1788,40 @@ run_analysis  (struct daemon_data *ddata,
             bin = MIN(bin + 1, NUM_FREQ_SAMPLES - 1);
             g_freq *= g_factor;
         }
-        freq_results[bin] += total_mags[k];
+        band[k] = bin;
     }
+}
+
+
+/**
+ * The part of the analysis after the song has been decoded, which only
+ * needs the BPM envelope and the spectrum totals. This is all that is
+ * redone for a song in the analysis cache.
+ */
+static void
+finish_analysis (struct daemon_data *ddata,
+                 struct analysis_worker *worker,
+                 const GjayAnalysisSignal * signal,
+                 gdouble * freq_results,
+                 gdouble * volume_diff,
+                 gdouble * bpm_result )
+{
+    double total_mags[WINDOW_SIZE / 2];
+    gint band[WINDOW_SIZE / 2];
+    long k;
+    guint64 bpm_start;
+    const BpmTempoPoint * point;
+
+    memset (freq_results, 0x00, NUM_FREQ_SAMPLES * sizeof(double));
+    *volume_diff =  signal->max_frame_sum /
+        (signal->sum / (gdouble) signal->num_frames);
+
+    for (k = 0; k < WINDOW_SIZE / 2; k++) 
+        total_mags[k] = (signal->total_mags[k] / signal->sum) * MAGS_MULTIPLIER;
+    
+    freq_bands(band);
+    for (k = 0; k < WINDOW_SIZE / 2; k++)
+        freq_results[band[k]] += total_mags[k];
 
     if (ddata->verbosity > 1) {
         printf(_("Frequencies: \n"));
@@ -768,180 +1830,395 @@ run_analysis  (struct daemon_data *ddata,
         printf("\n");
     }
 
-    /* Complete BPM analysis */
-    stopshift=AUDIO_RATE*60*4/START_BPM;
-    startshift=AUDIO_RATE*60*4/STOP_BPM;
-    {
-	unsigned long foutat[stopshift-startshift];
-	unsigned long fout, minimumfout=0, maximumfout,minimumfoutat=ULONG_MAX,
-                left,right;
-        memset(&foutat,0,sizeof(foutat));
-	for(h=startshift;h<stopshift;h+=50)
-        {
-            fout=bpm_phasefit(h, audio, audiosize);
-            foutat[h-startshift]=fout;
-            if (minimumfout==0) maximumfout=minimumfout=fout;
-            if (fout<minimumfout) 
-            {
-                minimumfout=fout;
-                minimumfoutat=h;
-            }
-            if (fout>maximumfout) maximumfout=fout;
-            
-            send_ui_percent (ddata->ipc->daemon_fifo, 70 + ((15*(h - startshift)) / (stopshift - startshift)));
-        }
-        left=minimumfoutat-100;
-	right=minimumfoutat+100;
-	if ( left < startshift ) 
-            left = startshift;
-	if ( right > stopshift ) 
-            right = stopshift;
-	for(h=left; h<right; h++) {
-            fout=bpm_phasefit(h, audio, audiosize);
-            foutat[h-startshift]=fout;
-            if (minimumfout==0) maximumfout=minimumfout=fout;
-            if (fout<minimumfout) 
-            {
-                minimumfout=fout;
-                minimumfoutat=h;
+    /* A streamed song has its tempo already */
+    if (signal->audio == NULL) {
+        *bpm_result = signal->bpm;
+        if (ddata->verbosity && signal->tempo_curve) {
+            for (k = 0; k < signal->tempo_curve->len; k++) {
+                point = &g_array_index(signal->tempo_curve, BpmTempoPoint, k);
+                printf(_("Tempo from %d:%02d: %f\n"),
+                       (gint) point->seconds / 60,
+                       (gint) point->seconds % 60, point->bpm);
             }
-            if (fout>maximumfout) maximumfout=fout;
-            
-            send_ui_percent(ddata->ipc->daemon_fifo, 85 + ((15*(h - left)) / (right - left)));
         }
-        
-        for(h=startshift;h<stopshift;h++) {
-            fout=foutat[h-startshift];
-            if (fout)
-            {
-                fout-=minimumfout;
-            }
-        }
-        *bpm_result = 4.0*(double)AUDIO_RATE*60.0/(double)minimumfoutat;
-        if (ddata->verbosity > 1) 
+        if (ddata->verbosity > 1)
             printf(_("BPM: %f\n"), *bpm_result);
+        return;
+    }
+
+    /* Complete BPM analysis */
+    bpm_start = gjay_stats_now();
+    *bpm_result = bpm_analyze(ddata->bpm_engine, signal->audio,
+                              signal->audiosize, worker->last_bpm,
+                              worker_pool(worker), bpm_progress, worker,
+                              &worker->stats);
+    if (ddata->verbosity > 1) {
+        printf(_("BPM: %f\n"), *bpm_result);
+        printf(_("BPM (%s engine) took %.3f seconds\n"),
+               bpm_engine_name(ddata->bpm_engine),
+               (gjay_stats_now() - bpm_start) / 1e9);
     }
-    g_free (audio);
-    g_free (freq_data);
-    g_free (mags);
-    g_free (total_mags);
-    g_free (read_buffer);
-    return TRUE;
 }
 
 
-static int
-freq_read_frames (wav_file * wsfile, int start, int length, void *data)
+/* The band the analysis puts a tone of hz in, for a 44.1kHz song */
+gint
+analysis_freq_band (const gdouble hz)
 {
-    int realstart = start;
-    int reallength = length;
-    int offset = 0;
-    int seek, len;
-    
-    if (start + length < 0 || start > (int)(wsfile->header.data_length / wsfile->header.byte_p_spl)) {
-        memset (data, 0, length * wsfile->header.byte_p_spl);
-        return 0;
+    gint band[WINDOW_SIZE / 2];
+    glong k;
+
+    freq_bands(band);
+    k = (glong) (hz * WINDOW_SIZE / 44100.0 + 0.5);
+    return band[CLAMP(k, 0, WINDOW_SIZE / 2 - 1)];
+}
+
+
+/**
+ * Analyze the WAV file fname, length seconds long, timing each stage.
+ * Nothing is sent to the UI or stored; this is for the benchmark.
+ */
+gboolean
+analysis_benchmark_song (GjayApp * gjay, const gchar * fname,
+                         const gint length, GjayAnalysisBench * bench)
+{
+    struct daemon_data *ddata;
+    struct analysis_worker worker;
+    GjayIPC ipc;
+    GjaySong * song;
+    GjayAnalysisSignal signal;
+    gint64 start, finish_usec = 0;
+    gint result;
+    GjayStats * stats = &worker.stats;
+
+    memset(bench, 0x00, sizeof(GjayAnalysisBench));
+    if ((ddata = create_daemon_data(gjay)) == NULL)
+        return FALSE;
+    /* No UI to tell how it is going */
+    memset(&ipc, 0x00, sizeof(GjayIPC));
+    ipc.ui_fifo = -1;
+    ipc.daemon_fifo = -1;
+    ddata->ipc = &ipc;
+    ddata->mode = ANALYZE_DETACHED;
+    /* The results may be going to stdout, and printing takes time */
+    ddata->verbosity = 0;
+    memset(&worker, 0x00, sizeof(struct analysis_worker));
+    worker.ddata = ddata;
+    worker.percent = -1;
+
+    song = create_song();
+    song->length = length;
+    memset(&signal, 0x00, sizeof(GjayAnalysisSignal));
+
+    start = g_get_monotonic_time();
+    result = decode_song(&worker, fname, WAV, song, 0, &signal);
+    if (result > 0) {
+        finish_usec = g_get_monotonic_time();
+        finish_analysis(ddata, &worker, &signal, bench->freq,
+                        &bench->volume_diff, &bench->bpm);
+        finish_usec = g_get_monotonic_time() - finish_usec;
     }
-    
-    if (start < 0) {
-        offset = -start;
-        memset (data, 0, offset * wsfile->header.byte_p_spl);
-        realstart = 0;
-        reallength += start;
+    bench->total_usec = g_get_monotonic_time() - start;
+    bench->frames = stats->frames;
+    bench->decode_usec = stats->nsec[GJAY_SPAN_DECODE] / 1000;
+    bench->analysis_usec = stats->nsec[GJAY_SPAN_SPECTRUM] / 1000;
+    bench->bpm_usec = (stats->nsec[GJAY_SPAN_BPM_COARSE] +
+                       stats->nsec[GJAY_SPAN_BPM_FINE]) / 1000;
+    /* finish_analysis() is the bands and the BPM */
+    bench->bands_usec = MAX(0, finish_usec - bench->bpm_usec);
+
+    gjay_analysis_signal_clear(&signal);
+    delete_song(song);
+    g_mutex_clear(&ddata->queue_lock);
+    g_cond_clear(&ddata->queue_cond);
+    g_mutex_clear(&ddata->status_lock);
+    g_mutex_clear(&ddata->append_lock);
+    g_mutex_clear(&ddata->decoder_lock);
+    g_free(ddata);
+    return (result > 0);
+}
+
+
+/* Decimate a block of the song into the BPM envelope */
+static void
+bpm_decimate (block_reader * reader, const signed short * buffer,
+              const long count)
+{
+    long h, redux;
+
+    for (h=0;h<count/2;h+=2*(44100/AUDIO_RATE))
+    {
+        signed long int left, right,mean;
+        left=abs(buffer[h]);
+        right=abs(buffer[h+1]);
+        mean=(left+right)/2;
+        redux=abs(mean)/128;
+        if (reader->pos+h/(2*(44100/AUDIO_RATE))>=reader->audiosize) break;
+        assert(reader->pos+h/(2*(44100/AUDIO_RATE))<reader->audiosize);
+        reader->audio[reader->pos+h/(2*(44100/AUDIO_RATE))]=(unsigned char)redux;
     }
-    
-    if (start + length > (int)(wsfile->header.data_length / wsfile->header.byte_p_spl)) {
-        reallength -= start + length - (wsfile->header.data_length / wsfile->header.byte_p_spl);
-        memset (data, 0, reallength * wsfile->header.byte_p_spl);
+    reader->pos+=count/(4*(44100/AUDIO_RATE));
+}
+
+
+/**
+ * Hand the current block back to the decode ring and take the next,
+ * adding it to the BPM envelope. Returns FALSE at the end of the song.
+ */
+static gboolean
+next_block (block_reader * reader)
+{
+    wav_file * wsfile = reader->wsfile;
+    gsize count;
+    guint64 start, skip;
+
+    if (reader->block) {
+        gjay_pcm_ring_release(wsfile->ring);
+        reader->block = NULL;
+        reader->block_start += reader->block_frames;
+        reader->block_frames = 0;
     }
-    
-    seek = ((realstart + offset) * wsfile->header.byte_p_spl);
-    len = wsfile->header.byte_p_spl * reallength;
-    if (seek + len <= read_buffer_size) {
-        memcpy(data + offset * wsfile->header.byte_p_spl,
-               read_buffer + seek,
-               wsfile->header.byte_p_spl * reallength);
+    if (reader->eof)
+        return FALSE;
+    if ((reader->block = gjay_pcm_ring_get(wsfile->ring, &count)) == NULL) {
+        reader->eof = TRUE;
+        return FALSE;
+    }
+    reader->block_frames = count / wsfile->header.byte_p_spl;
+    wsfile->seek += count;
+
+    /* Update status bar. This chunk takes ~70% of the time  */
+    if (wsfile->header.data_length >= 70)
+        set_percent(reader->worker,
+                    MIN(70, wsfile->seek/(wsfile->header.data_length / 70)));
+
+    if (reader->stream) {
+        start = gjay_stats_now();
+        reader->pos = 0;
+        bpm_decimate(reader, (const signed short *) reader->block, count);
+        skip = MIN(reader->stream_skip, (guint64) reader->pos);
+        reader->stream_skip -= skip;
+        bpm_stream_feed(reader->stream, reader->audio + skip,
+                        reader->pos - skip);
+        gjay_stats_span_end(&reader->worker->stats, GJAY_SPAN_BPM_COARSE,
+                            start);
     } else {
-        if (seek + len > read_buffer_end) {
-            char * new_buffer = malloc(read_buffer_size);
-            int shift = seek + len - read_buffer_end;
-            memcpy(new_buffer, 
-                   read_buffer + shift,
-                   read_buffer_size - shift);
-            free(read_buffer);
-            read_buffer = new_buffer;
-
-            memcpy (read_buffer + read_buffer_size - shift,
-                    wsfile->buffer + wsfile->freq_seek,
-                    shift);
-            wsfile->freq_seek += shift;
-
-            read_buffer_start += shift;
-            read_buffer_end += shift;
-        }
-        memcpy(data + offset * wsfile->header.byte_p_spl,
-               read_buffer + seek - read_buffer_start,
-               wsfile->header.byte_p_spl * reallength);
+        bpm_decimate(reader, (const signed short *) reader->block, count);
+    }
+    return TRUE;
+}
+
+
+/**
+ * Copy frames start .. start + n - 1 of the song to dest, where frames
+ * before 0 and from last on are silent. Nothing before the current
+ * block is left in the ring, so start must not be before it.
+ */
+static void
+copy_frames (block_reader * reader, gint16 * dest, const glong start,
+             const glong n, const glong last)
+{
+    const guint bps = reader->wsfile->header.byte_p_spl;
+    const guint channels = reader->wsfile->header.modus;
+    glong from, to, end;
+
+    while (start >= reader->block_start + reader->block_frames &&
+           next_block(reader))
+        ;
+
+    memset(dest, 0x00, n * bps);
+    from = MAX(start, 0);
+    end = MIN(start + n, last);
+    while (from < end && reader->block) {
+        to = MIN(end, reader->block_start + reader->block_frames);
+        memcpy(dest + (from - start) * channels,
+               reader->block + (from - reader->block_start) * bps,
+               (to - from) * bps);
+        from = to;
+        if (from < end)
+            next_block(reader);
     }
-    return 1;
 }
 
 
-static unsigned long
-bpm_phasefit(const long i, const unsigned char const *audio,
-    const unsigned long audiosize)
+/**
+ * Frames start .. start + WINDOW_SIZE - 1 of the song, where frames
+ * before 0 and from last on are silent. Windows move forward through
+ * the song. Points into the ring block when the window is inside it,
+ * which is nearly always as blocks hold a whole number of windows;
+ * otherwise the window is put together in reader->staging.
+ */
+static const gint16 *
+window_frames (block_reader * reader, const glong start, const glong last)
+{
+    const guint bps = reader->wsfile->header.byte_p_spl;
+    glong end;
+
+    while (start >= reader->block_start + reader->block_frames &&
+           next_block(reader))
+        ;
+
+    end = start + WINDOW_SIZE;
+    if (reader->block && start >= 0 && end <= last &&
+        end <= reader->block_start + reader->block_frames)
+        return (const gint16 *)
+            (reader->block + (start - reader->block_start) * bps);
+
+    /* Off either end of the song, or across two blocks */
+    copy_frames(reader, reader->staging, start, WINDOW_SIZE, last);
+    return reader->staging;
+}
+
+
+/* BPM detection is the last 30% of the analysis */
+static void
+bpm_progress (gpointer user_data, const gint percent)
+{
+    set_percent((struct analysis_worker *) user_data, 70 + (30 * percent) / 100);
+}
+
+
+
+/**
+ * The threads to split the worker's song over, or NULL if it isn't
+ * split or other songs have come along since it was started. Only one
+ * song is split at a time, as only a lone one is, so the workers share
+ * the one pool; it is started the first time a song is split and kept
+ * until the daemon stops.
+ */
+static GjayWorkPool *
+worker_pool (struct analysis_worker *worker)
 {
-   long c,d;
-   unsigned long mismatch=0;
-   unsigned long prev=mismatch;
-   for(c=i;c<audiosize;c++)
-     {
-	d=abs((long)audio[c]-(long)audio[c-i]);
-	prev=mismatch;
-	mismatch+=d;
-	assert(mismatch>=prev);
-     }
-   return mismatch;
+  struct daemon_data *ddata = worker->ddata;
+
+  if (worker->threads < 2 || split_crowded(ddata))
+    return NULL;
+  if (ddata->pool == NULL)
+    ddata->pool = gjay_work_pool_new(worker->threads);
+  return ddata->pool;
 }
 
 
+/**
+ * Whether a split song should give its threads back to the other
+ * workers: songs have been queued, or are being analyzed or upgraded,
+ * besides it.
+ */
+static gboolean
+split_crowded (struct daemon_data *ddata)
+{
+  gboolean crowded;
+
+  g_mutex_lock(&ddata->queue_lock);
+  crowded = (!g_queue_is_empty(&queue) || upgrading != NULL ||
+             (active != NULL && active->next != NULL));
+  g_mutex_unlock(&ddata->queue_lock);
+  return crowded;
+}
+
 
+/**
+ * Called from the analysis loops, so it is only an atomic store; the
+ * main loop sends it on in forward_percent(). Standalone there is no
+ * main loop and only the one song, so changes go straight to the UI.
+ */
 static void
-send_ui_percent (const int fd, int percent)
+set_percent (struct analysis_worker *worker, int percent)
 {
-  static int old_percent = -1;
+  struct daemon_data *ddata = worker->ddata;
 
-  if (old_percent == percent)
-    return;
-    
   if (percent < 0)
 	percent = 0;
   if (percent > 100)
 	percent = 100;
-  old_percent = percent;
-    
-  send_ipc_int(fd, STATUS_PERCENT, percent);
 
-  /* This is a bit of a hack, but... anytime we care enough to pause
-   * analysis so we can send the percentage,  run an iteration of the 
-   * event loop */
-  if (g_main_pending())
-    g_main_iteration(TRUE);
+  if (g_atomic_int_get(&worker->percent) == percent)
+    return;
+  g_atomic_int_set(&worker->percent, percent);
+
+  if (ddata->worker == NULL && percent != ddata->percent) {
+    ddata->percent = percent;
+    send_ipc_int(ddata->ipc->daemon_fifo, STATUS_PERCENT, percent);
+  }
+}
+
+
+/**
+ * Run every PROGRESS_INTERVAL ms from the main loop. Each worker has its
+ * own percentage; the UI has one progress bar so it is sent the mean
+ * over the busy workers, if that has changed.
+ */
+static gboolean
+forward_percent (gpointer data)
+{
+  struct daemon_data *ddata = (struct daemon_data *) data;
+  guint w, n;
+  gint total;
+
+  g_mutex_lock(&ddata->status_lock);
+  for (w = 0, n = 0, total = 0; w < ddata->workers; w++) {
+    if (ddata->worker[w].analyze_song) {
+      total += MAX(0, g_atomic_int_get(&ddata->worker[w].percent));
+      n++;
+    }
+  }
+  total = n ? total / (gint) n : 0;
+  if (total != ddata->percent) {
+    ddata->percent = total;
+    send_ipc_int(ddata->ipc->daemon_fifo, STATUS_PERCENT, total);
+  }
+  g_mutex_unlock(&ddata->status_lock);
+  return TRUE;
 }
 
 
+/* Call with the status lock held */
 static void
-send_analyze_song_name ( const int fd, GjaySong *song )
+send_analyze_song_name ( struct analysis_worker *worker, GjaySong *song )
 {
   char buffer[BUFFER_SIZE];
+  gchar *prefix;
+
   if (!song)
     return;
+  /* Say which worker it is when there is more than one */
+  if (worker->ddata->workers > 1)
+    prefix = g_strdup_printf("[%u] ", worker->id + 1);
+  else
+    prefix = g_strdup("");
   if (song->title && song->artist)
-	g_snprintf(buffer, BUFFER_SIZE, "%s : %s", song->artist, song->title);
+	g_snprintf(buffer, BUFFER_SIZE, "%s%s : %s", prefix, song->artist, song->title);
   else
-	g_snprintf(buffer, BUFFER_SIZE, "%s", song->path);
+	g_snprintf(buffer, BUFFER_SIZE, "%s%s", prefix, song->path);
+  g_free(prefix);
   strncpy(buffer + 60, "...\0", 4);
-  send_ipc_text(fd, STATUS_TEXT, buffer);
+  send_ipc_text(worker->ddata->ipc->daemon_fifo, STATUS_TEXT, buffer);
+}
+
+
+/**
+ * Set (or with NULL, clear) the song the worker is analyzing and tell
+ * the UI about it. Returns the number of busy workers afterwards.
+ */
+static guint
+worker_set_song ( struct analysis_worker *worker, GjaySong *song )
+{
+  struct daemon_data *ddata = worker->ddata;
+  guint busy;
+
+  g_mutex_lock(&ddata->status_lock);
+  if (song && worker->analyze_song == NULL)
+    ddata->busy++;
+  else if (song == NULL && worker->analyze_song)
+    ddata->busy--;
+  worker->analyze_song = song;
+  if (song)
+    send_analyze_song_name(worker, song);
+  else
+    g_atomic_int_set(&worker->percent, -1);
+  busy = ddata->busy;
+  g_mutex_unlock(&ddata->status_lock);
+  return busy;
 }
 
 
@@ -949,83 +2226,206 @@ send_analyze_song_name ( const int fd, GjaySong *song )
 static void
 analysis_daemon(struct daemon_data *ddata) {
     GIOChannel * ui_io;
-    char buffer[BUFFER_SIZE];
-    gchar * file;
-    FILE * f;
+    guint w;
     
-    /* Nice the analysis */
+    /* Nice the analysis. The workers inherit this from us */
     setpriority(PRIO_PROCESS, getpid(), 19);
     
-    ddata->in_analysis = FALSE;
     ddata->loop = g_main_new(FALSE);
     ddata->last_ping = time(NULL);
     queue_hash = g_hash_table_new(g_str_hash, g_str_equal);
-
-    /* Read analysis queue, if any */
-    snprintf(buffer, BUFFER_SIZE, "%s/%s/%s", getenv("HOME"), 
-             GJAY_DIR, GJAY_QUEUE);
-    f = fopen(buffer, "r");
-    if (f) {
-        while (!feof(f)) {
-            read_line(f, buffer, BUFFER_SIZE);
-            if (strlen(buffer) &&!g_hash_table_lookup(queue_hash, buffer)) {
-                file = g_strdup(buffer);
-                g_hash_table_insert(queue_hash, file, (void *) 1);
-                queue = g_list_append(queue, file);
-            }
-        }
-        fclose(f);
+    upgrade_hash = g_hash_table_new(g_str_hash, g_str_equal);
+
+    /* Read analysis queues, if any */
+    queue_done = read_queue_file(GJAY_QUEUE, &queue, queue_hash);
+    upgrade_done = read_queue_file(GJAY_UPGRADE_QUEUE, &upgrade, upgrade_hash);
+
+    if (ddata->verbosity)
+        printf(_("Starting %u analysis workers\n"), ddata->workers);
+    if (ddata->verbosity > 1)
+        printf(_("BPM phase fit uses the %s kernel\n"), bpm_sad_name());
+    ddata->worker = g_new0(struct analysis_worker, ddata->workers);
+    for (w = 0; w < ddata->workers; w++) {
+        ddata->worker[w].ddata = ddata;
+        ddata->worker[w].id = w;
+        ddata->worker[w].percent = -1;
+        ddata->worker[w].thread = g_thread_new("analysis",
+            analysis_worker_thread, &ddata->worker[w]);
     }
+
     ui_io = g_io_channel_unix_new (ddata->ipc->ui_fifo);
     g_io_add_watch (ui_io,
                     G_IO_IN,
                     ui_pipe_input,
                     ddata);
     g_idle_add (daemon_idle, ddata);
+    g_timeout_add_seconds (1, daemon_watchdog, ddata);
+    g_timeout_add (PROGRESS_INTERVAL, forward_percent, ddata);
     // FIXME: add G_IO_HUP watcher
 
     g_main_run(ddata->loop);
-}
 
+    /* Let the workers finish the songs they are on */
+    g_mutex_lock(&ddata->queue_lock);
+    ddata->quit = TRUE;
+    g_cond_broadcast(&ddata->queue_cond);
+    g_mutex_unlock(&ddata->queue_lock);
+    for (w = 0; w < ddata->workers; w++)
+        g_thread_join(ddata->worker[w].thread);
+    gjay_work_pool_free(ddata->pool);
+    ddata->pool = NULL;
+    g_free(ddata->worker);
+    ddata->worker = NULL;
+    publish_stats(ddata, TRUE);
+}
 
-gboolean daemon_idle (gpointer data) {
-    gchar * file;
-	struct daemon_data *ddata = (struct daemon_data*)data;
 
+/* Check the UI is still there while there is analysis to do */
+static void
+daemon_check_orphaned (struct daemon_data *ddata) {
     if ((ddata->mode != DAEMON_DETACHED) && 
         (time(NULL) - ddata->last_ping > DAEMON_ATTACH_FREAKOUT)) {
         if (ddata->verbosity)
             printf(_("Daemon appears to have been orphaned. Quitting.\n"));
         g_main_quit(ddata->loop);
     } 
+}
+
+
+/**
+ * Run from the main loop when there may be new work; wakes up the
+ * workers once the daemon is attached or detached.
+ */
+gboolean daemon_idle (gpointer data) {
+	struct daemon_data *ddata = (struct daemon_data*)data;
+
+    daemon_check_orphaned(ddata);
 
     if (ddata->mode == DAEMON_INIT) {
         usleep(SLEEP_WHILE_IDLE);
         return TRUE;
     }
 
-    if (ddata->in_analysis)
-        return TRUE;
-    
-    if (queue) {
-        file = g_list_first(queue)->data;
-        analyze(ddata, file, FALSE);
-        g_hash_table_remove(queue_hash, file);
-        queue = g_list_remove(queue, file);
-        g_free(file);
-        
-        write_queue();
+    g_mutex_lock(&ddata->queue_lock);
+    ddata->running = TRUE;
+    g_cond_broadcast(&ddata->queue_cond);
+    g_mutex_unlock(&ddata->queue_lock);
+    return FALSE;
+}
+
+
+static gboolean
+daemon_watchdog (gpointer data) {
+	struct daemon_data *ddata = (struct daemon_data*)data;
+    gboolean pending;
+
+    g_mutex_lock(&ddata->queue_lock);
+    pending = ddata->running &&
+        (!g_queue_is_empty(&queue) || active ||
+         !g_queue_is_empty(&upgrade) || upgrading);
+    g_mutex_unlock(&ddata->queue_lock);
+    if (pending)
+        daemon_check_orphaned(ddata);
+    publish_stats(ddata, FALSE);
+    return TRUE;
+}
+
+
+/**
+ * Write out the statistics of all the songs analyzed so far and send
+ * them to the UI, if there are new ones and it has been a while.
+ */
+static void
+publish_stats (struct daemon_data *ddata, const gboolean now) {
+    GjayStats stats;
+    gchar * json;
+
+    g_mutex_lock(&ddata->status_lock);
+    if (!ddata->stats_dirty ||
+        (!now && time(NULL) - ddata->stats_time < STATS_INTERVAL)) {
+        g_mutex_unlock(&ddata->status_lock);
+        return;
     }
-    
-    if (queue)
-        return TRUE;
+    stats = ddata->stats;
+    ddata->stats_dirty = FALSE;
+    ddata->stats_time = time(NULL);
+    g_mutex_unlock(&ddata->status_lock);
+
+    gjay_stats_write(&stats);
+    json = gjay_stats_to_json(&stats);
+    send_ipc_text(ddata->ipc->daemon_fifo, STATS, json);
+    g_free(json);
+}
 
-    if (ddata->mode == DAEMON_DETACHED) {
-        if (ddata->verbosity)
+
+static gpointer
+analysis_worker_thread (gpointer data) {
+    struct analysis_worker *worker = (struct analysis_worker *) data;
+    struct daemon_data *ddata = worker->ddata;
+    gchar * file;
+    gboolean sampled;
+
+    g_mutex_lock(&ddata->queue_lock);
+    while (!ddata->quit) {
+        if (!ddata->running ||
+            (g_queue_is_empty(&queue) && g_queue_is_empty(&upgrade))) {
+            g_cond_wait(&ddata->queue_cond, &ddata->queue_lock);
+            continue;
+        }
+        if (g_queue_is_empty(&queue)) {
+            /* Nothing new, redo a sampled song in full */
+            file = g_queue_pop_head(&upgrade);
+            g_hash_table_insert(upgrade_hash, file, QUEUE_IN_PROGRESS);
+            upgrading = g_list_prepend(upgrading, file);
+            worker->threads = 1;
+            g_mutex_unlock(&ddata->queue_lock);
+
+            if (ddata->verbosity > 1)
+                printf(_("Upgrading sampled analysis of '%s'\n"), file);
+            analyze(worker, file, FALSE, FALSE);
+
+            g_mutex_lock(&ddata->queue_lock);
+            g_hash_table_remove(upgrade_hash, file);
+            upgrading = g_list_remove(upgrading, file);
+            upgrade_file_done(file);
+            g_free(file);
+        } else {
+            file = g_queue_pop_head(&queue);
+            g_hash_table_insert(queue_hash, file, QUEUE_IN_PROGRESS);
+            /* A song on its own, say one just added in the UI, is
+               wanted now and the other workers have nothing to do */
+            worker->threads = (g_queue_is_empty(&queue) && active == NULL &&
+                               upgrading == NULL) ? ddata->workers : 1;
+            active = g_list_prepend(active, file);
+            g_mutex_unlock(&ddata->queue_lock);
+
+            if (ddata->verbosity > 1 && worker->threads > 1)
+                printf(_("Analyzing '%s' with %u threads\n"), file,
+                       worker->threads);
+            sampled = analyze(worker, file, FALSE, ddata->sampled);
+
+            g_mutex_lock(&ddata->queue_lock);
+            g_hash_table_remove(queue_hash, file);
+            active = g_list_remove(active, file);
+            queue_file_done(file);
+            if (sampled && !g_hash_table_lookup(upgrade_hash, file)) {
+                g_queue_push_tail(&upgrade, file);
+                g_hash_table_insert(upgrade_hash, file, upgrade.tail);
+                append_queue_file(GJAY_UPGRADE_QUEUE, file, 0);
+            } else {
+                if (!sampled)
+                    drop_upgrade(file);
+                g_free(file);
+            }
+        }
+
+        if (g_queue_is_empty(&queue) && active == NULL &&
+            g_queue_is_empty(&upgrade) && upgrading == NULL &&
+            ddata->mode == DAEMON_DETACHED && ddata->verbosity)
             printf(_("Analysis daemon done.\n"));
-        //g_main_quit((GMainLoop *) data);
     }
-    return FALSE;
+    g_mutex_unlock(&ddata->queue_lock);
+    return NULL;
 }
 
 static struct daemon_data *create_daemon_data(GjayApp *gjay){
@@ -1038,10 +2438,24 @@ static struct daemon_data *create_daemon_data(GjayApp *gjay){
   ddata->verbosity = gjay->verbosity;
   ddata->ogg_supported = gjay->ogg_supported;
   ddata->flac_supported = gjay->flac_supported;
-  create_gjay_ipc(&(ddata->ipc));
-
-  ddata->in_analysis = FALSE;
-  ddata->analyze_song = NULL;
+  ddata->external_decoders = gjay->external_decoders;
+  ddata->sampled = gjay->sampled;
+  ddata->pcm_cache_bytes = (guint64) MAX(gjay->pcm_cache_mb, 0) * 1048576;
+  ddata->write_tags = gjay->write_tags;
+  ddata->bpm_engine = gjay->bpm_engine;
+  ddata->spectrum_engine = gjay->spectrum_engine;
+  if (gjay->workers > 0)
+    ddata->workers = gjay->workers;
+  else
+    ddata->workers = g_get_num_processors();
+
+  g_mutex_init(&ddata->queue_lock);
+  g_cond_init(&ddata->queue_cond);
+  g_mutex_init(&ddata->status_lock);
+  g_mutex_init(&ddata->append_lock);
+  g_mutex_init(&ddata->decoder_lock);
+  ddata->worker = NULL;
+  ddata->percent = -1;
 
   ddata->mp3_decoder = NULL;
   ddata->ogg_decoder = NULL;
@@ -76,9 +76,28 @@ typedef struct {
 extern int             analyze_percent;
 
 
+/* One song's analysis with the time each stage took, see benchmark.c */
+typedef struct {
+  gdouble  freq[NUM_FREQ_SAMPLES];
+  gdouble  volume_diff;
+  gdouble  bpm;
+  guint64  frames;        /* Sample frames analyzed */
+  gint64   decode_usec;   /* Reading the song, in the decoder thread */
+  gint64   analysis_usec; /* Spectrum and BPM envelope, less waiting */
+  gint64   bands_usec;    /* Frequency bands and volume */
+  gint64   bpm_usec;      /* Tempo detection */
+  gint64   total_usec;
+} GjayAnalysisBench;
+
+
 /* Run the analysis of one song */
 void run_as_daemon(GjayApp *gjay, gjay_mode mode);
 void     run_as_analyze_detached  ( GjayApp *gjay, const char * analyze_detached_fname );
+gboolean analysis_benchmark_song  ( GjayApp *gjay,
+                                    const gchar * fname,
+                                    const gint length,
+                                    GjayAnalysisBench * bench );
+gint     analysis_freq_band       ( const gdouble hz );
 
 /* Endian stuff */
 void     wav_header_swab(waveheaderstruct * header); 
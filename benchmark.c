@@ -0,0 +1,814 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * benchmark.c -- gjay --benchmark writes click tracks of known tempo and
+ * noise in known bands as WAV files, runs the analysis over them and
+ * writes out as JSON how long each stage took and how far the BPM and
+ * spectrum are off. The songs are made the same way every time, so
+ * runs can be compared from one version to the next.
+ *
+ * The float spectrum engine is also run against the GSL one on every
+ * fixture, and the benchmark fails if they are further apart than
+ * SPECTRUM_TOLERANCE, and every SAD kernel the CPU can run is checked
+ * against the scalar one and timed.
+ *
+ * It then makes a library of songs from the noise's spectra and scores
+ * it for playlists with the full and the compact song features, to
+ * show how much faster the compact ones are and how far off.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "gjay.h"
+#include "analysis.h"
+#include "bpm.h"
+#include "bpm_sad.h"
+#include "spectrum.h"
+#include "benchmark.h"
+#include "i18n.h"
+
+#define BENCH_RATE     44100
+#define BENCH_SECONDS  30
+
+/* A click is a short burst of a decaying tone */
+#define CLICK_HZ       1000.0
+#define CLICK_SECONDS  0.02
+#define CLICK_DECAY    0.005
+
+/* Noise is this many tones spread evenly over its band, with random
+   phases, to give a flat spectrum there and nothing elsewhere */
+#define NOISE_TONES    48
+
+typedef enum {
+  FIXTURE_CLICKS,
+  FIXTURE_NOISE
+} fixture_kind;
+
+typedef struct {
+  fixture_kind kind;
+  guint        channels;
+  gdouble      bpm;      /* Of the clicks */
+  gdouble      low;      /* Band of the noise, in Hz */
+  gdouble      high;
+} bench_fixture;
+
+/* The BPM detection looks between START_BPM and STOP_BPM, so outside
+   that the best it can find is a multiple of the tempo */
+static const bench_fixture fixtures[] = {
+  { FIXTURE_CLICKS, 2,  90.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 100.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 120.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 128.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 140.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 150.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 160.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 175.0,     0,     0 },
+  { FIXTURE_CLICKS, 2, 200.0,     0,     0 },
+  { FIXTURE_CLICKS, 1, 128.0,     0,     0 },
+  { FIXTURE_CLICKS, 1, 150.0,     0,     0 },
+  { FIXTURE_NOISE,  2,     0,   150,   400 },
+  { FIXTURE_NOISE,  2,     0,  1000,  3000 },
+  { FIXTURE_NOISE,  2,     0,  6000, 12000 },
+  { FIXTURE_NOISE,  1,     0,   150,   400 },
+  { FIXTURE_NOISE,  1,     0,  1000,  3000 },
+  { FIXTURE_NOISE,  1,     0,  6000, 12000 },
+};
+#define NUM_FIXTURES (sizeof(fixtures) / sizeof(fixtures[0]))
+
+/* The analysis' window. The engines are compared bin by bin over each
+   channel of each window, the difference taken as a fraction of the
+   window's energy, the size of its whole spectrum; the float engine's
+   rounding is well under a part per million of that. */
+#define SPECTRUM_WINDOW    1024
+#define SPECTRUM_TOLERANCE 1e-5
+
+/* The SAD kernels are timed on a fixture's envelope, as the BPM phase
+   fit compares it with itself, and checked on every length up to
+   SAD_SHORT, every tail of the envelope and its largest sums */
+#define SAD_BYTES (BENCH_SECONDS * AUDIO_RATE)
+#define SAD_CALLS 2000
+#define SAD_SHORT 256
+
+/* The library scored, and how many of its songs are compared with all
+   the others */
+#define BENCH_LIBRARY_SONGS 20000
+#define BENCH_QUERIES       50
+
+/* Members of a JSON object, written as they come */
+typedef struct {
+  FILE        * f;
+  const gchar * indent;
+  gboolean      first;
+} json_object;
+
+/* How far the float spectrum engine is from the GSL one */
+typedef struct {
+  guint64  windows;      /* Of one channel */
+  gint64   float_usec;
+  gint64   gsl_usec;
+  gdouble  max_error;    /* Of a bin, as a fraction of the window's energy */
+  gdouble  error_sum;    /* Of each window's largest */
+} spectrum_compare;
+
+static gint16 * fixture_samples  ( const bench_fixture * fixture,
+                                   const guint seed );
+static gboolean write_fixture    ( const gchar * path,
+                                   gint16 * pcm,
+                                   const guint channels );
+static gchar *  fixture_name     ( const bench_fixture * fixture );
+static gdouble  octave_error     ( const gdouble bpm,
+                                   const gdouble expected );
+static void     compare_spectrum_engines ( const gint16 * pcm,
+                                           const guint channels,
+                                           spectrum_compare * cmp );
+static gboolean bench_sad_kernels ( json_object * o );
+static GjaySongLists * bench_library ( const gboolean compact,
+                                       gdouble noise_freq[][NUM_FREQ_SAMPLES],
+                                       const guint noises );
+static void     bench_scoring    ( GjayApp * gjay,
+                                   json_object * o,
+                                   gdouble noise_freq[][NUM_FREQ_SAMPLES],
+                                   const guint noises );
+
+
+static gint16 *
+fixture_samples (const bench_fixture * fixture, const guint seed)
+{
+  const gsize frames = BENCH_SECONDS * BENCH_RATE;
+  const guint channels = fixture->channels;
+  gint16 * pcm;
+  gdouble * mix, x, v, hz, step_re, step_im, re, im, t, mag, scale;
+  gsize i, start;
+  guint c, k, beat;
+  GRand * rand;
+
+  pcm = g_new0(gint16, frames * channels);
+  if (fixture->kind == FIXTURE_CLICKS) {
+    for (beat = 0; (t = beat * 60.0 / fixture->bpm) < BENCH_SECONDS; beat++) {
+      start = (gsize) (t * BENCH_RATE + 0.5);
+      for (i = 0; i < CLICK_SECONDS * BENCH_RATE && start + i < frames; i++) {
+        x = i / (gdouble) BENCH_RATE;
+        v = sin(2 * M_PI * CLICK_HZ * x) * exp(-x / CLICK_DECAY);
+        for (c = 0; c < channels; c++)
+          pcm[(start + i) * channels + c] = (gint16) (v * 0.8 * G_MAXINT16);
+      }
+    }
+    return pcm;
+  }
+
+  /* GRand gives the same numbers for a seed everywhere */
+  rand = g_rand_new_with_seed(seed);
+  mix = g_new(gdouble, frames);
+  scale = 0.25 * G_MAXINT16 / sqrt(NOISE_TONES / 2.0);
+  for (c = 0; c < channels; c++) {
+    memset(mix, 0x00, frames * sizeof(gdouble));
+    for (k = 0; k < NOISE_TONES; k++) {
+      hz = fixture->low +
+        (fixture->high - fixture->low) * (k + 0.5) / NOISE_TONES;
+      t = g_rand_double(rand) * 2 * M_PI;
+      re = cos(t);
+      im = sin(t);
+      step_re = cos(2 * M_PI * hz / BENCH_RATE);
+      step_im = sin(2 * M_PI * hz / BENCH_RATE);
+      for (i = 0; i < frames; i++) {
+        mix[i] += im;
+        x = re * step_re - im * step_im;
+        im = re * step_im + im * step_re;
+        re = x;
+        if ((i & 4095) == 4095) {
+          /* Keep the rotation from drifting */
+          mag = sqrt(re * re + im * im);
+          re /= mag;
+          im /= mag;
+        }
+      }
+    }
+    for (i = 0; i < frames; i++)
+      pcm[i * channels + c] = (gint16) CLAMP(mix[i] * scale,
+                                             G_MININT16, G_MAXINT16);
+  }
+  g_free(mix);
+  g_rand_free(rand);
+  return pcm;
+}
+
+
+static gboolean
+write_fixture (const gchar * path, gint16 * pcm, const guint channels)
+{
+  const gsize frames = BENCH_SECONDS * BENCH_RATE;
+  waveheaderstruct header;
+  FILE * f;
+  gsize i;
+  gboolean ok;
+
+  memset(&header, 0x00, sizeof(waveheaderstruct));
+  memcpy(header.main_chunk, "RIFF", 4);
+  memcpy(header.chunk_type, "WAVE", 4);
+  memcpy(header.sub_chunk, "fmt ", 4);
+  memcpy(header.data_chunk, "data", 4);
+  header.length_chunk = 16;
+  header.format = 1;
+  header.modus = channels;
+  header.sample_fq = BENCH_RATE;
+  header.byte_p_spl = 2 * channels;
+  header.byte_p_sec = BENCH_RATE * header.byte_p_spl;
+  header.bit_p_spl = 16;
+  header.data_length = frames * header.byte_p_spl;
+  header.length = sizeof(waveheaderstruct) - 8 + header.data_length;
+  /* Both ways round */
+  wav_header_swab(&header);
+  for (i = 0; i < frames * channels; i++)
+    pcm[i] = GINT16_TO_LE(pcm[i]);
+
+  if ((f = g_fopen(path, "wb")) == NULL)
+    return FALSE;
+  ok = (fwrite(&header, sizeof(waveheaderstruct), 1, f) == 1 &&
+        fwrite(pcm, sizeof(gint16), frames * channels, f) ==
+        frames * channels);
+  if (fclose(f) != 0)
+    ok = FALSE;
+  return ok;
+}
+
+
+static gchar *
+fixture_name (const bench_fixture * fixture)
+{
+  const gchar * channels = (fixture->channels == 1) ? "mono" : "stereo";
+
+  if (fixture->kind == FIXTURE_CLICKS)
+    return g_strdup_printf("click-%.0f-%s", fixture->bpm, channels);
+  return g_strdup_printf("noise-%.0f-%.0f-%s", fixture->low, fixture->high,
+                         channels);
+}
+
+
+/* How far bpm is from the nearest of expected's halves and doubles */
+static gdouble
+octave_error (const gdouble bpm, const gdouble expected)
+{
+  gdouble best = bpm - expected;
+  gint k;
+
+  for (k = -2; k <= 2; k++)
+    if (fabs(bpm - ldexp(expected, k)) < fabs(best))
+      best = bpm - ldexp(expected, k);
+  return best;
+}
+
+/* Both engines over all of a fixture, one after the other so each can
+   be timed. Bins either side of the glitch check, which the engines may
+   round to different sides of, are left out. */
+static void
+compare_spectrum_engines (const gint16 * pcm, const guint channels,
+                          spectrum_compare * cmp)
+{
+  const guint windows = BENCH_SECONDS * BENCH_RATE / SPECTRUM_WINDOW;
+  const guint bins = SPECTRUM_WINDOW / 2;
+  spectrum_plan * plan;
+  gdouble * mags[2], * f, * g;
+  gdouble energy, x, error, worst;
+  gint64 start;
+  guint e, w, c, i;
+
+  for (e = 0; e < 2; e++) {
+    plan = spectrum_plan_new(e ? SPECTRUM_ENGINE_GSL : SPECTRUM_ENGINE_FLOAT,
+                             SPECTRUM_WINDOW);
+    mags[e] = g_new(gdouble, (gsize) windows * 2 * bins);
+    start = g_get_monotonic_time();
+    for (w = 0; w < windows; w++)
+      spectrum_window(plan, pcm + (gsize) w * SPECTRUM_WINDOW * channels,
+                      channels, mags[e] + (gsize) w * 2 * bins,
+                      mags[e] + (gsize) w * 2 * bins + bins);
+    if (e)
+      cmp->gsl_usec += g_get_monotonic_time() - start;
+    else
+      cmp->float_usec += g_get_monotonic_time() - start;
+    spectrum_plan_free(plan);
+  }
+
+  for (w = 0; w < windows; w++) {
+    for (c = 0; c < channels; c++) {
+      for (energy = 0, i = 0; i < SPECTRUM_WINDOW; i++) {
+        x = pcm[((gsize) w * SPECTRUM_WINDOW + i) * channels + c];
+        energy += x * x;
+      }
+      energy = MAX(sqrt(energy * SPECTRUM_WINDOW), 1.0);
+      f = mags[0] + ((gsize) w * 2 + c) * bins;
+      g = mags[1] + ((gsize) w * 2 + c) * bins;
+      for (worst = 0, i = 0; i < bins; i++) {
+        if ((f[i] == 0) != (g[i] == 0) &&
+            MAX(f[i], g[i]) * MAX(f[i], g[i]) > BROKEN_VAL * 0.999)
+          continue;
+        error = fabs(f[i] - g[i]) / energy;
+        worst = MAX(worst, error);
+      }
+      cmp->windows++;
+      cmp->error_sum += worst;
+      cmp->max_error = MAX(cmp->max_error, worst);
+    }
+  }
+  g_free(mags[0]);
+  g_free(mags[1]);
+}
+
+
+static void
+json_member (json_object * o, const gchar * name)
+{
+  fprintf(o->f, "%s\n%s\"%s\": ", o->first ? "" : ",", o->indent, name);
+  o->first = FALSE;
+}
+
+/* Only ever given our own names, which need no escaping */
+static void
+json_string (json_object * o, const gchar * name, const gchar * value)
+{
+  json_member(o, name);
+  fprintf(o->f, "\"%s\"", value);
+}
+
+static void
+json_int (json_object * o, const gchar * name, const gint64 value)
+{
+  json_member(o, name);
+  fprintf(o->f, "%" G_GINT64_FORMAT, value);
+}
+
+static void
+json_double (json_object * o, const gchar * name, const gdouble value)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  json_member(o, name);
+  if (isfinite(value))
+    fputs(g_ascii_formatd(buf, sizeof(buf), "%.6f", value), o->f);
+  else
+    fputs("null", o->f);
+}
+
+static void
+json_seconds (json_object * o, const gchar * name, const gint64 usec)
+{
+  json_double(o, name, usec / (gdouble) G_USEC_PER_SEC);
+}
+
+
+/* How many of the checks a kernel gets a different answer to the
+   scalar one on */
+static guint
+sad_mismatches (const bpm_sad_func func, const guchar * a,
+                const guchar * b)
+{
+  guchar * high, * low;
+  guint mismatches = 0;
+  gsize n;
+
+  for (n = 0; n <= SAD_SHORT; n++)
+    if ((*func) (a + n % 7, b + n % 13, n) !=
+        bpm_sad_scalar(a + n % 7, b + n % 13, n))
+      mismatches++;
+  for (n = SAD_BYTES - 64; n <= SAD_BYTES; n++)
+    if ((*func) (a, b + SAD_BYTES - n, n) !=
+        bpm_sad_scalar(a, b + SAD_BYTES - n, n))
+      mismatches++;
+
+  high = g_malloc(SAD_BYTES);
+  low = g_malloc0(SAD_BYTES);
+  memset(high, 0xff, SAD_BYTES);
+  if ((*func) (high, low, SAD_BYTES) != (guint64) 0xff * SAD_BYTES)
+    mismatches++;
+  if ((*func) (low, high, SAD_BYTES) != (guint64) 0xff * SAD_BYTES)
+    mismatches++;
+  g_free(high);
+  g_free(low);
+  return mismatches;
+}
+
+/* Each kernel against the scalar one, and how fast it goes over an
+   envelope's worth of random bytes */
+static gboolean
+bench_sad_kernels (json_object * o)
+{
+  const BpmSadKernel * kernels = bpm_sad_kernels();
+  json_object sad, entry;
+  GRand * rand;
+  guchar * a, * b;
+  guint64 sum;
+  gint64 start, usec, scalar_usec = 0;
+  gboolean ok = TRUE;
+  guint i, k, mismatches;
+
+  rand = g_rand_new_with_seed(1);
+  a = g_malloc(SAD_BYTES);
+  b = g_malloc(SAD_BYTES);
+  for (i = 0; i < SAD_BYTES; i++) {
+    a[i] = g_rand_int_range(rand, 0, 256);
+    b[i] = g_rand_int_range(rand, 0, 256);
+  }
+  g_rand_free(rand);
+
+  sad.f = o->f;
+  sad.indent = "    ";
+  sad.first = TRUE;
+  json_member(o, "sad_kernels");
+  fputs("{", o->f);
+  json_string(&sad, "best", bpm_sad_name());
+  json_int(&sad, "bytes", SAD_BYTES);
+  json_int(&sad, "calls", SAD_CALLS);
+  json_member(&sad, "kernels");
+  for (k = 0; kernels[k].name; k++) {
+    mismatches = sad_mismatches(kernels[k].func, a, b);
+    start = g_get_monotonic_time();
+    for (sum = 0, i = 0; i < SAD_CALLS; i++)
+      sum += (*kernels[k].func) (a, b, SAD_BYTES);
+    usec = g_get_monotonic_time() - start;
+    if (sum != SAD_CALLS * bpm_sad_scalar(a, b, SAD_BYTES))
+      mismatches++;
+    if (k == 0)
+      scalar_usec = usec;
+    if (mismatches) {
+      g_warning(_("The %s SAD kernel differs from the scalar one in %u checks\n"),
+                kernels[k].name, mismatches);
+      ok = FALSE;
+    }
+
+    entry.f = o->f;
+    entry.indent = "        ";
+    entry.first = TRUE;
+    fprintf(o->f, "%s\n      {", k ? "," : "[");
+    json_string(&entry, "name", kernels[k].name);
+    json_int(&entry, "mismatches", mismatches);
+    json_double(&entry, "bytes_per_second", usec > 0 ?
+                (gdouble) SAD_BYTES * SAD_CALLS /
+                (usec / (gdouble) G_USEC_PER_SEC) : 0);
+    json_double(&entry, "speedup", usec > 0 ?
+                scalar_usec / (gdouble) usec : 0);
+    fputs("\n      }", o->f);
+  }
+  fputs("\n    ]\n  }", o->f);
+  g_free(a);
+  g_free(b);
+  return ok;
+}
+
+
+/* Songs whose spectrum is a random mix of the noise fixtures', with a
+   random tempo and volume, and a color for most. Made the same way
+   every time. */
+static GjaySongLists *
+bench_library (const gboolean compact,
+               gdouble noise_freq[][NUM_FREQ_SAMPLES], const guint noises)
+{
+  GjaySongLists * sl;
+  GjaySong * s;
+  GRand * rand;
+  gchar * path;
+  gdouble w;
+  guint i, j;
+  gint k;
+
+  if (create_song_lists(&sl, compact) == FALSE)
+    return NULL;
+  rand = g_rand_new_with_seed(1);
+  for (i = 0; i < BENCH_LIBRARY_SONGS; i++) {
+    s = create_song();
+    path = g_strdup_printf("benchmark/%05u.wav", i);
+    song_set_path(s, path);
+    g_free(path);
+    s->no_data = (i % 20 == 19);
+    if (!s->no_data) {
+      for (j = 0; j < noises; j++) {
+        w = g_rand_double(rand);
+        for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+          s->freq[k] += w * noise_freq[j][k];
+      }
+      s->volume_diff = g_rand_double_range(rand, 1.0, 3.0);
+      s->bpm = g_rand_double_range(rand, 80.0, 180.0);
+      s->bpm_undef = (i % 33 == 32);
+    }
+    if (i % 4) {
+      s->no_color = FALSE;
+      s->color.H = g_rand_double_range(rand, 0, 6.0);
+      s->color.S = g_rand_double(rand);
+      s->color.V = g_rand_double(rand);
+    }
+    add_song(sl, s);
+  }
+  g_rand_free(rand);
+  return sl;
+}
+
+/* Score the first BENCH_QUERIES songs against the whole library with
+   both sets of features. The force is -100...100. The best pick is
+   the song a playlist would go to next; its loss is how much lower the
+   full force is of the song the compact features pick. */
+static void
+bench_scoring (GjayApp * gjay, json_object * o,
+               gdouble noise_freq[][NUM_FREQ_SAMPLES], const guint noises)
+{
+  GjaySongLists * full, * compact;
+  GjayPrefs prefs;
+  json_object scoring;
+  gdouble * full_force, * compact_force;
+  gdouble err, err_sum = 0, err_max = 0, loss_sum = 0;
+  gint64 full_usec = 0, compact_usec = 0, start;
+  guint64 pairs = 0;
+  guint q, i, best, best_compact, same = 0;
+
+  if (gjay->verbosity)
+    fprintf(stderr, _("Benchmark: scoring %d songs\n"), BENCH_LIBRARY_SONGS);
+  full = bench_library(FALSE, noise_freq, noises);
+  compact = bench_library(TRUE, noise_freq, noises);
+
+  /* Everything counts the same, and there are no directories */
+  prefs = *gjay->prefs;
+  prefs.hue = prefs.saturation = prefs.brightness = 1.0;
+  prefs.bpm = prefs.freq = 1.0;
+  prefs.path_weight = 0;
+
+  full_force = g_new(gdouble, BENCH_LIBRARY_SONGS);
+  compact_force = g_new(gdouble, BENCH_LIBRARY_SONGS);
+  for (q = 0; q < BENCH_QUERIES; q++) {
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_LIBRARY_SONGS; i++)
+      full_force[i] = song_force(&prefs, full, q, i, 0);
+    full_usec += g_get_monotonic_time() - start;
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_LIBRARY_SONGS; i++)
+      compact_force[i] = song_force(&prefs, compact, q, i, 0);
+    compact_usec += g_get_monotonic_time() - start;
+
+    best = best_compact = (q == 0);
+    for (i = 0; i < BENCH_LIBRARY_SONGS; i++) {
+      err = fabs(compact_force[i] - full_force[i]);
+      err_sum += err;
+      err_max = MAX(err_max, err);
+      if (i == q)
+        continue;
+      if (full_force[i] > full_force[best])
+        best = i;
+      if (compact_force[i] > compact_force[best_compact])
+        best_compact = i;
+    }
+    pairs += BENCH_LIBRARY_SONGS;
+    if (best == best_compact)
+      same++;
+    loss_sum += full_force[best] - full_force[best_compact];
+  }
+
+  scoring.f = o->f;
+  scoring.indent = "    ";
+  scoring.first = TRUE;
+  json_member(o, "scoring");
+  fputs("{", o->f);
+  json_int(&scoring, "songs", BENCH_LIBRARY_SONGS);
+  json_int(&scoring, "queries", BENCH_QUERIES);
+  json_int(&scoring, "full_bytes_per_song",
+           gjay_features_row_size(full->features));
+  json_int(&scoring, "compact_bytes_per_song",
+           gjay_features_row_size(compact->features));
+  json_double(&scoring, "full_scores_per_second", full_usec > 0 ?
+              pairs / (full_usec / (gdouble) G_USEC_PER_SEC) : 0);
+  json_double(&scoring, "compact_scores_per_second", compact_usec > 0 ?
+              pairs / (compact_usec / (gdouble) G_USEC_PER_SEC) : 0);
+  json_double(&scoring, "force_mean_abs_error", err_sum / pairs);
+  json_double(&scoring, "force_max_abs_error", err_max);
+  json_int(&scoring, "best_pick_same", same);
+  json_double(&scoring, "best_pick_mean_loss", loss_sum / BENCH_QUERIES);
+  fputs("\n  }", o->f);
+
+  g_free(full_force);
+  g_free(compact_force);
+  destroy_song_lists(full);
+  destroy_song_lists(compact);
+}
+
+
+gboolean
+run_as_benchmark (GjayApp * gjay, const gchar * fname)
+{
+  const bench_fixture * fixture;
+  GjayAnalysisBench bench;
+  spectrum_compare spectra;
+  json_object top, entry, summary, engines;
+  gchar * dir, * name, * path;
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+  gint16 * pcm;
+  FILE * f;
+  GError * error = NULL;
+  gdouble bpm_error, bpm_octave, in_band, sum, centroid, expected, rate;
+  gint band_low, band_high, k;
+  guint i;
+  gboolean ok = TRUE;
+  /* Over all the fixtures */
+  guint64 frames = 0;
+  gint64 decode_usec = 0, analysis_usec = 0, bands_usec = 0, bpm_usec = 0;
+  gint64 total_usec = 0;
+  guint clicks = 0, clicks_close = 0, noises = 0;
+  gdouble bpm_abs = 0, bpm_octave_abs = 0, in_band_sum = 0, centroid_abs = 0;
+  gdouble noise_freq[NUM_FIXTURES][NUM_FREQ_SAMPLES];
+
+  memset(&spectra, 0x00, sizeof(spectrum_compare));
+
+  if ((dir = g_dir_make_tmp("gjay-benchmark-XXXXXX", &error)) == NULL) {
+    g_warning(_("Unable to make a directory for the benchmark: %s\n"),
+              error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+  if (strcmp(fname, "-") == 0) {
+    f = stdout;
+  } else if ((f = g_fopen(fname, "w")) == NULL) {
+    g_warning(_("Unable to open '%s' for writing\n"), fname);
+    g_rmdir(dir);
+    g_free(dir);
+    return FALSE;
+  }
+
+  top.f = f;
+  top.indent = "  ";
+  top.first = TRUE;
+  fputs("{", f);
+  json_string(&top, "version", VERSION);
+  json_string(&top, "bpm_engine", bpm_engine_name(gjay->bpm_engine));
+  json_string(&top, "spectrum_engine",
+              spectrum_engine_name(gjay->spectrum_engine));
+  json_int(&top, "sample_rate", BENCH_RATE);
+  json_int(&top, "seconds", BENCH_SECONDS);
+  json_member(&top, "fixtures");
+  fputs("[", f);
+
+  for (i = 0; i < NUM_FIXTURES; i++) {
+    fixture = &fixtures[i];
+    name = fixture_name(fixture);
+    path = g_strdup_printf("%s/%s.wav", dir, name);
+    if (gjay->verbosity)
+      fprintf(stderr, _("Benchmark: analyzing %s\n"), name);
+
+    memset(&bench, 0x00, sizeof(GjayAnalysisBench));
+    pcm = fixture_samples(fixture, i + 1);
+    if (!write_fixture(path, pcm, fixture->channels) ||
+        !analysis_benchmark_song(gjay, path, BENCH_SECONDS, &bench)) {
+      g_warning(_("Benchmark of %s failed\n"), name);
+      ok = FALSE;
+    }
+    compare_spectrum_engines(pcm, fixture->channels, &spectra);
+    g_free(pcm);
+    g_unlink(path);
+    g_free(path);
+
+    entry.f = f;
+    entry.indent = "      ";
+    entry.first = TRUE;
+    fprintf(f, "%s\n    {", i ? "," : "");
+    json_string(&entry, "name", name);
+    json_string(&entry, "kind",
+                fixture->kind == FIXTURE_CLICKS ? "clicks" : "noise");
+    json_int(&entry, "channels", fixture->channels);
+    json_int(&entry, "frames", bench.frames);
+    rate = bench.total_usec > 0 ?
+      bench.frames / (bench.total_usec / (gdouble) G_USEC_PER_SEC) : 0;
+    json_double(&entry, "samples_per_second", rate);
+    json_seconds(&entry, "decode_seconds", bench.decode_usec);
+    json_seconds(&entry, "analysis_seconds", bench.analysis_usec);
+    json_seconds(&entry, "bands_seconds", bench.bands_usec);
+    json_seconds(&entry, "bpm_seconds", bench.bpm_usec);
+    json_seconds(&entry, "total_seconds", bench.total_usec);
+    json_double(&entry, "bpm", bench.bpm);
+    json_double(&entry, "volume_diff", bench.volume_diff);
+
+    frames += bench.frames;
+    decode_usec += bench.decode_usec;
+    analysis_usec += bench.analysis_usec;
+    bands_usec += bench.bands_usec;
+    bpm_usec += bench.bpm_usec;
+    total_usec += bench.total_usec;
+
+    if (fixture->kind == FIXTURE_CLICKS) {
+      bpm_error = bench.bpm - fixture->bpm;
+      bpm_octave = octave_error(bench.bpm, fixture->bpm);
+      json_double(&entry, "expected_bpm", fixture->bpm);
+      json_double(&entry, "bpm_error", bpm_error);
+      json_double(&entry, "bpm_octave_error", bpm_octave);
+      clicks++;
+      bpm_abs += fabs(bpm_error);
+      bpm_octave_abs += fabs(bpm_octave);
+      if (fabs(bpm_octave) <= 1.0)
+        clicks_close++;
+    } else {
+      /* How much of the spectrum is in the noise's bands, and how far
+         its middle is from where the tones put it */
+      band_low = analysis_freq_band(fixture->low);
+      band_high = analysis_freq_band(fixture->high);
+      for (sum = 0, in_band = 0, centroid = 0, k = 0;
+           k < NUM_FREQ_SAMPLES; k++) {
+        sum += bench.freq[k];
+        centroid += k * bench.freq[k];
+        if (k >= band_low && k <= band_high)
+          in_band += bench.freq[k];
+      }
+      in_band = sum > 0 ? in_band / sum : 0;
+      centroid = sum > 0 ? centroid / sum : 0;
+      for (expected = 0, k = 0; k < NOISE_TONES; k++)
+        expected += analysis_freq_band(fixture->low +
+          (fixture->high - fixture->low) * (k + 0.5) / NOISE_TONES);
+      expected /= NOISE_TONES;
+      json_int(&entry, "band_low", band_low);
+      json_int(&entry, "band_high", band_high);
+      json_double(&entry, "freq_in_band", in_band);
+      json_double(&entry, "freq_centroid_error", centroid - expected);
+      memcpy(noise_freq[noises], bench.freq, sizeof(noise_freq[noises]));
+      noises++;
+      in_band_sum += in_band;
+      centroid_abs += fabs(centroid - expected);
+    }
+    json_member(&entry, "freq");
+    for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+      fprintf(f, "%s%s", k ? ", " : "[",
+              g_ascii_formatd(buf, sizeof(buf), "%.6f", bench.freq[k]));
+    fputs("]\n    }", f);
+    g_free(name);
+  }
+  fputs("\n  ]", f);
+
+  summary.f = f;
+  summary.indent = "    ";
+  summary.first = TRUE;
+  json_member(&top, "summary");
+  fputs("{", f);
+  json_int(&summary, "frames", frames);
+  json_double(&summary, "samples_per_second", total_usec > 0 ?
+              frames / (total_usec / (gdouble) G_USEC_PER_SEC) : 0);
+  json_seconds(&summary, "decode_seconds", decode_usec);
+  json_seconds(&summary, "analysis_seconds", analysis_usec);
+  json_seconds(&summary, "bands_seconds", bands_usec);
+  json_seconds(&summary, "bpm_seconds", bpm_usec);
+  json_seconds(&summary, "total_seconds", total_usec);
+  json_double(&summary, "bpm_mean_abs_error", clicks ? bpm_abs / clicks : 0);
+  json_double(&summary, "bpm_mean_abs_octave_error",
+              clicks ? bpm_octave_abs / clicks : 0);
+  json_int(&summary, "bpm_within_1", clicks_close);
+  json_int(&summary, "bpm_fixtures", clicks);
+  json_double(&summary, "freq_mean_in_band",
+              noises ? in_band_sum / noises : 0);
+  json_double(&summary, "freq_mean_abs_centroid_error",
+              noises ? centroid_abs / noises : 0);
+  fputs("\n  }", f);
+
+  engines.f = f;
+  engines.indent = "    ";
+  engines.first = TRUE;
+  json_member(&top, "spectrum_engines");
+  fputs("{", f);
+  json_int(&engines, "windows", spectra.windows);
+  json_double(&engines, "float_seconds",
+              spectra.float_usec / (gdouble) G_USEC_PER_SEC);
+  json_double(&engines, "gsl_seconds",
+              spectra.gsl_usec / (gdouble) G_USEC_PER_SEC);
+  json_double(&engines, "max_error_ppm", spectra.max_error * 1e6);
+  json_double(&engines, "mean_error_ppm", spectra.windows ?
+              spectra.error_sum / spectra.windows * 1e6 : 0);
+  json_double(&engines, "tolerance_ppm", SPECTRUM_TOLERANCE * 1e6);
+  fputs("\n  }", f);
+  if (spectra.max_error > SPECTRUM_TOLERANCE) {
+    g_warning(_("The float and GSL spectra differ by %g of a window, more than %g\n"),
+              spectra.max_error, SPECTRUM_TOLERANCE);
+    ok = FALSE;
+  }
+
+  if (!bench_sad_kernels(&top))
+    ok = FALSE;
+  bench_scoring(gjay, &top, noise_freq, noises);
+  fputs("\n}\n", f);
+
+  if (f != stdout && fclose(f) != 0) {
+    g_warning(_("Unable to write '%s'\n"), fname);
+    ok = FALSE;
+  }
+  g_rmdir(dir);
+  g_free(dir);
+  return ok;
+}
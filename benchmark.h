@@ -0,0 +1,29 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * benchmark.h -- time the analysis on generated songs of known tempo
+ * and spectrum, and see how close it gets
+ */
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "gjay.h"
+
+/* Writes the results as JSON to fname, "-" for standard output */
+gboolean run_as_benchmark ( GjayApp * gjay, const gchar * fname );
+
+#endif /* BENCHMARK_H */
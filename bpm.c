@@ -0,0 +1,880 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ * Copyright (C) 2002 Chuck Groom.
+ *
+ * The phase fit scan comes from BpmDJ by Werner Van Belle.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * bpm.c -- finds the tempo of a song from its envelope, sampled at
+ * AUDIO_RATE. The envelope is compared with itself shifted by one beat
+ * period (lag); the lag with the least mismatch is the tempo.
+ *
+ * The scan engine is the original BpmDJ phase fit. It sums the absolute
+ * differences for every 50th lag, then for every lag near the best one,
+ * so its cost is lags times song length. The sum for a lag is abandoned
+ * as soon as it can't beat the best so far, and the lags near the
+ * previous song's tempo are tried first so that happens early; the
+ * answer is always the same as the exhaustive scan's.
+ *
+ * Either scan can share its lags out over several threads for one song.
+ * The exhaustive scan works out each lag's mismatch in full on whichever
+ * thread, and picks the best afterwards in its own order. The scan's
+ * threads share the best so far, and so the bound, under a lock, and a
+ * tie goes by lag rather than by which was tried first. Either way the
+ * answer doesn't depend on the number of threads or their timing.
+ *
+ * The autocorr engine gets the whole lag curve from one FFT
+ * autocorrelation, using the squared difference instead:
+ *   SSD(lag) = sum(c >= lag) a[c]^2 + sum(c < N - lag) a[c]^2 - 2 r(lag)
+ * where r is the autocorrelation of the envelope a.
+ *
+ * The streaming estimator adds each new stretch of envelope to the
+ * mismatch of every lag as it arrives, which needs only the last
+ * stopshift bytes, and then picks the lag as the exhaustive scan would.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <glib.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_fft_real.h>
+#include <gsl/gsl_fft_halfcomplex.h>
+#include "gjay.h"
+#include "bpm.h"
+#include "bpm_sad.h"
+#include "stats.h"
+#include "work_pool.h"
+#include "i18n.h"
+
+static gdouble       bpm_scan         ( const unsigned char *audio,
+                                        const unsigned long audiosize,
+                                        const gdouble hint_bpm,
+                                        GjayWorkPool *pool,
+                                        bpm_progress_func progress,
+                                        gpointer user_data,
+                                        GjayStats *stats );
+static gdouble       bpm_scan_exhaustive ( const unsigned char *audio,
+                                        const unsigned long audiosize,
+                                        GjayWorkPool *pool,
+                                        bpm_progress_func progress,
+                                        gpointer user_data,
+                                        GjayStats *stats );
+static gdouble       bpm_autocorr     ( const unsigned char *audio,
+                                        const unsigned long audiosize,
+                                        bpm_progress_func progress,
+                                        gpointer user_data,
+                                        GjayStats *stats );
+static unsigned long bpm_phasefit     ( const long i,
+                                        const unsigned char *audio,
+                                        const unsigned long audiosize );
+static unsigned long bpm_phasefit_bounded ( const long i,
+                                        const unsigned char *audio,
+                                        const unsigned long audiosize,
+                                        const unsigned long limit );
+static void          phasefit_lags    ( const unsigned long *lags,
+                                        const guint nlags,
+                                        const unsigned char *audio,
+                                        const unsigned long audiosize,
+                                        unsigned long *fouts,
+                                        GjayWorkPool *pool,
+                                        bpm_progress_func progress,
+                                        gpointer user_data,
+                                        const gint percent_from );
+
+/* In the order of bpm_engine */
+static const gchar *engine_names[] = { "scan", "autocorr", "exhaustive", NULL };
+
+/* Bounded phase fits are summed this many bytes at a time */
+#define PHASEFIT_BLOCK 4096
+
+/* The streaming estimator takes new envelope this many bytes at a time */
+#define BPM_STREAM_BLOCK 4096
+
+/* A saved stream is this, then have bytes of history, the mismatch at
+   each lag all told and for the segment, then the tempo curve */
+#define BPM_STREAM_MAGIC   "GJAYBPS"
+#define BPM_STREAM_VERSION 1
+
+typedef struct {
+  gchar   magic[8];
+  guint32 version;
+  guint32 audio_rate;
+  guint64 startshift;
+  guint64 stopshift;
+  guint64 have;
+  guint64 total;
+  guint64 segment_start;
+  guint64 curve_points;
+} bpm_stream_header;
+
+struct _BpmStream {
+  unsigned long   startshift;
+  unsigned long   stopshift;
+  unsigned char * history;      /* The last stopshift bytes, then new ones */
+  unsigned long   have;         /* Bytes in history */
+  guint64         total;        /* Bytes fed in so far */
+  guint64 *       fout;         /* Mismatch at each lag, all of it */
+  guint64 *       segment_fout; /* and since segment_start */
+  guint64         segment_start;
+  GArray *        curve;        /* of BpmTempoPoint */
+};
+
+/**
+ * Find the tempo of the envelope audio. Returns beats per minute; the
+ * caller decides if it is believable.
+ */
+gdouble
+bpm_analyze (const bpm_engine engine, const unsigned char *audio,
+             const unsigned long audiosize, const gdouble hint_bpm,
+             GjayWorkPool *pool,
+             bpm_progress_func progress, gpointer user_data,
+             GjayStats *stats)
+{
+  switch (engine) {
+    case BPM_ENGINE_AUTOCORR:
+      return bpm_autocorr(audio, audiosize, progress, user_data, stats);
+    case BPM_ENGINE_SCAN_EXHAUSTIVE:
+      return bpm_scan_exhaustive(audio, audiosize, pool, progress,
+                                 user_data, stats);
+    case BPM_ENGINE_SCAN:
+    default:
+      return bpm_scan(audio, audiosize, hint_bpm, pool, progress,
+                      user_data, stats);
+  }
+}
+
+const gchar *
+bpm_engine_name (const bpm_engine engine)
+{
+  if (engine > BPM_ENGINE_SCAN_EXHAUSTIVE)
+    return engine_names[BPM_ENGINE_SCAN];
+  return engine_names[engine];
+}
+
+gboolean
+bpm_engine_from_name (const gchar *name, bpm_engine *engine)
+{
+  int i;
+
+  for (i = 0; engine_names[i]; i++) {
+    if (g_ascii_strcasecmp(name, engine_names[i]) == 0) {
+      *engine = i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+static gdouble
+bpm_scan_exhaustive (const unsigned char *audio, const unsigned long audiosize,
+                     GjayWorkPool *pool,
+                     bpm_progress_func progress, gpointer user_data,
+                     GjayStats *stats)
+{
+    unsigned long startshift = 0, stopshift = 0;
+    long h;
+    guint64 span_start;
+    unsigned long *lags, *fouts;
+    guint nlags, i;
+
+    stopshift=AUDIO_RATE*60*4/START_BPM;
+    startshift=AUDIO_RATE*60*4/STOP_BPM;
+    lags = g_new(unsigned long, (stopshift - startshift) / 50 + 201);
+    fouts = g_new(unsigned long, (stopshift - startshift) / 50 + 201);
+    {
+	unsigned long fout, minimumfout=0, minimumfoutat=ULONG_MAX,
+                left,right;
+        span_start = gjay_stats_now();
+	for(nlags=0, h=startshift;h<stopshift;h+=50)
+            lags[nlags++] = h;
+        phasefit_lags(lags, nlags, audio, audiosize, fouts, pool,
+                      progress, user_data, 0);
+	for(i=0;i<nlags;i++)
+        {
+            h=lags[i];
+            fout=fouts[i];
+            if (minimumfout==0) minimumfout=fout;
+            if (fout<minimumfout)
+            {
+                minimumfout=fout;
+                minimumfoutat=h;
+            }
+        }
+        gjay_stats_span_end(stats, GJAY_SPAN_BPM_COARSE, span_start);
+        span_start = gjay_stats_now();
+        left=minimumfoutat-100;
+	right=minimumfoutat+100;
+	if ( left < startshift )
+            left = startshift;
+	if ( right > stopshift )
+            right = stopshift;
+	for(nlags=0, h=left; h<right; h++)
+            lags[nlags++] = h;
+        phasefit_lags(lags, nlags, audio, audiosize, fouts, pool,
+                      progress, user_data, 50);
+	for(i=0;i<nlags;i++) {
+            h=lags[i];
+            fout=fouts[i];
+            if (minimumfout==0) minimumfout=fout;
+            if (fout<minimumfout)
+            {
+                minimumfout=fout;
+                minimumfoutat=h;
+            }
+        }
+        gjay_stats_span_end(stats, GJAY_SPAN_BPM_FINE, span_start);
+        g_free(lags);
+        g_free(fouts);
+
+        return 4.0*(double)AUDIO_RATE*60.0/(double)minimumfoutat;
+    }
+}
+
+
+/* How badly the envelope matches itself shifted by i */
+static unsigned long
+bpm_phasefit(const long i, const unsigned char *audio,
+    const unsigned long audiosize)
+{
+   if (i >= audiosize)
+     return 0;
+   return (*bpm_sad_best()) (audio + i, audio, audiosize - i);
+}
+
+
+/* As bpm_phasefit(), but gives up once the mismatch reaches limit. A
+   result below limit is exact. */
+static unsigned long
+bpm_phasefit_bounded(const long i, const unsigned char *audio,
+    const unsigned long audiosize, const unsigned long limit)
+{
+   bpm_sad_func sad = bpm_sad_best();
+   unsigned long c, len, mismatch = 0;
+
+   for (c = i; c < audiosize && mismatch < limit; c += len) {
+     len = MIN(PHASEFIT_BLOCK, audiosize - c);
+     mismatch += (*sad) (audio + c, audio + c - i, len);
+   }
+   return mismatch;
+}
+
+
+/* One thread's share of phasefit_lags() */
+typedef struct {
+  const unsigned long *lags;
+  unsigned long *fouts;
+  guint nlags;
+  guint first;
+  guint stride;
+  const unsigned char *audio;
+  unsigned long audiosize;
+} phasefit_share;
+
+static gpointer
+phasefit_thread (gpointer data)
+{
+  phasefit_share *share = (phasefit_share *) data;
+  guint i;
+
+  for (i = share->first; i < share->nlags; i += share->stride)
+    share->fouts[i] = bpm_phasefit(share->lags[i], share->audio,
+                                   share->audiosize);
+  return NULL;
+}
+
+/**
+ * Put bpm_phasefit() of each of the lags in fouts, sharing them out
+ * over the pool's threads. This thread takes every stride'th lag from
+ * the first and reports the progress, from percent_from to 50 more.
+ */
+static void
+phasefit_lags (const unsigned long *lags, const guint nlags,
+               const unsigned char *audio, const unsigned long audiosize,
+               unsigned long *fouts, GjayWorkPool *pool,
+               bpm_progress_func progress, gpointer user_data,
+               const gint percent_from)
+{
+  phasefit_share *share;
+  guint t, i, stride;
+
+  stride = CLAMP(gjay_work_pool_threads(pool), 1, MAX(nlags, 1));
+  share = g_new(phasefit_share, stride);
+  for (t = 0; t < stride; t++) {
+    share[t].lags = lags;
+    share[t].fouts = fouts;
+    share[t].nlags = nlags;
+    share[t].first = t;
+    share[t].stride = stride;
+    share[t].audio = audio;
+    share[t].audiosize = audiosize;
+    if (t > 0)
+      gjay_work_pool_push(pool, phasefit_thread, &share[t]);
+  }
+  for (i = 0; i < nlags; i += stride) {
+    fouts[i] = bpm_phasefit(lags[i], audio, audiosize);
+    if (progress)
+      (*progress) (user_data, percent_from + (50 * (i + 1)) / nlags);
+  }
+  gjay_work_pool_wait(pool);
+  g_free(share);
+}
+
+
+/* Search order for the lags: nearest a hinted lag first */
+typedef struct {
+  unsigned long lag;
+  unsigned long distance;
+} lag_order;
+
+static int
+compare_lag_order (const void *a, const void *b)
+{
+  const lag_order *x = a, *y = b;
+
+  if (x->distance != y->distance)
+    return x->distance < y->distance ? -1 : 1;
+  return x->lag < y->lag ? -1 : (x->lag > y->lag);
+}
+
+/* Sort lags by how close they are to any of the hints */
+static void
+order_lags (lag_order *lags, const int nlags,
+            const unsigned long *hints, const int nhints)
+{
+  int i, j;
+  unsigned long d;
+
+  for (i = 0; i < nlags; i++) {
+    lags[i].distance = 0;
+    for (j = 0; j < nhints; j++) {
+      d = lags[i].lag > hints[j] ? lags[i].lag - hints[j] :
+        hints[j] - lags[i].lag;
+      if (j == 0 || d < lags[i].distance)
+        lags[i].distance = d;
+    }
+  }
+  if (nhints > 0)
+    qsort(lags, nlags, sizeof(lag_order), compare_lag_order);
+}
+
+/* The best lag so far, shared by the threads of scan_lags() */
+typedef struct {
+  GMutex        mutex;
+  unsigned long fout;
+  unsigned long at;
+  gboolean      keep_ties;  /* The best on entry, which wins ties */
+  gboolean      perfect;    /* Some lag matched perfectly */
+} scan_best;
+
+/* One thread's share of scan_lags(): every stride'th lag from first */
+typedef struct {
+  const lag_order *lags;
+  int nlags;
+  int first;
+  int stride;
+  const unsigned char *audio;
+  unsigned long audiosize;
+  scan_best *best;
+  bpm_progress_func progress;
+  gpointer user_data;
+  gint percent_from;
+} scan_share;
+
+static gpointer
+scan_thread (gpointer data)
+{
+  scan_share *share = (scan_share *) data;
+  scan_best *best = share->best;
+  unsigned long fout, limit, h;
+  int i;
+
+  for (i = share->first; i < share->nlags; i += share->stride) {
+    h = share->lags[i].lag;
+    g_mutex_lock(&best->mutex);
+    if (best->perfect) {
+      g_mutex_unlock(&best->mutex);
+      break;
+    }
+    /* A tie only wins if it has the lower lag */
+    if (best->keep_ties || h > best->at)
+      limit = best->fout;
+    else
+      limit = best->fout + 1;
+    g_mutex_unlock(&best->mutex);
+
+    fout = bpm_phasefit_bounded(h, share->audio, share->audiosize, limit);
+
+    /* Another thread may have done better meanwhile */
+    g_mutex_lock(&best->mutex);
+    if (fout == 0) {
+      best->perfect = TRUE;
+    } else if (fout < limit &&
+               (fout < best->fout ||
+                (fout == best->fout && !best->keep_ties && h < best->at))) {
+      best->fout = fout;
+      best->at = h;
+      best->keep_ties = FALSE;
+    }
+    g_mutex_unlock(&best->mutex);
+    if (share->progress)
+      (*share->progress) (share->user_data,
+                          share->percent_from + (50 * (i + 1)) / share->nlags);
+  }
+  return NULL;
+}
+
+/**
+ * Try the lags in the given order, keeping the best (lowest mismatch,
+ * then lowest lag) in *best_fout and *best_at. If keep_ties, the best
+ * on entry wins ties whatever its lag, as it would in the exhaustive
+ * scan. Returns FALSE if some lag matched perfectly; the exhaustive scan
+ * treats that specially so the caller has to use it instead.
+ *
+ * The lags are dealt out over the pool's threads in turn, so each still
+ * goes nearest the hints first. This thread takes the first share and
+ * reports the progress, from percent_from to 50 more.
+ */
+static gboolean
+scan_lags (const lag_order *lags, const int nlags,
+           const unsigned char *audio, const unsigned long audiosize,
+           unsigned long *best_fout, unsigned long *best_at,
+           gboolean keep_ties, GjayWorkPool *pool,
+           bpm_progress_func progress, gpointer user_data,
+           const gint percent_from)
+{
+  scan_best best;
+  scan_share *share;
+  int t, stride;
+
+  g_mutex_init(&best.mutex);
+  best.fout = *best_fout;
+  best.at = *best_at;
+  best.keep_ties = keep_ties;
+  best.perfect = FALSE;
+
+  stride = CLAMP((int) gjay_work_pool_threads(pool), 1, MAX(nlags, 1));
+  share = g_new(scan_share, stride);
+  for (t = 0; t < stride; t++) {
+    share[t].lags = lags;
+    share[t].nlags = nlags;
+    share[t].first = t;
+    share[t].stride = stride;
+    share[t].audio = audio;
+    share[t].audiosize = audiosize;
+    share[t].best = &best;
+    share[t].progress = t == 0 ? progress : NULL;
+    share[t].user_data = user_data;
+    share[t].percent_from = percent_from;
+    if (t > 0)
+      gjay_work_pool_push(pool, scan_thread, &share[t]);
+  }
+  scan_thread(&share[0]);
+  gjay_work_pool_wait(pool);
+  g_free(share);
+  g_mutex_clear(&best.mutex);
+
+  *best_fout = best.fout;
+  *best_at = best.at;
+  return !best.perfect;
+}
+
+/**
+ * The phase fit scan, skipping work which can't change the answer.
+ *
+ * The exhaustive scan tries every 50th lag from startshift, then every
+ * lag within 100 of the best. Its first lag only sets the mismatch to
+ * beat (minimumfoutat stays ULONG_MAX), and later lags replace the best
+ * only if strictly better, so the earliest wins a tie. Here the first
+ * lag is still tried first, and ties are settled by comparing lags, so
+ * the other lags can go in any order, and be shared out over threads.
+ */
+static gdouble
+bpm_scan (const unsigned char *audio, const unsigned long audiosize,
+          const gdouble hint_bpm, GjayWorkPool *pool,
+          bpm_progress_func progress, gpointer user_data,
+          GjayStats *stats)
+{
+  unsigned long startshift, stopshift, minimumfout, minimumfoutat,
+                left, right, hints[8], lag;
+  lag_order *lags;
+  gdouble b;
+  int nlags, nhints;
+  guint64 span_start;
+
+  stopshift = AUDIO_RATE*60*4/START_BPM;
+  startshift = AUDIO_RATE*60*4/STOP_BPM;
+
+  span_start = gjay_stats_now();
+  minimumfout = bpm_phasefit(startshift, audio, audiosize);
+  if (minimumfout == 0)
+    return bpm_scan_exhaustive(audio, audiosize, pool, progress, user_data,
+                               stats);
+  minimumfoutat = ULONG_MAX;
+
+  /* The previous song's tempo and its octaves are good guesses */
+  nhints = 0;
+  if (hint_bpm > 0.0 && isfinite(hint_bpm)) {
+    for (b = hint_bpm / 8.0; b <= hint_bpm * 8.0 && nhints < 8; b *= 2.0) {
+      lag = (unsigned long) (4.0 * AUDIO_RATE * 60.0 / b);
+      if (lag >= startshift && lag < stopshift)
+        hints[nhints++] = lag;
+    }
+  }
+
+  /* Coarse pass, bar the first lag */
+  lags = g_new(lag_order, (stopshift - startshift) / 50 + 201);
+  for (nlags = 0, lag = startshift + 50; lag < stopshift; lag += 50)
+    lags[nlags++].lag = lag;
+  order_lags(lags, nlags, hints, nhints);
+  if (!scan_lags(lags, nlags, audio, audiosize, &minimumfout,
+        &minimumfoutat, TRUE, pool, progress, user_data, 0)) {
+    g_free(lags);
+    return bpm_scan_exhaustive(audio, audiosize, pool, progress, user_data,
+                               stats);
+  }
+  gjay_stats_span_end(stats, GJAY_SPAN_BPM_COARSE, span_start);
+  span_start = gjay_stats_now();
+
+  /* Fine pass around the coarse winner. The arithmetic (and its
+     wrapping if there was no winner) is the exhaustive scan's. */
+  left = minimumfoutat - 100;
+  right = minimumfoutat + 100;
+  if ( left < startshift )
+    left = startshift;
+  if ( right > stopshift )
+    right = stopshift;
+  for (nlags = 0, lag = left; lag < right; lag++)
+    lags[nlags++].lag = lag;
+  hints[0] = minimumfoutat;
+  order_lags(lags, nlags, hints, 1);
+  if (!scan_lags(lags, nlags, audio, audiosize, &minimumfout,
+        &minimumfoutat, TRUE, pool, progress, user_data, 50)) {
+    g_free(lags);
+    return bpm_scan_exhaustive(audio, audiosize, pool, progress, user_data,
+                               stats);
+  }
+  g_free(lags);
+  gjay_stats_span_end(stats, GJAY_SPAN_BPM_FINE, span_start);
+
+  return 4.0*(double)AUDIO_RATE*60.0/(double)minimumfoutat;
+}
+
+
+static gdouble
+bpm_autocorr (const unsigned char *audio, const unsigned long audiosize,
+              bpm_progress_func progress, gpointer user_data,
+              GjayStats *stats)
+{
+  unsigned long startshift, stopshift, n, k, lag, best_lag;
+  guint64 head, tail, ssd, best_ssd, r, span_start;
+  double *data;
+
+  stopshift = AUDIO_RATE*60*4/START_BPM;
+  startshift = AUDIO_RATE*60*4/STOP_BPM;
+  if (audiosize <= stopshift)
+    return 0.0;
+
+  /* The lag curve counts as the coarse search, picking from it as the
+     fine one */
+  span_start = gjay_stats_now();
+
+  /* Pad with zeros so the circular correlation doesn't wrap round
+   * for any lag we look at */
+  for (n = 1; n < audiosize + stopshift; n <<= 1)
+    ;
+  data = g_malloc0(n * sizeof(double));
+  for (k = 0; k < audiosize; k++)
+    data[k] = audio[k];
+
+  gsl_fft_real_radix2_transform(data, 1, n);
+  if (progress)
+    (*progress) (user_data, 40);
+
+  /* Power spectrum, in GSL's half-complex order */
+  data[0] = data[0] * data[0];
+  for (k = 1; k < n / 2; k++) {
+    data[k] = data[k] * data[k] + data[n - k] * data[n - k];
+    data[n - k] = 0.0;
+  }
+  data[n / 2] = data[n / 2] * data[n / 2];
+
+  gsl_fft_halfcomplex_radix2_inverse(data, 1, n);
+  if (progress)
+    (*progress) (user_data, 80);
+  gjay_stats_span_end(stats, GJAY_SPAN_BPM_COARSE, span_start);
+  span_start = gjay_stats_now();
+
+  /* The envelope is integer so r is too; rounding removes the FFT
+   * noise and the comparison below is exact.
+   * head is the energy of a[0 .. N - lag), tail that of a[lag .. N) */
+  head = 0;
+  tail = 0;
+  for (k = 0; k < audiosize - startshift; k++)
+    head += (guint64) audio[k] * audio[k];
+  for (k = startshift; k < audiosize; k++)
+    tail += (guint64) audio[k] * audio[k];
+
+  best_lag = startshift;
+  best_ssd = G_MAXUINT64;
+  for (lag = startshift; lag < stopshift; lag++) {
+    r = (guint64) llround(MAX(data[lag], 0.0));
+    ssd = head + tail - 2 * r;
+    if (ssd < best_ssd) {
+      best_ssd = ssd;
+      best_lag = lag;
+    }
+    head -= (guint64) audio[audiosize - lag - 1] * audio[audiosize - lag - 1];
+    tail -= (guint64) audio[lag] * audio[lag];
+  }
+  if (progress)
+    (*progress) (user_data, 100);
+  g_free(data);
+  gjay_stats_span_end(stats, GJAY_SPAN_BPM_FINE, span_start);
+
+  return 4.0 * (double) AUDIO_RATE * 60.0 / (double) best_lag;
+}
+
+
+/**
+ * The lag bpm_scan_exhaustive() would pick, given the mismatch at every
+ * lag from startshift. It looks at the same lags in the same order, so
+ * ties and its other quirks come out the same.
+ */
+static unsigned long
+stream_pick_lag (const guint64 *fout, const unsigned long startshift,
+                 const unsigned long stopshift)
+{
+  unsigned long h, left, right, minimumfoutat = ULONG_MAX;
+  guint64 minimumfout = 0;
+
+  for (h = startshift; h < stopshift; h += 50) {
+    if (minimumfout == 0)
+      minimumfout = fout[h - startshift];
+    if (fout[h - startshift] < minimumfout) {
+      minimumfout = fout[h - startshift];
+      minimumfoutat = h;
+    }
+  }
+  left = minimumfoutat - 100;
+  right = minimumfoutat + 100;
+  if (left < startshift)
+    left = startshift;
+  if (right > stopshift)
+    right = stopshift;
+  for (h = left; h < right; h++) {
+    if (minimumfout == 0)
+      minimumfout = fout[h - startshift];
+    if (fout[h - startshift] < minimumfout) {
+      minimumfout = fout[h - startshift];
+      minimumfoutat = h;
+    }
+  }
+  return minimumfoutat;
+}
+
+/* Put the tempo of the part since segment_start on the curve */
+static void
+stream_end_segment (BpmStream *stream)
+{
+  BpmTempoPoint point;
+
+  point.seconds = stream->segment_start / (gdouble) AUDIO_RATE;
+  point.bpm = 4.0 * (double) AUDIO_RATE * 60.0 /
+    (double) stream_pick_lag(stream->segment_fout, stream->startshift,
+                             stream->stopshift);
+  g_array_append_val(stream->curve, point);
+  memset(stream->segment_fout, 0x00,
+         (stream->stopshift - stream->startshift) * sizeof(guint64));
+  stream->segment_start = stream->total;
+}
+
+BpmStream *
+bpm_stream_new (void)
+{
+  BpmStream *stream;
+
+  stream = g_new0(BpmStream, 1);
+  stream->stopshift = AUDIO_RATE*60*4/START_BPM;
+  stream->startshift = AUDIO_RATE*60*4/STOP_BPM;
+  stream->history = g_malloc(stream->stopshift + BPM_STREAM_BLOCK);
+  stream->fout = g_new0(guint64, stream->stopshift - stream->startshift);
+  stream->segment_fout = g_new0(guint64,
+                                stream->stopshift - stream->startshift);
+  stream->curve = g_array_new(FALSE, FALSE, sizeof(BpmTempoPoint));
+  return stream;
+}
+
+void
+bpm_stream_feed (BpmStream *stream, const unsigned char *envelope,
+                 const unsigned long len)
+{
+  bpm_sad_func sad = bpm_sad_best();
+  const unsigned char *from = envelope;
+  unsigned long left = len, n, lag, c;
+  guint64 mismatch;
+
+  while (left > 0) {
+    /* Up to the end of the history or of the segment */
+    n = MIN(left, stream->stopshift + BPM_STREAM_BLOCK - stream->have);
+    n = MIN(n, stream->segment_start +
+               (guint64) BPM_CURVE_SECONDS * AUDIO_RATE - stream->total);
+    memcpy(stream->history + stream->have, from, n);
+
+    /* Each new byte against the one lag before it. Until stopshift
+       bytes have been fed in, history starts at the first byte and a
+       lag only counts from there. */
+    for (lag = stream->startshift; lag < stream->stopshift; lag++) {
+      c = stream->have;
+      if (stream->total < lag)
+        c += lag - stream->total;
+      if (c >= stream->have + n)
+        continue;
+      mismatch = (*sad) (stream->history + c, stream->history + c - lag,
+                         stream->have + n - c);
+      stream->fout[lag - stream->startshift] += mismatch;
+      stream->segment_fout[lag - stream->startshift] += mismatch;
+    }
+
+    stream->have += n;
+    stream->total += n;
+    from += n;
+    left -= n;
+    if (stream->total == stream->segment_start +
+                         (guint64) BPM_CURVE_SECONDS * AUDIO_RATE)
+      stream_end_segment(stream);
+    if (stream->have == stream->stopshift + BPM_STREAM_BLOCK) {
+      memmove(stream->history,
+              stream->history + stream->have - stream->stopshift,
+              stream->stopshift);
+      stream->have = stream->stopshift;
+    }
+  }
+}
+
+gdouble
+bpm_stream_finish (BpmStream *stream, GArray **curve)
+{
+  /* A last part too short for the longest lag tells us nothing */
+  if (stream->total >= stream->segment_start + 2 * stream->stopshift)
+    stream_end_segment(stream);
+  if (curve) {
+    *curve = stream->curve;
+    stream->curve = g_array_new(FALSE, FALSE, sizeof(BpmTempoPoint));
+  }
+  return 4.0 * (double) AUDIO_RATE * 60.0 /
+    (double) stream_pick_lag(stream->fout, stream->startshift,
+                             stream->stopshift);
+}
+
+void
+bpm_stream_free (BpmStream *stream)
+{
+  if (stream == NULL)
+    return;
+  g_free(stream->history);
+  g_free(stream->fout);
+  g_free(stream->segment_fout);
+  g_array_free(stream->curve, TRUE);
+  g_free(stream);
+}
+
+guint64
+bpm_stream_fed (const BpmStream *stream)
+{
+  return stream->total;
+}
+
+gchar *
+bpm_stream_save (const BpmStream *stream, gsize *length)
+{
+  bpm_stream_header header;
+  gsize lags, at;
+  gchar *data;
+
+  memset(&header, 0x00, sizeof(header));
+  memcpy(header.magic, BPM_STREAM_MAGIC, sizeof(BPM_STREAM_MAGIC));
+  header.version = BPM_STREAM_VERSION;
+  header.audio_rate = AUDIO_RATE;
+  header.startshift = stream->startshift;
+  header.stopshift = stream->stopshift;
+  header.have = stream->have;
+  header.total = stream->total;
+  header.segment_start = stream->segment_start;
+  header.curve_points = stream->curve->len;
+
+  lags = stream->stopshift - stream->startshift;
+  *length = sizeof(header) + stream->have + 2 * lags * sizeof(guint64) +
+    stream->curve->len * sizeof(BpmTempoPoint);
+  data = g_malloc(*length);
+  memcpy(data, &header, sizeof(header));
+  at = sizeof(header);
+  memcpy(data + at, stream->history, stream->have);
+  at += stream->have;
+  memcpy(data + at, stream->fout, lags * sizeof(guint64));
+  at += lags * sizeof(guint64);
+  memcpy(data + at, stream->segment_fout, lags * sizeof(guint64));
+  at += lags * sizeof(guint64);
+  memcpy(data + at, stream->curve->data,
+         stream->curve->len * sizeof(BpmTempoPoint));
+  return data;
+}
+
+BpmStream *
+bpm_stream_load (const gchar *data, const gsize length)
+{
+  bpm_stream_header header;
+  BpmStream *stream;
+  gsize lags, at;
+
+  if (length < sizeof(header))
+    return NULL;
+  memcpy(&header, data, sizeof(header));
+  stream = bpm_stream_new();
+  lags = stream->stopshift - stream->startshift;
+  if (memcmp(header.magic, BPM_STREAM_MAGIC, sizeof(BPM_STREAM_MAGIC)) != 0 ||
+      header.version != BPM_STREAM_VERSION ||
+      header.audio_rate != AUDIO_RATE ||
+      header.startshift != stream->startshift ||
+      header.stopshift != stream->stopshift ||
+      header.have > stream->stopshift + BPM_STREAM_BLOCK ||
+      header.have > header.total ||
+      header.segment_start > header.total ||
+      header.curve_points > length ||
+      length != sizeof(header) + header.have + 2 * lags * sizeof(guint64) +
+                header.curve_points * sizeof(BpmTempoPoint)) {
+    bpm_stream_free(stream);
+    return NULL;
+  }
+
+  stream->have = header.have;
+  stream->total = header.total;
+  stream->segment_start = header.segment_start;
+  at = sizeof(header);
+  memcpy(stream->history, data + at, header.have);
+  at += header.have;
+  memcpy(stream->fout, data + at, lags * sizeof(guint64));
+  at += lags * sizeof(guint64);
+  memcpy(stream->segment_fout, data + at, lags * sizeof(guint64));
+  at += lags * sizeof(guint64);
+  g_array_append_vals(stream->curve, data + at, header.curve_points);
+  return stream;
+}
@@ -0,0 +1,82 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * bpm.h -- tempo detection on the decimated song envelope
+ */
+#ifndef BPM_H
+#define BPM_H
+
+#include "gjay.h"
+#include "stats.h"
+#include "work_pool.h"
+
+#define AUDIO_RATE 2756UL      /* Author states that 11025 is perfect
+                                  measure, but we can tolerate more
+                                  lossiness for the sake of speed */
+#define START_BPM 120UL
+#define STOP_BPM 160UL
+
+/* Called with how far through the BPM detection we are, 0 - 100.
+ * May be NULL. */
+typedef void (*bpm_progress_func) (gpointer user_data, const gint percent);
+
+/* The scan engines can share the lags out over the pool's threads,
+ * with the same answer as one. pool may be NULL. */
+gdouble       bpm_analyze          ( const bpm_engine engine,
+                                     const unsigned char *audio,
+                                     const unsigned long audiosize,
+                                     const gdouble hint_bpm,
+                                     GjayWorkPool *pool,
+                                     bpm_progress_func progress,
+                                     gpointer user_data,
+                                     GjayStats *stats );
+const gchar * bpm_engine_name      ( const bpm_engine engine );
+gboolean      bpm_engine_from_name ( const gchar *name,
+                                     bpm_engine *engine );
+
+/* Tempo of an envelope fed in as it comes, keeping only the last beat
+ * period of it, so songs of any length, or of no known length, take
+ * the same memory. It gets the exhaustive scan's answer for the whole
+ * envelope, and a tempo for each BPM_CURVE_SECONDS of it on the way. */
+#define BPM_CURVE_SECONDS 30
+
+typedef struct _BpmStream BpmStream;
+
+typedef struct {
+  gdouble seconds;      /* Where this part of the song starts */
+  gdouble bpm;
+} BpmTempoPoint;
+
+BpmStream *   bpm_stream_new       ( void );
+void          bpm_stream_feed      ( BpmStream *stream,
+                                     const unsigned char *envelope,
+                                     const unsigned long len );
+/* The tempo of all of it. The tempo curve, an array of BpmTempoPoint
+ * the caller frees, is put in curve unless that is NULL. */
+gdouble       bpm_stream_finish    ( BpmStream *stream,
+                                     GArray **curve );
+void          bpm_stream_free      ( BpmStream *stream );
+/* Envelope bytes fed in so far */
+guint64       bpm_stream_fed       ( const BpmStream *stream );
+/* Everything the stream has so far, for a checkpoint, and a stream
+ * made again from it, or NULL if it isn't one this build can use */
+gchar *       bpm_stream_save      ( const BpmStream *stream,
+                                     gsize *length );
+BpmStream *   bpm_stream_load      ( const gchar *data,
+                                     const gsize length );
+
+#endif /* BPM_H */
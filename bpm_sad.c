@@ -0,0 +1,169 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * bpm_sad.c -- sum of absolute differences kernels. The BPM phase fit
+ * spends nearly all its time here. x86 picks SSE2 or AVX2 at run time
+ * (PSADBW does 16 or 32 bytes at once); ARM uses NEON when the compiler
+ * targets it. Everything is integer so every kernel returns exactly
+ * what the scalar one does.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <glib.h>
+#include "bpm_sad.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define SAD_NEON 1
+#include <arm_neon.h>
+#endif
+
+guint64
+bpm_sad_scalar (const guchar *a, const guchar *b, const gsize n)
+{
+  guint64 sum = 0;
+  gsize i;
+
+  for (i = 0; i < n; i++)
+    sum += abs((int) a[i] - (int) b[i]);
+  return sum;
+}
+
+#ifdef SAD_X86
+__attribute__((target("sse2")))
+static guint64
+bpm_sad_sse2 (const guchar *a, const guchar *b, const gsize n)
+{
+  __m128i acc = _mm_setzero_si128();
+  guint64 lanes[2];
+  gsize i;
+
+  /* PSADBW leaves two 64-bit partial sums per register */
+  for (i = 0; i + 16 <= n; i += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(
+          _mm_loadu_si128((const __m128i *) (a + i)),
+          _mm_loadu_si128((const __m128i *) (b + i))));
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  return lanes[0] + lanes[1] + bpm_sad_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static guint64
+bpm_sad_avx2 (const guchar *a, const guchar *b, const gsize n)
+{
+  __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+  __m128i acc;
+  guint64 lanes[2];
+  gsize i;
+
+  /* Two accumulators to keep two loads in flight */
+  for (i = 0; i + 64 <= n; i += 64) {
+    acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(
+          _mm256_loadu_si256((const __m256i *) (a + i)),
+          _mm256_loadu_si256((const __m256i *) (b + i))));
+    acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(
+          _mm256_loadu_si256((const __m256i *) (a + i + 32)),
+          _mm256_loadu_si256((const __m256i *) (b + i + 32))));
+  }
+  acc0 = _mm256_add_epi64(acc0, acc1);
+  acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+                      _mm256_extracti128_si256(acc0, 1));
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  return lanes[0] + lanes[1] + bpm_sad_scalar(a + i, b + i, n - i);
+}
+#endif /* SAD_X86 */
+
+#ifdef SAD_NEON
+static guint64
+bpm_sad_neon (const guchar *a, const guchar *b, const gsize n)
+{
+  uint64x2_t total = vdupq_n_u64(0);
+  uint16x8_t acc;
+  gsize i = 0, j, end;
+
+  while (i + 16 <= n) {
+    /* Each 16-bit lane gains at most 2 * 255 per step; flush to the
+     * 64-bit total before it can overflow */
+    acc = vdupq_n_u16(0);
+    end = MIN(n - 15, i + 16 * 128);
+    for (j = i; j < end; j += 16)
+      acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + j), vld1q_u8(b + j)));
+    total = vpadalq_u32(total, vpaddlq_u16(acc));
+    i = j;
+  }
+  return vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1) +
+    bpm_sad_scalar(a + i, b + i, n - i);
+}
+#endif /* SAD_NEON */
+
+
+/* Room for every kernel and the end */
+static BpmSadKernel kernels[4];
+static guint n_kernels = 0;
+
+static void
+add_kernel (const gchar *name, const bpm_sad_func func)
+{
+  kernels[n_kernels].name = name;
+  kernels[n_kernels].func = func;
+  n_kernels++;
+}
+
+static gpointer
+pick_kernels (gpointer data)
+{
+  add_kernel("scalar", bpm_sad_scalar);
+#ifdef SAD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    add_kernel("sse2", bpm_sad_sse2);
+  if (__builtin_cpu_supports("avx2"))
+    add_kernel("avx2", bpm_sad_avx2);
+#endif /* SAD_X86 */
+#ifdef SAD_NEON
+  add_kernel("neon", bpm_sad_neon);
+#endif /* SAD_NEON */
+  return NULL;
+}
+
+const BpmSadKernel *
+bpm_sad_kernels (void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  g_once(&once, pick_kernels, NULL);
+  return kernels;
+}
+
+bpm_sad_func
+bpm_sad_best (void)
+{
+  bpm_sad_kernels();
+  return kernels[n_kernels - 1].func;
+}
+
+const gchar *
+bpm_sad_name (void)
+{
+  bpm_sad_kernels();
+  return kernels[n_kernels - 1].name;
+}
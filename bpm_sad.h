@@ -0,0 +1,44 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * bpm_sad.h -- sum of absolute differences of two byte arrays, for the
+ * BPM phase fit
+ */
+#ifndef BPM_SAD_H
+#define BPM_SAD_H
+
+#include <glib.h>
+
+/* sum(|a[i] - b[i]|) for i in 0 .. n-1 */
+typedef guint64 (*bpm_sad_func) (const guchar *a, const guchar *b,
+                                 const gsize n);
+
+guint64       bpm_sad_scalar ( const guchar *a, const guchar *b,
+                               const gsize n );
+typedef struct {
+  const gchar  *name;
+  bpm_sad_func  func;
+} BpmSadKernel;
+
+/* The fastest kernel this CPU can run; all give the same answer */
+bpm_sad_func  bpm_sad_best   ( void );
+const gchar * bpm_sad_name   ( void );
+/* Every kernel this CPU can run, the scalar one first and the fastest
+ * last, ended by one with a NULL name */
+const BpmSadKernel * bpm_sad_kernels ( void );
+
+#endif /* BPM_SAD_H */
@@ -6,7 +6,14 @@
 #define GJAY_PREFS          "prefs.xml"
 #define GJAY_FILE_DATA      "data.xml"
 #define GJAY_DAEMON_DATA    "daemon.xml"
+#define GJAY_FILE_DB        "data.gjdb"
+#define GJAY_JOURNAL        "data_journal.xml"
+#define GJAY_JOURNAL_OLD    "data_journal_old.xml"
 #define GJAY_QUEUE          "analysis_queue"
+#define GJAY_UPGRADE_QUEUE  "upgrade_queue"
+#define GJAY_PCM_CACHE      "pcm_cache"
+#define GJAY_DAEMON_STATS   "daemon_stats.json"
+#define GJAY_CHECKPOINTS    "checkpoints"
 #define GJAY_TEMP           "temp_analysis_append"
 #define GJAY_PID            "gjay.pid"
 
@@ -37,6 +44,10 @@
 /* Periodically write changed song data to disk */
 #define SONG_DIRTY_WRITE_TIMEOUT  1000 * 60 * 2
 
+/* Edits are appended to the journal, and the data file is rewritten
+   from it once it has this many songs, or a quarter of them if more */
+#define JOURNAL_COMPACT_MIN  1024
+
 /* For prefs */
 #define DEFAULT_PLAYLIST_TIME 72
 #define DEFAULT_MAX_WORKING_SET 1500
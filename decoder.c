@@ -0,0 +1,119 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * decoder.c -- picks an in-process decoder backend for a song. If no
+ * backend can open the file the caller falls back to the external
+ * decoder programs.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include "gjay.h"
+#include "decoder.h"
+#include "mp3.h"
+#include "vorbis.h"
+#include "flac.h"
+#include "i18n.h"
+
+static const GjayDecoderBackend *
+find_backend(const song_file_type type)
+{
+  switch (type) {
+#ifdef HAVE_VORBIS_VORBISFILE_H
+    case OGG:
+      return &vorbis_decoder_backend;
+#endif /* HAVE_VORBIS_VORBISFILE_H */
+#ifdef HAVE_MPG123_H
+    case MP3:
+      return &mpg123_decoder_backend;
+#endif /* HAVE_MPG123_H */
+#ifdef HAVE_FLAC_METADATA_H
+    case FLAC:
+      return &flac_decoder_backend;
+#endif /* HAVE_FLAC_METADATA_H */
+    default:
+      break;
+  }
+  return NULL;
+}
+
+/**
+ * Open path for in-process decoding. Returns NULL if there is no
+ * backend for the type, the library was not loaded or the file
+ * cannot be decoded.
+ */
+GjayDecoder *
+gjay_decoder_open(const gchar *path, const song_file_type type,
+                  const guint verbosity)
+{
+  const GjayDecoderBackend *backend;
+  GjayDecoder *dec;
+
+  if ((backend = find_backend(type)) == NULL)
+    return NULL;
+
+  dec = g_malloc0(sizeof(GjayDecoder));
+  dec->backend = backend;
+  if ((*backend->open)(dec, path) == FALSE) {
+    if (verbosity > 1)
+      printf(_("In-process %s decoder cannot open '%s'\n"),
+          backend->name, path);
+    g_free(dec);
+    return NULL;
+  }
+  if (dec->channels < 1 || dec->channels > 2) {
+    if (verbosity)
+      g_warning(_("In-process %s decoder: '%s' has %u channels\n"),
+          backend->name, path, dec->channels);
+    gjay_decoder_close(dec);
+    return NULL;
+  }
+  if (verbosity > 1)
+    printf(_("Decoding '%s' in-process with %s (%u Hz, %u channels)\n"),
+        path, backend->name, dec->rate, dec->channels);
+  return dec;
+}
+
+glong
+gjay_decoder_read(GjayDecoder *dec, gchar *buf, const gsize len)
+{
+  return (*dec->backend->read)(dec, buf, len);
+}
+
+/**
+ * Seek to PCM frame number frame. Returns FALSE if the backend cannot
+ * seek or the seek failed, in which case the caller has to read its
+ * way there.
+ */
+gboolean
+gjay_decoder_seek(GjayDecoder *dec, const guint64 frame)
+{
+  if (dec->backend->seek == NULL)
+    return FALSE;
+  return (*dec->backend->seek)(dec, frame);
+}
+
+void
+gjay_decoder_close(GjayDecoder *dec)
+{
+  if (dec == NULL)
+    return;
+  (*dec->backend->close)(dec);
+  g_free(dec);
+}
@@ -0,0 +1,60 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * decoder.h -- in-process decoding of songs to 16-bit PCM for analysis
+ */
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "gjay.h"
+
+typedef struct _GjayDecoder GjayDecoder;
+
+/* Each file type which can be decoded in-process provides one of these.
+ * The backends live next to the tag readers for the same format
+ * (vorbis.c, flac.c, mp3.c) and use the same dlopen'ed libraries. */
+typedef struct {
+  const gchar *name;
+  /* Open path, fill in dec->channels and dec->rate, set dec->handle */
+  gboolean (*open)  (GjayDecoder *dec, const gchar *path);
+  /* Read up to len bytes of little-endian signed 16-bit interleaved PCM.
+   * Returns bytes read, 0 at end of stream, < 0 on error. */
+  glong    (*read)  (GjayDecoder *dec, gchar *buf, const gsize len);
+  /* Carry on reading from PCM frame (sample per channel) number frame.
+   * May be NULL if the format cannot seek. */
+  gboolean (*seek)  (GjayDecoder *dec, const guint64 frame);
+  void     (*close) (GjayDecoder *dec);
+} GjayDecoderBackend;
+
+struct _GjayDecoder {
+  const GjayDecoderBackend *backend;
+  gpointer  handle;
+  guint     channels;
+  guint     rate;
+};
+
+GjayDecoder * gjay_decoder_open   ( const gchar * path,
+                                    const song_file_type type,
+                                    const guint verbosity );
+glong         gjay_decoder_read   ( GjayDecoder * dec,
+                                    gchar * buf,
+                                    const gsize len );
+gboolean      gjay_decoder_seek   ( GjayDecoder * dec,
+                                    const guint64 frame );
+void          gjay_decoder_close  ( GjayDecoder * dec );
+
+#endif /* DECODER_H */
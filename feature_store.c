@@ -0,0 +1,310 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * feature_store.c -- the song features that scoring reads, by song ID.
+ * The songs own the values; songs.c copies them here as songs are added
+ * and changed.
+ *
+ * The compact store rounds each feature to the nearest step. The
+ * frequency bins share one scale for the library, so the distance
+ * between two songs' bins is summed in integers and scaled once. The
+ * scale is the largest bin seen, with headroom; a song that is
+ * louder in some band than that widens it, and every row is redone.
+ * --benchmark measures how far the compact scores are from the full
+ * ones.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include "gjay.h"
+#include "feature_store.h"
+
+#define FEATURES_MIN_ROWS 1024
+
+/* A widened freq_scale is this much over the bin that widened it */
+#define FREQ_SCALE_HEADROOM 1.25
+
+#define ROUND_STEP(value, steps) ((guint) floor((value) * (steps) + 0.5))
+
+
+GjayFeatures *
+gjay_features_new (const gboolean compact)
+{
+  GjayFeatures * features;
+
+  features = g_new0(GjayFeatures, 1);
+  features->compact = compact;
+  return features;
+}
+
+void
+gjay_features_free (GjayFeatures * features)
+{
+  if (features == NULL)
+    return;
+  g_free(features->flags);
+  g_free(features->bpm);
+  g_free(features->volume_diff);
+  g_free(features->rating);
+  g_free(features->hue);
+  g_free(features->saturation);
+  g_free(features->brightness);
+  g_free(features->freq);
+  g_free(features->bpm_q);
+  g_free(features->volume_diff_q);
+  g_free(features->rating_q);
+  g_free(features->hsv_q);
+  g_free(features->freq_q);
+  g_free(features);
+}
+
+static void
+features_resize (GjayFeatures * features, const guint size)
+{
+  features->flags = g_renew(guint8, features->flags, size);
+  if (features->compact) {
+    features->bpm_q = g_renew(guint16, features->bpm_q, size);
+    features->volume_diff_q = g_renew(guint16, features->volume_diff_q, size);
+    features->rating_q = g_renew(guint8, features->rating_q, size);
+    features->hsv_q = g_renew(guint32, features->hsv_q, size);
+    features->freq_q = g_renew(guint8, features->freq_q,
+                               (gsize) size * NUM_FREQ_SAMPLES);
+  } else {
+    features->bpm = g_renew(gdouble, features->bpm, size);
+    features->volume_diff = g_renew(gdouble, features->volume_diff, size);
+    features->rating = g_renew(gdouble, features->rating, size);
+    features->hue = g_renew(gfloat, features->hue, size);
+    features->saturation = g_renew(gfloat, features->saturation, size);
+    features->brightness = g_renew(gfloat, features->brightness, size);
+    features->freq = g_renew(gdouble, features->freq,
+                             (gsize) size * NUM_FREQ_SAMPLES);
+  }
+  features->size = size;
+}
+
+static void
+features_grow (GjayFeatures * features, const guint rows)
+{
+  guint size;
+
+  for (size = MAX(features->size, FEATURES_MIN_ROWS); size < rows; size *= 2)
+    ;
+  if (size != features->size)
+    features_resize(features, size);
+}
+
+static void
+features_set_compact (GjayFeatures * features, const guint id,
+                      const GjaySong * s)
+{
+  guint8 * bins;
+  gdouble hue;
+  gint k;
+
+  features->bpm_q[id] =
+    ROUND_STEP((CLAMP(s->bpm, MIN_BPM, MAX_BPM) - MIN_BPM) /
+               (MAX_BPM - MIN_BPM), GJAY_FEATURE_BPM_STEPS);
+  features->volume_diff_q[id] =
+    MIN(ROUND_STEP(MAX(s->volume_diff, 0), GJAY_FEATURE_VOLUME_STEPS),
+        G_MAXUINT16);
+  features->rating_q[id] =
+    ROUND_STEP((CLAMP(s->rating, MIN_RATING, MAX_RATING) - MIN_RATING) /
+               (MAX_RATING - MIN_RATING), GJAY_FEATURE_RATING_STEPS);
+  /* Hue is 0...6, and 6 is 0 again */
+  hue = CLAMP(s->color.H, 0, 6) / 6.0;
+  features->hsv_q[id] =
+    (ROUND_STEP(hue, GJAY_FEATURE_HUE_STEPS) % GJAY_FEATURE_HUE_STEPS) << 20 |
+    ROUND_STEP(CLAMP(s->color.S, 0, 1), GJAY_FEATURE_SV_STEPS) << 10 |
+    ROUND_STEP(CLAMP(s->color.V, 0, 1), GJAY_FEATURE_SV_STEPS);
+
+  bins = GJAY_FEATURES_FREQ_Q(features, id);
+  for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+    bins[k] = features->freq_scale > 0 && !s->no_data ?
+      MIN(ROUND_STEP(MAX(s->freq[k], 0) / features->freq_scale,
+                     GJAY_FEATURE_FREQ_STEPS), GJAY_FEATURE_FREQ_STEPS) : 0;
+}
+
+gboolean
+gjay_features_set (GjayFeatures * features, const guint id,
+                   const GjaySong * s)
+{
+  gdouble top;
+  guint row;
+  gint k;
+
+  if (id >= features->size)
+    features_grow(features, id + 1);
+  /* Rows skipped over are songs with nothing known */
+  for (row = features->len; row < id; row++) {
+    features->flags[row] = GJAY_FEATURE_NO_DATA | GJAY_FEATURE_NO_RATING |
+      GJAY_FEATURE_NO_COLOR | GJAY_FEATURE_BPM_UNDEF;
+    if (features->compact) {
+      features->bpm_q[row] = features->volume_diff_q[row] = 0;
+      features->rating_q[row] = 0;
+      features->hsv_q[row] = 0;
+      memset(GJAY_FEATURES_FREQ_Q(features, row), 0x00, NUM_FREQ_SAMPLES);
+    } else {
+      features->bpm[row] = features->volume_diff[row] =
+        features->rating[row] = 0;
+      features->hue[row] = features->saturation[row] =
+        features->brightness[row] = 0;
+      memset(GJAY_FEATURES_FREQ(features, row), 0x00,
+             sizeof(gdouble) * NUM_FREQ_SAMPLES);
+    }
+  }
+  if (id >= features->len)
+    features->len = id + 1;
+
+  features->flags[id] = (s->no_data ? GJAY_FEATURE_NO_DATA : 0) |
+    (s->no_rating ? GJAY_FEATURE_NO_RATING : 0) |
+    (s->no_color ? GJAY_FEATURE_NO_COLOR : 0) |
+    (s->bpm_undef ? GJAY_FEATURE_BPM_UNDEF : 0);
+  if (features->compact) {
+    for (top = 0, k = 0; !s->no_data && k < NUM_FREQ_SAMPLES; k++)
+      top = MAX(top, s->freq[k]);
+    if (top > features->freq_scale) {
+      features->freq_scale = top * FREQ_SCALE_HEADROOM;
+      features_set_compact(features, id, s);
+      return TRUE;
+    }
+    features_set_compact(features, id, s);
+    return FALSE;
+  }
+  features->bpm[id] = s->bpm;
+  features->volume_diff[id] = s->volume_diff;
+  features->rating[id] = s->rating;
+  features->hue[id] = s->color.H;
+  features->saturation[id] = s->color.S;
+  features->brightness[id] = s->color.V;
+  memcpy(GJAY_FEATURES_FREQ(features, id), s->freq,
+         sizeof(gdouble) * NUM_FREQ_SAMPLES);
+  return FALSE;
+}
+
+void
+gjay_features_reserve (GjayFeatures * features, const guint rows)
+{
+  /* Exactly, so a big library loaded at once isn't copied as it grows */
+  if (rows > features->size)
+    features_resize(features, rows);
+}
+
+gsize
+gjay_features_row_size (const GjayFeatures * features)
+{
+  if (features->compact)
+    return sizeof(guint8) + 2 * sizeof(guint16) + sizeof(guint8) +
+      sizeof(guint32) + NUM_FREQ_SAMPLES;
+  return sizeof(guint8) + 3 * sizeof(gdouble) + 3 * sizeof(gfloat) +
+    NUM_FREQ_SAMPLES * sizeof(gdouble);
+}
+
+
+void
+gjay_features_color_distance (const GjayFeatures * f,
+                              const guint a, const guint b,
+                              gdouble * hue, gdouble * saturation,
+                              gdouble * brightness)
+{
+  guint32 qa, qb;
+
+  if (f->compact) {
+    qa = f->hsv_q[a];
+    qb = f->hsv_q[b];
+    *hue = abs((gint) (qa >> 20) - (gint) (qb >> 20)) /
+      (gdouble) GJAY_FEATURE_HUE_STEPS;
+    *saturation = abs((gint) ((qa >> 10) & 0x3ff) -
+                      (gint) ((qb >> 10) & 0x3ff)) /
+      (gdouble) GJAY_FEATURE_SV_STEPS;
+    *brightness = abs((gint) (qa & 0x3ff) - (gint) (qb & 0x3ff)) /
+      (gdouble) GJAY_FEATURE_SV_STEPS;
+  } else {
+    /* Hue is 0...6 */
+    *hue = fabs(f->hue[a] - f->hue[b]) / 6.0;
+    *saturation = fabs(f->saturation[a] - f->saturation[b]);
+    *brightness = fabs(f->brightness[a] - f->brightness[b]);
+  }
+  if (*hue > 0.5)
+    *hue = 1 - *hue;
+}
+
+gdouble
+gjay_features_bpm_distance (const GjayFeatures * f,
+                            const guint a, const guint b)
+{
+  gdouble ba, bb;
+
+  if (f->compact)
+    return abs((gint) f->bpm_q[a] - (gint) f->bpm_q[b]) /
+      (gdouble) GJAY_FEATURE_BPM_STEPS;
+  ba = MIN(MAX(MIN_BPM, f->bpm[a]), MAX_BPM) - MIN_BPM;
+  bb = MIN(MAX(MIN_BPM, f->bpm[b]), MAX_BPM) - MIN_BPM;
+  return fabs(ba - bb) / ((gdouble) (MAX_BPM - MIN_BPM));
+}
+
+gdouble
+gjay_features_freq_distance (const GjayFeatures * f,
+                             const guint a, const guint b)
+{
+  const gdouble * a_bins, * b_bins;
+  const guint8 * qa, * qb;
+  gdouble d;
+  guint sum;
+  gint i;
+
+  if (f->compact) {
+    /* The same sum as below: each pair of neighbouring bins is met
+       twice, by halves */
+    qa = GJAY_FEATURES_FREQ_Q(f, a);
+    qb = GJAY_FEATURES_FREQ_Q(f, b);
+    for (sum = 0, i = 0; i < NUM_FREQ_SAMPLES; i++)
+      sum += abs(qa[i] - qb[i]);
+    for (i = 0; i < NUM_FREQ_SAMPLES - 1; i++)
+      sum += abs(qa[i] - qb[i + 1]) + abs(qa[i + 1] - qb[i]);
+    return sum * (f->freq_scale / GJAY_FEATURE_FREQ_STEPS);
+  }
+  a_bins = GJAY_FEATURES_FREQ(f, a);
+  b_bins = GJAY_FEATURES_FREQ(f, b);
+  for (d = 0, i = 0; i < NUM_FREQ_SAMPLES; i++) {
+    d += fabs(a_bins[i] - b_bins[i]);
+    if (i < NUM_FREQ_SAMPLES - 1) {
+      d += fabs(a_bins[i] - b_bins[i + 1]) / 2.0;
+      d += fabs(a_bins[i + 1] - b_bins[i]) / 2.0;
+    }
+    if (i > 0) {
+      d += fabs(a_bins[i] - b_bins[i - 1]) / 2.0;
+      d += fabs(a_bins[i - 1] - b_bins[i]) / 2.0;
+    }
+  }
+  return d;
+}
+
+gdouble
+gjay_features_volume_distance (const GjayFeatures * f,
+                               const guint a, const guint b)
+{
+  if (f->compact)
+    return abs((gint) f->volume_diff_q[a] - (gint) f->volume_diff_q[b]) /
+      (gdouble) GJAY_FEATURE_VOLUME_STEPS;
+  return MAX(f->volume_diff[a], f->volume_diff[b]) -
+    MIN(f->volume_diff[a], f->volume_diff[b]);
+}
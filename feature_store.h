@@ -0,0 +1,114 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * feature_store.h -- what song_force() compares, kept apart from the songs
+ * in an array for each feature, indexed by song ID. Scoring a set of
+ * candidates reads only these arrays, not every song's strings,
+ * pixbufs and list pointers along with them.
+ *
+ * A compact store (--compact-features) keeps each feature quantized
+ * to a byte or two instead of a double, about a seventh of the size,
+ * and compares the songs in that form. The songs keep their doubles
+ * either way, for display and saving.
+ */
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <glib.h>
+#include "constants.h"
+
+/* Flags, the song's gbooleans that scoring looks at */
+#define GJAY_FEATURE_NO_DATA   (1 << 0)
+#define GJAY_FEATURE_NO_RATING (1 << 1)
+#define GJAY_FEATURE_NO_COLOR  (1 << 2)
+#define GJAY_FEATURE_BPM_UNDEF (1 << 3)
+
+/* Steps of the compact features */
+#define GJAY_FEATURE_BPM_STEPS    65535  /* Over MIN_BPM...MAX_BPM */
+#define GJAY_FEATURE_VOLUME_STEPS 1024   /* For each 1.0 of volume_diff */
+#define GJAY_FEATURE_RATING_STEPS 255    /* Over MIN_RATING...MAX_RATING */
+#define GJAY_FEATURE_HUE_STEPS    4096   /* Around the wheel, 12 bits */
+#define GJAY_FEATURE_SV_STEPS     1023   /* Saturation, brightness: 10 bits */
+#define GJAY_FEATURE_FREQ_STEPS   255    /* Up to freq_scale */
+
+typedef struct {
+  guint     len;          /* Rows, one for each song ID */
+  guint     size;         /* Rows allocated */
+  gboolean  compact;      /* The quantized arrays, not the doubles */
+  guint8  * flags;
+
+  gdouble * bpm;
+  gdouble * volume_diff;
+  gdouble * rating;
+  gfloat  * hue;          /* The song's color; floats, as in HSV */
+  gfloat  * saturation;
+  gfloat  * brightness;
+  gdouble * freq;         /* NUM_FREQ_SAMPLES for each row in turn */
+
+  guint16 * bpm_q;
+  guint16 * volume_diff_q;
+  guint8  * rating_q;
+  guint32 * hsv_q;        /* Hue << 20 | saturation << 10 | brightness */
+  guint8  * freq_q;       /* NUM_FREQ_SAMPLES for each row in turn */
+  gdouble   freq_scale;   /* What the top step of freq_q stands for */
+} GjayFeatures;
+
+/* The frequency bins of the song with the ID */
+#define GJAY_FEATURES_FREQ(f, id) \
+  ((f)->freq + (gsize) (id) * NUM_FREQ_SAMPLES)
+#define GJAY_FEATURES_FREQ_Q(f, id) \
+  ((f)->freq_q + (gsize) (id) * NUM_FREQ_SAMPLES)
+
+struct _song;
+
+GjayFeatures * gjay_features_new      ( const gboolean compact );
+void           gjay_features_free     ( GjayFeatures * features );
+/* Copy the song's features to row id, adding rows up to it. Returns
+   TRUE if a compact store had to widen freq_scale for the song, when
+   the other rows must be set again. */
+gboolean       gjay_features_set      ( GjayFeatures * features,
+                                        const guint id,
+                                        const struct _song * s );
+/* Bytes kept for each song */
+gsize          gjay_features_row_size ( const GjayFeatures * features );
+/* Make room for rows, when it is known how many are coming */
+void           gjay_features_reserve  ( GjayFeatures * features,
+                                        const guint rows );
+
+/* How far apart two songs are, for song_attraction(). The hue is
+   0...0.5 of the way around the wheel; saturation and brightness are
+   0...1 */
+void     gjay_features_color_distance  ( const GjayFeatures * f,
+                                         const guint a,
+                                         const guint b,
+                                         gdouble * hue,
+                                         gdouble * saturation,
+                                         gdouble * brightness );
+/* 0...1, of MIN_BPM...MAX_BPM */
+gdouble  gjay_features_bpm_distance    ( const GjayFeatures * f,
+                                         const guint a,
+                                         const guint b );
+/* Difference of each bin with the same and the neighbouring bins,
+   0...~20 */
+gdouble  gjay_features_freq_distance   ( const GjayFeatures * f,
+                                         const guint a,
+                                         const guint b );
+gdouble  gjay_features_volume_distance ( const GjayFeatures * f,
+                                         const guint a,
+                                         const guint b );
+
+#endif /* FEATURE_STORE_H */
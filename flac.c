@@ -30,6 +30,7 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <FLAC/metadata.h>
+#include <FLAC/stream_decoder.h>
 
 #include "flac.h"
 #include "gjay.h"
@@ -48,6 +49,40 @@ FLAC__StreamMetadata * (*gjflac_metadata_iterator_get_block)(FLAC__Metadata_Iter
 FLAC__bool (*gjflac_metadata_iterator_next)(FLAC__Metadata_Iterator *iterator);
 void (*gjflac_metadata_iterator_delete) (FLAC__Metadata_Iterator *iterator);
 
+FLAC__StreamDecoder* (*gjflac_stream_decoder_new)(void);
+FLAC__StreamDecoderInitStatus (*gjflac_stream_decoder_init_file)(FLAC__StreamDecoder *decoder, const char *filename, FLAC__StreamDecoderWriteCallback write_callback, FLAC__StreamDecoderMetadataCallback metadata_callback, FLAC__StreamDecoderErrorCallback error_callback, void *client_data);
+FLAC__bool (*gjflac_stream_decoder_process_single)(FLAC__StreamDecoder *decoder);
+FLAC__bool (*gjflac_stream_decoder_process_until_end_of_metadata)(FLAC__StreamDecoder *decoder);
+FLAC__StreamDecoderState (*gjflac_stream_decoder_get_state)(const FLAC__StreamDecoder *decoder);
+FLAC__bool (*gjflac_stream_decoder_seek_absolute)(FLAC__StreamDecoder *decoder, FLAC__uint64 sample);
+FLAC__bool (*gjflac_stream_decoder_flush)(FLAC__StreamDecoder *decoder);
+FLAC__bool (*gjflac_stream_decoder_finish)(FLAC__StreamDecoder *decoder);
+void (*gjflac_stream_decoder_delete)(FLAC__StreamDecoder *decoder);
+
+/* For writing tags; only looked for, as tags are written if they can be */
+FLAC__bool (*gjflac_metadata_chain_read_with_callbacks)(FLAC__Metadata_Chain *chain, FLAC__IOHandle handle, FLAC__IOCallbacks callbacks);
+FLAC__bool (*gjflac_metadata_chain_check_if_tempfile_needed)(FLAC__Metadata_Chain *chain, FLAC__bool use_padding);
+FLAC__bool (*gjflac_metadata_chain_write_with_callbacks)(FLAC__Metadata_Chain *chain, FLAC__bool use_padding, FLAC__IOHandle handle, FLAC__IOCallbacks callbacks);
+FLAC__bool (*gjflac_metadata_chain_write_with_callbacks_and_tempfile)(FLAC__Metadata_Chain *chain, FLAC__bool use_padding, FLAC__IOHandle handle, FLAC__IOCallbacks callbacks, FLAC__IOHandle temp_handle, FLAC__IOCallbacks temp_callbacks);
+void (*gjflac_metadata_chain_sort_padding)(FLAC__Metadata_Chain *chain);
+FLAC__bool (*gjflac_metadata_iterator_insert_block_after)(FLAC__Metadata_Iterator *iterator, FLAC__StreamMetadata *block);
+FLAC__StreamMetadata * (*gjflac_metadata_object_new)(FLAC__MetadataType type);
+void (*gjflac_metadata_object_delete)(FLAC__StreamMetadata *object);
+int (*gjflac_metadata_object_vorbiscomment_remove_entries_matching)(FLAC__StreamMetadata *object, const char *field_name);
+FLAC__bool (*gjflac_metadata_object_vorbiscomment_append_comment)(FLAC__StreamMetadata *object, FLAC__StreamMetadata_VorbisComment_Entry entry, FLAC__bool copy);
+static gboolean flac_write_supported = FALSE;
+
+/* State for in-process decoding */
+typedef struct {
+  FLAC__StreamDecoder *decoder;
+  guint       bits_per_sample;
+  guint       channels;
+  guint       rate;
+  GByteArray *pcm;       /* Decoded PCM not yet handed out */
+  guint       pcm_pos;
+  gboolean    error;
+} flac_decode_state;
+
 gboolean
 gjay_flac_dlopen(void) {
   void * lib;
@@ -87,6 +122,57 @@ gjay_flac_dlopen(void) {
       gjay_dlsym(lib, "FLAC__metadata_iterator_delete")) == NULL)
     return FALSE;
 
+  if ( (gjflac_stream_decoder_new =
+      gjay_dlsym(lib, "FLAC__stream_decoder_new")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_init_file =
+      gjay_dlsym(lib, "FLAC__stream_decoder_init_file")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_process_single =
+      gjay_dlsym(lib, "FLAC__stream_decoder_process_single")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_process_until_end_of_metadata =
+      gjay_dlsym(lib, "FLAC__stream_decoder_process_until_end_of_metadata")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_get_state =
+      gjay_dlsym(lib, "FLAC__stream_decoder_get_state")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_seek_absolute =
+      gjay_dlsym(lib, "FLAC__stream_decoder_seek_absolute")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_flush =
+      gjay_dlsym(lib, "FLAC__stream_decoder_flush")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_finish =
+      gjay_dlsym(lib, "FLAC__stream_decoder_finish")) == NULL)
+    return FALSE;
+  if ( (gjflac_stream_decoder_delete =
+      gjay_dlsym(lib, "FLAC__stream_decoder_delete")) == NULL)
+    return FALSE;
+
+  flac_write_supported =
+    (gjflac_metadata_chain_read_with_callbacks =
+     dlsym(lib, "FLAC__metadata_chain_read_with_callbacks")) != NULL &&
+    (gjflac_metadata_chain_check_if_tempfile_needed =
+     dlsym(lib, "FLAC__metadata_chain_check_if_tempfile_needed")) != NULL &&
+    (gjflac_metadata_chain_write_with_callbacks =
+     dlsym(lib, "FLAC__metadata_chain_write_with_callbacks")) != NULL &&
+    (gjflac_metadata_chain_write_with_callbacks_and_tempfile =
+     dlsym(lib, "FLAC__metadata_chain_write_with_callbacks_and_tempfile")) != NULL &&
+    (gjflac_metadata_chain_sort_padding =
+     dlsym(lib, "FLAC__metadata_chain_sort_padding")) != NULL &&
+    (gjflac_metadata_iterator_insert_block_after =
+     dlsym(lib, "FLAC__metadata_iterator_insert_block_after")) != NULL &&
+    (gjflac_metadata_object_new =
+     dlsym(lib, "FLAC__metadata_object_new")) != NULL &&
+    (gjflac_metadata_object_delete =
+     dlsym(lib, "FLAC__metadata_object_delete")) != NULL &&
+    (gjflac_metadata_object_vorbiscomment_remove_entries_matching =
+     dlsym(lib, "FLAC__metadata_object_vorbiscomment_remove_entries_matching")) != NULL &&
+    (gjflac_metadata_object_vorbiscomment_append_comment =
+     dlsym(lib, "FLAC__metadata_object_vorbiscomment_append_comment")) != NULL;
+  dlerror();
+
   return TRUE;
 }
 
@@ -95,7 +181,8 @@ read_flac_file_type( gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album)
+                      gchar   ** album,
+                      GjayTags * tags)
 {
   FILE *fp;
   int i;
@@ -182,6 +269,10 @@ read_flac_file_type( gchar    * path,
             free (text);
           }
 
+          if (tags && strncasecmp(GJAY_TAG_PREFIX, comment,
+                                  strlen(GJAY_TAG_PREFIX)) == 0)
+            gjay_tags_parse_comment(tags, comment,
+                                    block->data.vorbis_comment.comments[i].length);
         }
         
         free (comment);
@@ -202,4 +293,357 @@ read_flac_file_type( gchar    * path,
   return TRUE;
 }
 
+/* libFLAC reads and writes the tags through these, so that the file
+   can be rewritten to one of ours and checked before it replaces the
+   original */
+static size_t
+flac_io_read (void * ptr, size_t size, size_t nmemb, FLAC__IOHandle handle)
+{
+  return fread(ptr, size, nmemb, (FILE *) handle);
+}
+
+static size_t
+flac_io_write (const void * ptr, size_t size, size_t nmemb,
+               FLAC__IOHandle handle)
+{
+  return fwrite(ptr, size, nmemb, (FILE *) handle);
+}
+
+static int
+flac_io_seek (FLAC__IOHandle handle, FLAC__int64 offset, int whence)
+{
+  return fseeko((FILE *) handle, offset, whence);
+}
+
+static FLAC__int64
+flac_io_tell (FLAC__IOHandle handle)
+{
+  return ftello((FILE *) handle);
+}
+
+static int
+flac_io_eof (FLAC__IOHandle handle)
+{
+  return feof((FILE *) handle);
+}
+
+static const FLAC__IOCallbacks flac_io_callbacks = {
+  flac_io_read, flac_io_write, flac_io_seek, flac_io_tell, flac_io_eof, NULL
+};
+
+/* Where the audio frames start, after any ID3v2 tag and the metadata
+   blocks, or -1 if it isn't a FLAC file */
+static goffset
+flac_audio_offset (const gchar * path)
+{
+  FILE * f;
+  guchar b[10];
+  goffset offset = 0;
+  gboolean last = FALSE;
+
+  if ((f = fopen(path, "rb")) == NULL)
+    return -1;
+  /* libFLAC skips an ID3v2 tag before the stream and keeps it */
+  if (fread(b, 1, 10, f) == 10 && memcmp(b, "ID3", 3) == 0)
+    offset = 10 + (((b[6] & 0x7f) << 21) | ((b[7] & 0x7f) << 14) |
+                   ((b[8] & 0x7f) << 7) | (b[9] & 0x7f));
+  if (fseeko(f, offset, SEEK_SET) != 0 || fread(b, 1, 4, f) != 4 ||
+      memcmp(b, "fLaC", 4) != 0) {
+    fclose(f);
+    return -1;
+  }
+  offset += 4;
+  while (!last) {
+    if (fseeko(f, offset, SEEK_SET) != 0 || fread(b, 1, 4, f) != 4) {
+      offset = -1;
+      break;
+    }
+    last = (b[0] & 0x80) != 0;
+    offset += 4 + ((b[1] << 16) | (b[2] << 8) | b[3]);
+  }
+  fclose(f);
+  return offset;
+}
+
+/* Whether the audio frames of path are those that had the checksum sum */
+static gboolean
+flac_audio_same (const gchar * path, const gchar * sum)
+{
+  gchar * now = NULL;
+  goffset start;
+  gboolean same;
+
+  if ((start = flac_audio_offset(path)) >= 0)
+    now = gjay_tags_tail_checksum(path, start);
+  same = (now != NULL && strcmp(now, sum) == 0);
+  g_free(now);
+  return same;
+}
+
+/* Whether the tags read back from path are the comments written */
+static gboolean
+flac_tags_written (gchar * path, gchar ** comments)
+{
+  GjayTags tags;
+  gchar * title = NULL, * artist = NULL, * album = NULL;
+  gint length;
+  gboolean ok;
+
+  memset(&tags, 0x00, sizeof(tags));
+  ok = read_flac_file_type(path, &length, &title, &artist, &album, &tags) &&
+       gjay_tags_match(&tags, comments);
+  g_free(title);
+  g_free(artist);
+  g_free(album);
+  return ok;
+}
+
+/**
+ * Replace the GJAY_ comments of a FLAC file, adding a comment block if
+ * it has none. When the padding allows libFLAC rewrites the metadata
+ * in place, and it is put back if it doesn't then read back right with
+ * the same audio. Otherwise it writes the whole file to a copy, which has to
+ * read back with the new tags and the same audio frames before it
+ * replaces the original.
+ */
+gboolean
+write_flac_gjay_tags (const gchar * path, gchar ** comments)
+{
+  FLAC__Metadata_Chain *chain;
+  FLAC__Metadata_Iterator *iterator;
+  FLAC__StreamMetadata *block, *vc = NULL;
+  FLAC__StreamMetadata_VorbisComment_Entry entry;
+  FILE *f, *temp;
+  GByteArray *head;
+  gchar *name, *sum = NULL, *temp_path;
+  goffset start;
+  gboolean ok;
+  gint k;
+
+  if (!flac_write_supported)
+    return FALSE;
+  if ((f = fopen(path, "r+b")) == NULL)
+    return FALSE;
+  if ((chain = (*gjflac_metadata_chain_new)()) == NULL) {
+    fclose(f);
+    return FALSE;
+  }
+  if (!(*gjflac_metadata_chain_read_with_callbacks)(chain, f,
+                                                    flac_io_callbacks) ||
+      (iterator = (*gjflac_metadata_iterator_new)()) == NULL) {
+    (*gjflac_metadata_chain_delete)(chain);
+    fclose(f);
+    return FALSE;
+  }
+
+  (*gjflac_metadata_iterator_init)(iterator, chain);
+  do {
+    block = (*gjflac_metadata_iterator_get_block)(iterator);
+    if (block && block->type == FLAC__METADATA_TYPE_VORBIS_COMMENT)
+      vc = block;
+  } while (vc == NULL && (*gjflac_metadata_iterator_next)(iterator));
+
+  ok = TRUE;
+  if (vc == NULL) {
+    /* Straight after the stream info */
+    (*gjflac_metadata_iterator_init)(iterator, chain);
+    vc = (*gjflac_metadata_object_new)(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    if (vc && !(*gjflac_metadata_iterator_insert_block_after)(iterator, vc)) {
+      (*gjflac_metadata_object_delete)(vc);
+      vc = NULL;
+    }
+    ok = (vc != NULL);
+  }
+
+  for (k = 0; ok && comments[k]; k++) {
+    name = g_strndup(comments[k], strcspn(comments[k], "="));
+    ok = (*gjflac_metadata_object_vorbiscomment_remove_entries_matching)(vc, name) >= 0;
+    g_free(name);
+    entry.length = strlen(comments[k]);
+    entry.entry = (FLAC__byte *) comments[k];
+    ok = ok && (*gjflac_metadata_object_vorbiscomment_append_comment)(vc, entry, true);
+  }
+  if (ok) {
+    (*gjflac_metadata_chain_sort_padding)(chain);
+    if ((start = flac_audio_offset(path)) >= 0)
+      sum = gjay_tags_tail_checksum(path, start);
+    ok = (sum != NULL);
+  }
+
+  if (ok && !(*gjflac_metadata_chain_check_if_tempfile_needed)(chain, true)) {
+    /* The same file, with the audio frames where they were. The old
+       metadata goes back if the new doesn't read back right. */
+    if ((head = gjay_tags_head_save(f, start)) != NULL) {
+      ok = (*gjflac_metadata_chain_write_with_callbacks)(chain, true, f,
+                                                         flac_io_callbacks);
+      ok = ok && fflush(f) == 0 &&
+           flac_tags_written((gchar *) path, comments) &&
+           flac_audio_same(path, sum);
+      if (ok)
+        g_byte_array_free(head, TRUE);
+      else
+        gjay_tags_head_restore(f, path, head);
+    } else {
+      ok = FALSE;
+    }
+    ok = (fclose(f) == 0) && ok;
+    f = NULL;
+  } else if (ok && (temp = gjay_tags_temp_open(path, &temp_path)) != NULL) {
+    ok = (*gjflac_metadata_chain_write_with_callbacks_and_tempfile)(chain,
+        true, f, flac_io_callbacks, temp, flac_io_callbacks);
+    ok = ok && fflush(temp) == 0 &&
+         flac_tags_written(temp_path, comments) &&
+         flac_audio_same(temp_path, sum);
+    ok = gjay_tags_temp_replace(temp, temp_path, path, ok);
+  } else {
+    ok = FALSE;
+  }
+
+  if (f)
+    fclose(f);
+  g_free(sum);
+  (*gjflac_metadata_iterator_delete)(iterator);
+  (*gjflac_metadata_chain_delete)(chain);
+  return ok;
+}
+
+/* In-process decoding, see decoder.h */
+static FLAC__StreamDecoderWriteStatus
+flac_decoder_write_cb(const FLAC__StreamDecoder *decoder,
+    const FLAC__Frame *frame, const FLAC__int32 * const buffer[],
+    void *client_data)
+{
+  flac_decode_state *state = (flac_decode_state *)client_data;
+  guint i, c, old_len, bps;
+  FLAC__int32 v;
+  guint8 *out;
+
+  bps = frame->header.bits_per_sample;
+  old_len = state->pcm->len;
+  g_byte_array_set_size(state->pcm,
+      old_len + frame->header.blocksize * frame->header.channels * 2);
+  out = state->pcm->data + old_len;
+
+  for (i = 0; i < frame->header.blocksize; i++) {
+    for (c = 0; c < frame->header.channels; c++) {
+      v = buffer[c][i];
+      /* Analysis wants 16 bit samples whatever the source depth */
+      if (bps > 16)
+        v >>= (bps - 16);
+      else if (bps < 16)
+        v <<= (16 - bps);
+      *out++ = v & 0xff;
+      *out++ = (v >> 8) & 0xff;
+    }
+  }
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+flac_decoder_metadata_cb(const FLAC__StreamDecoder *decoder,
+    const FLAC__StreamMetadata *metadata, void *client_data)
+{
+  flac_decode_state *state = (flac_decode_state *)client_data;
+
+  if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+    state->channels = metadata->data.stream_info.channels;
+    state->rate = metadata->data.stream_info.sample_rate;
+    state->bits_per_sample = metadata->data.stream_info.bits_per_sample;
+  }
+}
+
+static void
+flac_decoder_error_cb(const FLAC__StreamDecoder *decoder,
+    FLAC__StreamDecoderErrorStatus status, void *client_data)
+{
+  /* Lost sync or a bad frame; the decoder carries on with the next one */
+}
+
+static void
+flac_decoder_close(GjayDecoder *dec)
+{
+  flac_decode_state *state = (flac_decode_state *)dec->handle;
+
+  (*gjflac_stream_decoder_finish)(state->decoder);
+  (*gjflac_stream_decoder_delete)(state->decoder);
+  g_byte_array_free(state->pcm, TRUE);
+  g_free(state);
+}
+
+static gboolean
+flac_decoder_open(GjayDecoder *dec, const gchar *path)
+{
+  flac_decode_state *state;
+
+  if (gjflac_stream_decoder_new == NULL)
+    return FALSE;
+
+  state = g_malloc0(sizeof(flac_decode_state));
+  if ((state->decoder = (*gjflac_stream_decoder_new)()) == NULL) {
+    g_free(state);
+    return FALSE;
+  }
+  state->pcm = g_byte_array_new();
+  dec->handle = state;
+
+  if ((*gjflac_stream_decoder_init_file)(state->decoder, path,
+        flac_decoder_write_cb, flac_decoder_metadata_cb,
+        flac_decoder_error_cb, state) !=
+      FLAC__STREAM_DECODER_INIT_STATUS_OK ||
+      !(*gjflac_stream_decoder_process_until_end_of_metadata)(state->decoder) ||
+      state->channels == 0) {
+    flac_decoder_close(dec);
+    dec->handle = NULL;
+    return FALSE;
+  }
+  dec->channels = state->channels;
+  dec->rate = state->rate;
+  return TRUE;
+}
+
+static glong
+flac_decoder_read(GjayDecoder *dec, gchar *buf, const gsize len)
+{
+  flac_decode_state *state = (flac_decode_state *)dec->handle;
+  gsize avail;
+
+  while (state->pcm_pos >= state->pcm->len) {
+    g_byte_array_set_size(state->pcm, 0);
+    state->pcm_pos = 0;
+    if ((*gjflac_stream_decoder_get_state)(state->decoder) ==
+        FLAC__STREAM_DECODER_END_OF_STREAM)
+      return 0;
+    if (!(*gjflac_stream_decoder_process_single)(state->decoder))
+      return -1;
+  }
+  avail = MIN(len, state->pcm->len - state->pcm_pos);
+  memcpy(buf, state->pcm->data + state->pcm_pos, avail);
+  state->pcm_pos += avail;
+  return avail;
+}
+
+static gboolean
+flac_decoder_seek(GjayDecoder *dec, const guint64 frame)
+{
+  flac_decode_state *state = (flac_decode_state *)dec->handle;
+
+  /* The seek hands the frame it lands in to the write callback */
+  g_byte_array_set_size(state->pcm, 0);
+  state->pcm_pos = 0;
+  if ((*gjflac_stream_decoder_seek_absolute)(state->decoder, frame))
+    return TRUE;
+  /* A failed seek leaves the decoder unusable until flushed */
+  (*gjflac_stream_decoder_flush)(state->decoder);
+  g_byte_array_set_size(state->pcm, 0);
+  return FALSE;
+}
+
+const GjayDecoderBackend flac_decoder_backend = {
+  "libFLAC",
+  flac_decoder_open,
+  flac_decoder_read,
+  flac_decoder_seek,
+  flac_decoder_close
+};
+
 #endif /* HAVE_FLAC_METADATA_H */
@@ -20,6 +20,8 @@
 #define FLAC_H
 
 #include <stdio.h>
+#include "decoder.h"
+#include "tags.h"
 
 gboolean gjay_flac_dlopen(void);
 gboolean
@@ -27,7 +29,12 @@ read_flac_file_type( gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album);
+                      gchar   ** album,
+                      GjayTags * tags);
+gboolean write_flac_gjay_tags( const gchar * path,
+                              gchar ** comments );
+
+extern const GjayDecoderBackend flac_decoder_backend;
 
 #endif /* FLAC_H */
 #endif /* HAVE_FLAC_METADATA_H */
@@ -54,10 +54,14 @@
 #endif /* WITH_DBUSGLIB */
 
 #include "analysis.h"
+#include "benchmark.h"
 #include "ipc.h"
 #include "playlist.h"
 #include "vorbis.h"
 #include "flac.h"
+#include "mp3.h"
+#include "bpm.h"
+#include "spectrum.h"
 #include "play_common.h"
 #include "i18n.h"
 
@@ -161,26 +165,38 @@ parse_commandline(int *argc_p,
                   gboolean *m3u_format,
                   gboolean *run_player,
                   gchar **analyze_detached_fname,
+                  gchar **benchmark_fname,
                   gjay_mode *mode)
 {
   gboolean opt_daemon=FALSE, opt_playlist=FALSE;
   gchar *opt_standalone=NULL, *opt_color=NULL, *opt_file=NULL;
+  gchar *opt_benchmark=NULL;
+  gchar *opt_bpm_engine=NULL, *opt_spectrum_engine=NULL;
   GError *error;
   GOptionContext *context;
 
   GOptionEntry entries[] =
   {
     { "analyze-standalone", 'a', 0, G_OPTION_ARG_FILENAME, &opt_standalone, _("Analyze FILE and exit"), _("FILE") },
+    { "benchmark", 0, 0, G_OPTION_ARG_FILENAME, &opt_benchmark, _("Time the analysis on generated songs and write the results as JSON to FILE (- for standard output)"), _("FILE") },
+    { "bpm-engine", 0, 0, G_OPTION_ARG_STRING, &opt_bpm_engine, _("How to find the BPM of songs"), _("scan|autocorr|exhaustive") },
     { "color", 'c', 0, G_OPTION_ARG_STRING, &opt_color, _("Start playlist at color- Hex or name"), _("0xrrggbb|NAME") },
+    { "compact-features", 0, 0, G_OPTION_ARG_NONE, &(gjay->compact_features), _("Keep song features quantized, in a seventh of the memory, to score songs for playlists"), NULL },
     { "daemon", 'd', 0, G_OPTION_ARG_NONE, &opt_daemon, _("Run as daemon"), NULL },
+    { "external-decoders", 0, 0, G_OPTION_ARG_NONE, &(gjay->external_decoders), _("Decode songs with external programs only"), NULL },
     { "file", 'f', 0, G_OPTION_ARG_STRING, &opt_file, _("Start playlist at file"), _("FILE") },
     { "length", 'l', 0, G_OPTION_ARG_INT, &playlist_minutes, _("Playlist length"), _("minutes") },
+    { "pcm-cache", 0, 0, G_OPTION_ARG_INT, &(gjay->pcm_cache_mb), _("Keep up to MB of decoded analysis data so songs can be analyzed again without decoding"), _("MB") },
     { "playlist", 'p', 0, G_OPTION_ARG_NONE, &opt_playlist, _("Generate a playlist"), NULL },
+    { "sampled", 0, 0, G_OPTION_ARG_NONE, &(gjay->sampled), _("Analyze new songs quickly from parts of them, then fully when idle"), NULL },
     { "skip-verification", 's', 0, G_OPTION_ARG_NONE, &skip_verify, _("Skip file verification"), NULL },
+    { "spectrum-engine", 0, 0, G_OPTION_ARG_STRING, &opt_spectrum_engine, _("How to work out the frequency spectrum of songs"), _("float|gsl") },
+    { "write-tags", 0, 0, G_OPTION_ARG_NONE, &(gjay->write_tags), _("Keep analysis results in the songs' own tags"), NULL },
     { "m3u-playlist", 'u', 0, G_OPTION_ARG_NONE, m3u_format, _("Use M3U playlist format"), NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_INT, &(gjay->verbosity), "Set verbosity/debug level", _("LEVEL") },
     { "player-start", 'P', 0, G_OPTION_ARG_NONE, run_player, _("Start player using generated playlist"), NULL },
     { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK , &print_version, _("Show version"), NULL },
+    { "workers", 0, 0, G_OPTION_ARG_INT, &(gjay->workers), _("Number of songs to analyze at once (default: one per CPU)"), _("N") },
     { NULL }
   };
 
@@ -196,11 +212,29 @@ parse_commandline(int *argc_p,
   }
 
 
+  if (opt_bpm_engine != NULL &&
+      bpm_engine_from_name(opt_bpm_engine, &(gjay->bpm_engine)) == FALSE)
+  {
+    g_print (_("Unknown BPM engine '%s'\n"), opt_bpm_engine);
+    exit (1);
+  }
+  if (opt_spectrum_engine != NULL &&
+      spectrum_engine_from_name(opt_spectrum_engine,
+                                &(gjay->spectrum_engine)) == FALSE)
+  {
+    g_print (_("Unknown spectrum engine '%s'\n"), opt_spectrum_engine);
+    exit (1);
+  }
   if (opt_standalone != NULL)
   {
     *analyze_detached_fname = opt_standalone;
     *mode = ANALYZE_DETACHED;
   }
+  if (opt_benchmark != NULL)
+  {
+    *benchmark_fname = opt_benchmark;
+    *mode = BENCHMARK;
+  }
   if (opt_color != NULL)
   {
     RGB rgb;
@@ -245,11 +279,11 @@ static void run_as_playlist( GjayApp *gjay,
                              gboolean player_autostart)
 {
     GList * list;
+    guint i;
     gjay->prefs->use_selected_songs = FALSE;
     gjay->prefs->rating_cutoff = FALSE;
-    for (list = g_list_first(gjay->songs->songs); list; list = g_list_next(list)) {
-        SONG(list)->in_tree = TRUE;
-    }
+    for (i = 0; i < gjay->songs->songs->len; i++)
+        SONG_AT(gjay->songs, i)->in_tree = TRUE;
     if (playlist_minutes == 0)
         playlist_minutes = gjay->prefs->playlist_time;
     list = generate_playlist(gjay, playlist_minutes);
@@ -319,10 +353,10 @@ static void run_as_ui(int argc, char *argv[], GjayApp *gjay )
 
     send_ipc(gjay->ipc->ui_fifo, ATTACH);
     if (skip_verify) {
-        GList * llist;
-        for (llist = g_list_first(gjay->songs->songs); llist; llist = g_list_next(llist)) {
-            SONG(llist)->in_tree = TRUE;
-            SONG(llist)->access_ok = TRUE;
+        guint i;
+        for (i = 0; i < gjay->songs->songs->len; i++) {
+            SONG_AT(gjay->songs, i)->in_tree = TRUE;
+            SONG_AT(gjay->songs, i)->access_ok = TRUE;
         }
     } else {
         explore_view_set_root(gjay);
@@ -333,8 +367,7 @@ static void run_as_ui(int argc, char *argv[], GjayApp *gjay )
     gtk_main();
 
     save_prefs(gjay->prefs);
-    if (gjay->songs->dirty)
-        write_data_file(gjay);
+    save_data_file(gjay);
 
     if (gjay->prefs->detach ||
         (gjay->prefs->daemon_action == PREF_DAEMON_DETACH)) {
@@ -354,6 +387,7 @@ int main( int argc, char *argv[] )
 {
   GjayApp *gjay;
   gchar * analyze_detached_fname=NULL;
+  gchar * benchmark_fname=NULL;
   gboolean m3u_format, player_autostart;
   guint playlist_minutes;
   gchar *gjay_home;
@@ -371,7 +405,7 @@ int main( int argc, char *argv[] )
   m3u_format = FALSE;
   player_autostart = FALSE;
 
-  parse_commandline(&argc, &argv, gjay, &playlist_minutes, &m3u_format, &player_autostart, &analyze_detached_fname, &mode);
+  parse_commandline(&argc, &argv, gjay, &playlist_minutes, &m3u_format, &player_autostart, &analyze_detached_fname, &benchmark_fname, &mode);
 
   /* Make sure there is a "~/.gjay" directory */
  gjay_home = g_strdup_printf("%s/%s", g_get_home_dir(), GJAY_DIR);
@@ -401,6 +435,13 @@ int main( int argc, char *argv[] )
       if (gjay->verbosity)
         printf(_("FLAC not supported.\n"));
 
+#ifdef HAVE_MPG123_H
+    /* In-process MP3 decoding; otherwise use mpg123/mpg321 programs */
+    if (gjay_mpg123_dlopen() == FALSE)
+#endif /* HAVE_MPG123_H */
+      if (gjay->verbosity)
+        printf(_("In-process MP3 decoding not supported.\n"));
+
 #ifdef WITH_GUI
     if (mode == UI) {
         /* UI needs a daemon */
@@ -427,6 +468,10 @@ int main( int argc, char *argv[] )
     case ANALYZE_DETACHED:
         run_as_analyze_detached(gjay, analyze_detached_fname);
         break;
+    case BENCHMARK:
+        if (!run_as_benchmark(gjay, benchmark_fname))
+            return 1;
+        break;
     default:
         g_warning( _("Error: app mode %d not supported\n"), mode);
         return -1;
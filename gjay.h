@@ -65,9 +65,23 @@ typedef enum {
     DAEMON,
     DAEMON_DETACHED,
     PLAYLIST,        /* Generate a playlist and quit */
-    ANALYZE_DETACHED /* Analyze one file and quit */
+    ANALYZE_DETACHED, /* Analyze one file and quit */
+    BENCHMARK        /* Time the analysis on test songs and quit */
 } gjay_mode;
 
+/* How the analysis finds the tempo, see bpm.c */
+typedef enum {
+    BPM_ENGINE_SCAN = 0,       /* BpmDJ phase fit over a lag scan */
+    BPM_ENGINE_AUTOCORR,       /* Whole lag curve from one FFT autocorrelation */
+    BPM_ENGINE_SCAN_EXHAUSTIVE /* Scan without skipping hopeless lags */
+} bpm_engine;
+
+/* How the analysis gets the spectrum of each window, see spectrum.c */
+typedef enum {
+    SPECTRUM_ENGINE_FLOAT = 0, /* Own single precision FFT */
+    SPECTRUM_ENGINE_GSL        /* GSL double precision real FFT */
+} spectrum_engine;
+
 
 /* State */
 extern gjay_mode mode;
@@ -82,7 +96,7 @@ void    read_line             ( FILE * f,
 
 typedef struct _GjayPlayer {
   gchar *name;
-  GjaySong* (*get_current_song)(struct _GjayPlayer *player, GHashTable *song_name_hash);
+  GjaySong* (*get_current_song)(struct _GjayPlayer *player, GjaySongLists *songs);
   gboolean (*is_running)(struct _GjayPlayer *player);
   void (*play_files)(struct _GjayPlayer *player, GList *list);
   gboolean (*start)(struct _GjayPlayer *player);
@@ -127,6 +141,18 @@ struct _GjayApp {
   /* Supported filetypes */
   gboolean ogg_supported;
   gboolean flac_supported;
+
+  /* Analysis options */
+  gboolean external_decoders; /* Always use the helper programs */
+  gint     workers;           /* Analysis threads, 0 for one per CPU */
+  gboolean sampled;           /* Quick first pass, full analysis later */
+  gint     pcm_cache_mb;      /* Size of the analysis cache, 0 for none */
+  gboolean write_tags;        /* Keep analysis results in the songs' tags */
+  bpm_engine bpm_engine;
+  spectrum_engine spectrum_engine;
+
+  /* Playlist options */
+  gboolean compact_features;  /* Score songs on quantized features */
 };
 
 /* From daemon.c */
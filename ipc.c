@@ -33,6 +33,10 @@
 #define DAEMON_PIPE_FILE "daemon"
 #define UI_PIPE_FILE     "ui"
 
+/* The analysis workers share the daemon pipe; a message is written
+ * in several parts so hold this while writing one */
+static GMutex send_lock;
+
 static int gjay_fifo(const char *dirname, const char *filename)
 {
     gchar *pathname;
@@ -115,12 +119,14 @@ void send_ipc_text(const int fd, const ipc_type type, const char * text) {
 
     slen = strlen(text);
     len = sizeof(ipc_type) + slen;
+    g_mutex_lock(&send_lock);
     if (write(fd, &len,  sizeof(int)) <= 0)
      perror("send_ipc_text(): write length:"); 
     if (write(fd, &type, sizeof(ipc_type)) <= 0)
      perror("send_ipc_text(): write type:"); 
     if (write(fd, text,  slen) <= 0)
      perror("send_ipc_text(): write text:"); 
+    g_mutex_unlock(&send_lock);
 }
 
 
@@ -130,12 +136,14 @@ void send_ipc_int (const int fd, const ipc_type type, const int val) {
         return;
     
     len = sizeof(ipc_type) + sizeof(int);
+    g_mutex_lock(&send_lock);
     if (write(fd, &len,  sizeof(int)) <= 0)
      perror("send_ipc_int(): write length:"); 
     if (write(fd, &type, sizeof(ipc_type)) <= 0)
      perror("send_ipc_int(): write type:"); 
     if (write(fd, &val,  sizeof(int)) <= 0)
      perror("send_ipc_int(): write value:"); 
+    g_mutex_unlock(&send_lock);
 }
 
 
@@ -146,9 +154,11 @@ void send_ipc (const int fd, const ipc_type type) {
         return;
 
     len = sizeof(ipc_type);
+    g_mutex_lock(&send_lock);
     if (write(fd, &len,  sizeof(int)) <= 0)
      perror("send_ipc(): write length:"); 
     if (write(fd, &type, sizeof(ipc_type)) <= 0)
      perror("send_ipc(): write type:"); 
+    g_mutex_unlock(&send_lock);
 }
 
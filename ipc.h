@@ -32,7 +32,12 @@ typedef enum {
 
     /* Both may send... */
     REQ_ACK,          /* no arg */
-    ACK               /* no arg */
+    ACK,              /* no arg */
+
+    /* Added later, and so after the rest, so that a daemon left
+       running by an older GJay still reads the messages above right */
+    PROMOTE,          /* UI: str arg -- file or directory to analyze next */
+    STATS             /* Daemon: str arg -- JSON analysis statistics */
 } ipc_type;
 
 
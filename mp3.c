@@ -34,6 +34,24 @@
 #include "mp3.h"
 #include "i18n.h"
 
+#ifdef HAVE_MPG123_H
+#include <dlfcn.h>
+#include <endian.h>
+#include <mpg123.h>
+
+/* libmpg123 is dlopen'ed, like libvorbisfile and libFLAC */
+int (*gjmpg123_init)(void);
+mpg123_handle* (*gjmpg123_new)(const char *decoder, int *error);
+int (*gjmpg123_open)(mpg123_handle *mh, const char *path);
+int (*gjmpg123_getformat)(mpg123_handle *mh, long *rate, int *channels, int *encoding);
+int (*gjmpg123_format_none)(mpg123_handle *mh);
+int (*gjmpg123_format)(mpg123_handle *mh, long rate, int channels, int encodings);
+int (*gjmpg123_read)(mpg123_handle *mh, unsigned char *outmemory, size_t outmemsize, size_t *done);
+off_t (*gjmpg123_seek)(mpg123_handle *mh, off_t sampleoff, int whence);
+int (*gjmpg123_close)(mpg123_handle *mh);
+void (*gjmpg123_delete)(mpg123_handle *mh);
+#endif /* HAVE_MPG123_H */
+
 /* MIN_CONSEC_GOOD_FRAMES defines how many consecutive valid MP3 frames
    we need to see before we decide we are looking at a real MP3 file */
 #define MIN_CONSEC_GOOD_FRAMES 4
@@ -546,7 +564,8 @@ read_mp3_file_type( gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album)
+                      gchar   ** album,
+                      GjayTags * tags)
 {
   mp3info mp3;
 
@@ -571,6 +590,8 @@ read_mp3_file_type( gchar    * path,
        * mp3s generated by iTunes */
       get_id3_tags(mp3.file, title, artist, album);
     }
+    if (tags)
+      id3v2_read_gjay_tags(mp3.file, tags);
   }
   fclose(mp3.file);
   if (mp3.header_isvalid)
@@ -579,3 +600,132 @@ read_mp3_file_type( gchar    * path,
 }
 
 
+#ifdef HAVE_MPG123_H
+gboolean
+gjay_mpg123_dlopen(void) {
+  void * lib;
+
+  lib = dlopen("libmpg123.so.0", RTLD_GLOBAL | RTLD_LAZY);
+  if (!lib)
+    return FALSE;
+  /* Clear any error first */
+  dlerror();
+
+  if ( (gjmpg123_init =
+        gjay_dlsym(lib, "mpg123_init")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_new =
+        gjay_dlsym(lib, "mpg123_new")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_open =
+        gjay_dlsym(lib, "mpg123_open")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_getformat =
+        gjay_dlsym(lib, "mpg123_getformat")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_format_none =
+        gjay_dlsym(lib, "mpg123_format_none")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_format =
+        gjay_dlsym(lib, "mpg123_format")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_read =
+        gjay_dlsym(lib, "mpg123_read")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_seek =
+        gjay_dlsym(lib, "mpg123_seek")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_close =
+        gjay_dlsym(lib, "mpg123_close")) == NULL)
+    return FALSE;
+  if ( (gjmpg123_delete =
+        gjay_dlsym(lib, "mpg123_delete")) == NULL)
+    return FALSE;
+
+  if ((*gjmpg123_init)() != MPG123_OK)
+    return FALSE;
+  return TRUE;
+}
+
+/* In-process decoding, see decoder.h */
+static gboolean
+mpg123_decoder_open(GjayDecoder *dec, const gchar *path)
+{
+  mpg123_handle *mh;
+  long rate;
+  int channels, encoding, err;
+
+  if (gjmpg123_new == NULL)
+    return FALSE;
+
+  if ((mh = (*gjmpg123_new)(NULL, &err)) == NULL)
+    return FALSE;
+  if ((*gjmpg123_open)(mh, path) != MPG123_OK ||
+      (*gjmpg123_getformat)(mh, &rate, &channels, &encoding) != MPG123_OK) {
+    (*gjmpg123_delete)(mh);
+    return FALSE;
+  }
+  /* Lock the output format to what the analysis expects */
+  (*gjmpg123_format_none)(mh);
+  if ((*gjmpg123_format)(mh, rate, channels, MPG123_ENC_SIGNED_16) !=
+      MPG123_OK) {
+    (*gjmpg123_close)(mh);
+    (*gjmpg123_delete)(mh);
+    return FALSE;
+  }
+  dec->channels = channels;
+  dec->rate = rate;
+  dec->handle = mh;
+  return TRUE;
+}
+
+static glong
+mpg123_decoder_read(GjayDecoder *dec, gchar *buf, const gsize len)
+{
+  size_t done;
+  int result;
+
+  do {
+    done = 0;
+    result = (*gjmpg123_read)((mpg123_handle *)dec->handle,
+        (unsigned char *)buf, len, &done);
+  } while (result == MPG123_NEW_FORMAT && done == 0);
+
+  if (result != MPG123_OK && result != MPG123_DONE &&
+      result != MPG123_NEW_FORMAT)
+    return -1;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+  {
+    gint16 *s = (gint16 *)buf;
+    size_t i;
+    /* libmpg123 gives native byte order; analysis wants little-endian */
+    for (i = 0; i < done / 2; i++)
+      s[i] = GINT16_TO_LE(s[i]);
+  }
+#endif
+  return done;
+}
+
+static gboolean
+mpg123_decoder_seek(GjayDecoder *dec, const guint64 frame)
+{
+  return (*gjmpg123_seek)((mpg123_handle *)dec->handle, (off_t)frame,
+      SEEK_SET) >= 0;
+}
+
+static void
+mpg123_decoder_close(GjayDecoder *dec)
+{
+  (*gjmpg123_close)((mpg123_handle *)dec->handle);
+  (*gjmpg123_delete)((mpg123_handle *)dec->handle);
+}
+
+const GjayDecoderBackend mpg123_decoder_backend = {
+  "libmpg123",
+  mpg123_decoder_open,
+  mpg123_decoder_read,
+  mpg123_decoder_seek,
+  mpg123_decoder_close
+};
+#endif /* HAVE_MPG123_H */
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <string.h>
+#include "tags.h"
 
 enum VBR_REPORT { VBR_VARIABLE, VBR_AVERAGE, VBR_MEDIAN };
 enum SCANTYPE { SCAN_NONE, SCAN_QUICK, SCAN_FULL };
@@ -82,7 +83,8 @@ read_mp3_file_type( gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album);
+                      gchar   ** album,
+                      GjayTags * tags);
 
 int get_mp3_info( mp3info *mp3,
                   int scantype, 
@@ -91,3 +93,10 @@ int get_id3_tags( FILE         * fp,
                   gchar       ** title,
                   gchar       ** artist,
                   gchar       ** album);
+
+#ifdef HAVE_MPG123_H
+#include "decoder.h"
+
+gboolean gjay_mpg123_dlopen(void);
+extern const GjayDecoderBackend mpg123_decoder_backend;
+#endif /* HAVE_MPG123_H */
@@ -0,0 +1,431 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * pcm_cache.c -- each song's BPM envelope and summed spectrum go in a
+ * file in ~/.gjay/pcm_cache, named after the SHA1 of the song's path,
+ * size and modification time. A few hundred kilobytes a song stands in
+ * for decoding it again when the BPM or frequency code changes. The
+ * files are in the machine's own byte order; a cache from another
+ * machine is ignored, not converted.
+ *
+ * Checkpoints of long songs part way through their analysis are kept
+ * the same way in ~/.gjay/checkpoints, until the analysis finishes.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <glib.h>
+#include "constants.h"
+#include "bpm.h"
+#include "pcm_cache.h"
+#include "i18n.h"
+
+#define PCM_CACHE_MAGIC   "GJAYPCM"
+#define PCM_CACHE_VERSION 2
+
+typedef struct {
+  gchar   magic[8];
+  guint32 version;
+  guint32 audio_rate;
+  guint32 modus;
+  guint32 bins;
+  gint64  num_frames;
+  gdouble sum;
+  gdouble max_frame_sum;
+  guint64 audiosize;
+  gdouble bpm;            /* Of a song with no envelope */
+  guint64 curve_points;
+  /* then bins gdoubles of total_mags, the envelope, then the tempo
+     curve */
+} pcm_cache_header;
+
+/* A checkpoint is this, then stream_size bytes of a tempo stream, then
+   the signal so far as in the cache */
+typedef struct {
+  guint64 frame;
+  guint64 pos;
+  guint64 stream_size;
+} pcm_checkpoint_header;
+
+typedef struct {
+  gchar * path;
+  time_t  mtime;
+  off_t   size;
+} pcm_cache_file;
+
+/* A full cache is trimmed to this much of its size, so that it isn't
+   listed again on every store after */
+#define PCM_CACHE_TRIM_PERCENT 90
+
+/* Workers store entries at the same time */
+static GMutex cache_lock;
+
+/* Bytes in the cache, found by listing it on the first store and kept
+   up to date after. Only used with cache_lock held. */
+static guint64 cache_bytes = 0;
+static gboolean cache_bytes_known = FALSE;
+
+static gchar *
+pcm_cache_dir (void)
+{
+  return g_strdup_printf("%s/%s/%s", g_get_home_dir(),
+                         GJAY_DIR, GJAY_PCM_CACHE);
+}
+
+static gchar *
+pcm_cache_path (const gchar * key)
+{
+  return g_strdup_printf("%s/%s/%s/%s", g_get_home_dir(),
+                         GJAY_DIR, GJAY_PCM_CACHE, key);
+}
+
+gchar *
+gjay_pcm_cache_key (const gchar * path, const gchar * variant)
+{
+  struct stat st;
+  gchar * id, * key;
+
+  if (stat(path, &st) != 0)
+    return NULL;
+  id = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n%s",
+                       path, (gint64) st.st_size, (gint64) st.st_mtime,
+                       variant);
+  key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+  g_free(id);
+  return key;
+}
+
+/* Fill in signal from length bytes of a cache file */
+static gboolean
+pcm_cache_unpack (const gchar * contents, const gsize length,
+                  GjayAnalysisSignal * signal)
+{
+  pcm_cache_header header;
+  gsize at;
+
+  if (length < sizeof(header))
+    return FALSE;
+  memcpy(&header, contents, sizeof(header));
+  if (memcmp(header.magic, PCM_CACHE_MAGIC, sizeof(PCM_CACHE_MAGIC)) != 0 ||
+      header.version != PCM_CACHE_VERSION ||
+      header.audio_rate != AUDIO_RATE ||
+      header.bins != signal->bins ||
+      header.audiosize > length || header.curve_points > length ||
+      length != sizeof(header) + header.bins * sizeof(gdouble) +
+                header.audiosize +
+                header.curve_points * sizeof(BpmTempoPoint))
+    return FALSE;
+
+  signal->modus = header.modus;
+  signal->num_frames = header.num_frames;
+  signal->sum = header.sum;
+  signal->max_frame_sum = header.max_frame_sum;
+  signal->total_mags = g_new(gdouble, header.bins);
+  memcpy(signal->total_mags, contents + sizeof(header),
+         header.bins * sizeof(gdouble));
+  at = sizeof(header) + header.bins * sizeof(gdouble);
+  if (header.audiosize > 0) {
+    signal->audiosize = header.audiosize;
+    signal->audio = g_malloc0(header.audiosize + 1);
+    memcpy(signal->audio, contents + at, header.audiosize);
+    at += header.audiosize;
+  }
+  signal->bpm = header.bpm;
+  if (header.curve_points > 0) {
+    signal->tempo_curve = g_array_new(FALSE, FALSE, sizeof(BpmTempoPoint));
+    g_array_append_vals(signal->tempo_curve, contents + at,
+                        header.curve_points);
+  }
+  return TRUE;
+}
+
+/* Bytes of signal in the cache */
+static gsize
+pcm_cache_size (const GjayAnalysisSignal * signal)
+{
+  return sizeof(pcm_cache_header) + signal->bins * sizeof(gdouble) +
+    signal->audiosize +
+    (signal->tempo_curve ? signal->tempo_curve->len : 0) *
+    sizeof(BpmTempoPoint);
+}
+
+/* A cache file for signal, after room for prefix bytes */
+static gchar *
+pcm_cache_pack (const GjayAnalysisSignal * signal, const gsize prefix,
+                gsize * length)
+{
+  pcm_cache_header header;
+  gchar * contents;
+  gsize at;
+
+  memset(&header, 0x00, sizeof(header));
+  memcpy(header.magic, PCM_CACHE_MAGIC, sizeof(PCM_CACHE_MAGIC));
+  header.version = PCM_CACHE_VERSION;
+  header.audio_rate = AUDIO_RATE;
+  header.modus = signal->modus;
+  header.bins = signal->bins;
+  header.num_frames = signal->num_frames;
+  header.sum = signal->sum;
+  header.max_frame_sum = signal->max_frame_sum;
+  header.audiosize = signal->audio ? signal->audiosize : 0;
+  header.bpm = signal->bpm;
+  header.curve_points = signal->tempo_curve ? signal->tempo_curve->len : 0;
+
+  *length = prefix + sizeof(header) + signal->bins * sizeof(gdouble) +
+    header.audiosize + header.curve_points * sizeof(BpmTempoPoint);
+  contents = g_malloc0(*length);
+  at = prefix;
+  memcpy(contents + at, &header, sizeof(header));
+  at += sizeof(header);
+  memcpy(contents + at, signal->total_mags, signal->bins * sizeof(gdouble));
+  at += signal->bins * sizeof(gdouble);
+  if (header.audiosize > 0)
+    memcpy(contents + at, signal->audio, header.audiosize);
+  at += header.audiosize;
+  if (header.curve_points > 0)
+    memcpy(contents + at, signal->tempo_curve->data,
+           header.curve_points * sizeof(BpmTempoPoint));
+  return contents;
+}
+
+gboolean
+gjay_pcm_cache_load (const gchar * key, GjayAnalysisSignal * signal)
+{
+  gchar * path, * contents;
+  gsize length;
+  gboolean result;
+
+  path = pcm_cache_path(key);
+  if (!g_file_get_contents(path, &contents, &length, NULL)) {
+    g_free(path);
+    return FALSE;
+  }
+  result = pcm_cache_unpack(contents, length, signal);
+  g_free(contents);
+
+  /* Eviction goes by modification time, whatever the mount options */
+  if (result)
+    utime(path, NULL);
+  g_free(path);
+  return result;
+}
+
+static gint
+pcm_cache_file_cmp (gconstpointer a, gconstpointer b)
+{
+  const pcm_cache_file * fa = a, * fb = b;
+
+  if (fa->mtime != fb->mtime)
+    return (fa->mtime < fb->mtime) ? -1 : 1;
+  return 0;
+}
+
+/* The cache's size, and its files in files unless that is NULL */
+static guint64
+pcm_cache_list (const gchar * dir, GArray * files)
+{
+  GDir * d;
+  const gchar * name;
+  pcm_cache_file file;
+  struct stat st;
+  guint64 total = 0;
+
+  if ((d = g_dir_open(dir, 0, NULL)) == NULL)
+    return 0;
+  while ((name = g_dir_read_name(d)) != NULL) {
+    file.path = g_build_filename(dir, name, NULL);
+    if (stat(file.path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      g_free(file.path);
+      continue;
+    }
+    file.mtime = st.st_mtime;
+    file.size = st.st_size;
+    total += st.st_size;
+    if (files)
+      g_array_append_val(files, file);
+    else
+      g_free(file.path);
+  }
+  g_dir_close(d);
+  return total;
+}
+
+/* Drop the least recently used files until there are no more than
+   max_bytes. Call with cache_lock held. */
+static void
+pcm_cache_trim (const gchar * dir, const guint64 max_bytes)
+{
+  GArray * files;
+  pcm_cache_file file;
+  guint64 total;
+  guint i;
+
+  files = g_array_new(FALSE, FALSE, sizeof(pcm_cache_file));
+  total = pcm_cache_list(dir, files);
+  g_array_sort(files, pcm_cache_file_cmp);
+  for (i = 0; i < files->len; i++) {
+    file = g_array_index(files, pcm_cache_file, i);
+    if (total > max_bytes && unlink(file.path) == 0)
+      total -= file.size;
+    g_free(file.path);
+  }
+  g_array_free(files, TRUE);
+  cache_bytes = total;
+}
+
+void
+gjay_pcm_cache_store (const gchar * key, const GjayAnalysisSignal * signal,
+                      const guint64 max_bytes)
+{
+  gchar * dir, * path, * contents;
+  gsize length;
+  struct stat st;
+  off_t old_size = 0;
+  GError * error = NULL;
+
+  if (pcm_cache_size(signal) > max_bytes)
+    return;
+  contents = pcm_cache_pack(signal, 0, &length);
+
+  dir = pcm_cache_dir();
+  path = pcm_cache_path(key);
+  g_mutex_lock(&cache_lock);
+  g_mkdir_with_parents(dir, 0700);
+  if (!cache_bytes_known) {
+    cache_bytes = pcm_cache_list(dir, NULL);
+    cache_bytes_known = TRUE;
+  }
+  if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+    old_size = st.st_size;
+  /* Written to a temporary file and renamed, so never seen half done */
+  if (g_file_set_contents(path, contents, length, &error)) {
+    cache_bytes -= MIN((guint64) old_size, cache_bytes);
+    cache_bytes += length;
+  } else {
+    g_warning(_("Unable to write analysis cache '%s': %s\n"),
+              path, error->message);
+    g_error_free(error);
+  }
+  if (cache_bytes > max_bytes)
+    pcm_cache_trim(dir, max_bytes / 100 * PCM_CACHE_TRIM_PERCENT);
+  g_mutex_unlock(&cache_lock);
+  g_free(path);
+  g_free(dir);
+  g_free(contents);
+}
+
+static gchar *
+pcm_checkpoint_path (const gchar * key)
+{
+  return g_strdup_printf("%s/%s/%s/%s", g_get_home_dir(),
+                         GJAY_DIR, GJAY_CHECKPOINTS, key);
+}
+
+gboolean
+gjay_pcm_checkpoint_load (const gchar * key, GjayAnalysisSignal * signal,
+                          guint64 * frame, guint64 * pos,
+                          gchar ** stream, gsize * stream_size)
+{
+  pcm_checkpoint_header header;
+  gchar * path, * contents;
+  gsize length, at;
+  gboolean result = FALSE;
+
+  path = pcm_checkpoint_path(key);
+  if (g_file_get_contents(path, &contents, &length, NULL)) {
+    memset(&header, 0x00, sizeof(header));
+    if (length >= sizeof(header))
+      memcpy(&header, contents, sizeof(header));
+    at = sizeof(header) + header.stream_size;
+    if (length >= sizeof(header) &&
+        header.stream_size <= length - sizeof(header) &&
+        pcm_cache_unpack(contents + at, length - at, signal)) {
+      *frame = header.frame;
+      *pos = header.pos;
+      *stream_size = header.stream_size;
+      *stream = header.stream_size ?
+        g_memdup(contents + sizeof(header), header.stream_size) : NULL;
+      result = TRUE;
+    }
+    g_free(contents);
+  }
+  g_free(path);
+  return result;
+}
+
+void
+gjay_pcm_checkpoint_store (const gchar * key,
+                           const GjayAnalysisSignal * signal,
+                           const guint64 frame, const guint64 pos,
+                           const gchar * stream, const gsize stream_size)
+{
+  pcm_checkpoint_header header;
+  gchar * dir, * path, * contents;
+  gsize length;
+  GError * error = NULL;
+
+  header.frame = frame;
+  header.pos = pos;
+  header.stream_size = stream_size;
+  contents = pcm_cache_pack(signal, sizeof(header) + stream_size, &length);
+  memcpy(contents, &header, sizeof(header));
+  if (stream_size)
+    memcpy(contents + sizeof(header), stream, stream_size);
+
+  dir = g_strdup_printf("%s/%s/%s", g_get_home_dir(),
+                        GJAY_DIR, GJAY_CHECKPOINTS);
+  path = pcm_checkpoint_path(key);
+  g_mkdir_with_parents(dir, 0700);
+  if (!g_file_set_contents(path, contents, length, &error)) {
+    g_warning(_("Unable to write analysis checkpoint '%s': %s\n"),
+              path, error->message);
+    g_error_free(error);
+  }
+  g_free(path);
+  g_free(dir);
+  g_free(contents);
+}
+
+void
+gjay_pcm_checkpoint_drop (const gchar * key)
+{
+  gchar * path;
+
+  path = pcm_checkpoint_path(key);
+  unlink(path);
+  g_free(path);
+}
+
+void
+gjay_analysis_signal_clear (GjayAnalysisSignal * signal)
+{
+  g_free(signal->total_mags);
+  signal->total_mags = NULL;
+  g_free(signal->audio);
+  signal->audio = NULL;
+  signal->audiosize = 0;
+  if (signal->tempo_curve) {
+    g_array_free(signal->tempo_curve, TRUE);
+    signal->tempo_curve = NULL;
+  }
+}
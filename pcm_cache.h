@@ -0,0 +1,76 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * pcm_cache.h -- keep what the analysis got out of decoding a song, so
+ * it can be redone without decoding the song again, and checkpoints of
+ * long songs part way through
+ */
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include <glib.h>
+
+/* What run_analysis() gets out of decoding a song; everything after
+   that is worked out from this alone */
+typedef struct {
+  guint     modus;          /* Channels */
+  guint     bins;           /* Spectrum bins per window */
+  gdouble * total_mags;     /* Spectrum summed over windows and channels */
+  gdouble   sum;            /* Of all the magnitudes */
+  gdouble   max_frame_sum;  /* Largest sum of one window's magnitudes */
+  glong     num_frames;     /* Windows times channels */
+  unsigned char * audio;    /* BPM envelope, AUDIO_RATE samples a second */
+  unsigned long   audiosize;
+  /* Without audio, the tempo was found as the song went by */
+  gdouble   bpm;
+  GArray *  tempo_curve;    /* of BpmTempoPoint, may be NULL */
+} GjayAnalysisSignal;
+
+/* Name for the cache entry of path as it is now, or NULL if it can't be
+   looked at. variant tells apart analyses of different parts of it. */
+gchar *  gjay_pcm_cache_key    ( const gchar * path,
+                                 const gchar * variant );
+/* Fills in signal from the cache, which the caller clears */
+gboolean gjay_pcm_cache_load   ( const gchar * key,
+                                 GjayAnalysisSignal * signal );
+/* Adds signal, dropping the least recently used entries until the
+   cache is no more than max_bytes */
+void     gjay_pcm_cache_store  ( const gchar * key,
+                                 const GjayAnalysisSignal * signal,
+                                 const guint64 max_bytes );
+void     gjay_analysis_signal_clear ( GjayAnalysisSignal * signal );
+
+/* The signal of a long song as far as frame, with the BPM envelope
+   filled in up to pos, so its analysis can carry on from there if the
+   daemon is stopped. Keyed like the cache. A song whose tempo is found
+   as it goes has no envelope; stream is the saved BpmStream instead,
+   fed up to pos and some way past it, or NULL. */
+gboolean gjay_pcm_checkpoint_load  ( const gchar * key,
+                                     GjayAnalysisSignal * signal,
+                                     guint64 * frame,
+                                     guint64 * pos,
+                                     gchar ** stream,
+                                     gsize * stream_size );
+void     gjay_pcm_checkpoint_store ( const gchar * key,
+                                     const GjayAnalysisSignal * signal,
+                                     const guint64 frame,
+                                     const guint64 pos,
+                                     const gchar * stream,
+                                     const gsize stream_size );
+void     gjay_pcm_checkpoint_drop  ( const gchar * key );
+
+#endif /* PCM_CACHE_H */
@@ -0,0 +1,197 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * pcm_ring.c -- a producer thread decodes into a ring of fixed size
+ * blocks while the analysis works on the blocks before it, so waiting
+ * on the decoder (or the pipe to it) overlaps with the number
+ * crunching. There is one producer and one consumer.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <glib.h>
+#include "pcm_ring.h"
+
+struct _GjayPcmRing {
+  guint     nblocks;
+  gsize     block_size;
+  gchar    *data;
+  gsize    *fill;      /* Bytes in each block */
+  guint     head;      /* Next block the producer fills */
+  guint     tail;      /* Next block the consumer takes */
+  guint     full;      /* Blocks filled and not yet released */
+  gboolean  eof;       /* Producer has finished */
+  gboolean  quit;      /* Consumer wants the producer to stop */
+  GMutex    lock;
+  GCond     cond;
+  GThread  *thread;
+  GjayPcmRingFill fill_func;
+  gpointer  user_data;
+
+  /* gjay_pcm_ring_read() works through one block at a time */
+  const gchar *cur;
+  gsize     cur_len, cur_pos;
+
+  GjayPcmRingStats stats;
+};
+
+static gpointer
+pcm_ring_producer (gpointer data)
+{
+  GjayPcmRing *ring = data;
+  gchar *block;
+  gsize count;
+  gint64 start;
+
+  g_mutex_lock(&ring->lock);
+  while (!ring->quit) {
+    if (ring->full == ring->nblocks) {
+      start = g_get_monotonic_time();
+      g_cond_wait(&ring->cond, &ring->lock);
+      ring->stats.producer_stall_usec += g_get_monotonic_time() - start;
+      continue;
+    }
+    /* Only we touch the block at head until it is counted as full */
+    block = ring->data + ring->head * ring->block_size;
+    g_mutex_unlock(&ring->lock);
+
+    count = (*ring->fill_func)(ring->user_data, block, ring->block_size);
+
+    g_mutex_lock(&ring->lock);
+    if (count > 0) {
+      ring->fill[ring->head] = count;
+      ring->head = (ring->head + 1) % ring->nblocks;
+      ring->full++;
+      g_cond_broadcast(&ring->cond);
+    }
+    if (count < ring->block_size)
+      break;
+  }
+  ring->eof = TRUE;
+  g_cond_broadcast(&ring->cond);
+  g_mutex_unlock(&ring->lock);
+  return NULL;
+}
+
+GjayPcmRing *
+gjay_pcm_ring_new (const guint nblocks, const gsize block_size,
+                   GjayPcmRingFill fill, gpointer user_data)
+{
+  GjayPcmRing *ring;
+
+  g_assert(nblocks >= 2);
+
+  ring = g_malloc0(sizeof(GjayPcmRing));
+  ring->nblocks = nblocks;
+  ring->block_size = block_size;
+  ring->data = g_malloc(nblocks * block_size);
+  ring->fill = g_new0(gsize, nblocks);
+  ring->fill_func = fill;
+  ring->user_data = user_data;
+  g_mutex_init(&ring->lock);
+  g_cond_init(&ring->cond);
+  ring->thread = g_thread_new("decode", pcm_ring_producer, ring);
+  return ring;
+}
+
+const gchar *
+gjay_pcm_ring_get (GjayPcmRing *ring, gsize *len)
+{
+  const gchar *block;
+  gint64 start;
+
+  g_mutex_lock(&ring->lock);
+  ring->stats.depth_sum += ring->full;
+  ring->stats.depth_max = MAX(ring->stats.depth_max, ring->full);
+  if (ring->full == 0 && !ring->eof) {
+    start = g_get_monotonic_time();
+    while (ring->full == 0 && !ring->eof)
+      g_cond_wait(&ring->cond, &ring->lock);
+    ring->stats.consumer_stall_usec += g_get_monotonic_time() - start;
+  }
+  if (ring->full == 0) {
+    g_mutex_unlock(&ring->lock);
+    *len = 0;
+    return NULL;
+  }
+  block = ring->data + ring->tail * ring->block_size;
+  *len = ring->fill[ring->tail];
+  ring->stats.blocks++;
+  g_mutex_unlock(&ring->lock);
+  return block;
+}
+
+void
+gjay_pcm_ring_release (GjayPcmRing *ring)
+{
+  g_mutex_lock(&ring->lock);
+  ring->tail = (ring->tail + 1) % ring->nblocks;
+  ring->full--;
+  g_cond_broadcast(&ring->cond);
+  g_mutex_unlock(&ring->lock);
+}
+
+gsize
+gjay_pcm_ring_read (GjayPcmRing *ring, gchar *buf, const gsize len)
+{
+  gsize count = 0, n;
+
+  while (count < len) {
+    if (ring->cur == NULL) {
+      if ((ring->cur = gjay_pcm_ring_get(ring, &ring->cur_len)) == NULL)
+        break;
+      ring->cur_pos = 0;
+    }
+    n = MIN(len - count, ring->cur_len - ring->cur_pos);
+    memcpy(buf + count, ring->cur + ring->cur_pos, n);
+    count += n;
+    ring->cur_pos += n;
+    if (ring->cur_pos == ring->cur_len) {
+      gjay_pcm_ring_release(ring);
+      ring->cur = NULL;
+    }
+  }
+  return count;
+}
+
+void
+gjay_pcm_ring_stats (GjayPcmRing *ring, GjayPcmRingStats *stats)
+{
+  g_mutex_lock(&ring->lock);
+  *stats = ring->stats;
+  g_mutex_unlock(&ring->lock);
+}
+
+void
+gjay_pcm_ring_free (GjayPcmRing *ring)
+{
+  if (ring == NULL)
+    return;
+  g_mutex_lock(&ring->lock);
+  ring->quit = TRUE;
+  g_cond_broadcast(&ring->cond);
+  g_mutex_unlock(&ring->lock);
+  g_thread_join(ring->thread);
+
+  g_mutex_clear(&ring->lock);
+  g_cond_clear(&ring->cond);
+  g_free(ring->fill);
+  g_free(ring->data);
+  g_free(ring);
+}
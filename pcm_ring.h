@@ -0,0 +1,58 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * pcm_ring.h -- decode a song in its own thread, a few blocks ahead of
+ * the analysis
+ */
+#ifndef PCM_RING_H
+#define PCM_RING_H
+
+#include <glib.h>
+
+typedef struct _GjayPcmRing GjayPcmRing;
+
+/* Fill buf with up to len bytes; only returns short at the end */
+typedef gsize (*GjayPcmRingFill) (gpointer user_data, gchar *buf,
+                                  const gsize len);
+
+/* For tuning the number of blocks */
+typedef struct {
+  guint64 blocks;              /* Blocks handed to the analysis */
+  guint64 depth_sum;           /* Full blocks waiting, summed over gets */
+  guint   depth_max;
+  gint64  producer_stall_usec; /* Decoder waiting for a free block */
+  gint64  consumer_stall_usec; /* Analysis waiting for a full block */
+} GjayPcmRingStats;
+
+/* Starts a thread calling fill until it returns short */
+GjayPcmRing * gjay_pcm_ring_new     ( const guint nblocks,
+                                      const gsize block_size,
+                                      GjayPcmRingFill fill,
+                                      gpointer user_data );
+/* Waits for the next full block and returns it, NULL at the end. The
+ * block stays valid until gjay_pcm_ring_release(). */
+const gchar * gjay_pcm_ring_get     ( GjayPcmRing *ring, gsize *len );
+void          gjay_pcm_ring_release ( GjayPcmRing *ring );
+/* Like fread, copying out of the blocks */
+gsize         gjay_pcm_ring_read    ( GjayPcmRing *ring, gchar *buf,
+                                      const gsize len );
+void          gjay_pcm_ring_stats   ( GjayPcmRing *ring,
+                                      GjayPcmRingStats *stats );
+/* Stops the thread after the block it is filling and frees the ring */
+void          gjay_pcm_ring_free    ( GjayPcmRing *ring );
+
+#endif /* PCM_RING_H */
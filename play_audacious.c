@@ -125,7 +125,7 @@ audacious_is_running(GjayPlayer *player)
 }
 
 GjaySong *
-audacious_get_current_song(GjayPlayer *player, GHashTable *song_name_hash) {
+audacious_get_current_song(GjayPlayer *player, GjaySongLists *songs) {
   gchar *playlist_file;
   gchar *uri;
   gint pos;
@@ -139,7 +139,7 @@ audacious_get_current_song(GjayPlayer *player, GHashTable *song_name_hash) {
   uri = g_filename_from_uri(playlist_file, NULL, NULL);
   if (uri == NULL)
     return NULL;
-  s = g_hash_table_lookup(song_name_hash, uri);
+  s = song_by_path(songs, uri);
   g_free(playlist_file);
   g_free(uri);
   return s;
@@ -22,7 +22,7 @@
 #include "gjay.h" 
 
 gboolean      audacious_init(GjayPlayer *player);
-GjaySong*     audacious_get_current_song(GjayPlayer *player, GHashTable *song_name_hash);
+GjaySong*     audacious_get_current_song(GjayPlayer *player, GjaySongLists *songs);
 gboolean  audacious_is_running(GjayPlayer *player);
 void      audacious_play_files(GjayPlayer *player, GList *list);
 gboolean audacious_start(GjayPlayer *player);
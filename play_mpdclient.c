@@ -116,7 +116,7 @@ mpdclient_is_running(GjayPlayer *player)
 }
 
 GjaySong *
-mpdclient_get_current_song(GjayPlayer *player, GHashTable *song_name_hash) {
+mpdclient_get_current_song(GjayPlayer *player, GjaySongLists *songs) {
   GjaySong *s;
   struct mpd_song *ms;
   const char *uri;
@@ -128,7 +128,7 @@ mpdclient_get_current_song(GjayPlayer *player, GHashTable *song_name_hash) {
   uri = (*gjmpd_song_get_uri)(ms);
   song_file = g_strdup_printf("%s/%s",player->song_root_dir,uri);
   /* FIXME - how do we determine its a file or not? */
-  s = g_hash_table_lookup(song_name_hash, song_file);
+  s = song_by_path(songs, song_file);
   (*gjmpd_song_free)(ms);
   g_free(song_file);
   return s;
@@ -22,7 +22,7 @@
 #include "gjay.h" 
 
 gboolean      mpdclient_init(GjayPlayer *player);
-GjaySong*     mpdclient_get_current_song(GjayPlayer *player, GHashTable *htb);
+GjaySong*     mpdclient_get_current_song(GjayPlayer *player, GjaySongLists *songs);
 gboolean  mpdclient_is_running(GjayPlayer *player);
 void      mpdclient_play_files(GjayPlayer *player, GList *list);
 gboolean mpdclient_start(GjayPlayer *player);
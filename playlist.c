@@ -36,7 +36,8 @@
 
 static GjaySong * current;
 static GjaySong * first;
-static void remove_repeats   ( GjaySong * s, GList * list);
+static void remove_repeats   ( GjaySong * s, GArray * working );
+static guint take_random     ( GArray * working );
 
 /* How much does brightness factor into matching two songs? */
 #define BRIGHTNESS_FACTOR .8
@@ -45,11 +46,14 @@ static void remove_repeats   ( GjaySong * s, GList * list);
 
 /**
  * Generate a playlist (list of song *) no longer than the specified
- * time, in minutes 
+ * time, in minutes. The working set is song IDs, so scoring the
+ * candidates reads only gjay->songs->features.
  */
 GList * generate_playlist (GjayApp *gjay, const guint minutes ) {
-    GList * working, * final, * rand_list, * list;
-    gint i, list_time, l, r, max_force_index, len;
+    GArray * working, * rand_list;
+    GList * final, * list;
+    gint list_time, r, max_force_index;
+    guint i, id;
     gdouble max_force, s_force;
     GjaySong * s;
     time_t t=0;
@@ -59,18 +63,24 @@ GList * generate_playlist (GjayApp *gjay, const guint minutes ) {
     if (gjay->verbosity) 
         t = time(NULL);
     
-    if (!g_list_length(gjay->songs->songs))
+    if (!gjay->songs->songs->len)
         return NULL;
 
-    /* Create a working set, a copy of the songs list */
-    if (gjay->prefs->use_selected_songs) 
-        working = g_list_copy(gjay->selected_songs); 
-    else
-        working = g_list_copy(gjay->songs->songs); 
+    /* Create a working set from the songs, or the selected songs */
+    working = g_array_sized_new(FALSE, FALSE, sizeof(guint),
+                                gjay->songs->songs->len);
+    if (gjay->prefs->use_selected_songs) {
+        for (list = g_list_first(gjay->selected_songs); list;
+             list = g_list_next(list))
+            g_array_append_val(working, SONG(list)->id);
+    } else {
+        for (i = 0; i < gjay->songs->songs->len; i++)
+            g_array_append_val(working, i);
+    }
 
     final = NULL;
-    for (list = g_list_first(working); list; ) {
-        current = SONG(list);
+    for (i = 0; i < working->len; ) {
+        current = SONG_AT(gjay->songs, g_array_index(working, guint, i));
         /* OK, hold your breath. We exclude songs which:
          * 1. Are not in the current file tree
          * 2. Are no longer present
@@ -79,38 +89,36 @@ GList * generate_playlist (GjayApp *gjay, const guint minutes ) {
          *    specified that s/he wanted to limit the playlist to the 
          *    current dir. */
         if ((!current->in_tree) || 
-            (!current->access_ok) ||
+            (!song_access_ok(gjay->songs, current)) ||
             (gjay->prefs->use_ratings && gjay->prefs->rating_cutoff && 
              (current->rating < gjay->prefs->rating)) ||
             (gjay->prefs->use_selected_dir && 
              gjay->selected_files && 
              (strncmp((char *) gjay->selected_files->data, current->path,
                       strlen((char *) gjay->selected_files->data)) != 0))) {
-            if (g_list_next(list))
-                list = g_list_next(list);
-            else 
-                list = g_list_previous(list);
-            working = g_list_remove(working, current);
+            /* The last song takes its place */
+            g_array_remove_index_fast(working, i);
         } else {
-            list = g_list_next(list);
+            i++;
         }
     }
     
-    if (!working) {
+    if (!working->len) {
         g_warning(_("No songs to create playlist from"));
+        g_array_free(working, TRUE);
         return NULL;
     }
     if (gjay->verbosity > 2)
-	  printf(_("Working set is %d songs long.\n"), g_list_length(working));
+	  printf(_("Working set is %d songs long.\n"), working->len);
     
     /* Pick the first song */
     first = NULL;
     if (gjay->prefs->start_selected) {
-        for (list = g_list_first(working); list && !first; 
-             list = g_list_next(list)) {
-            if (strncmp((char *) gjay->selected_files->data, SONG(list)->path,
+        for (i = 0; i < working->len && !first; i++) {
+            s = SONG_AT(gjay->songs, g_array_index(working, guint, i));
+            if (strncmp((char *) gjay->selected_files->data, s->path,
                         strlen((char *) gjay->selected_files->data)) == 0)
-                first = SONG(list);
+                first = s;
         }
         if (!first) {
             gchar * latin1;
@@ -128,25 +136,31 @@ GList * generate_playlist (GjayApp *gjay, const guint minutes ) {
         temp_song.no_data = TRUE;
         temp_song.no_rating = TRUE;
         temp_song.color = gjay->prefs->start_color;
-        for (max_force = -1000, list = g_list_first(working); 
-             list; 
-             list = g_list_next(list)) {
-            s = SONG(list);
-            s_force = song_force(gjay->prefs, &temp_song, s, gjay->tree_depth);
+        /* It goes in the row after the last song, until another song
+           is added */
+        gjay_features_set(gjay->songs->features, gjay->songs->songs->len,
+                          &temp_song);
+        for (max_force = -1000, i = 0; i < working->len; i++) {
+            id = g_array_index(working, guint, i);
+            s_force = song_force(gjay->prefs, gjay->songs,
+                                 gjay->songs->songs->len, id,
+                                 gjay->tree_depth);
             if (s_force > max_force) {
                 max_force = s_force;
-                first = s;
+                first = SONG_AT(gjay->songs, id);
             }
         } 
     } 
-    if (!first) {
+    if (first) {
+        for (i = 0; g_array_index(working, guint, i) != first->id; i++)
+            ;
+        g_array_remove_index_fast(working, i);
+    } else {
         /* Pick random starting song */
-        i = rand() % g_list_length(working); 
-        first = SONG(g_list_nth(working, i));
+        first = SONG_AT(gjay->songs, take_random(working));
     }
 
-    final = g_list_append(final, first);    
-    working = g_list_remove (working, first);
+    final = g_list_prepend(final, first);    
     current = first;
     
     /* If the song had any duplicates (symlinks) in the working
@@ -156,55 +170,56 @@ GList * generate_playlist (GjayApp *gjay, const guint minutes ) {
     /* Regretably, we must winnow the working set to something reasonable.
        If there were 10,000 songs, this would take ~20 seconds on a fast
        machine. */
-    for (len = g_list_length(working); len > gjay->prefs->max_working_set; len--) {
-        s = SONG(g_list_nth(working, rand() % len));
-        working = g_list_remove(working, s);
-    }
+    while (working->len > gjay->prefs->max_working_set)
+        take_random(working);
     
-
     /* Pick the rest of the songs */
-    while (working && (list_time < minutes * 60)) {
+    rand_list = g_array_new(FALSE, FALSE, sizeof(guint));
+    while (working->len && (list_time < minutes * 60)) {
         /* Divide working list into { random set, leftover }. Then 
          * pick the best song in random set. */
-        rand_list = NULL;
         max_force = -10000;
         max_force_index = -1;
-        l = g_list_length(working);
-        r = MAX(1, (l * gjay->prefs->variance) / MAX_CRITERIA );
+        r = MAX(1, (working->len * gjay->prefs->variance) / MAX_CRITERIA );
         /* Reduce copy of working to size of random list */
-        len = g_list_length(working);
-        while(r--) {
-            s = SONG(g_list_nth(working, rand() % len));
-            working = g_list_remove(working, s);
-            rand_list = g_list_append(rand_list, s);
-            len--;
+        while(r-- && working->len) {
+            id = take_random(working);
+            g_array_append_val(rand_list, id);
             /* Find the closest song */
             if (gjay->prefs->wander) 
-                s_force = song_force(gjay->prefs, s, current, gjay->tree_depth);
+                s_force = song_force(gjay->prefs, gjay->songs, id,
+                                     current->id, gjay->tree_depth);
             else
-                s_force = song_force(gjay->prefs, s, first, gjay->tree_depth);
+                s_force = song_force(gjay->prefs, gjay->songs, id,
+                                     first->id, gjay->tree_depth);
 
             if (s_force > max_force) {
                 max_force = s_force;
-                max_force_index = g_list_length(rand_list) - 1;
+                max_force_index = rand_list->len - 1;
             }
         }
-        current = SONG(g_list_nth(rand_list, max_force_index));
+        current = SONG_AT(gjay->songs,
+                          g_array_index(rand_list, guint, max_force_index));
         list_time += current->length;
-        final = g_list_append(final, current);
-        rand_list = g_list_remove(rand_list, current);
-        working = g_list_concat(working, rand_list);
+        final = g_list_prepend(final, current);
+        g_array_remove_index_fast(rand_list, max_force_index);
+        /* The rest go back */
+        g_array_append_vals(working, rand_list->data, rand_list->len);
+        g_array_set_size(rand_list, 0);
         
        /* If the song had any duplicates (symlinks) in the working
         * list, remove them from the working list, too */
         remove_repeats(current, working);
     }
+    /* The last song picked is at the head */
     if (final && (list_time > minutes * 60)) {
-        list_time -= SONG(g_list_last(final))->length;
-        final = g_list_remove(final, SONG(g_list_last(final)));
+        list_time -= SONG(final)->length;
+        final = g_list_delete_link(final, final);
     }
+    final = g_list_reverse(final);
     
-    g_list_free(working);
+    g_array_free(rand_list, TRUE);
+    g_array_free(working, TRUE);
 
     if (gjay->verbosity) 
         printf(_("It took %d seconds to generate playlist\n"),  
@@ -260,14 +275,37 @@ void write_playlist ( GList * list, FILE * f, gboolean m3u_format) {
 }
 
 
-static void remove_repeats ( GjaySong * s, GList * list) {
+static void remove_id ( GArray * working, const guint id ) {
+    guint i;
+    for (i = 0; i < working->len; i++) {
+        if (g_array_index(working, guint, i) == id) {
+            g_array_remove_index_fast(working, i);
+            return;
+        }
+    }
+}
+
+
+static void remove_repeats ( GjaySong * s, GArray * working ) {
     GjaySong * repeat;
     for (repeat = s->repeat_prev; repeat; 
          repeat = repeat->repeat_prev) {
-        list = g_list_remove(list, repeat);
+        remove_id(working, repeat->id);
     }
     for (repeat = s->repeat_next; repeat; 
          repeat = repeat->repeat_next) {
-        list = g_list_remove(list, repeat);
+        remove_id(working, repeat->id);
     }
 }
+
+
+/* Take a song ID at random out of the working set; the last one takes
+   its place */
+static guint take_random ( GArray * working ) {
+    guint i, id;
+
+    i = rand() % working->len;
+    id = g_array_index(working, guint, i);
+    g_array_remove_index_fast(working, i);
+    return id;
+}
@@ -0,0 +1,222 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * songdb.c -- the binary song database. Opening it is an mmap() and a
+ * few checks; nothing is read until it is used. A database from another
+ * version or machine is ignored, and data.xml read instead.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "songdb.h"
+#include "i18n.h"
+
+struct _GjaySongDbWriter {
+  GArray     * records;
+  GArray     * not_songs;
+  GString    * heap;
+  GHashTable * offsets;   /* Strings already in the heap */
+};
+
+
+GjaySongDb *
+gjay_song_db_open (const gchar * path)
+{
+  GjaySongDb * db;
+  const GjaySongDbHeader * header;
+  struct stat st;
+  gpointer map;
+  guint64 want;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(GjaySongDbHeader)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  header = (const GjaySongDbHeader *) map;
+  want = sizeof(GjaySongDbHeader) +
+    (guint64) header->songs * sizeof(GjaySongDbRecord) +
+    (guint64) header->not_songs * sizeof(guint32) + header->heap_size;
+  if (memcmp(header->magic, GJAY_SONG_DB_MAGIC,
+             sizeof(GJAY_SONG_DB_MAGIC)) != 0 ||
+      header->version != GJAY_SONG_DB_VERSION ||
+      header->record_size != sizeof(GjaySongDbRecord) ||
+      want != (guint64) st.st_size ||
+      header->heap_size == 0) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  db = g_new0(GjaySongDb, 1);
+  db->map = map;
+  db->size = st.st_size;
+  db->header = header;
+  db->records = (const GjaySongDbRecord *) (header + 1);
+  db->not_songs = (const guint32 *) (db->records + header->songs);
+  db->heap = (const gchar *) (db->not_songs + header->not_songs);
+  /* Strings can't run off the end */
+  if (db->heap[header->heap_size - 1] != '\0') {
+    gjay_song_db_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+void
+gjay_song_db_close (GjaySongDb * db)
+{
+  if (db == NULL)
+    return;
+  munmap(db->map, db->size);
+  g_free(db);
+}
+
+const gchar *
+gjay_song_db_string (const GjaySongDb * db, const guint32 offset)
+{
+  if (offset == GJAY_SONG_DB_NONE || offset >= db->header->heap_size)
+    return NULL;
+  return db->heap + offset;
+}
+
+
+GjaySongDbWriter *
+gjay_song_db_writer_new (void)
+{
+  GjaySongDbWriter * writer;
+
+  writer = g_new0(GjaySongDbWriter, 1);
+  writer->records = g_array_new(FALSE, TRUE, sizeof(GjaySongDbRecord));
+  writer->not_songs = g_array_new(FALSE, FALSE, sizeof(guint32));
+  writer->heap = g_string_new(NULL);
+  writer->offsets = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, NULL);
+  /* Never empty, so the last byte is always a terminator */
+  g_string_append_c(writer->heap, '\0');
+  return writer;
+}
+
+/* Artists and albums come up again and again, so each string is kept
+   once */
+guint32
+gjay_song_db_add_string (GjaySongDbWriter * writer, const gchar * str)
+{
+  gpointer offset;
+  guint32 at;
+
+  if (str == NULL)
+    return GJAY_SONG_DB_NONE;
+  if (g_hash_table_lookup_extended(writer->offsets, str, NULL, &offset))
+    return GPOINTER_TO_UINT(offset);
+  at = writer->heap->len;
+  g_string_append_len(writer->heap, str, strlen(str) + 1);
+  g_hash_table_insert(writer->offsets, g_strdup(str), GUINT_TO_POINTER(at));
+  return at;
+}
+
+GjaySongDbRecord *
+gjay_song_db_add_song (GjaySongDbWriter * writer)
+{
+  GjaySongDbRecord * record;
+
+  g_array_set_size(writer->records, writer->records->len + 1);
+  record = &g_array_index(writer->records, GjaySongDbRecord,
+                          writer->records->len - 1);
+  record->path = record->title = record->artist = record->album =
+    record->fingerprint = record->repeats = GJAY_SONG_DB_NONE;
+  return record;
+}
+
+void
+gjay_song_db_add_not_song (GjaySongDbWriter * writer, const gchar * path)
+{
+  guint32 offset;
+
+  offset = gjay_song_db_add_string(writer, path);
+  g_array_append_val(writer->not_songs, offset);
+}
+
+gboolean
+gjay_song_db_writer_save (GjaySongDbWriter * writer, const gchar * path)
+{
+  GjaySongDbHeader header;
+  gchar * tmp_path;
+  FILE * f;
+  gboolean ok;
+
+  memset(&header, 0x00, sizeof(header));
+  memcpy(header.magic, GJAY_SONG_DB_MAGIC, sizeof(GJAY_SONG_DB_MAGIC));
+  header.version = GJAY_SONG_DB_VERSION;
+  header.record_size = sizeof(GjaySongDbRecord);
+  header.songs = writer->records->len;
+  header.not_songs = writer->not_songs->len;
+  header.heap_size = writer->heap->len;
+
+  /* Readers have it mapped, so it is replaced rather than rewritten */
+  tmp_path = g_strdup_printf("%s_temp", path);
+  if ((f = fopen(tmp_path, "w")) == NULL) {
+    g_warning(_("Unable to write song database '%s'\n"), tmp_path);
+    g_free(tmp_path);
+    return FALSE;
+  }
+  ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+  if (ok && header.songs)
+    ok = (fwrite(writer->records->data, sizeof(GjaySongDbRecord),
+                 header.songs, f) == header.songs);
+  if (ok && header.not_songs)
+    ok = (fwrite(writer->not_songs->data, sizeof(guint32),
+                 header.not_songs, f) == header.not_songs);
+  if (ok)
+    ok = (fwrite(writer->heap->str, 1, writer->heap->len, f) ==
+          writer->heap->len);
+  if (fclose(f) != 0)
+    ok = FALSE;
+  if (ok && rename(tmp_path, path) != 0)
+    ok = FALSE;
+  if (!ok) {
+    g_warning(_("Unable to write song database '%s'\n"), path);
+    unlink(tmp_path);
+  }
+  g_free(tmp_path);
+  return ok;
+}
+
+void
+gjay_song_db_writer_free (GjaySongDbWriter * writer)
+{
+  g_array_free(writer->records, TRUE);
+  g_array_free(writer->not_songs, TRUE);
+  g_string_free(writer->heap, TRUE);
+  g_hash_table_destroy(writer->offsets);
+  g_free(writer);
+}
@@ -0,0 +1,101 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * songdb.h -- the song data as a binary file, ~/.gjay/data.gjdb, which
+ * is mapped into memory and read in place rather than parsed. It is a
+ * header, a fixed size record for each song, the not-song paths, then
+ * the strings, all in the machine's own byte order.
+ */
+#ifndef SONGDB_H
+#define SONGDB_H
+
+#include <glib.h>
+#include "constants.h"
+
+#define GJAY_SONG_DB_MAGIC   "GJAYSDB"
+#define GJAY_SONG_DB_VERSION 1
+
+/* No string, or no song */
+#define GJAY_SONG_DB_NONE    G_MAXUINT32
+
+/* Record flags, the song's gbooleans */
+#define GJAY_SONG_DB_NO_DATA   (1 << 0)
+#define GJAY_SONG_DB_NO_RATING (1 << 1)
+#define GJAY_SONG_DB_NO_COLOR  (1 << 2)
+#define GJAY_SONG_DB_BPM_UNDEF (1 << 3)
+#define GJAY_SONG_DB_SAMPLED   (1 << 4)
+
+typedef struct {
+  gchar    magic[8];
+  guint32  version;
+  guint32  record_size;   /* sizeof(GjaySongDbRecord), as a check */
+  guint32  songs;
+  guint32  not_songs;
+  guint64  heap_size;
+} GjaySongDbHeader;
+
+typedef struct {
+  /* Offsets into the string heap, or GJAY_SONG_DB_NONE */
+  guint32  path;
+  guint32  title;
+  guint32  artist;
+  guint32  album;
+  guint32  fingerprint;
+  guint32  repeats;       /* Index of the song this one repeats */
+  guint32  inode;
+  guint32  dev;
+  gint32   length;
+  guint32  flags;
+  gdouble  bpm;
+  gdouble  volume_diff;
+  gdouble  rating;
+  gdouble  hsv[3];
+  gdouble  freq[NUM_FREQ_SAMPLES];
+} GjaySongDbRecord;
+
+typedef struct {
+  gpointer                 map;
+  gsize                    size;
+  const GjaySongDbHeader * header;
+  const GjaySongDbRecord * records;
+  const guint32 *          not_songs;  /* String offsets of their paths */
+  const gchar *            heap;
+} GjaySongDb;
+
+/* Map the database at path, or NULL if it isn't there or isn't one
+   this machine can read */
+GjaySongDb *  gjay_song_db_open   ( const gchar * path );
+void          gjay_song_db_close  ( GjaySongDb * db );
+/* The string at offset, or NULL for GJAY_SONG_DB_NONE */
+const gchar * gjay_song_db_string ( const GjaySongDb * db,
+                                    const guint32 offset );
+
+/* Writing one: add the strings to the heap, fill in the records, then
+   write the lot to path, replacing it whole */
+typedef struct _GjaySongDbWriter GjaySongDbWriter;
+
+GjaySongDbWriter * gjay_song_db_writer_new  ( void );
+guint32            gjay_song_db_add_string  ( GjaySongDbWriter * writer,
+                                              const gchar * str );
+GjaySongDbRecord * gjay_song_db_add_song    ( GjaySongDbWriter * writer );
+void               gjay_song_db_add_not_song ( GjaySongDbWriter * writer,
+                                               const gchar * path );
+gboolean           gjay_song_db_writer_save ( GjaySongDbWriter * writer,
+                                              const gchar * path );
+void               gjay_song_db_writer_free ( GjaySongDbWriter * writer );
+
+#endif /* SONGDB_H */
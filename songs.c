@@ -35,6 +35,8 @@
 #include "mp3.h"
 #include "vorbis.h"
 #include "flac.h"
+#include "tags.h"
+#include "songdb.h"
 #include "i18n.h"
 #ifdef WITH_GUI
 #include "ui.h"
@@ -61,6 +63,8 @@ typedef enum {
     E_VOL_DIFF,
     E_TYPE,
     E_VERSION,
+    E_SAMPLED,
+    E_FINGERPRINT,
     E_LAST
 } element_type;
 
@@ -83,7 +87,9 @@ static const char * element_str[E_LAST] = {
     "repeats",
     "volume_diff",
     "type",
-    "version"
+    "version",
+    "sampled",
+    "fingerprint"
 };
 
 
@@ -99,10 +105,35 @@ typedef struct {
 } song_parse_state;
 
 
-static gdouble song_mass   ( const GjayPrefs *prefs,  GjaySong * s );
-static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong  * b,
-   const int tree_depth	);
+/* The song database read at startup stays mapped for the session, and
+   the strings of the songs read from it point into it rather than
+   being copied; those songs are in the one block, song_db_songs. */
+static GjaySongDb * song_db = NULL;
+static GjaySong *   song_db_songs = NULL;
+static guint32      song_db_num_songs = 0;
+static GjaySongLists * song_db_lists = NULL;  /* Whose songs they are */
+
+
+static gdouble song_mass   ( const GjayPrefs *prefs,
+                             const GjayFeatures * features, const guint s );
+static gdouble song_attraction (const GjayPrefs *prefs, GjaySongLists * sl,
+   const guint a, const guint b, const int tree_depth	);
+static void     song_set_features   ( GjaySongLists * sl,
+                                      GjaySong * s );
+static void     song_set_features_row ( GjaySongLists * sl,
+                                        GjaySong * s );
+static void     song_append         ( GjaySongLists * sl,
+                                      GjaySong * s );
+static void     song_lists_hash     ( GjaySongLists * sl );
 static void     write_not_song_data ( FILE * f, gchar * path );
+static void     write_song_db       ( GPtrArray * songs,
+                                      GPtrArray * not_songs );
+static gboolean read_song_db        ( GjayApp *gjay );
+static void     write_journal       ( GjaySongLists * sl );
+static gboolean write_songs         ( GPtrArray * songs,
+                                      GPtrArray * not_songs );
+static void     compact_data_file   ( GjayApp *gjay );
+static void     compact_done        ( GjaySongLists * sl );
 static gboolean read_song_file_type ( char * path, 
                                       song_file_type type,
                                       gint   * length,
@@ -129,23 +160,79 @@ static void     data_text           ( GMarkupParseContext *context,
 static int      get_element         ( gchar * element_name );
 static void     song_copy_attrs     ( GjaySong * dest, 
                                       GjaySong * original );
+static gchar *  song_strdup         ( const gchar * str );
+static void     song_free_string    ( gchar * str );
 
 gboolean
-create_song_lists(GjaySongLists **sl) {
+create_song_lists(GjaySongLists **sl, const gboolean compact_features) {
 
   if ( (*sl = g_malloc0(sizeof(GjaySongLists))) == NULL)
 	return FALSE;
 
-  (*sl)->songs = NULL;
-  (*sl)->not_songs = NULL;
+  (*sl)->songs = g_ptr_array_new();
+  (*sl)->not_songs = g_ptr_array_new();
   (*sl)->dirty = FALSE;
   (*sl)->name_hash    = g_hash_table_new(g_str_hash, g_str_equal);
   (*sl)->inode_dev_hash = g_hash_table_new(g_int_hash, g_int_equal);
+  (*sl)->fingerprint_hash = g_hash_table_new(g_str_hash, g_str_equal);
   (*sl)->not_hash     = g_hash_table_new(g_str_hash, g_str_equal);
+  (*sl)->journal_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+  (*sl)->features = gjay_features_new(compact_features);
 
   return TRUE;
 }
 
+/* Free the lists, and the songs in them */
+void destroy_song_lists ( GjaySongLists * sl ) {
+    guint i;
+
+    for (i = 0; i < sl->songs->len; i++)
+        delete_song(SONG_AT(sl, i));
+    g_ptr_array_free(sl->songs, TRUE);
+    for (i = 0; i < sl->not_songs->len; i++)
+        song_free_string(g_ptr_array_index(sl->not_songs, i));
+    g_ptr_array_free(sl->not_songs, TRUE);
+    g_hash_table_destroy(sl->name_hash);
+    g_hash_table_destroy(sl->inode_dev_hash);
+    g_hash_table_destroy(sl->fingerprint_hash);
+    g_hash_table_destroy(sl->not_hash);
+    g_hash_table_destroy(sl->journal_hash);
+    g_list_free(sl->journal);
+    g_list_free(sl->journal_not_songs);
+    if (sl == song_db_lists) {
+        g_free(song_db_songs);
+        gjay_song_db_close(song_db);
+        song_db = NULL;
+        song_db_songs = NULL;
+        song_db_num_songs = 0;
+        song_db_lists = NULL;
+    }
+    gjay_features_free(sl->features);
+    g_free(sl);
+}
+
+
+/* Whether str is a string in the mapped song database */
+static gboolean in_song_db ( const gchar * str ) {
+    return song_db && str >= song_db->heap &&
+        str < song_db->heap + song_db->header->heap_size;
+}
+
+
+/* A copy of the string for a song, unless it is one of the song
+   database's, which last as long as the song does */
+static gchar * song_strdup ( const gchar * str ) {
+    if (in_song_db(str))
+        return (gchar *) str;
+    return g_strdup(str);
+}
+
+
+static void song_free_string ( gchar * str ) {
+    if (!in_song_db(str))
+        g_free(str);
+}
+
 /* Create a new song with the given filename */
 GjaySong * create_song ( void ) {
     GjaySong * s;
@@ -159,6 +246,108 @@ GjaySong * create_song ( void ) {
     return s;
 }
 
+
+/**
+ * Add the song to the end of the table, which gives it its ID, and to
+ * the path hash and features.
+ */
+void add_song ( GjaySongLists * sl, GjaySong * s ) {
+    song_lists_hash(sl);
+    song_append(sl, s);
+    g_hash_table_insert(sl->name_hash, s->path, GUINT_TO_POINTER(s->id));
+}
+
+
+/* add_song() but for the hashes, which read_song_db() leaves for later */
+static void song_append ( GjaySongLists * sl, GjaySong * s ) {
+    s->id = sl->songs->len;
+    g_ptr_array_add(sl->songs, s);
+    song_set_features_row(sl, s);
+}
+
+
+/**
+ * Put the songs read from the database in the hashes, as add_song()
+ * and read_song_db() once did for each, so that a load which never
+ * looks a song up doesn't pay for them. Called before the hashes are
+ * used; it does nothing after the first time.
+ */
+static void song_lists_hash ( GjaySongLists * sl ) {
+    GjaySong * s;
+    guint i;
+
+    for (i = 0; i < sl->unhashed; i++) {
+        s = SONG_AT(sl, i);
+        g_hash_table_insert(sl->name_hash, s->path, GUINT_TO_POINTER(s->id));
+        g_hash_table_insert(sl->inode_dev_hash, &s->inode_dev_hash,
+                            GUINT_TO_POINTER(s->id));
+        /* The first song with a fingerprint stands for all copies */
+        if (s->fingerprint &&
+            !g_hash_table_lookup_extended(sl->fingerprint_hash,
+                                          s->fingerprint, NULL, NULL))
+            g_hash_table_insert(sl->fingerprint_hash, s->fingerprint,
+                                GUINT_TO_POINTER(s->id));
+    }
+    sl->unhashed = 0;
+}
+
+
+/**
+ * Set the song's row of sl->features. If the song changed how the
+ * rows are kept, as one louder than any before it does in a compact
+ * store, every row is set again.
+ */
+static void song_set_features_row ( GjaySongLists * sl, GjaySong * s ) {
+    guint i;
+
+    if (!gjay_features_set(sl->features, s->id, s))
+        return;
+    for (i = 0; i < sl->songs->len; i++)
+        gjay_features_set(sl->features, i, SONG_AT(sl, i));
+}
+
+
+/**
+ * Copy the features of the song and the songs which repeat it to
+ * sl->features, after they have changed.
+ */
+static void song_set_features ( GjaySongLists * sl, GjaySong * s ) {
+    GjaySong * repeat;
+
+    for (repeat = s; repeat->repeat_prev; repeat = repeat->repeat_prev)
+        ;
+    for (; repeat; repeat = repeat->repeat_next)
+        song_set_features_row(sl, repeat);
+}
+
+
+void add_not_song ( GjaySongLists * sl, gchar * path ) {
+    g_ptr_array_add(sl->not_songs, path);
+    g_hash_table_insert(sl->not_hash, path, (gpointer) TRUE);
+}
+
+
+static GjaySong * song_by_id ( GjaySongLists * sl, GHashTable * hash,
+                               gconstpointer key ) {
+    gpointer id;
+
+    song_lists_hash(sl);
+    if (!g_hash_table_lookup_extended(hash, key, NULL, &id))
+        return NULL;
+    return SONG_AT(sl, GPOINTER_TO_UINT(id));
+}
+
+
+GjaySong * song_by_path ( GjaySongLists * sl, const gchar * path ) {
+    return song_by_id(sl, sl->name_hash, path);
+}
+
+
+GjaySong * song_by_inode_dev ( GjaySongLists * sl,
+                               guint32 * inode_dev_hash ) {
+    return song_by_id(sl, sl->inode_dev_hash, inode_dev_hash);
+}
+
 void delete_song (GjaySong * s) {
 #ifdef WITH_GUI
     if(s->freq_pixbuf)
@@ -166,19 +355,21 @@ void delete_song (GjaySong * s) {
     if(s->color_pixbuf)
         g_object_unref(s->color_pixbuf);
 #endif /* WITH_GUI */
-    g_free(s->path);
-    g_free(s->title);
-    g_free(s->artist);
-    g_free(s->album);
-    g_free(s);
+    song_free_string(s->path);
+    song_free_string(s->title);
+    song_free_string(s->artist);
+    song_free_string(s->album);
+    song_free_string(s->fingerprint);
+    if (s < song_db_songs || s >= song_db_songs + song_db_num_songs)
+        g_free(s);
 }
 
 
 GjaySong * song_set_path ( GjaySong * s, 
                        char * path ) {
     int i;
-    free(s->path);
-    s->path = g_strdup(path);
+    song_free_string(s->path);
+    s->path = song_strdup(path);
     s->fname = s->path;
     for (i = strlen(s->path) - 1; i; i--) {
         if (s->path[i] == '/') {
@@ -273,23 +464,34 @@ void song_set_color_pixbuf ( GjaySong * s) {
 void song_set_repeats ( GjaySong * s, GjaySong * original ) {
     char * path, * fname;
     GjaySong * ll;
+    gboolean access_ok, access_unknown;
+    guint id;
 
     path = s->path;
     fname = s->fname;
-
-    g_free(s->artist);
-    g_free(s->title);
-    g_free(s->album);
+    id = s->id;
+    access_ok = s->access_ok;
+    access_unknown = s->access_unknown;
+
+    song_free_string(s->artist);
+    song_free_string(s->title);
+    song_free_string(s->album);
+    song_free_string(s->fingerprint);
     
     memcpy(s, original, sizeof(GjaySong));
     if (original->title)
-        s->title = g_strdup(original->title);
+        s->title = song_strdup(original->title);
     if (original->album)
-        s->album = g_strdup(original->album);
+        s->album = song_strdup(original->album);
     if (original->artist)
-        s->artist = g_strdup(original->artist);
+        s->artist = song_strdup(original->artist);
+    if (original->fingerprint)
+        s->fingerprint = song_strdup(original->fingerprint);
     s->path = path;
     s->fname = fname;
+    s->id = id;
+    s->access_ok = access_ok;
+    s->access_unknown = access_unknown;
     s->repeat_prev = NULL;
     s->repeat_next = NULL;
 #ifdef WITH_GUI
@@ -316,6 +518,27 @@ void song_set_repeat_attrs( GjaySong * s) {
 }
 
 
+/**
+ * Whether the song's file is still there. A song read from the song
+ * database is looked for the first time this is asked, rather than
+ * every song being looked for at startup; one found gone is culled at
+ * the next save.
+ */
+gboolean song_access_ok ( GjaySongLists * sl, GjaySong * s ) {
+    gchar * latin1_path;
+
+    if (s->access_unknown) {
+        latin1_path = strdup_to_latin1(s->path);
+        s->access_ok = !access(latin1_path, R_OK);
+        g_free(latin1_path);
+        s->access_unknown = FALSE;
+        if (!s->access_ok)
+            sl->dirty = TRUE;
+    }
+    return s->access_ok;
+}
+
+
 static void song_copy_attrs( GjaySong * dest, GjaySong * original ) {
     dest->bpm = original->bpm;
     dest->rating = original->rating;
@@ -326,6 +549,7 @@ static void song_copy_attrs( GjaySong * dest, GjaySong * original ) {
     dest->no_color = original->no_color;
     dest->bpm_undef = original->bpm_undef;
     dest->volume_diff = original->volume_diff;
+    dest->sampled = original->sampled;
     dest->marked = original->marked;
 }
 
@@ -333,7 +557,8 @@ static void song_copy_attrs( GjaySong * dest, GjaySong * original ) {
  * Collect information about a path. 
  * IN:     Path
  * RETURN: Set all other attributes if it is a song, otherwise set is_song
- *         to false
+ *         to false. If tags isn't NULL, it gets any analysis kept in the
+ *         song's tags.
  *
  * Note that we expect the path to be UTF8
  */
@@ -348,7 +573,8 @@ void file_info ( const guint verbosity,
                  gchar   ** title,
                  gchar   ** artist,
                  gchar   ** album, 
-                 song_file_type * type ) {
+                 song_file_type * type,
+                 GjayTags * tags ) {
     gchar * latin1_path;
     struct stat buf;
     
@@ -359,6 +585,8 @@ void file_info ( const guint verbosity,
     *artist = NULL;
     *title = NULL;
     *album = NULL;
+    if (tags)
+        memset(tags, 0x00, sizeof(GjayTags));
 
     if (verbosity > 1) {
         printf(_("Scanning '%s'...\n"), path);
@@ -374,7 +602,7 @@ void file_info ( const guint verbosity,
     *inode = buf.st_ino;
 
 #ifdef HAVE_VORBIS_VORBISFILE_H
-    if (ogg_supported && read_ogg_file_type(latin1_path, length, title, artist, album) == TRUE)
+    if (ogg_supported && read_ogg_file_type(latin1_path, length, title, artist, album, tags) == TRUE)
     {
       *is_song = TRUE;
       *type = OGG;
@@ -383,7 +611,7 @@ void file_info ( const guint verbosity,
     }
 #endif /* HAVE_VORBIS_VORBISFILE_H */
 
-    if (read_mp3_file_type(latin1_path, length, title, artist, album) == TRUE)
+    if (read_mp3_file_type(latin1_path, length, title, artist, album, tags) == TRUE)
     {
       *is_song = TRUE;
       *type = MP3;
@@ -399,7 +627,7 @@ void file_info ( const guint verbosity,
     }
 
 #ifdef HAVE_FLAC_METADATA_H
-    if (flac_supported && read_flac_file_type(latin1_path, length, title, artist, album) == TRUE)
+    if (flac_supported && read_flac_file_type(latin1_path, length, title, artist, album, tags) == TRUE)
     {
       *is_song = TRUE;
       *type = FLAC;
@@ -412,48 +640,478 @@ void file_info ( const guint verbosity,
 }
 
 
-void write_data_file(GjayApp *gjay) {
-    gchar *tmp_filename, *data_filename;
+/**
+ * Identify a song by what is in the file rather than where it is: the
+ * length of its audio and a hash of the first and last 64 KiB of it.
+ * ID3 tags at either end are skipped, as taggers rewrite them in
+ * place. Returns NULL if the file can't be read.
+ */
+#define FINGERPRINT_BYTES 65536
+gchar * file_fingerprint ( const gchar * latin1_path ) {
     FILE * f;
-    GList * llist, * w_songs = NULL;
+    struct stat buf;
+    guchar * data, tag[10];
+    off_t start, end, len;
+    size_t count;
+    GChecksum * checksum;
+    gchar * fingerprint;
+
+    if (stat(latin1_path, &buf) || (f = fopen(latin1_path, "r")) == NULL)
+        return NULL;
+    start = 0;
+    end = buf.st_size;
+
+    /* ID3v2 at the front; its size is 7 bits a byte */
+    if (fread(tag, 1, 10, f) == 10 && memcmp(tag, "ID3", 3) == 0 &&
+        tag[6] < 0x80 && tag[7] < 0x80 && tag[8] < 0x80 && tag[9] < 0x80) {
+        start = 10 + ((tag[6] << 21) | (tag[7] << 14) |
+                      (tag[8] << 7) | tag[9]);
+        if (tag[5] & 0x10) /* Footer */
+            start += 10;
+    }
+    /* ID3v1 at the end */
+    if (end - start >= 128 && fseeko(f, end - 128, SEEK_SET) == 0 &&
+        fread(tag, 1, 3, f) == 3 && memcmp(tag, "TAG", 3) == 0)
+        end -= 128;
+    if (start > end)
+        start = end;
+    len = end - start;
+
+    data = g_malloc(FINGERPRINT_BYTES);
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    if (fseeko(f, start, SEEK_SET) == 0) {
+        count = fread(data, 1, MIN(len, FINGERPRINT_BYTES), f);
+        g_checksum_update(checksum, data, count);
+    }
+    if (len > FINGERPRINT_BYTES &&
+        fseeko(f, MAX(end - FINGERPRINT_BYTES, start + FINGERPRINT_BYTES),
+               SEEK_SET) == 0) {
+        count = fread(data, 1, MIN(len - FINGERPRINT_BYTES, FINGERPRINT_BYTES), f);
+        g_checksum_update(checksum, data, count);
+    }
+    fclose(f);
+    fingerprint = g_strdup_printf("%" G_GINT64_FORMAT ":%s", (gint64) len,
+                                  g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    g_free(data);
+    return fingerprint;
+}
+
+
+/**
+ * Look for a song already analyzed whose file has the same content as
+ * s's, and give s its attributes. Otherwise s is remembered as the
+ * song with its fingerprint. Returns TRUE if the attributes were
+ * carried over, when there is no need to analyze s.
+ */
+gboolean song_from_fingerprint ( GjaySongLists * sl, GjaySong * s ) {
+    GjaySong * original;
+    gchar * latin1_path;
+
+    if (s->fingerprint == NULL) {
+        latin1_path = strdup_to_latin1(s->path);
+        s->fingerprint = file_fingerprint(latin1_path);
+        g_free(latin1_path);
+        if (s->fingerprint == NULL)
+            return FALSE;
+    }
+    original = song_by_id(sl, sl->fingerprint_hash, s->fingerprint);
+    if (original == NULL) {
+        g_hash_table_insert(sl->fingerprint_hash, s->fingerprint,
+                            GUINT_TO_POINTER(s->id));
+        return FALSE;
+    }
+    if (original == s || original->no_data)
+        return FALSE;
+    song_copy_attrs(s, original);
+    return TRUE;
+}
+
+
+void write_data_file(GjayApp *gjay) {
+    GPtrArray * w_songs;
     GjaySong * s;
+    guint i;
 
-    tmp_filename = g_strdup_printf("%s/%s/%s_temp",
-        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DATA);
-    data_filename = g_strdup_printf("%s/%s/%s",
-        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DATA);
-  
     /* Cull songs which are no longer there */
-    for (llist = g_list_first(gjay->songs->songs); llist; llist = g_list_next(llist)) {
-        s = SONG(llist);
+    w_songs = g_ptr_array_sized_new(gjay->songs->songs->len);
+    for (i = 0; i < gjay->songs->songs->len; i++) {
+        s = SONG_AT(gjay->songs, i);
         if (!s->access_ok) {
             if (s->repeat_prev)
                 s->repeat_prev->repeat_next = s->repeat_next;
             if (s->repeat_next)
                 s->repeat_next->repeat_prev = s->repeat_prev;
         } else {
-            w_songs = g_list_append(w_songs, s);
+            g_ptr_array_add(w_songs, s);
         }
     }
+    if (write_songs(w_songs, gjay->songs->not_songs))
+        gjay->songs->dirty = FALSE;
+    g_ptr_array_free(w_songs, TRUE);
+}
+
+
+/**
+ * Write the songs, and the not songs which are still there, to
+ * data.xml and then the song database. Only reads what it is given, so
+ * it can run in a thread of its own on a snapshot of them.
+ */
+static gboolean write_songs ( GPtrArray * songs, GPtrArray * not_songs ) {
+    gchar *tmp_filename, *data_filename;
+    FILE * f;
+    GPtrArray * w_not_songs;
+    gchar * path;
+    gboolean ok;
+    guint i;
+
+    tmp_filename = g_strdup_printf("%s/%s/%s_temp",
+        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DATA);
+    data_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DATA);
+
+    w_not_songs = g_ptr_array_sized_new(not_songs->len);
+    for (i = 0; i < not_songs->len; i++) {
+        path = (gchar *) g_ptr_array_index(not_songs, i);
+        if (skip_verify || !access(path, R_OK))
+            g_ptr_array_add(w_not_songs, path);
+    }
     
-    if ( (f = fopen(tmp_filename, "w")) == NULL) {
-      g_error(_("Unable to write song data %s\n"), tmp_filename);
+    ok = (f = fopen(tmp_filename, "w")) != NULL;
+    if (!ok) {
+        g_warning(_("Unable to write song data %s\n"), tmp_filename);
     } else {
         fprintf(f, "<gjay_data version=\"%s\">\n", VERSION);
-        for (llist = g_list_first(w_songs); llist; llist = g_list_next(llist))
-            write_song_data(f, SONG(llist));
-        for (llist = g_list_first(gjay->songs->not_songs); 
-             llist; llist = g_list_next(llist))
-            write_not_song_data(f, (char *) llist->data);
+        for (i = 0; i < songs->len; i++)
+            write_song_data(f, (GjaySong *) g_ptr_array_index(songs, i));
+        for (i = 0; i < w_not_songs->len; i++)
+            write_not_song_data(f, (char *) g_ptr_array_index(
+                                    w_not_songs, i));
         fprintf(f, "</gjay_data>\n");
         fclose(f);
         rename(tmp_filename, data_filename);
-        gjay->songs->dirty = FALSE;
+        /* After data.xml, so it is never older than the XML */
+        write_song_db(songs, w_not_songs);
     }
 
-    g_list_free(w_songs);
+    g_ptr_array_free(w_not_songs, TRUE);
     g_free(tmp_filename);
     g_free(data_filename);
+    return ok;
+}
+
+
+/**
+ * At exit: wait for a rewrite of the data file under way, then append
+ * the last changes to the journal, or rewrite the data file if it
+ * needs it.
+ */
+void save_data_file (GjayApp *gjay) {
+    GjaySongLists * sl = gjay->songs;
+    gchar * filename;
+
+    if (sl->compact_thread)
+        compact_done(sl);
+    write_journal(sl);
+    if (sl->dirty) {
+        write_data_file(gjay);
+        filename = g_strdup_printf("%s/%s/%s",
+            g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL_OLD);
+        unlink(filename);
+        g_free(filename);
+        filename = g_strdup_printf("%s/%s/%s",
+            g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL);
+        unlink(filename);
+        g_free(filename);
+        sl->journal_len = 0;
+    }
+}
+
+
+/**
+ * The song has changed. It is appended to the journal at the next
+ * write, rather than the whole data file being rewritten. A repeat
+ * keeps its data in the song it repeats, so that goes in first.
+ */
+void journal_song ( GjaySongLists * sl, GjaySong * s ) {
+    GjaySong * original;
+
+    song_set_features(sl, s);
+    for (original = s; original->repeat_prev;
+         original = original->repeat_prev)
+        ;
+    if (original != s)
+        journal_song(sl, original);
+    if (g_hash_table_lookup(sl->journal_hash, s))
+        return;
+    g_hash_table_insert(sl->journal_hash, s, s);
+    sl->journal = g_list_prepend(sl->journal, s);
+}
+
+
+void journal_not_song ( GjaySongLists * sl, gchar * path ) {
+    sl->journal_not_songs = g_list_prepend(sl->journal_not_songs, path);
+}
+
+
+/**
+ * Append the songs changed since the last time to the journal, in the
+ * same XML as the data file. It is read after the data file, as
+ * the daemon's file is.
+ */
+static void write_journal ( GjaySongLists * sl ) {
+    gchar * journal_filename;
+    GList * llist;
+    FILE * f;
+
+    if (sl->journal == NULL && sl->journal_not_songs == NULL)
+        return;
+    journal_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL);
+    if ((f = fopen(journal_filename, "a")) == NULL) {
+        g_warning(_("Unable to write '%s'\n"), journal_filename);
+        /* Save them with the rest at the next rewrite */
+        sl->dirty = TRUE;
+    } else {
+        sl->journal = g_list_reverse(sl->journal);
+        for (llist = sl->journal; llist; llist = g_list_next(llist)) {
+            write_song_data(f, SONG(llist));
+            sl->journal_len++;
+        }
+        sl->journal_not_songs = g_list_reverse(sl->journal_not_songs);
+        for (llist = sl->journal_not_songs; llist; llist = g_list_next(llist))
+            write_not_song_data(f, (gchar *) llist->data);
+        fclose(f);
+    }
+    g_list_free(sl->journal);
+    g_list_free(sl->journal_not_songs);
+    sl->journal = NULL;
+    sl->journal_not_songs = NULL;
+    g_hash_table_remove_all(sl->journal_hash);
+    g_free(journal_filename);
+}
+
+
+/* The songs as they were when a rewrite of the data file started, for
+   the thread writing them while they carry on changing */
+typedef struct {
+    GjaySongLists * sl;
+    GjaySong      * copies;     /* One block, as read_song_db() does */
+    GPtrArray     * songs;      /* Into copies */
+    GPtrArray     * not_songs;  /* Copied paths */
+    gboolean        ok;         /* Written */
+} GjaySongSnapshot;
+
+
+/**
+ * Copy the songs that are still there, as write_data_file() culls
+ * them, and the not songs. Strings from the song database aren't
+ * copied, as it stays open until the snapshot is freed. A repeat of a
+ * song that has gone repeats the one before that.
+ */
+static GjaySongSnapshot * snapshot_songs ( GjaySongLists * sl ) {
+    GjaySongSnapshot * snap;
+    GjaySong * s, * c, * original;
+    guint * copy_of, i;
+
+    snap = g_new0(GjaySongSnapshot, 1);
+    snap->sl = sl;
+    snap->copies = g_new(GjaySong, MAX(sl->songs->len, 1));
+    snap->songs = g_ptr_array_sized_new(sl->songs->len);
+    copy_of = g_new(guint, MAX(sl->songs->len, 1));
+    for (i = 0; i < sl->songs->len; i++) {
+        s = SONG_AT(sl, i);
+        if (!s->access_ok)
+            continue;
+        copy_of[i] = snap->songs->len;
+        c = snap->copies + snap->songs->len;
+        *c = *s;
+        c->path = song_strdup(s->path);
+        c->fname = s->fname ? c->path + (s->fname - s->path) : NULL;
+        c->title = song_strdup(s->title);
+        c->artist = song_strdup(s->artist);
+        c->album = song_strdup(s->album);
+        c->fingerprint = song_strdup(s->fingerprint);
+#ifdef WITH_GUI
+        c->freq_pixbuf = NULL;
+        c->color_pixbuf = NULL;
+#endif /* WITH_GUI */
+        g_ptr_array_add(snap->songs, c);
+    }
+    for (i = 0; i < sl->songs->len; i++) {
+        s = SONG_AT(sl, i);
+        if (!s->access_ok)
+            continue;
+        c = snap->copies + copy_of[i];
+        for (original = s->repeat_prev; original && !original->access_ok;
+             original = original->repeat_prev)
+            ;
+        c->repeat_prev = original ? snap->copies + copy_of[original->id]
+                                  : NULL;
+        c->repeat_next = NULL;
+    }
+    g_free(copy_of);
+
+    snap->not_songs = g_ptr_array_sized_new(sl->not_songs->len);
+    for (i = 0; i < sl->not_songs->len; i++)
+        g_ptr_array_add(snap->not_songs,
+                        song_strdup(g_ptr_array_index(sl->not_songs, i)));
+    return snap;
+}
+
+
+static void free_snapshot ( GjaySongSnapshot * snap ) {
+    GjaySong * c;
+    guint i;
+
+    for (i = 0; i < snap->songs->len; i++) {
+        c = (GjaySong *) g_ptr_array_index(snap->songs, i);
+        song_free_string(c->path);
+        song_free_string(c->title);
+        song_free_string(c->artist);
+        song_free_string(c->album);
+        song_free_string(c->fingerprint);
+    }
+    for (i = 0; i < snap->not_songs->len; i++)
+        song_free_string(g_ptr_array_index(snap->not_songs, i));
+    g_ptr_array_free(snap->songs, TRUE);
+    g_ptr_array_free(snap->not_songs, TRUE);
+    g_free(snap->copies);
+    g_free(snap);
+}
+
+
+/* Write the snapshot, and remove the old journal it has in it */
+static gpointer compact_thread ( gpointer data ) {
+    GjaySongSnapshot * snap = (GjaySongSnapshot *) data;
+    gchar * old_filename;
+
+    snap->ok = write_songs(snap->songs, snap->not_songs);
+    if (snap->ok) {
+        old_filename = g_strdup_printf("%s/%s/%s",
+            g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL_OLD);
+        unlink(old_filename);
+        g_free(old_filename);
+    }
+    g_atomic_int_set(&snap->sl->compact_finished, TRUE);
+    return snap;
+}
+
+
+/**
+ * Rewrite the data file in a thread, from a snapshot of the songs as
+ * they are now, so the UI carries on. The journal is moved aside for
+ * the thread to remove once the data file has it all; changes from now
+ * on go to a new one.
+ */
+static void compact_data_file ( GjayApp *gjay ) {
+    GjaySongLists * sl = gjay->songs;
+    gchar * journal_filename, * old_filename, * contents;
+    gsize length;
+    FILE * f;
+
+    write_journal(sl);
+    journal_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL);
+    old_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_JOURNAL_OLD);
+    if (access(old_filename, F_OK) != 0) {
+        rename(journal_filename, old_filename);
+    } else if (g_file_get_contents(journal_filename, &contents,
+                                   &length, NULL)) {
+        /* Left by a rewrite which didn't finish; it has to be kept
+           until one does */
+        if ((f = fopen(old_filename, "a")) != NULL) {
+            if (fwrite(contents, 1, length, f) == length && fclose(f) == 0)
+                unlink(journal_filename);
+            else
+                fclose(f);
+        }
+        g_free(contents);
+    }
+
+    if (gjay->verbosity > 1)
+        printf(_("Rewriting song data from %u journaled songs\n"),
+               sl->journal_len);
+    sl->compact_thread = g_thread_new("compact", compact_thread,
+                                      snapshot_songs(sl));
+    sl->dirty = FALSE;
+    sl->journal_len = 0;
+    g_free(journal_filename);
+    g_free(old_filename);
+}
+
+
+/* Wait for the rewrite of the data file and free its snapshot */
+static void compact_done ( GjaySongLists * sl ) {
+    GjaySongSnapshot * snap;
+
+    snap = (GjaySongSnapshot *) g_thread_join(sl->compact_thread);
+    sl->compact_thread = NULL;
+    g_atomic_int_set(&sl->compact_finished, FALSE);
+    /* The old journal is still there; try again at the next write */
+    if (!snap->ok)
+        sl->dirty = TRUE;
+    free_snapshot(snap);
+}
+
+
+/**
+ * Write the songs to the binary database, which is what is read at
+ * startup; data.xml is kept alongside it for import and export.
+ * Each record has the song's data, repeats included, so a repeat whose
+ * original comes after it is just a song.
+ */
+static void write_song_db (GPtrArray * songs, GPtrArray * not_songs) {
+    GjaySongDbWriter * writer;
+    GjaySongDbRecord * record;
+    GHashTable * index;
+    GjaySong * s;
+    gpointer original;
+    gchar * db_filename;
+    guint32 i;
+
+    writer = gjay_song_db_writer_new();
+    index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < songs->len; i++) {
+        s = (GjaySong *) g_ptr_array_index(songs, i);
+        g_hash_table_insert(index, s, GUINT_TO_POINTER(i));
+        record = gjay_song_db_add_song(writer);
+        record->path = gjay_song_db_add_string(writer, s->path);
+        record->title = gjay_song_db_add_string(writer, s->title);
+        record->artist = gjay_song_db_add_string(writer, s->artist);
+        record->album = gjay_song_db_add_string(writer, s->album);
+        record->fingerprint = gjay_song_db_add_string(writer, s->fingerprint);
+        if (s->repeat_prev &&
+            g_hash_table_lookup_extended(index, s->repeat_prev,
+                                         NULL, &original))
+            record->repeats = GPOINTER_TO_UINT(original);
+        record->inode = s->inode;
+        record->dev = s->dev;
+        record->length = s->length;
+        record->flags = (s->no_data ? GJAY_SONG_DB_NO_DATA : 0) |
+            (s->no_rating ? GJAY_SONG_DB_NO_RATING : 0) |
+            (s->no_color ? GJAY_SONG_DB_NO_COLOR : 0) |
+            (s->bpm_undef ? GJAY_SONG_DB_BPM_UNDEF : 0) |
+            (s->sampled ? GJAY_SONG_DB_SAMPLED : 0);
+        record->bpm = s->bpm;
+        record->volume_diff = s->volume_diff;
+        record->rating = s->rating;
+        record->hsv[0] = s->color.H;
+        record->hsv[1] = s->color.S;
+        record->hsv[2] = s->color.V;
+        memcpy(record->freq, s->freq, sizeof(record->freq));
+    }
+    for (i = 0; i < not_songs->len; i++)
+        gjay_song_db_add_not_song(writer,
+                                  (gchar *) g_ptr_array_index(not_songs, i));
+
+    db_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DB);
+    gjay_song_db_writer_save(writer, db_filename);
+    g_free(db_filename);
+    g_hash_table_destroy(index);
+    gjay_song_db_writer_free(writer);
 }
 
 
@@ -496,8 +1154,9 @@ int append_daemon_file (GjaySong * s) {
  *   <length>int</length>
  *   <rating>float</rating>
  *   <color type="hsv">float float float</color>  
- *   <freq volume_diff="float">float float...</freq>
+ *   <freq volume_diff="float" [sampled="t"]>float float...</freq>
  *   <bpm>float</bpm>
+ *   <fingerprint>str</fingerprint>
  * </file>
  */
 void write_song_data (FILE * f, GjaySong * s) {
@@ -543,7 +1202,8 @@ void write_song_data (FILE * f, GjaySong * s) {
             else 
                 fprintf(f, "\t<bpm>%f</bpm>\n", s->bpm);
             
-            fprintf(f, "\t<freq volume_diff=\"%f\">", s->volume_diff);
+            fprintf(f, "\t<freq volume_diff=\"%f\"%s>", s->volume_diff,
+                    s->sampled ? " sampled=\"t\"" : "");
 
             for (k = 0; k < NUM_FREQ_SAMPLES; k++) 
                 fprintf(f, "%f ", s->freq[k]);
@@ -556,6 +1216,8 @@ void write_song_data (FILE * f, GjaySong * s) {
                     s->color.H,
                     s->color.S,
                     s->color.V);
+        if (s->fingerprint)
+            fprintf(f, "\t<fingerprint>%s</fingerprint>\n", s->fingerprint);
     }
     fprintf(f, "</file>\n");
 }
@@ -571,19 +1233,23 @@ static void write_not_song_data (FILE * f, gchar * path) {
 
 
 /**
- * Read the main GJay data file and, if present, the daemon's analysis
- * data.
+ * Read the song database, or the main GJay data file if there is none
+ * or it is older, then the journal of changes since and, if present,
+ * the daemon's analysis data.
  */
-#define NUM_DATA_FILES 2
+#define NUM_DATA_FILES 4
 void read_data_file ( GjayApp *gjay) {
     char buffer[BUFFER_SIZE];
-    char * files[NUM_DATA_FILES] = { GJAY_FILE_DATA, GJAY_DAEMON_DATA };
+    char * files[NUM_DATA_FILES] = { GJAY_FILE_DATA, GJAY_JOURNAL_OLD,
+                                     GJAY_JOURNAL, GJAY_DAEMON_DATA };
     FILE * f;
     gint k;
 
-    if (create_song_lists(&(gjay->songs)) == FALSE)
+    if (create_song_lists(&(gjay->songs), gjay->compact_features) == FALSE)
 	  return ;
     for (k = 0; k < NUM_DATA_FILES; k++) {
+        if (k == 0 && read_song_db(gjay))
+            continue;
         snprintf(buffer, BUFFER_SIZE, "%s/%s/%s", 
                  getenv("HOME"), GJAY_DIR, files[k]);
         if (gjay->verbosity) {
@@ -593,8 +1259,103 @@ void read_data_file ( GjayApp *gjay) {
         if (f) {
             read_data(gjay, f);
             fclose(f);
+            /* Imported, so the database is written on the next save;
+               a journal is folded into it then too */
+            if (k < NUM_DATA_FILES - 1)
+                gjay->songs->dirty = TRUE;
+        }
+    }
+}
+
+
+/**
+ * Read the songs from the binary database in place of data.xml, unless
+ * data.xml is newer, as it is when one has been copied in to import it.
+ * The songs are set up as data_start_element() and data_end_element()
+ * would for the same song in the XML, but all in one block, with their
+ * strings left in the database, which stays mapped. Their files are
+ * looked for later, by song_access_ok(). Returns FALSE if there is no
+ * database that can be used.
+ */
+static gboolean read_song_db ( GjayApp *gjay ) {
+    gchar * db_filename, * xml_filename, * path;
+    struct stat db_stat, xml_stat;
+    const GjaySongDbRecord * record;
+    GjaySongDb * db;
+    GjaySong * s;
+    guint32 i, num_songs;
+
+    db_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DB);
+    xml_filename = g_strdup_printf("%s/%s/%s",
+        g_get_home_dir(), GJAY_DIR, GJAY_FILE_DATA);
+    db = NULL;
+    if (song_db == NULL && stat(db_filename, &db_stat) == 0 &&
+        (stat(xml_filename, &xml_stat) != 0 ||
+         db_stat.st_mtime >= xml_stat.st_mtime))
+        db = gjay_song_db_open(db_filename);
+    if (db && gjay->verbosity)
+        printf(_("Reading from song database '%s'\n"), db_filename);
+    g_free(db_filename);
+    g_free(xml_filename);
+    if (db == NULL)
+        return FALSE;
+
+    num_songs = db->header->songs;
+    song_db = db;
+    song_db_lists = gjay->songs;
+    song_db_songs = g_new0(GjaySong, num_songs);
+    song_db_num_songs = num_songs;
+    gjay_features_reserve(gjay->songs->features, num_songs);
+    for (i = 0; i < num_songs; i++) {
+        record = &db->records[i];
+        if ((path = (gchar *) gjay_song_db_string(db, record->path)) == NULL)
+            continue;
+        s = &song_db_songs[i];
+        song_set_path(s, path);
+        if (record->repeats < i && song_db_songs[record->repeats].path) {
+            song_set_repeats(s, &song_db_songs[record->repeats]);
+        } else {
+            s->title = (gchar *) gjay_song_db_string(db, record->title);
+            s->artist = (gchar *) gjay_song_db_string(db, record->artist);
+            s->album = (gchar *) gjay_song_db_string(db, record->album);
+            s->fingerprint =
+                (gchar *) gjay_song_db_string(db, record->fingerprint);
+            s->inode = record->inode;
+            s->dev = record->dev;
+            s->length = record->length;
+            s->no_data = (record->flags & GJAY_SONG_DB_NO_DATA) != 0;
+            s->no_rating = (record->flags & GJAY_SONG_DB_NO_RATING) != 0;
+            s->no_color = (record->flags & GJAY_SONG_DB_NO_COLOR) != 0;
+            s->bpm_undef = (record->flags & GJAY_SONG_DB_BPM_UNDEF) != 0;
+            s->sampled = (record->flags & GJAY_SONG_DB_SAMPLED) != 0;
+            s->bpm = record->bpm;
+            s->volume_diff = record->volume_diff;
+            s->rating = record->rating;
+            s->color.H = record->hsv[0];
+            s->color.S = record->hsv[1];
+            s->color.V = record->hsv[2];
+            memcpy(s->freq, record->freq, sizeof(s->freq));
         }
+        s->marked = TRUE;
+        s->access_ok = TRUE;
+        s->access_unknown = !skip_verify;
+
+        song_append(gjay->songs, s);
+        hash_inode_dev(s, TRUE);
+    }
+    /* They go in the hashes when one is first looked up */
+    gjay->songs->unhashed = gjay->songs->songs->len;
+
+    /* Ones whose files have gone are dropped when it is next written */
+    for (i = 0; i < db->header->not_songs; i++) {
+        path = (gchar *) gjay_song_db_string(db, db->not_songs[i]);
+        if (path == NULL ||
+            g_hash_table_lookup(gjay->songs->not_hash, path))
+            continue;
+        add_not_song(gjay->songs, path);
     }
+    return TRUE;
 }
 
 
@@ -696,17 +1457,12 @@ void data_start_element  (GMarkupParseContext *context,
         if (!g_hash_table_lookup(state->gjay->songs->not_hash, path)) {
           state->new = TRUE;
           /* Only keep track of files which still exist */
-          if (!access(path, R_OK)) {
-            path = g_strdup(path);
-            state->gjay->songs->not_songs = g_list_append(state->gjay->songs->not_songs, path);
-            g_hash_table_insert ( state->gjay->songs->not_hash,
-                                          path, 
-                                          (gpointer) TRUE);
-                } 
-            }
-            return;
+          if (!access(path, R_OK))
+            add_not_song(state->gjay->songs, g_strdup(path));
         }
-        state->s = g_hash_table_lookup(state->gjay->songs->name_hash, path);
+        return;
+      }
+        state->s = song_by_path(state->gjay->songs, path);
         if (!state->s) {
             state->new = TRUE;
             state->s = create_song();
@@ -714,9 +1470,11 @@ void data_start_element  (GMarkupParseContext *context,
         }
         if (repeat_path && (strlen(repeat_path) > 0)) {
             state->is_repeat = TRUE;
-            original = g_hash_table_lookup(state->gjay->songs->name_hash, repeat_path);
+            original = song_by_path(state->gjay->songs, repeat_path);
             assert(original);
-            song_set_repeats(state->s, original);
+            /* A journaled repeat may be one already */
+            if (!state->s->repeat_prev)
+                song_set_repeats(state->s, original);
         }
         state->s->marked = TRUE; /* Mark all modified or added songs */
         break;
@@ -737,9 +1495,16 @@ void data_start_element  (GMarkupParseContext *context,
         state->s->no_color = FALSE;
         break;
     case E_FREQ:
+        state->s->sampled = FALSE;
         for (k = 0; attribute_names[k]; k++) {
-            if (get_element((gchar *) attribute_names[k]) == E_VOL_DIFF) { 
-                state->s->volume_diff = strtof_gjay(attribute_values[0], NULL);
+            switch(get_element((gchar *) attribute_names[k])) {
+            case E_VOL_DIFF:
+                state->s->volume_diff = strtof_gjay(attribute_values[k], NULL);
+                break;
+            case E_SAMPLED:
+                if (*attribute_values[k] == 't')
+                    state->s->sampled = TRUE;
+                break;
             }
         }
         /* Fall into next case */
@@ -761,7 +1526,7 @@ void data_end_element (GMarkupParseContext *context,
     gchar * latin1_path;
     song_parse_state * state = (song_parse_state *) user_data;
     if (get_element((char *) element_name) == E_FILE) {
-        if (state->new && state->s) {
+        if (state->new && state->s && !state->not_song) {
             /* Check to see if the song is still there */
             latin1_path = strdup_to_latin1(state->s->path);
             state->s->access_ok = !access(latin1_path, R_OK);
@@ -770,21 +1535,27 @@ void data_end_element (GMarkupParseContext *context,
             }
             g_free(latin1_path);
 
-            /* Add song to song list and hash table */
-            state->gjay->songs->songs = g_list_append(state->gjay->songs->songs, state->s);
-            g_hash_table_insert (state->gjay->songs->name_hash,
-                                 state->s->path, 
-                                 state->s);           
+            /* Add song to song table and hash tables */
+            add_song(state->gjay->songs, state->s);
             hash_inode_dev(state->s, state->has_dev);
             g_hash_table_insert (state->gjay->songs->inode_dev_hash,
                                  &state->s->inode_dev_hash,
-                                 state->s);
+                                 GUINT_TO_POINTER(state->s->id));
         }
+        /* The first song with a fingerprint stands for all copies */
+        if (state->s && !state->not_song && state->s->fingerprint &&
+            !g_hash_table_lookup_extended(state->gjay->songs->fingerprint_hash,
+                                          state->s->fingerprint, NULL, NULL))
+            g_hash_table_insert (state->gjay->songs->fingerprint_hash,
+                                 state->s->fingerprint,
+                                 GUINT_TO_POINTER(state->s->id));
         /* If there is a song and it itself is not copy of another
          * song, check to see if it is the original upon which copies
          * are based and set their attributes */
         if (!(state->not_song || state->is_repeat))  
             song_set_repeat_attrs(state->s);
+        if (state->s && !state->not_song)
+            song_set_features(state->gjay->songs, state->s);
     }
     state->element = E_LAST;
 }
@@ -855,6 +1626,10 @@ void data_text ( GMarkupParseContext *context,
             state->s->color.V = strtof_gjay(buffer_str, NULL);
         }
         break;
+    case E_FINGERPRINT:
+        if (!state->s->fingerprint)
+            state->s->fingerprint = g_strdup(buffer);
+        break;
     case E_FREQ:
         buffer_str = buffer;
         for (n = 0; n < NUM_FREQ_SAMPLES; n++) {
@@ -948,18 +1723,27 @@ static int get_element ( gchar * element_name ) {
 
 
 int write_dirty_song_timeout ( gpointer data ) {
-  GjayApp *gjay = (GjayApp*)data;
-    if (gjay->songs->dirty) 
-        write_data_file(gjay);
+    GjayApp *gjay = (GjayApp*)data;
+    GjaySongLists * sl = gjay->songs;
+
+    if (sl->compact_thread && g_atomic_int_get(&sl->compact_finished))
+        compact_done(sl);
+    write_journal(sl);
+    if (sl->compact_thread == NULL &&
+        (sl->dirty ||
+         sl->journal_len >= MAX(JOURNAL_COMPACT_MIN,
+                                sl->songs->len / 4)))
+        compact_data_file(gjay);
     return TRUE;
 }
 
 
-gdouble song_force ( const GjayPrefs *prefs, GjaySong * a, GjaySong  * b, const gint tree_depth ) {
+gdouble song_force ( const GjayPrefs *prefs, GjaySongLists * sl,
+                     const guint a, const guint b, const gint tree_depth ) {
     gdouble ma, mb, attr, sign = 1;
-    ma = song_mass(prefs, a);
-    mb = song_mass(prefs, b);
-    attr = song_attraction(prefs, a, b, tree_depth) * 10;
+    ma = song_mass(prefs, sl->features, a);
+    mb = song_mass(prefs, sl->features, b);
+    attr = song_attraction(prefs, sl, a, b, tree_depth) * 10;
     if (attr < 0)
         sign = -1;
     return (ma * mb * attr * attr * sign);
@@ -968,11 +1752,13 @@ gdouble song_force ( const GjayPrefs *prefs, GjaySong * a, GjaySong  * b, const
 
 /* Attraction is a value -1...1 for the affinity between A and B,
    with criteria weighed by prefs */
-static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong  * b,
-   const int tree_depth	) {
+static gdouble song_attraction (const GjayPrefs *prefs, GjaySongLists * sl,
+   const guint a, const guint b, const int tree_depth	) {
+    const GjayFeatures * f = sl->features;
     gdouble a_hue, a_saturation, a_brightness, a_freq, a_bpm;
-    gdouble d, ba, bb, v_diff, a_max, attraction = 0;
-    gint i;
+    gdouble d_hue, d_saturation, d_brightness;
+    gdouble d, v_diff, a_max, attraction = 0;
+    guint8 flags;
 
     a_max = 
         (prefs->hue + 
@@ -988,48 +1774,34 @@ static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong
     a_freq = prefs->freq / a_max;
     a_bpm = prefs->bpm / a_max;
 
-    if (!(a->no_color || b->no_color)) {
-        /* Hue is 0...6 */
-        d = fabsl(a->color.H - b->color.H) / 6.0;
-        if (d > 0.5) {
-            d = 1 - d;
-        }
+    flags = f->flags[a] | f->flags[b];
+    if (!(flags & GJAY_FEATURE_NO_COLOR)) {
+        gjay_features_color_distance(f, a, b, &d_hue, &d_saturation,
+                                     &d_brightness);
         /* d is 0...1, where 0 is more similiar */
-        d = 1.0 - d*2.0;
+        d = 1.0 - d_hue*2.0;
         /* d is now -1...1, where 1 is more similiar */
         attraction += d * a_hue;
 
-        d = 1.0 - fabsl(a->color.S - b->color.S) * 2.0;
+        d = 1.0 - d_saturation * 2.0;
         /* d is -1 ... 1, where 1 is more similiar*/
         attraction += d * a_saturation;
 
-        d = 1.0 - fabsl(a->color.V - b->color.V) * 2.0;
+        d = 1.0 - d_brightness * 2.0;
         /* d is -1 ... 1, where 1 is more similiar*/
         attraction += d * a_brightness;
     }
 
-    if (!(a->bpm_undef || b->bpm_undef)) {
-        ba = MIN(MAX(MIN_BPM, a->bpm), MAX_BPM) - MIN_BPM;
-        bb = MIN(MAX(MIN_BPM, b->bpm), MAX_BPM) - MIN_BPM;
-        d = fabsl(ba - bb) / ((gdouble) (MAX_BPM - MIN_BPM));
+    if (!(flags & GJAY_FEATURE_BPM_UNDEF)) {
+        d = gjay_features_bpm_distance(f, a, b);
         /* d is 0...1, 0 is most similar */
         d = 1.0 - d * 2.0;
         /* d is -1 ... 1 */
         attraction += d * a_bpm;
     }
 
-    if (!(a->no_data || b->no_data)) {
-        for (d = 0, i = 0; i < NUM_FREQ_SAMPLES; i++) {
-            d += fabsl(a->freq[i] - b->freq[i]);
-            if (i < NUM_FREQ_SAMPLES - 1) {
-                d += fabsl(a->freq[i] - b->freq[i + 1]) / 2.0;
-                d += fabsl(a->freq[i + 1] - b->freq[i]) / 2.0;
-            }
-            if (i > 0) {
-                d += fabsl(a->freq[i] - b->freq[i - 1]) / 2.0;  
-                d += fabsl(a->freq[i - 1] - b->freq[i]) / 2.0;
-            }
-        }
+    if (!(flags & GJAY_FEATURE_NO_DATA)) {
+        d = gjay_features_freq_distance(f, a, b);
         /* d is 0...~20.0. Most similar is 0, medium similar are about 2 */
         d = 1.0 - (d / 2.5);
         d = MIN(MAX(d, -1.0), 1.0);
@@ -1037,8 +1809,7 @@ static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong
         
         /* We adjust the freq val by the volume diff. The closer to 0, the 
            more similar the two songs are. Values over 1 are dissimilar. */
-        v_diff = (MAX(a->volume_diff, b->volume_diff) - 
-                  MIN(a->volume_diff, b->volume_diff));
+        v_diff = gjay_features_volume_distance(f, a, b);
         v_diff = MAX(-1.0, 1.0 - v_diff);
         d = 0.75 * d + 0.25 * v_diff;
         attraction += d * a_freq;
@@ -1046,9 +1817,10 @@ static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong
 
 #ifdef WITH_GUI
 	/* FIXME - This is not really a GUI thing but a function using Gtk */
-    if (tree_depth && a->path && b->path) {
+    if (tree_depth && a < sl->songs->len && b < sl->songs->len) {
         gdouble a_path = prefs->path_weight / a_max;
-        d = explore_files_depth_distance(a->path, b->path);
+        d = explore_files_depth_distance(SONG_AT(sl, a)->path,
+                                         SONG_AT(sl, b)->path);
         if (d >= 0) {
             d = 1.0 - 2.0 * (d / tree_depth);
             /* d = -1 ... 1, where 1 is more similiar */
@@ -1063,7 +1835,8 @@ static gdouble song_attraction (const GjayPrefs *prefs, GjaySong * a, GjaySong
 
 /* Every song has a mass 0...1.0 */
 static gdouble
-song_mass (const GjayPrefs *prefs, GjaySong * s ) {
+song_mass (const GjayPrefs *prefs, const GjayFeatures * features,
+           const guint s ) {
   gdouble max_mass = 0, song_mass = 0;
     max_mass = 
         prefs->hue + 
@@ -1075,15 +1848,15 @@ song_mass (const GjayPrefs *prefs, GjaySong * s ) {
     assert(max_mass != 0);
 
     song_mass += prefs->path_weight;
-    if (!s->no_data) {
+    if (!(features->flags[s] & GJAY_FEATURE_NO_DATA)) {
         song_mass += prefs->freq;
     }
-    if (!s->no_color) {
+    if (!(features->flags[s] & GJAY_FEATURE_NO_COLOR)) {
         song_mass += prefs->hue;
         song_mass += prefs->brightness;
         song_mass += prefs->saturation;
     }
-    if (!s->bpm_undef) {
+    if (!(features->flags[s] & GJAY_FEATURE_BPM_UNDEF)) {
         song_mass += prefs->bpm;
     }
     
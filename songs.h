@@ -22,6 +22,7 @@
 
 #include "gjay.h"
 #include "prefs.h"
+#include "feature_store.h"
 
 typedef enum {
     OGG = 0, 
@@ -42,14 +43,28 @@ typedef enum {
     FREQ
 } sort_by;
  
+/* Songs are kept in a table, and a song's ID is its index in it. The
+   hashes map to song IDs; look songs up with song_by_path() and the
+   like, as ID 0 is a song. */
 typedef struct _GjaySongLists {
-  GList			* songs;
-  GList			* not_songs;
+  GPtrArray		* songs;      /* GjaySong *, by ID */
+  GPtrArray		* not_songs;  /* Paths */
   GHashTable	* name_hash;
   GHashTable	* inode_dev_hash;
+  GHashTable	* fingerprint_hash; /* Songs by what is in the file */
   GHashTable	* not_hash;
-
-  gboolean		dirty;
+  GjayFeatures	* features;   /* What scoring reads, by song ID */
+  guint			unhashed;     /* The first songs, from the database, not yet
+                                 in the hashes; see song_lists_hash() */
+
+  gboolean		dirty;        /* Needs the whole data file rewritten */
+  /* Changes not yet appended to the journal */
+  GList			* journal;
+  GList			* journal_not_songs;
+  GHashTable	* journal_hash;
+  guint			journal_len;  /* Songs in the journal file */
+  GThread		* compact_thread; /* Rewriting the data file, or NULL */
+  volatile gint	compact_finished; /* Only used with g_atomic_int_*() */
 } GjaySongLists;
 
 struct _song {
@@ -74,6 +89,7 @@ struct _song {
     gboolean no_data;   /* Characteristics not set */
     gboolean no_rating; /* Rating attributes not set */
     gboolean no_color;  /* Color attributes not set */
+    gboolean sampled;   /* Characteristics are from parts of the song */
 
     /* Transient flags, not saved with song data */
     gboolean in_tree;
@@ -90,16 +106,38 @@ struct _song {
     guint32 inode; 
     guint32 dev; 
     guint32 inode_dev_hash;
+
+    /* How to tell it is the same song after it has been moved or
+       copied; see file_fingerprint() */
+    gchar * fingerprint;
     
     GjaySong * repeat_prev, * repeat_next;    
 
-    /* Does the song exist? */
+    /* Does the song exist? Songs read from the song database are only
+       looked for when needed; see song_access_ok() */
     gboolean access_ok;
+    gboolean access_unknown;
+
+    guint id;  /* Index in the song table, for this session */
 };
 
 #define SONG(list) ((GjaySong *) list->data)
+#define SONG_AT(sl, id) ((GjaySong *) g_ptr_array_index((sl)->songs, (id)))
 
+struct _GjayTags;
+
+gboolean    create_song_lists      ( GjaySongLists ** sl,
+                                     const gboolean compact_features );
+void        destroy_song_lists     ( GjaySongLists * sl );
 GjaySong *      create_song            ( void );
+void        add_song               ( GjaySongLists * sl,
+                                     GjaySong * s );
+void        add_not_song           ( GjaySongLists * sl,
+                                     gchar * path );
+GjaySong *  song_by_path           ( GjaySongLists * sl,
+                                     const gchar * path );
+GjaySong *  song_by_inode_dev      ( GjaySongLists * sl,
+                                     guint32 * inode_dev_hash );
 void        delete_song            ( GjaySong * s );
 GjaySong *      song_set_path          ( GjaySong * s, 
                                      char * path );
@@ -110,6 +148,8 @@ void        song_set_color_pixbuf  ( GjaySong * s);
 void        song_set_repeats       ( GjaySong * s, 
                                      GjaySong * original );
 void        song_set_repeat_attrs  ( GjaySong * s);
+gboolean    song_access_ok         ( GjaySongLists * sl,
+                                     GjaySong * s );
 void        file_info              ( const guint verbosity,
 									 const gboolean ogg_supported,
 									 const gboolean flac_supported,
@@ -121,19 +161,33 @@ void        file_info              ( const guint verbosity,
                                      gchar         ** title,
                                      gchar         ** artist,
                                      gchar         ** album,
-                                     song_file_type * type );
+                                     song_file_type * type,
+                                     struct _GjayTags * tags );
+gchar *     file_fingerprint       ( const gchar * latin1_path );
+gboolean    song_from_fingerprint  ( GjaySongLists * sl,
+                                     GjaySong * s );
 /* There are two factors for the related-ness of two songs;
  * how similiar their parameters are, and how important these
  * similarities are we. We model this like particle
  * attraction/repulsion (f = m1 * m2 * d^2), where "mass" means the 
  * importance of each song's attributes and "d" is the attraction
  * or repulsion (note that the attraction of a -> b = b-> a)
+ *
+ * Songs are given by ID, and read from sl->features. An ID past the
+ * last song is a row set by hand, such as a color to start from, and
+ * has no path.
  */
-gdouble song_force ( const GjayPrefs *prefs, GjaySong * a, GjaySong  * b, const gint tree_depth );
+gdouble song_force ( const GjayPrefs *prefs, GjaySongLists * sl,
+                     const guint a, const guint b, const gint tree_depth );
 
 
 void        write_data_file        ( GjayApp *gjay );
+void        save_data_file         ( GjayApp *gjay );
 int         write_dirty_song_timeout ( gpointer data );
+void        journal_song           ( GjaySongLists * sl,
+                                     GjaySong * s );
+void        journal_not_song       ( GjaySongLists * sl,
+                                     gchar * path );
 int         append_daemon_file     ( GjaySong * s );
 void        write_song_data        ( FILE * f, GjaySong * s );
 
@@ -0,0 +1,540 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ * Copyright (C) 2002 Chuck Groom.
+ *
+ * The magnitude calculation comes from spectromatic, copyright (C)
+ * 1997-2002 Daniel Franklin.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * spectrum.c -- magnitude spectrum of a window of samples.
+ *
+ * The gsl engine is the original: one double precision real FFT per
+ * channel, then a sqrt per bin.
+ *
+ * The float engine does one single precision complex FFT per window,
+ * with the twiddles and bit reversal worked out in the plan. For stereo
+ * the left channel goes in the real part and the right in the imaginary
+ * part, and the two spectra are pulled apart afterwards using
+ *   X[k] = (Z[k] + conj Z[n-k]) / 2,  Y[k] = (Z[k] - conj Z[n-k]) / 2i
+ * so both channels cost one FFT. Mono goes the other way: the even
+ * samples go in the real part and the odd ones in the imaginary part
+ * of a half size FFT, and the same split plus one more twiddle gives
+ * the spectrum. Square roots are done four or eight at a time.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_fft_real.h>
+#include "gjay.h"
+#include "spectrum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAGS_X86 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define MAGS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef __GNUC__
+/* Four floats; GCC turns these into SSE or NEON. Only 4-byte aligned
+ * so they can be loaded from anywhere in the work arrays. */
+typedef float v4sf __attribute__ ((vector_size (16), aligned (4)));
+#endif
+
+typedef void (*mags_func) (const gfloat *sq, gdouble *mags, const guint n);
+
+struct _spectrum_plan {
+  spectrum_engine engine;
+  guint     size;
+  /* float engine */
+  guint    *bitrev;        /* Where input i goes */
+  gfloat   *tw_re, *tw_im; /* Stage with m butterflies uses [m, 2m) */
+  gfloat   *re, *im;
+  gfloat   *sq1, *sq2;     /* Squared magnitudes */
+  mags_func mags;
+  /* gsl engine; one spare element each, see spectrum_window_gsl() */
+  gdouble  *ch1, *ch2;
+};
+
+static const gchar *engine_names[] = { "float", "gsl", NULL };
+
+static void mags_scalar (const gfloat *sq, gdouble *mags, const guint n);
+static mags_func mags_best (void);
+
+
+spectrum_plan *
+spectrum_plan_new (const spectrum_engine engine, const guint size)
+{
+  spectrum_plan *plan;
+  guint i, j, bits, m;
+  gdouble theta;
+
+  g_assert(size >= 8 && (size & (size - 1)) == 0);
+
+  plan = g_malloc0(sizeof(spectrum_plan));
+  plan->engine = engine;
+  plan->size = size;
+
+  if (engine == SPECTRUM_ENGINE_GSL) {
+    plan->ch1 = g_malloc0((size + 1) * sizeof(gdouble));
+    plan->ch2 = g_malloc0((size + 1) * sizeof(gdouble));
+    return plan;
+  }
+
+  for (bits = 0; (1U << bits) < size; bits++)
+    ;
+  plan->bitrev = g_malloc(size * sizeof(guint));
+  for (i = 0; i < size; i++) {
+    for (j = 0, m = 0; m < bits; m++)
+      j |= ((i >> m) & 1) << (bits - 1 - m);
+    plan->bitrev[i] = j;
+  }
+
+  /* Twiddles for each stage, worked out in double precision */
+  plan->tw_re = g_malloc(size * sizeof(gfloat));
+  plan->tw_im = g_malloc(size * sizeof(gfloat));
+  for (m = 1; m < size; m <<= 1) {
+    for (i = 0; i < m; i++) {
+      theta = -M_PI * (gdouble) i / (gdouble) m;
+      plan->tw_re[m + i] = cos(theta);
+      plan->tw_im[m + i] = sin(theta);
+    }
+  }
+
+  plan->re = g_malloc(size * sizeof(gfloat));
+  plan->im = g_malloc(size * sizeof(gfloat));
+  plan->sq1 = g_malloc(size / 2 * sizeof(gfloat));
+  plan->sq2 = g_malloc(size / 2 * sizeof(gfloat));
+  plan->mags = mags_best();
+  return plan;
+}
+
+void
+spectrum_plan_free (spectrum_plan *plan)
+{
+  if (plan == NULL)
+    return;
+  g_free(plan->bitrev);
+  g_free(plan->tw_re);
+  g_free(plan->tw_im);
+  g_free(plan->re);
+  g_free(plan->im);
+  g_free(plan->sq1);
+  g_free(plan->sq2);
+  g_free(plan->ch1);
+  g_free(plan->ch2);
+  g_free(plan);
+}
+
+const gchar *
+spectrum_engine_name (const spectrum_engine engine)
+{
+  if (engine > SPECTRUM_ENGINE_GSL)
+    return engine_names[SPECTRUM_ENGINE_FLOAT];
+  return engine_names[engine];
+}
+
+gboolean
+spectrum_engine_from_name (const gchar *name, spectrum_engine *engine)
+{
+  int i;
+
+  for (i = 0; engine_names[i]; i++) {
+    if (g_ascii_strcasecmp(name, engine_names[i]) == 0) {
+      *engine = i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+/* The original spectromatic code. The arrays have a spare zero element
+   because bin 0 reads ch[size] */
+static void
+spectrum_window_gsl (spectrum_plan *plan, const gint16 *frames,
+                     const guint channels, gdouble *mags1, gdouble *mags2)
+{
+  gdouble *ch1 = plan->ch1, *ch2 = plan->ch2;
+  const guint size = plan->size;
+  guint j, k;
+
+  if (channels == 1) {
+    for (j = 0; j < size; j++)
+      ch1 [j] = GINT16_FROM_LE(frames[j]);
+    gsl_fft_real_radix2_transform (ch1, 1, size);
+  } else {
+    for (j = 0, k = 0; k < size; k++, j+=2) {
+      ch1[k] = (gdouble) GINT16_FROM_LE(frames[j]);
+      ch2[k] = (gdouble) GINT16_FROM_LE(frames[j+1]);
+    }
+    gsl_fft_real_radix2_transform (ch1, 1, size);
+    gsl_fft_real_radix2_transform (ch2, 1, size);
+  }
+
+  for (j = 0; j < size / 2; j++) {
+    gdouble square_this = ch1 [j] * ch1 [j] + ch1 [size - j] * ch1 [size - j];
+    if (square_this > 0.0 && square_this < BROKEN_VAL)
+      mags1 [j] = sqrt (square_this);
+    else
+      mags1 [j] = 0;
+  }
+  if (channels == 2) {
+    for (j = 0; j < size / 2; j++) {
+      gdouble square_this = ch2 [j] * ch2 [j] + ch2 [size - j] * ch2 [size - j];
+      if (square_this > 0.0 && square_this < BROKEN_VAL)
+        mags2 [j] = sqrt (square_this);
+      else
+        mags2 [j] = 0;
+    }
+  }
+}
+
+
+/* One stage of radix-2 butterflies on the m-point halves a and b */
+static inline void
+fft_butterflies (gfloat *a_re, gfloat *a_im, gfloat *b_re, gfloat *b_im,
+                 const gfloat *w_re, const gfloat *w_im, const guint m)
+{
+  guint k;
+#ifdef __GNUC__
+  v4sf ar, ai, br, bi, wr, wi, tr, ti;
+
+  /* m is at least 4 here */
+  for (k = 0; k < m; k += 4) {
+    memcpy(&ar, a_re + k, sizeof(v4sf));
+    memcpy(&ai, a_im + k, sizeof(v4sf));
+    memcpy(&br, b_re + k, sizeof(v4sf));
+    memcpy(&bi, b_im + k, sizeof(v4sf));
+    memcpy(&wr, w_re + k, sizeof(v4sf));
+    memcpy(&wi, w_im + k, sizeof(v4sf));
+    tr = br * wr - bi * wi;
+    ti = br * wi + bi * wr;
+    br = ar - tr;
+    bi = ai - ti;
+    ar = ar + tr;
+    ai = ai + ti;
+    memcpy(a_re + k, &ar, sizeof(v4sf));
+    memcpy(a_im + k, &ai, sizeof(v4sf));
+    memcpy(b_re + k, &br, sizeof(v4sf));
+    memcpy(b_im + k, &bi, sizeof(v4sf));
+  }
+#else
+  gfloat tr, ti;
+
+  for (k = 0; k < m; k++) {
+    tr = b_re[k] * w_re[k] - b_im[k] * w_im[k];
+    ti = b_re[k] * w_im[k] + b_im[k] * w_re[k];
+    b_re[k] = a_re[k] - tr;
+    b_im[k] = a_im[k] - ti;
+    a_re[k] += tr;
+    a_im[k] += ti;
+  }
+#endif
+}
+
+/* n point complex FFT of frame pairs: frames[2i] is the real part and
+   frames[2i + 1] the imaginary part of input i. n is size, or size / 2
+   with shift 1; bitrev[i] >> 1 is the bit reversal for the half size.
+   The bit reversed load is done in the same pass as the first two
+   stages, which only need twiddles of 1 and -i. */
+static void
+fft_complex (spectrum_plan *plan, const gint16 *frames, const guint n,
+             const guint shift)
+{
+  gfloat *re = plan->re, *im = plan->im;
+  const guint *bitrev = plan->bitrev;
+  gfloat r0, i0, r1, i1, r2, i2, r3, i3;
+  gfloat t0r, t0i, t1r, t1i, t2r, t2i, t3r, t3i;
+  guint j, m, s;
+
+  for (j = 0; j < n; j += 4) {
+    s = 2 * (bitrev[j] >> shift);
+    r0 = GINT16_FROM_LE(frames[s]);
+    i0 = GINT16_FROM_LE(frames[s + 1]);
+    s = 2 * (bitrev[j + 1] >> shift);
+    r1 = GINT16_FROM_LE(frames[s]);
+    i1 = GINT16_FROM_LE(frames[s + 1]);
+    s = 2 * (bitrev[j + 2] >> shift);
+    r2 = GINT16_FROM_LE(frames[s]);
+    i2 = GINT16_FROM_LE(frames[s + 1]);
+    s = 2 * (bitrev[j + 3] >> shift);
+    r3 = GINT16_FROM_LE(frames[s]);
+    i3 = GINT16_FROM_LE(frames[s + 1]);
+
+    t0r = r0 + r1;
+    t0i = i0 + i1;
+    t1r = r0 - r1;
+    t1i = i0 - i1;
+    t2r = r2 + r3;
+    t2i = i2 + i3;
+    t3r = r2 - r3;
+    t3i = i2 - i3;
+    re[j] = t0r + t2r;
+    im[j] = t0i + t2i;
+    re[j + 2] = t0r - t2r;
+    im[j + 2] = t0i - t2i;
+    re[j + 1] = t1r + t3i;
+    im[j + 1] = t1i - t3r;
+    re[j + 3] = t1r - t3i;
+    im[j + 3] = t1i + t3r;
+  }
+
+  for (m = 4; m < n; m <<= 1)
+    for (j = 0; j < n; j += 2 * m)
+      fft_butterflies(re + j, im + j, re + j + m, im + j + m,
+                      plan->tw_re + m, plan->tw_im + m, m);
+}
+
+/* Pulls the spectra of the real and imaginary inputs out of bin k and
+   its partner n - k of an n point FFT */
+static inline void
+split_bin (const gfloat *re, const gfloat *im, const guint k, const guint n,
+           gfloat *xr, gfloat *xi, gfloat *yr, gfloat *yi)
+{
+  *xr = 0.5f * (re[k] + re[n - k]);
+  *xi = 0.5f * (im[k] - im[n - k]);
+  *yr = 0.5f * (im[k] + im[n - k]);
+  *yi = 0.5f * (re[n - k] - re[k]);
+}
+
+#ifdef __GNUC__
+static inline v4sf
+v4sf_reverse (const v4sf x)
+{
+  return (v4sf) { x[3], x[2], x[1], x[0] };
+}
+
+/* Four bins at once of split_bin(); the partners are read backwards */
+static inline void
+split_bins4 (const gfloat *re, const gfloat *im, const guint k,
+             const guint n, v4sf *xr, v4sf *xi, v4sf *yr, v4sf *yi)
+{
+  v4sf ar, ai, br, bi;
+
+  memcpy(&ar, re + k, sizeof(v4sf));
+  memcpy(&ai, im + k, sizeof(v4sf));
+  memcpy(&br, re + n - k - 3, sizeof(v4sf));
+  memcpy(&bi, im + n - k - 3, sizeof(v4sf));
+  br = v4sf_reverse(br);
+  bi = v4sf_reverse(bi);
+  *xr = 0.5f * (ar + br);
+  *xi = 0.5f * (ai - bi);
+  *yr = 0.5f * (ai + bi);
+  *yi = 0.5f * (br - ar);
+}
+#endif /* __GNUC__ */
+
+static void
+spectrum_window_float (spectrum_plan *plan, const gint16 *frames,
+                       const guint channels, gdouble *mags1, gdouble *mags2)
+{
+  const gfloat *re = plan->re, *im = plan->im;
+  const gfloat *w_re, *w_im;
+  gfloat *sq1 = plan->sq1, *sq2 = plan->sq2;
+  gfloat xr, xi, yr, yi, tr, ti;
+  const guint n = plan->size;
+  const guint h = n / 2;
+  guint k;
+#ifdef __GNUC__
+  v4sf vxr, vxi, vyr, vyi, vwr, vwi, vtr, vti;
+#endif
+
+  if (channels == 1) {
+    fft_complex(plan, frames, h, 1);
+
+    /* Even and odd spectra, then X[k] = E[k] + w^k O[k]; the twiddles
+       of the last stage of a size point FFT are exactly w^k */
+    w_re = plan->tw_re + h;
+    w_im = plan->tw_im + h;
+    sq1[0] = (re[0] + im[0]) * (re[0] + im[0]);
+    k = 1;
+#ifdef __GNUC__
+    for (; k < 4; k++) {
+#else
+    for (; k < h; k++) {
+#endif
+      split_bin(re, im, k, h, &xr, &xi, &yr, &yi);
+      tr = xr + yr * w_re[k] - yi * w_im[k];
+      ti = xi + yr * w_im[k] + yi * w_re[k];
+      sq1[k] = tr * tr + ti * ti;
+    }
+#ifdef __GNUC__
+    for (; k < h; k += 4) {
+      split_bins4(re, im, k, h, &vxr, &vxi, &vyr, &vyi);
+      memcpy(&vwr, w_re + k, sizeof(v4sf));
+      memcpy(&vwi, w_im + k, sizeof(v4sf));
+      vtr = vxr + vyr * vwr - vyi * vwi;
+      vti = vxi + vyr * vwi + vyi * vwr;
+      vtr = vtr * vtr + vti * vti;
+      memcpy(sq1 + k, &vtr, sizeof(v4sf));
+    }
+#endif /* __GNUC__ */
+    (*plan->mags) (sq1, mags1, h);
+    return;
+  }
+
+  fft_complex(plan, frames, n, 0);
+
+  /* Split the two channels apart */
+  sq1[0] = re[0] * re[0];
+  sq2[0] = im[0] * im[0];
+  k = 1;
+#ifdef __GNUC__
+  for (; k < 4; k++) {
+#else
+  for (; k < h; k++) {
+#endif
+    split_bin(re, im, k, n, &xr, &xi, &yr, &yi);
+    sq1[k] = xr * xr + xi * xi;
+    sq2[k] = yr * yr + yi * yi;
+  }
+#ifdef __GNUC__
+  for (; k < h; k += 4) {
+    split_bins4(re, im, k, n, &vxr, &vxi, &vyr, &vyi);
+    vxr = vxr * vxr + vxi * vxi;
+    vyr = vyr * vyr + vyi * vyi;
+    memcpy(sq1 + k, &vxr, sizeof(v4sf));
+    memcpy(sq2 + k, &vyr, sizeof(v4sf));
+  }
+#endif /* __GNUC__ */
+  (*plan->mags) (sq1, mags1, h);
+  (*plan->mags) (sq2, mags2, h);
+}
+
+void
+spectrum_window (spectrum_plan *plan, const gint16 *frames,
+                 const guint channels, gdouble *mags1, gdouble *mags2)
+{
+  if (plan->engine == SPECTRUM_ENGINE_GSL)
+    spectrum_window_gsl(plan, frames, channels, mags1, mags2);
+  else
+    spectrum_window_float(plan, frames, channels, mags1, mags2);
+}
+
+
+/* Square roots of the squared magnitudes, zero where the original
+   code's BROKEN_VAL check would give zero */
+static void
+mags_scalar (const gfloat *sq, gdouble *mags, const guint n)
+{
+  guint k;
+
+  for (k = 0; k < n; k++) {
+    if (sq[k] > 0.0f && sq[k] < (gfloat) BROKEN_VAL)
+      mags[k] = sqrtf(sq[k]);
+    else
+      mags[k] = 0.0;
+  }
+}
+
+#ifdef MAGS_X86
+__attribute__((target("sse2")))
+static void
+mags_sse2 (const gfloat *sq, gdouble *mags, const guint n)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 broken = _mm_set1_ps((gfloat) BROKEN_VAL);
+  __m128 s, ok, r;
+  guint k;
+
+  for (k = 0; k + 4 <= n; k += 4) {
+    s = _mm_loadu_ps(sq + k);
+    ok = _mm_and_ps(_mm_cmpgt_ps(s, zero), _mm_cmplt_ps(s, broken));
+    r = _mm_and_ps(_mm_sqrt_ps(s), ok);
+    _mm_storeu_pd(mags + k, _mm_cvtps_pd(r));
+    _mm_storeu_pd(mags + k + 2, _mm_cvtps_pd(_mm_movehl_ps(r, r)));
+  }
+  mags_scalar(sq + k, mags + k, n - k);
+}
+
+__attribute__((target("avx")))
+static void
+mags_avx (const gfloat *sq, gdouble *mags, const guint n)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 broken = _mm256_set1_ps((gfloat) BROKEN_VAL);
+  __m256 s, ok, r;
+  guint k;
+
+  for (k = 0; k + 8 <= n; k += 8) {
+    s = _mm256_loadu_ps(sq + k);
+    ok = _mm256_and_ps(_mm256_cmp_ps(s, zero, _CMP_GT_OQ),
+                       _mm256_cmp_ps(s, broken, _CMP_LT_OQ));
+    r = _mm256_and_ps(_mm256_sqrt_ps(s), ok);
+    _mm256_storeu_pd(mags + k, _mm256_cvtps_pd(_mm256_castps256_ps128(r)));
+    _mm256_storeu_pd(mags + k + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(r, 1)));
+  }
+  mags_scalar(sq + k, mags + k, n - k);
+}
+#endif /* MAGS_X86 */
+
+#ifdef MAGS_NEON
+static void
+mags_neon (const gfloat *sq, gdouble *mags, const guint n)
+{
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const float32x4_t broken = vdupq_n_f32((gfloat) BROKEN_VAL);
+  float32x4_t s, r;
+  uint32x4_t ok;
+  guint k;
+
+  for (k = 0; k + 4 <= n; k += 4) {
+    s = vld1q_f32(sq + k);
+    ok = vandq_u32(vcgtq_f32(s, zero), vcltq_f32(s, broken));
+    r = vreinterpretq_f32_u32(vandq_u32(
+          vreinterpretq_u32_f32(vsqrtq_f32(s)), ok));
+    vst1q_f64(mags + k, vcvt_f64_f32(vget_low_f32(r)));
+    vst1q_f64(mags + k + 2, vcvt_high_f64_f32(r));
+  }
+  mags_scalar(sq + k, mags + k, n - k);
+}
+#endif /* MAGS_NEON */
+
+static gpointer
+pick_mags (gpointer data)
+{
+  mags_func *best = data;
+
+  *best = mags_scalar;
+#ifdef MAGS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx"))
+    *best = mags_avx;
+  else if (__builtin_cpu_supports("sse2"))
+    *best = mags_sse2;
+#endif /* MAGS_X86 */
+#ifdef MAGS_NEON
+  *best = mags_neon;
+#endif /* MAGS_NEON */
+  return NULL;
+}
+
+static mags_func
+mags_best (void)
+{
+  static GOnce once = G_ONCE_INIT;
+  static mags_func best;
+
+  g_once(&once, pick_mags, &best);
+  return best;
+}
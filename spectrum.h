@@ -0,0 +1,46 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * spectrum.h -- magnitude spectrum of one window of 16-bit PCM
+ */
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include "gjay.h"
+
+/* Magnitudes whose square is this big are taken to be glitches */
+#define BROKEN_VAL 100000000000000.0
+
+typedef struct _spectrum_plan spectrum_plan;
+
+/* Everything which only depends on the window size is worked out once */
+spectrum_plan * spectrum_plan_new    ( const spectrum_engine engine,
+                                       const guint size );
+void            spectrum_plan_free   ( spectrum_plan *plan );
+/* frames is size frames of little-endian interleaved samples. Writes
+ * the magnitudes of bins 0 .. size/2 - 1 of each channel; mags2 is
+ * only used for stereo. */
+void            spectrum_window      ( spectrum_plan *plan,
+                                       const gint16 *frames,
+                                       const guint channels,
+                                       gdouble *mags1,
+                                       gdouble *mags2 );
+const gchar *   spectrum_engine_name ( const spectrum_engine engine );
+gboolean        spectrum_engine_from_name ( const gchar *name,
+                                       spectrum_engine *engine );
+
+#endif /* SPECTRUM_H */
@@ -0,0 +1,126 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * stats.c -- each worker times the stages of the song it is on; the
+ * daemon adds the songs up, and every so often sends the totals to the
+ * UI and writes them to ~/.gjay/daemon_stats.json.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "constants.h"
+#include "stats.h"
+#include "i18n.h"
+
+/* As they appear in the JSON */
+static const gchar * span_names[GJAY_NUM_SPANS] = {
+  "inflate",
+  "decode",
+  "spectrum",
+  "bpm_coarse",
+  "bpm_fine",
+  "append"
+};
+
+guint64
+gjay_stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+gjay_stats_add_span (GjayStats * stats, const GjayStatsSpan span,
+                     const guint64 nsec)
+{
+  if (stats == NULL)
+    return;
+  stats->count[span]++;
+  stats->nsec[span] += nsec;
+}
+
+void
+gjay_stats_span_end (GjayStats * stats, const GjayStatsSpan span,
+                     const guint64 start)
+{
+  if (stats == NULL)
+    return;
+  gjay_stats_add_span(stats, span, gjay_stats_now() - start);
+}
+
+void
+gjay_stats_add (GjayStats * total, const GjayStats * stats)
+{
+  gint k;
+
+  total->songs += stats->songs;
+  total->bytes_decoded += stats->bytes_decoded;
+  total->frames += stats->frames;
+  for (k = 0; k < GJAY_NUM_SPANS; k++) {
+    total->count[k] += stats->count[k];
+    total->nsec[k] += stats->nsec[k];
+  }
+}
+
+gchar *
+gjay_stats_to_json (const GjayStats * stats)
+{
+  GString * json;
+  gint k;
+
+  json = g_string_new(NULL);
+  g_string_append_printf(json, "{\"songs\": %" G_GUINT64_FORMAT
+                         ", \"bytes_decoded\": %" G_GUINT64_FORMAT
+                         ", \"frames\": %" G_GUINT64_FORMAT
+                         ", \"spans\": {",
+                         stats->songs, stats->bytes_decoded, stats->frames);
+  for (k = 0; k < GJAY_NUM_SPANS; k++)
+    g_string_append_printf(json, "%s\"%s\": {\"count\": %" G_GUINT64_FORMAT
+                           ", \"nsec\": %" G_GUINT64_FORMAT "}",
+                           k ? ", " : "", span_names[k],
+                           stats->count[k], stats->nsec[k]);
+  g_string_append(json, "}}");
+  return g_string_free(json, FALSE);
+}
+
+gboolean
+gjay_stats_write (const GjayStats * stats)
+{
+  gchar * path, * json, * contents;
+  GError * error = NULL;
+  gboolean result;
+
+  path = g_strdup_printf("%s/%s/%s", g_get_home_dir(),
+                         GJAY_DIR, GJAY_DAEMON_STATS);
+  json = gjay_stats_to_json(stats);
+  contents = g_strconcat(json, "\n", NULL);
+  /* Readers never see it half written */
+  if ((result = g_file_set_contents(path, contents, -1, &error)) == FALSE) {
+    g_warning(_("Unable to write '%s': %s\n"), path, error->message);
+    g_error_free(error);
+  }
+  g_free(contents);
+  g_free(json);
+  g_free(path);
+  return result;
+}
@@ -0,0 +1,61 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * stats.h -- where the analysis spends its time, so a slow ingest can
+ * be pinned on decoding, the spectrum, the BPM search or disk writes
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <glib.h>
+
+/* The stages of analyzing a song that are timed */
+typedef enum {
+  GJAY_SPAN_INFLATE = 0, /* Opening the decoder or starting the helper */
+  GJAY_SPAN_DECODE,      /* Reading the audio, in the decoder thread */
+  GJAY_SPAN_SPECTRUM,    /* The spectrum loop, less waiting for audio */
+  GJAY_SPAN_BPM_COARSE,  /* BPM search over the whole lag range */
+  GJAY_SPAN_BPM_FINE,    /* BPM search around the best coarse lag */
+  GJAY_SPAN_APPEND,      /* Adding the result to the daemon data file */
+  GJAY_NUM_SPANS
+} GjayStatsSpan;
+
+typedef struct {
+  guint64 songs;
+  guint64 bytes_decoded;
+  guint64 frames;                  /* Sample frames analyzed */
+  guint64 count[GJAY_NUM_SPANS];   /* Times each span was timed */
+  guint64 nsec[GJAY_NUM_SPANS];    /* Total time in each span */
+} GjayStats;
+
+/* Monotonic clock in nanoseconds, for starting a span */
+guint64  gjay_stats_now      ( void );
+/* Adds the time since start to span; stats may be NULL */
+void     gjay_stats_span_end ( GjayStats * stats,
+                               const GjayStatsSpan span,
+                               const guint64 start );
+void     gjay_stats_add_span ( GjayStats * stats,
+                               const GjayStatsSpan span,
+                               const guint64 nsec );
+void     gjay_stats_add      ( GjayStats * total,
+                               const GjayStats * stats );
+/* One line of JSON, freed with g_free() */
+gchar *  gjay_stats_to_json  ( const GjayStats * stats );
+/* Replaces ~/.gjay/daemon_stats.json */
+gboolean gjay_stats_write    ( const GjayStats * stats );
+
+#endif /* STATS_H */
@@ -0,0 +1,589 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * tags.c -- reading and writing GJay's analysis in the songs' tags. The
+ * Vorbis comment writers live with the rest of the Ogg and FLAC code;
+ * ID3v2 is simple enough to do here. Only ID3v2.3 and 2.4 tags are
+ * read or written, and tags using unsynchronisation are left alone.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "gjay.h"
+#include "tags.h"
+#include "vorbis.h"
+#include "flac.h"
+#include "i18n.h"
+
+/* Room left for later edits when an ID3v2 tag has to grow */
+#define ID3V2_PADDING 1024
+
+void
+gjay_tags_parse_comment (GjayTags * tags, const gchar * comment,
+                         const gsize len)
+{
+  const gchar * equals;
+  gchar * value, * str, * end;
+  gsize name_len;
+  gint k;
+
+  if ((equals = memchr(comment, '=', len)) == NULL)
+    return;
+  name_len = equals - comment;
+  value = g_strndup(equals + 1, len - name_len - 1);
+
+  if (name_len == strlen(GJAY_TAG_BPM) &&
+      g_ascii_strncasecmp(comment, GJAY_TAG_BPM, name_len) == 0) {
+    if (strcmp(value, "undef") == 0)
+      tags->bpm = 0;
+    else
+      tags->bpm = strtof_gjay(value, NULL);
+    tags->found |= GJAY_TAGS_BPM;
+  } else if (name_len == strlen(GJAY_TAG_FREQ) &&
+             g_ascii_strncasecmp(comment, GJAY_TAG_FREQ, name_len) == 0) {
+    str = value;
+    for (k = 0; k < NUM_FREQ_SAMPLES; k++) {
+      tags->freq[k] = strtof_gjay(str, &end);
+      if (end == str)
+        break;
+      str = end;
+    }
+    /* A different number of bands is no use to us */
+    if (k == NUM_FREQ_SAMPLES)
+      tags->found |= GJAY_TAGS_FREQ;
+  } else if (name_len == strlen(GJAY_TAG_VOLUME_DIFF) &&
+             g_ascii_strncasecmp(comment, GJAY_TAG_VOLUME_DIFF,
+                                 name_len) == 0) {
+    tags->volume_diff = strtof_gjay(value, NULL);
+    tags->found |= GJAY_TAGS_VOLUME_DIFF;
+  }
+  g_free(value);
+}
+
+gboolean
+gjay_tags_to_song (const GjayTags * tags, GjaySong * s)
+{
+  gint k;
+
+  if ((tags->found & GJAY_TAGS_ALL) != GJAY_TAGS_ALL)
+    return FALSE;
+  for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+    s->freq[k] = tags->freq[k];
+  s->bpm = tags->bpm;
+  s->bpm_undef = (s->bpm < MIN_BPM);
+  s->volume_diff = tags->volume_diff;
+  s->no_data = FALSE;
+  s->sampled = FALSE;
+  return TRUE;
+}
+
+gchar **
+gjay_tags_from_song (const GjaySong * s)
+{
+  GPtrArray * comments;
+  GString * freq;
+  gint k;
+
+  comments = g_ptr_array_new();
+  if (s->bpm_undef)
+    g_ptr_array_add(comments, g_strdup(GJAY_TAG_BPM "=undef"));
+  else
+    g_ptr_array_add(comments, g_strdup_printf(GJAY_TAG_BPM "=%f", s->bpm));
+  freq = g_string_new(GJAY_TAG_FREQ "=");
+  for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+    g_string_append_printf(freq, k ? " %f" : "%f", s->freq[k]);
+  g_ptr_array_add(comments, g_string_free(freq, FALSE));
+  g_ptr_array_add(comments, g_strdup_printf(GJAY_TAG_VOLUME_DIFF "=%f",
+                                            s->volume_diff));
+  g_ptr_array_add(comments, NULL);
+  return (gchar **) g_ptr_array_free(comments, FALSE);
+}
+
+gboolean
+gjay_tags_write (const gchar * latin1_path, const song_file_type type,
+                 const GjaySong * s)
+{
+  gchar ** comments;
+  gboolean result = FALSE;
+
+  comments = gjay_tags_from_song(s);
+  switch (type) {
+  case MP3:
+    result = id3v2_write_gjay_tags(latin1_path, comments);
+    break;
+#ifdef HAVE_VORBIS_VORBISFILE_H
+  case OGG:
+    result = write_ogg_gjay_tags(latin1_path, comments);
+    break;
+#endif /* HAVE_VORBIS_VORBISFILE_H */
+#ifdef HAVE_FLAC_METADATA_H
+  case FLAC:
+    result = write_flac_gjay_tags(latin1_path, comments);
+    break;
+#endif /* HAVE_FLAC_METADATA_H */
+  default:
+    break;
+  }
+  g_strfreev(comments);
+  return result;
+}
+
+
+FILE *
+gjay_tags_temp_open (const gchar * path, gchar ** temp_path)
+{
+  struct stat buf;
+  gint fd;
+
+  if (stat(path, &buf) != 0)
+    return NULL;
+  *temp_path = g_strdup_printf("%s.XXXXXX", path);
+  if ((fd = g_mkstemp(*temp_path)) < 0) {
+    g_free(*temp_path);
+    *temp_path = NULL;
+    return NULL;
+  }
+  /* A file that can't keep its owner and group is left as it is */
+  if (fchown(fd, buf.st_uid, buf.st_gid) != 0) {
+    close(fd);
+    unlink(*temp_path);
+    g_free(*temp_path);
+    *temp_path = NULL;
+    return NULL;
+  }
+  fchmod(fd, buf.st_mode & 07777);
+  return fdopen(fd, "w");
+}
+
+gboolean
+gjay_tags_temp_replace (FILE * temp, gchar * temp_path, const gchar * path,
+                        gboolean ok)
+{
+  if (fclose(temp) != 0)
+    ok = FALSE;
+  if (ok && rename(temp_path, path) != 0) {
+    g_warning(_("Unable to replace '%s' with the retagged file\n"), path);
+    ok = FALSE;
+  }
+  if (!ok)
+    unlink(temp_path);
+  g_free(temp_path);
+  return ok;
+}
+
+gboolean
+gjay_tags_match (const GjayTags * tags, gchar ** comments)
+{
+  GjayTags want;
+  gint k;
+
+  memset(&want, 0x00, sizeof(want));
+  for (k = 0; comments[k]; k++)
+    gjay_tags_parse_comment(&want, comments[k], strlen(comments[k]));
+  if ((tags->found & want.found) != want.found)
+    return FALSE;
+  if ((want.found & GJAY_TAGS_BPM) && tags->bpm != want.bpm)
+    return FALSE;
+  if ((want.found & GJAY_TAGS_VOLUME_DIFF) &&
+      tags->volume_diff != want.volume_diff)
+    return FALSE;
+  if (want.found & GJAY_TAGS_FREQ)
+    for (k = 0; k < NUM_FREQ_SAMPLES; k++)
+      if (tags->freq[k] != want.freq[k])
+        return FALSE;
+  return TRUE;
+}
+
+gchar *
+gjay_tags_tail_checksum (const gchar * path, const goffset start)
+{
+  GChecksum * checksum;
+  FILE * f;
+  guchar * buffer;
+  gchar * sum = NULL;
+  size_t count;
+
+  if ((f = fopen(path, "rb")) == NULL)
+    return NULL;
+  if (fseeko(f, start, SEEK_SET) == 0) {
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    buffer = g_malloc(BUFFER_SIZE);
+    while ((count = fread(buffer, 1, BUFFER_SIZE, f)) > 0)
+      g_checksum_update(checksum, buffer, count);
+    if (!ferror(f))
+      sum = g_strdup(g_checksum_get_string(checksum));
+    g_free(buffer);
+    g_checksum_free(checksum);
+  }
+  fclose(f);
+  return sum;
+}
+
+GByteArray *
+gjay_tags_head_save (FILE * f, const gsize length)
+{
+  GByteArray * head;
+
+  head = g_byte_array_sized_new(length);
+  g_byte_array_set_size(head, length);
+  if (fseeko(f, 0, SEEK_SET) != 0 ||
+      fread(head->data, 1, length, f) != length ||
+      fseeko(f, 0, SEEK_SET) != 0) {
+    g_byte_array_free(head, TRUE);
+    return NULL;
+  }
+  return head;
+}
+
+gboolean
+gjay_tags_head_restore (FILE * f, const gchar * path, GByteArray * head)
+{
+  gboolean ok;
+
+  ok = (fseeko(f, 0, SEEK_SET) == 0 &&
+        fwrite(head->data, 1, head->len, f) == head->len &&
+        fflush(f) == 0);
+  if (!ok)
+    g_warning(_("Unable to put back the old tags of '%s'\n"), path);
+  g_byte_array_free(head, TRUE);
+  return ok;
+}
+
+
+static guint32
+id3v2_synchsafe (const guchar * b)
+{
+  return (b[0] << 21) | (b[1] << 14) | (b[2] << 7) | b[3];
+}
+
+static void
+id3v2_put_synchsafe (guchar * b, const guint32 n)
+{
+  b[0] = (n >> 21) & 0x7f;
+  b[1] = (n >> 14) & 0x7f;
+  b[2] = (n >> 7) & 0x7f;
+  b[3] = n & 0x7f;
+}
+
+static guint32
+id3v2_be32 (const guchar * b)
+{
+  return ((guint32) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/**
+ * Read the ID3v2 tag at the start of f into header and a new buffer,
+ * which is returned. NULL if there is no tag of a version we know.
+ */
+static guchar *
+id3v2_read_tag (FILE * f, guchar header[10], gsize * size)
+{
+  guchar * body;
+
+  rewind(f);
+  if (fread(header, 1, 10, f) != 10 || memcmp(header, "ID3", 3) != 0 ||
+      header[3] < 3 || header[3] > 4 ||
+      ((header[6] | header[7] | header[8] | header[9]) & 0x80))
+    return NULL;
+  *size = id3v2_synchsafe(header + 6);
+  body = g_malloc(*size + 1);
+  if (fread(body, 1, *size, f) != *size) {
+    g_free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/* Where the frames start, after any extended header */
+static gsize
+id3v2_frames_start (const guchar * header, const guchar * body,
+                    const gsize size)
+{
+  gsize start;
+
+  if (!(header[5] & 0x40))
+    return 0;
+  if (size < 4)
+    return size;
+  if (header[3] == 3)
+    start = 4 + id3v2_be32(body);
+  else
+    start = id3v2_synchsafe(body);
+  return MIN(start, size);
+}
+
+/* Steps *pos over the frame there; FALSE at the padding or the end */
+static gboolean
+id3v2_next_frame (const guchar * header, const guchar * body,
+                  const gsize size, gsize * pos,
+                  const guchar ** frame, gsize * frame_size)
+{
+  gsize len;
+
+  if (*pos + 10 > size || body[*pos] == '\0')
+    return FALSE;
+  if (header[3] == 4)
+    len = id3v2_synchsafe(body + *pos + 4);
+  else
+    len = id3v2_be32(body + *pos + 4);
+  if (len > size - *pos - 10)
+    return FALSE;
+  *frame = body + *pos;
+  *frame_size = 10 + len;
+  *pos += 10 + len;
+  return TRUE;
+}
+
+/**
+ * A TXXX frame as "description=value" in UTF-8, or NULL if it isn't
+ * one or can't be read.
+ */
+static gchar *
+id3v2_txxx (const guchar * header, const guchar * frame,
+            const gsize frame_size)
+{
+  const guchar * data;
+  gsize len, i;
+  gchar * desc, * value, * result;
+  const gchar * charset;
+
+  if (memcmp(frame, "TXXX", 4) != 0)
+    return NULL;
+  data = frame + 10;
+  len = frame_size - 10;
+  if (header[3] == 4) {
+    if (frame[9] & 0x0e) /* Compressed, encrypted or unsynchronised */
+      return NULL;
+    if (frame[9] & 0x01) { /* Data length indicator */
+      if (len < 4)
+        return NULL;
+      data += 4;
+      len -= 4;
+    }
+  } else {
+    if (frame[9] & 0xc0) /* Compressed or encrypted */
+      return NULL;
+    if (frame[9] & 0x20) { /* Grouping identity */
+      if (len < 1)
+        return NULL;
+      data++;
+      len--;
+    }
+  }
+  if (len < 1)
+    return NULL;
+
+  switch (data[0]) {
+  case 0: /* ISO-8859-1 */
+  case 3: /* UTF-8 */
+    for (i = 1; i < len && data[i]; i++)
+      ;
+    desc = g_strndup((const gchar *) data + 1, i - 1);
+    value = (i < len) ?
+        g_strndup((const gchar *) data + i + 1, len - i - 1) : g_strdup("");
+    break;
+  case 1: /* UTF-16 with a byte order mark */
+  case 2: /* UTF-16BE */
+    charset = (data[0] == 1) ? "UTF-16" : "UTF-16BE";
+    for (i = 1; i + 1 < len && (data[i] || data[i + 1]); i += 2)
+      ;
+    desc = g_convert((const gchar *) data + 1, i - 1, "UTF-8", charset,
+                     NULL, NULL, NULL);
+    value = (i + 2 <= len) ?
+        g_convert((const gchar *) data + i + 2, len - i - 2, "UTF-8",
+                  charset, NULL, NULL, NULL) : g_strdup("");
+    break;
+  default:
+    return NULL;
+  }
+  if (desc == NULL || value == NULL) {
+    g_free(desc);
+    g_free(value);
+    return NULL;
+  }
+  result = g_strconcat(desc, "=", value, NULL);
+  g_free(desc);
+  g_free(value);
+  return result;
+}
+
+/* Undo ID3v2.3 whole-tag unsynchronisation in place */
+static gsize
+id3v2_resync (guchar * body, const gsize size)
+{
+  gsize i, j;
+
+  for (i = 0, j = 0; i < size; i++) {
+    body[j++] = body[i];
+    if (body[i] == 0xff && i + 1 < size && body[i + 1] == 0x00)
+      i++;
+  }
+  return j;
+}
+
+void
+id3v2_read_gjay_tags (FILE * f, GjayTags * tags)
+{
+  guchar header[10], * body;
+  const guchar * frame;
+  gsize size, pos, frame_size;
+  gchar * comment;
+
+  if ((body = id3v2_read_tag(f, header, &size)) == NULL)
+    return;
+  if (header[3] == 3 && (header[5] & 0x80))
+    size = id3v2_resync(body, size);
+  pos = id3v2_frames_start(header, body, size);
+  while (id3v2_next_frame(header, body, size, &pos, &frame, &frame_size)) {
+    if ((comment = id3v2_txxx(header, frame, frame_size)) != NULL) {
+      gjay_tags_parse_comment(tags, comment, strlen(comment));
+      g_free(comment);
+    }
+  }
+  g_free(body);
+}
+
+/* Appends a TXXX frame for a NAME=value comment */
+static void
+id3v2_append_txxx (GByteArray * frames, const guchar version,
+                   const gchar * comment)
+{
+  const gchar * equals;
+  guchar frame_header[10];
+  guint32 len;
+  guint8 encoding;
+
+  if ((equals = strchr(comment, '=')) == NULL)
+    return;
+  /* Our tags are ASCII, which ISO-8859-1 holds in any version */
+  encoding = 0;
+  len = 1 + (equals - comment) + 1 + strlen(equals + 1);
+  memcpy(frame_header, "TXXX", 4);
+  if (version == 4) {
+    id3v2_put_synchsafe(frame_header + 4, len);
+  } else {
+    frame_header[4] = (len >> 24) & 0xff;
+    frame_header[5] = (len >> 16) & 0xff;
+    frame_header[6] = (len >> 8) & 0xff;
+    frame_header[7] = len & 0xff;
+  }
+  frame_header[8] = frame_header[9] = 0;
+  g_byte_array_append(frames, frame_header, 10);
+  g_byte_array_append(frames, &encoding, 1);
+  g_byte_array_append(frames, (const guint8 *) comment, equals - comment);
+  g_byte_array_append(frames, (const guint8 *) "", 1);
+  g_byte_array_append(frames, (const guint8 *) equals + 1,
+                      strlen(equals + 1));
+}
+
+/**
+ * Replace any GJAY_ TXXX frames in the file's ID3v2 tag with the given
+ * comments, adding a tag if there is none. The tag is rewritten in
+ * place if it has the room, otherwise the whole file is.
+ */
+gboolean
+id3v2_write_gjay_tags (const gchar * path, gchar ** comments)
+{
+  FILE * f, * temp;
+  guchar header[10], * body, * buffer;
+  const guchar * frame;
+  gsize size = 0, pos, frame_size, count, new_size;
+  GByteArray * frames;
+  gchar * comment, * temp_path;
+  gboolean ok;
+  gint k;
+
+  if ((f = fopen(path, "r+b")) == NULL)
+    return FALSE;
+  memset(header, 0x00, sizeof(header));
+  body = id3v2_read_tag(f, header, &size);
+  if (body == NULL) {
+    if (memcmp(header, "ID3", 3) == 0) {
+      /* A tag, but one we don't understand */
+      fclose(f);
+      return FALSE;
+    }
+    memcpy(header, "ID3\3\0\0", 6);
+    size = 0;
+  } else if (header[5] & 0x90) {
+    /* Unsynchronised or with a footer; leave well alone */
+    g_free(body);
+    fclose(f);
+    return FALSE;
+  }
+
+  frames = g_byte_array_new();
+  if (body) {
+    /* The extended header may hold a CRC of the frames; drop it */
+    pos = id3v2_frames_start(header, body, size);
+    header[5] &= ~0x40;
+    while (id3v2_next_frame(header, body, size, &pos, &frame, &frame_size)) {
+      comment = id3v2_txxx(header, frame, frame_size);
+      if (comment == NULL ||
+          g_ascii_strncasecmp(comment, GJAY_TAG_PREFIX,
+                              strlen(GJAY_TAG_PREFIX)) != 0)
+        g_byte_array_append(frames, frame, frame_size);
+      g_free(comment);
+    }
+    g_free(body);
+  }
+  for (k = 0; comments[k]; k++)
+    id3v2_append_txxx(frames, header[3], comments[k]);
+
+  if (size > 0 && frames->len <= size) {
+    /* Fits in the old tag's padding */
+    count = frames->len;
+    g_byte_array_set_size(frames, size);
+    memset(frames->data + count, 0x00, size - count);
+    ok = (fseek(f, 0, SEEK_SET) == 0 &&
+          fwrite(header, 1, 10, f) == 10 &&
+          fwrite(frames->data, 1, size, f) == size);
+    ok = (fclose(f) == 0) && ok;
+    g_byte_array_free(frames, TRUE);
+    return ok;
+  }
+
+  if ((temp = gjay_tags_temp_open(path, &temp_path)) == NULL) {
+    fclose(f);
+    g_byte_array_free(frames, TRUE);
+    return FALSE;
+  }
+  new_size = frames->len + ID3V2_PADDING;
+  id3v2_put_synchsafe(header + 6, new_size);
+  ok = (fwrite(header, 1, 10, temp) == 10 &&
+        fwrite(frames->data, 1, frames->len, temp) == frames->len);
+  buffer = g_malloc0(BUFFER_SIZE);
+  ok = ok && fwrite(buffer, 1, ID3V2_PADDING, temp) == ID3V2_PADDING;
+  /* Then the audio after the old tag */
+  ok = ok && fseek(f, size ? 10 + size : 0, SEEK_SET) == 0;
+  while (ok && (count = fread(buffer, 1, BUFFER_SIZE, f)) > 0)
+    ok = (fwrite(buffer, 1, count, temp) == count);
+  ok = ok && !ferror(f);
+  g_free(buffer);
+  fclose(f);
+  g_byte_array_free(frames, TRUE);
+  return gjay_tags_temp_replace(temp, temp_path, path, ok);
+}
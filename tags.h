@@ -0,0 +1,87 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * tags.h -- analysis results kept in the songs' own tags, as
+ * GJAY_BPM, GJAY_FREQ and GJAY_VOLUME_DIFF Vorbis comments in Ogg and
+ * FLAC files and ID3v2 TXXX frames of the same names in MP3 files
+ */
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stdio.h>
+#include "gjay.h"
+
+#define GJAY_TAG_PREFIX      "GJAY_"
+#define GJAY_TAG_BPM         "GJAY_BPM"
+#define GJAY_TAG_FREQ        "GJAY_FREQ"
+#define GJAY_TAG_VOLUME_DIFF "GJAY_VOLUME_DIFF"
+
+/* What was found in a song's tags */
+typedef struct _GjayTags {
+  guint    found;           /* GJAY_TAGS_* bits */
+  gdouble  bpm;             /* 0 if undefined */
+  gdouble  freq[NUM_FREQ_SAMPLES];
+  gdouble  volume_diff;
+} GjayTags;
+
+#define GJAY_TAGS_BPM         (1 << 0)
+#define GJAY_TAGS_FREQ        (1 << 1)
+#define GJAY_TAGS_VOLUME_DIFF (1 << 2)
+#define GJAY_TAGS_ALL         (GJAY_TAGS_BPM | GJAY_TAGS_FREQ | \
+                               GJAY_TAGS_VOLUME_DIFF)
+
+/* Takes a NAME=value comment, ignoring anything not ours */
+void      gjay_tags_parse_comment ( GjayTags * tags,
+                                    const gchar * comment,
+                                    const gsize len );
+/* Give s the analysis in tags if it is all there */
+gboolean  gjay_tags_to_song       ( const GjayTags * tags,
+                                    GjaySong * s );
+/* NAME=value comments for s, freed with g_strfreev() */
+gchar **  gjay_tags_from_song     ( const GjaySong * s );
+/* Store s's analysis in the tags of its file at latin1_path */
+gboolean  gjay_tags_write         ( const gchar * latin1_path,
+                                    const song_file_type type,
+                                    const GjaySong * s );
+
+/* For rewriting a file: a temporary file beside it with the same
+   owner and permissions, which replaces it if ok */
+FILE *    gjay_tags_temp_open     ( const gchar * path,
+                                    gchar ** temp_path );
+gboolean  gjay_tags_temp_replace  ( FILE * temp, gchar * temp_path,
+                                    const gchar * path, gboolean ok );
+/* For checking a rewritten file: whether the tags read back from it
+   have the comments written, and a checksum of what follows start in
+   it, to see the audio is as it was. NULL if it can't be read. */
+gboolean  gjay_tags_match         ( const GjayTags * tags,
+                                    gchar ** comments );
+gchar *   gjay_tags_tail_checksum ( const gchar * path,
+                                    const goffset start );
+/* For writing over the start of a file in place: its first length
+   bytes, kept to be put back if what is written doesn't read back
+   right, leaving f at the start again. NULL if they can't be read.
+   Restoring frees head. */
+GByteArray * gjay_tags_head_save    ( FILE * f, const gsize length );
+gboolean  gjay_tags_head_restore  ( FILE * f, const gchar * path,
+                                    GByteArray * head );
+
+/* ID3v2 TXXX frames in MP3 files */
+void      id3v2_read_gjay_tags    ( FILE * f, GjayTags * tags );
+gboolean  id3v2_write_gjay_tags   ( const gchar * path,
+                                    gchar ** comments );
+
+#endif /* TAGS_H */
@@ -314,8 +314,8 @@ gboolean daemon_pipe_input (GIOChannel *source,
     gchar * str;
     int len, k, p, l, seek;
     ipc_type ipc, send_ipc;
-    GList * ll;
-    gboolean update;
+    guint i;
+    gboolean update, added;
     GjaySong * s;
 
     GjayApp *gjay = (GjayApp*)user_data;
@@ -369,15 +369,16 @@ gboolean daemon_pipe_input (GIOChannel *source,
         break;
     case ADDED_FILE:
         /* Unmark all songs */
-        for (ll = g_list_first(gjay->songs->songs); ll; ll = g_list_next(ll))
-            SONG(ll)->marked = FALSE;
+        for (i = 0; i < gjay->songs->songs->len; i++)
+            SONG_AT(gjay->songs, i)->marked = FALSE;
         memcpy(&seek, buffer + sizeof(ipc_type), sizeof(int));
-        if (add_from_daemon_file_at_seek(gjay, seek) == TRUE)
-          gjay->songs->dirty = TRUE;
+        added = add_from_daemon_file_at_seek(gjay, seek);
         update = FALSE;
         /* Update visible marked songs */
-        for (ll = g_list_first(gjay->songs->songs); ll; ll = g_list_next(ll)) {
-            s = SONG(ll);
+        for (i = 0; i < gjay->songs->songs->len; i++) {
+            s = SONG_AT(gjay->songs, i);
+            if (s->marked && added)
+                journal_song(gjay->songs, s);
             if (s->marked && !s->no_data) {
                 /* Change the tree view icon and selection view, if
                  * necessary. Note that song paths are latin-1 */
@@ -387,7 +388,7 @@ gboolean daemon_pipe_input (GIOChannel *source,
                     update = TRUE;
                 }
             }
-            SONG(ll)->marked = FALSE;
+            s->marked = FALSE;
         }
         break;
     case ANIMATE_START:
@@ -399,6 +400,12 @@ gboolean daemon_pipe_input (GIOChannel *source,
     case ANIMATE_STOP:
         explore_animate_stop();
         break;
+    case STATS:
+        /* Also kept in ~/.gjay/daemon_stats.json */
+        buffer[len] = '\0';
+        if (gjay->verbosity > 1)
+            printf(_("Daemon statistics: %s\n"), buffer + sizeof(ipc_type));
+        break;
     default:
         // Do nothing
         break;
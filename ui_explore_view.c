@@ -30,6 +30,7 @@
 #include "ui.h"
 #include "ui_private.h"
 #include "ipc.h"
+#include "tags.h"
 
 
 
@@ -149,6 +150,7 @@ NULL);
  */
 void explore_view_set_root (GjayApp *gjay) {
     GList * llist=NULL;
+    guint i;
     char buffer[BUFFER_SIZE];
 	ftw_data fdata;
 
@@ -159,9 +161,8 @@ void explore_view_set_root (GjayApp *gjay) {
     gjay->tree_depth = 0;
     
     /* Unmark current songs */
-    for (llist = g_list_first(gjay->songs->songs); llist!=NULL; llist = g_list_next(llist)) {
-        SONG(llist)->in_tree = FALSE;
-    }
+    for (i = 0; i < gjay->songs->songs->len; i++)
+        SONG_AT(gjay->songs, i)->in_tree = FALSE;
     
     /* Clear queue of files which were pending addition from previous
      * tree-building attempt. This should rarely be needed. */
@@ -294,6 +295,7 @@ static int tree_add_idle (gpointer data) {
     GjaySong * s, * original;
     gboolean is_song;
     song_file_type type;
+    GjayTags tags;
 	GjayApp *gjay=(GjayApp*)data;
     
     if (g_queue_is_empty(files_to_add_queue)) {
@@ -355,7 +357,7 @@ static int tree_add_idle (gpointer data) {
         }
         parent = iter_stack->tail->data;   
 
-        s = (GjaySong *) g_hash_table_lookup(gjay->songs->name_hash, fta->fname);
+        s = song_by_path(gjay->songs, fta->fname);
         
         if (s) {
             set_add_files_progress(NULL, (file_to_add_count * 100) / 
@@ -363,12 +365,19 @@ static int tree_add_idle (gpointer data) {
             s->in_tree = TRUE;
             if (!s->no_data) {
                 pm_type = PM_FILE_SONG;
+                /* Songs from before fingerprints get one now */
+                if (s->fingerprint == NULL && !s->repeat_prev) {
+                    song_from_fingerprint(gjay->songs, s);
+                    journal_song(gjay->songs, s);
+                }
+            } else if (song_from_fingerprint(gjay->songs, s)) {
+                pm_type = PM_FILE_SONG;
+                journal_song(gjay->songs, s);
             } else {
                 pm_type = PM_FILE_PENDING;
                 /* Analyze this file if it's the first song of a string of
                  * duplicates */
-                if (s == g_hash_table_lookup(gjay->songs->inode_dev_hash, 
-                                             &s->inode_dev_hash)) {
+                if (s == song_by_inode_dev(gjay->songs, &s->inode_dev_hash)) {
                     files_to_analyze = g_list_append(
                         files_to_analyze, strdup_to_latin1(s->path));
                 }
@@ -379,7 +388,6 @@ static int tree_add_idle (gpointer data) {
             set_add_files_progress(fta->fname, 
                                    (file_to_add_count * 100) / 
                                    total_files_to_add);
-            gjay->songs->dirty = TRUE;
 
             s = create_song();
             file_info(gjay->verbosity,
@@ -392,32 +400,41 @@ static int tree_add_idle (gpointer data) {
                       &s->title,
                       &s->artist,
                       &s->album,
-                      &type);
+                      &type,
+                      &tags);
             hash_inode_dev(s, TRUE);
             if (is_song) {
                 song_set_path(s, fta->fname);
+                add_song(gjay->songs, s);
                 /* Check for symlinkery */
-                original = g_hash_table_lookup(gjay->songs->inode_dev_hash, 
-                                               &s->inode_dev_hash);
+                original = song_by_inode_dev(gjay->songs, &s->inode_dev_hash);
                 if (original) { 
                     song_set_repeats(s, original);
                     pm_type = PM_FILE_SONG;
                 } else { 
                     g_hash_table_insert(gjay->songs->inode_dev_hash, 
-                                        &s->inode_dev_hash, s);
-                    /* Add to analysis queue */
-                    files_to_analyze = g_list_append(files_to_analyze,
-                                                     strdup_to_latin1(fta->fname));
-                    pm_type = PM_FILE_PENDING;
+                                        &s->inode_dev_hash,
+                                        GUINT_TO_POINTER(s->id));
+                    if (gjay_tags_to_song(&tags, s)) {
+                        /* Analyzed before and tagged, maybe elsewhere */
+                        pm_type = PM_FILE_SONG;
+                    } else if (song_from_fingerprint(gjay->songs, s)) {
+                        /* Moved or copied from a song we know */
+                        pm_type = PM_FILE_SONG;
+                    } else {
+                        /* Add to analysis queue */
+                        files_to_analyze = g_list_append(files_to_analyze,
+                                                         strdup_to_latin1(fta->fname));
+                        pm_type = PM_FILE_PENDING;
+                    }
                 }
-                gjay->songs->songs = g_list_append(gjay->songs->songs, s);
-                g_hash_table_insert(gjay->songs->name_hash, s->path, s);
                 s->in_tree = TRUE;
+                journal_song(gjay->songs, s);
             } else {
                 delete_song(s);
                 str = g_strdup(fta->fname);
-                gjay->songs->not_songs = g_list_append(gjay->songs->not_songs, str);
-                g_hash_table_insert(gjay->songs->not_hash, str, (gpointer) TRUE);
+                add_not_song(gjay->songs, str);
+                journal_not_song(gjay->songs, str);
                 pm_type = PM_FILE_NOSONG;
             }
         }
@@ -706,7 +723,7 @@ gint iter_sort_strcmp  (GtkTreeModel *model,
  * Return TRUE if the directory contains at least one song which
  * has not been rated or color-categorized
  */
-gboolean explore_dir_has_new_songs ( GHashTable *name_hash, const gchar * dir, const guint verbosity ) {
+gboolean explore_dir_has_new_songs ( GjaySongLists *songs, const gchar * dir, const guint verbosity ) {
     gboolean result = FALSE;
     GList * list;
     GjaySong * s;
@@ -714,7 +731,7 @@ gboolean explore_dir_has_new_songs ( GHashTable *name_hash, const gchar * dir, c
     list = explore_files_in_dir(dir, TRUE);
     for (; list; list = g_list_next(list)) {
         if (result == FALSE) {
-            s = g_hash_table_lookup(name_hash, list->data);
+            s = song_by_path(songs, list->data);
             if (s) {
                 if (s->no_rating && s->no_color) {
                     result = TRUE;
@@ -747,7 +764,7 @@ static void explore_mark_new_dirs ( GjayApp *gjay, char * dir ) {
         buffer[len - 1] = '\0';
     
     if (strcmp(dir, gjay->prefs->song_root_dir) != 0) {
-        if (explore_dir_has_new_songs(gjay->songs->name_hash, dir,
+        if (explore_dir_has_new_songs(gjay->songs, dir,
 			  gjay->verbosity)) {
             str = g_strdup(dir); 
             gjay->new_song_dirs = g_list_append(gjay->new_song_dirs, str);
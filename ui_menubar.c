@@ -104,7 +104,7 @@ void menuitem_currentsong (GtkAction *action, gpointer user_data) {
     }
     return;
   }
-  s = gjay->player->get_current_song(gjay->player,gjay->songs->name_hash);
+  s = gjay->player->get_current_song(gjay->player,gjay->songs);
   if (s) {
     explore_select_song(s);
   } else {
@@ -62,7 +62,7 @@ GList *     explore_files_in_dir         ( const char * dir,
 GList *     explore_dirs_in_dir          ( const char * dir );
 void        explore_animate_pending      ( GjayGUI *gui, char * file );
 void        explore_animate_stop         ( void );
-gboolean    explore_dir_has_new_songs    ( GHashTable *name_hash,
+gboolean    explore_dir_has_new_songs    ( GjaySongLists *songs,
                                            const gchar * dir,
                                            const guint verbosity	);
 void        explore_select_song          ( GjaySong * s);
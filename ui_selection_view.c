@@ -30,6 +30,7 @@
 #include "ui_private.h"
 #include "rgbhsv.h"
 #include "play_common.h"
+#include "ipc.h"
 
 enum {
    ARTIST_COLUMN,
@@ -228,7 +229,7 @@ void set_selected_in_playlist_view ( GjayApp *gjay, const gboolean in_view ) {
     if (g_list_length(gjay->selected_files) > 1)
         return;
     fname = (gchar *) gjay->selected_files->data;
-    if ( g_hash_table_lookup(gjay->songs->name_hash, fname) ||
+    if ( song_by_path(gjay->songs, fname) ||
          g_hash_table_lookup(gjay->songs->not_hash, fname))
         return;
     if (in_view) {
@@ -249,6 +250,7 @@ set_selected_file ( GjayApp *gjay,
     GList * llist;
     int pm_type;
     GjaySong * s;
+    gchar * latin1;
 
     for (llist = g_list_first(gjay->selected_files); 
          llist;
@@ -270,6 +272,17 @@ set_selected_file ( GjayApp *gjay,
     }
 
     gtk_widget_show(icon);   
+
+    /* Anything in it still waiting to be analyzed is wanted first. A
+       queued file is already a song, one with no data yet. The
+       daemon's queue has latin-1 paths. */
+    if (is_dir ||
+        (!g_hash_table_lookup(gjay->songs->not_hash, file) &&
+         ((s = song_by_path(gjay->songs, file)) == NULL || s->no_data))) {
+        latin1 = strdup_to_latin1(file);
+        send_ipc_text(gjay->ipc->ui_fifo, PROMOTE, latin1);
+        g_free(latin1);
+    }
         
     strncpy(short_name_trunc, short_name, BUFFER_SIZE);
     if (strlen(short_name) > TRUNC_NAME)
@@ -295,7 +308,7 @@ set_selected_file ( GjayApp *gjay,
     } else {
         gtk_widget_hide(select_all_recursive);
     
-        s = g_hash_table_lookup(gjay->songs->name_hash, file);
+        s = song_by_path(gjay->songs, file);
         
         if (s) {
             gtk_label_set_text(GTK_LABEL(label_name), "");
@@ -356,7 +369,7 @@ static void set_selected_files (GjayApp *gjay, GList * files) {
         if (g_hash_table_lookup(gjay->songs->not_hash, llist->data)) {
             g_free(llist->data);
         } else {
-            s = g_hash_table_lookup(gjay->songs->name_hash, llist->data);
+            s = song_by_path(gjay->songs, llist->data);
             if (!s) {
                 /* This may happen a directory contains an empty directory, 
                    so the file list includes a directory path and not
@@ -494,14 +507,13 @@ void update_selected_songs_color (gpointer data,
         
         /* If other songs mirror this one, pass on the change */
         song_set_repeat_attrs(s);
+        journal_song(gjay->songs, s);
 
         /* If this song was not previously assigned a color or rating,
            update how it is displayed */
         if (!had_color_rating) 
             update_song_has_rating_color(gjay, s);
     }
-
-    gjay->songs->dirty = TRUE;
 }
 
 
@@ -563,6 +575,7 @@ static void rating_changed ( GtkRange *range,
         s->rating = val;
         /* If other songs mirror this one, pass on the change */
         song_set_repeat_attrs(s);
+        journal_song(gjay->songs, s);
 
         /* If this song was not previously assigned a color or rating,
            update how it is displayed */
@@ -571,8 +584,6 @@ static void rating_changed ( GtkRange *range,
         }
     }
     gtk_label_set_text (GTK_LABEL(label_rating), "Rating");
-
-    gjay->songs->dirty = TRUE;
 }
 
 
@@ -600,7 +611,7 @@ static void update_dir_has_rating_color (GjayApp *gjay, const gchar * dir ) {
     if (!str) 
         return;
 
-    if (explore_dir_has_new_songs(gjay->songs->name_hash, dir,
+    if (explore_dir_has_new_songs(gjay->songs, dir,
 		  gjay->verbosity))
         return;
 
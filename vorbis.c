@@ -24,17 +24,46 @@
 
 #ifdef HAVE_VORBIS_VORBISFILE_H
 
+#include <string.h>
 #include <strings.h>
 #include <dlfcn.h>
 #include <gjay.h>
 #include <vorbis/vorbisfile.h>
 #include "vorbis.h"
+#include "i18n.h"
 
 /* the functions */
 int (*gjov_fopen)(char *path, OggVorbis_File *vf);
 vorbis_comment *(*gjov_comment)(OggVorbis_File *vf, int link);
 double (*gjov_time_total)(OggVorbis_File *vf, int i);
 int (*gjov_clear)(OggVorbis_File *vf);
+long (*gjov_read)(OggVorbis_File *vf, char *buffer, int length,
+    int bigendianp, int word, int sgned, int *bitstream);
+vorbis_info *(*gjov_info)(OggVorbis_File *vf, int link);
+int (*gjov_pcm_seek_page)(OggVorbis_File *vf, ogg_int64_t pos);
+
+/* For rewriting the comment header; libogg comes in with libvorbis.
+ * Only looked for, as tags are written if they can be. */
+int (*gjogg_sync_init)(ogg_sync_state *oy);
+int (*gjogg_sync_clear)(ogg_sync_state *oy);
+char *(*gjogg_sync_buffer)(ogg_sync_state *oy, long size);
+int (*gjogg_sync_wrote)(ogg_sync_state *oy, long bytes);
+int (*gjogg_sync_pageout)(ogg_sync_state *oy, ogg_page *og);
+int (*gjogg_stream_init)(ogg_stream_state *os, int serialno);
+int (*gjogg_stream_clear)(ogg_stream_state *os);
+int (*gjogg_stream_pagein)(ogg_stream_state *os, ogg_page *og);
+int (*gjogg_stream_packetout)(ogg_stream_state *os, ogg_packet *op);
+int (*gjogg_stream_packetin)(ogg_stream_state *os, ogg_packet *op);
+int (*gjogg_stream_flush)(ogg_stream_state *os, ogg_page *og);
+int (*gjogg_page_serialno)(const ogg_page *og);
+long (*gjogg_page_pageno)(const ogg_page *og);
+void (*gjogg_page_checksum_set)(ogg_page *og);
+static gboolean ogg_write_supported = FALSE;
+
+#define OGG_READ_SIZE 4096
+/* Room left after the comments when the headers have to grow, so that
+   the next change fits in place */
+#define OGG_COMMENT_PADDING 1024
 
 gboolean
 gjay_vorbis_dlopen(void) {
@@ -60,6 +89,32 @@ gjay_vorbis_dlopen(void) {
   if ( (gjov_clear = 
         gjay_dlsym(lib, "ov_clear")) == NULL)
     return FALSE;
+  if ( (gjov_read = 
+        gjay_dlsym(lib, "ov_read")) == NULL)
+    return FALSE;
+  if ( (gjov_info = 
+        gjay_dlsym(lib, "ov_info")) == NULL)
+    return FALSE;
+  if ( (gjov_pcm_seek_page = 
+        gjay_dlsym(lib, "ov_pcm_seek_page")) == NULL)
+    return FALSE;
+
+  ogg_write_supported =
+    (gjogg_sync_init = dlsym(lib, "ogg_sync_init")) != NULL &&
+    (gjogg_sync_clear = dlsym(lib, "ogg_sync_clear")) != NULL &&
+    (gjogg_sync_buffer = dlsym(lib, "ogg_sync_buffer")) != NULL &&
+    (gjogg_sync_wrote = dlsym(lib, "ogg_sync_wrote")) != NULL &&
+    (gjogg_sync_pageout = dlsym(lib, "ogg_sync_pageout")) != NULL &&
+    (gjogg_stream_init = dlsym(lib, "ogg_stream_init")) != NULL &&
+    (gjogg_stream_clear = dlsym(lib, "ogg_stream_clear")) != NULL &&
+    (gjogg_stream_pagein = dlsym(lib, "ogg_stream_pagein")) != NULL &&
+    (gjogg_stream_packetout = dlsym(lib, "ogg_stream_packetout")) != NULL &&
+    (gjogg_stream_packetin = dlsym(lib, "ogg_stream_packetin")) != NULL &&
+    (gjogg_stream_flush = dlsym(lib, "ogg_stream_flush")) != NULL &&
+    (gjogg_page_serialno = dlsym(lib, "ogg_page_serialno")) != NULL &&
+    (gjogg_page_pageno = dlsym(lib, "ogg_page_pageno")) != NULL &&
+    (gjogg_page_checksum_set = dlsym(lib, "ogg_page_checksum_set")) != NULL;
+  dlerror();
   return TRUE;
 }
 
@@ -68,7 +123,8 @@ read_ogg_file_type(   gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album)
+                      gchar   ** album,
+                      GjayTags * tags)
 {
   OggVorbis_File *vf;
   vorbis_comment *vc;
@@ -96,6 +152,11 @@ read_ogg_file_type(   gchar    * path,
     } else if (strncasecmp(vc->user_comments[i], "album=", 6) ==0)
     {
       *album = strdup_to_utf8(vc->user_comments[i] + 6);
+    } else if (tags && strncasecmp(vc->user_comments[i], GJAY_TAG_PREFIX,
+                                   strlen(GJAY_TAG_PREFIX)) == 0)
+    {
+      gjay_tags_parse_comment(tags, vc->user_comments[i],
+                              vc->comment_lengths[i]);
     }
   }
   (*gjov_clear)(vf);
@@ -104,5 +165,432 @@ read_ogg_file_type(   gchar    * path,
   return TRUE;
 }
 
+static guint32
+le32 (const guchar * b)
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((guint32) b[3] << 24);
+}
+
+static void
+append_le32 (GByteArray * array, const guint32 n)
+{
+  guint32 le = GUINT32_TO_LE(n);
+
+  g_byte_array_append(array, (const guint8 *) &le, 4);
+}
+
+/**
+ * A copy of the Vorbis comment header packet with any GJAY_ comments
+ * replaced by the given ones. NULL if old isn't a comment header.
+ */
+static GByteArray *
+vorbis_comment_packet (const GByteArray * old, gchar ** comments)
+{
+  GByteArray * packet, * kept;
+  guint32 len, n, count, i;
+  gsize pos;
+  gint k;
+
+  if (old->len < 15 || memcmp(old->data, "\003vorbis", 7) != 0)
+    return NULL;
+  pos = 7;
+  len = le32(old->data + pos);
+  if (len > old->len - 15)
+    return NULL;
+  pos += 4 + len;
+  n = le32(old->data + pos);
+  pos += 4;
+
+  kept = g_byte_array_new();
+  count = 0;
+  for (i = 0; i < n; i++) {
+    if (old->len - pos < 4 || (len = le32(old->data + pos)) > old->len - pos - 4) {
+      g_byte_array_free(kept, TRUE);
+      return NULL;
+    }
+    if (len < strlen(GJAY_TAG_PREFIX) ||
+        g_ascii_strncasecmp((const gchar *) old->data + pos + 4,
+                            GJAY_TAG_PREFIX, strlen(GJAY_TAG_PREFIX)) != 0) {
+      g_byte_array_append(kept, old->data + pos, 4 + len);
+      count++;
+    }
+    pos += 4 + len;
+  }
+  for (k = 0; comments[k]; k++) {
+    append_le32(kept, strlen(comments[k]));
+    g_byte_array_append(kept, (const guint8 *) comments[k],
+                        strlen(comments[k]));
+    count++;
+  }
+
+  /* Signature and vendor, the comments, then the framing bit */
+  packet = g_byte_array_new();
+  g_byte_array_append(packet, old->data, 7 + 4 + le32(old->data + 7));
+  append_le32(packet, count);
+  g_byte_array_append(packet, kept->data, kept->len);
+  g_byte_array_append(packet, (const guint8 *) "\001", 1);
+  g_byte_array_free(kept, TRUE);
+  return packet;
+}
+
+static gboolean
+write_ogg_page (FILE * f, const ogg_page * og)
+{
+  return fwrite(og->header, 1, og->header_len, f) == (size_t) og->header_len &&
+         fwrite(og->body, 1, og->body_len, f) == (size_t) og->body_len;
+}
+
+/* The next whole page of f, skipping any that are damaged; FALSE at
+   its end */
+static gboolean
+read_ogg_page (FILE * f, ogg_sync_state * oy, ogg_page * og)
+{
+  gchar * buf;
+  glong count;
+  gint result;
+
+  while ((result = (*gjogg_sync_pageout)(oy, og)) != 1) {
+    if (result < 0)
+      continue;
+    buf = (*gjogg_sync_buffer)(oy, OGG_READ_SIZE);
+    if ((count = fread(buf, 1, OGG_READ_SIZE, f)) <= 0)
+      return FALSE;
+    (*gjogg_sync_wrote)(oy, count);
+  }
+  return TRUE;
+}
+
+/**
+ * The three header packets in pages, the identification header on the
+ * first page by itself as encoders do it, and the number of pages in
+ * pages. The comment header is padded with pad zero bytes after its
+ * framing bit, which decoders don't read.
+ */
+static GByteArray *
+ogg_header_pages (const gint serial, GByteArray ** header,
+                  GByteArray * comment, const gsize pad, gint * pages)
+{
+  ogg_stream_state os;
+  ogg_packet op;
+  ogg_page og;
+  GByteArray * out;
+  guint len;
+  gint k;
+
+  len = comment->len;
+  g_byte_array_set_size(comment, len + pad);
+  memset(comment->data + len, 0x00, pad);
+
+  out = g_byte_array_new();
+  *pages = 0;
+  (*gjogg_stream_init)(&os, serial);
+  for (k = 0; k < 3; k++) {
+    memset(&op, 0x00, sizeof(op));
+    op.packet = (k == 1) ? comment->data : header[k]->data;
+    op.bytes = (k == 1) ? comment->len : header[k]->len;
+    op.b_o_s = (k == 0);
+    op.packetno = k;
+    (*gjogg_stream_packetin)(&os, &op);
+    if (k == 0 || k == 2) {
+      while ((*gjogg_stream_flush)(&os, &og)) {
+        g_byte_array_append(out, og.header, og.header_len);
+        g_byte_array_append(out, og.body, og.body_len);
+        (*pages)++;
+      }
+    }
+  }
+  (*gjogg_stream_clear)(&os);
+  g_byte_array_set_size(comment, len);
+  return out;
+}
+
+/**
+ * The header pages padded out to exactly size bytes over the given
+ * number of pages, so they can be written over the old ones, or NULL
+ * if they can't be.
+ */
+static GByteArray *
+ogg_header_pages_fit (const gint serial, GByteArray ** header,
+                      GByteArray * comment, const gsize size,
+                      const gint pages)
+{
+  GByteArray * out;
+  gsize pad, gap;
+  gint n;
+
+  out = ogg_header_pages(serial, header, comment, 0, &n);
+  if (out->len == size && n == pages)
+    return out;
+  gap = size - out->len;
+  if (out->len > size)
+    gap = 0;
+  g_byte_array_free(out, TRUE);
+
+  /* Each 255 bytes of padding take another byte of lacing */
+  for (pad = gap - MIN(gap, gap / 255 + 2); pad <= gap && gap > 0; pad++) {
+    out = ogg_header_pages(serial, header, comment, pad, &n);
+    if (out->len == size && n == pages)
+      return out;
+    n = (out->len > size);
+    g_byte_array_free(out, TRUE);
+    if (n)
+      break;
+  }
+  return NULL;
+}
+
+/* Whether the tags read back from path are the comments written */
+static gboolean
+ogg_tags_written (gchar * path, gchar ** comments)
+{
+  GjayTags tags;
+  gchar * title = NULL, * artist = NULL, * album = NULL;
+  gint length;
+  gboolean ok;
+
+  memset(&tags, 0x00, sizeof(tags));
+  ok = read_ogg_file_type(path, &length, &title, &artist, &album, &tags) &&
+       gjay_tags_match(&tags, comments);
+  g_free(title);
+  g_free(artist);
+  g_free(album);
+  return ok;
+}
+
+/**
+ * Whether the pages after the headers of a rewritten file, from
+ * temp_start on, are those from start on in the original, byte for
+ * byte but for the page numbers of the first stream, which move by
+ * delta, and so the checksums.
+ */
+static gboolean
+ogg_audio_same (const gchar * path, const glong start,
+                const gchar * temp_path, const glong temp_start,
+                const gint serial, const glong delta)
+{
+  FILE * f[2];
+  ogg_sync_state oy[2];
+  ogg_page og[2];
+  gboolean more[2], ok;
+  gint k;
+
+  f[0] = fopen(path, "rb");
+  f[1] = fopen(temp_path, "rb");
+  ok = (f[0] && f[1] && fseek(f[0], start, SEEK_SET) == 0 &&
+        fseek(f[1], temp_start, SEEK_SET) == 0);
+  for (k = 0; k < 2; k++)
+    (*gjogg_sync_init)(&oy[k]);
+
+  while (ok) {
+    for (k = 0; k < 2; k++)
+      more[k] = read_ogg_page(f[k], &oy[k], &og[k]);
+    if (!more[0] || !more[1]) {
+      ok = (more[0] == more[1] && !ferror(f[0]) && !ferror(f[1]));
+      break;
+    }
+    ok = (og[0].header_len == og[1].header_len &&
+          og[0].body_len == og[1].body_len &&
+          memcmp(og[0].header, og[1].header, 18) == 0 &&
+          memcmp(og[0].header + 26, og[1].header + 26,
+                 og[0].header_len - 26) == 0 &&
+          memcmp(og[0].body, og[1].body, og[0].body_len) == 0 &&
+          (*gjogg_page_pageno)(&og[1]) == (*gjogg_page_pageno)(&og[0]) +
+            ((*gjogg_page_serialno)(&og[0]) == serial ? delta : 0));
+  }
+
+  for (k = 0; k < 2; k++) {
+    (*gjogg_sync_clear)(&oy[k]);
+    if (f[k])
+      fclose(f[k]);
+  }
+  return ok;
+}
+
+/**
+ * Replace the GJAY_ comments of an Ogg Vorbis file. When the new
+ * headers can be padded out to the old ones' pages they are written
+ * over them, and put back if the tags don't then read back right.
+ * Otherwise the file is rewritten with room to spare: the
+ * three header packets are put in new pages and the audio pages are
+ * copied over, renumbered if the headers now take up a different
+ * number of pages. The copy has to read back with the new tags and
+ * the same audio before it replaces the original.
+ */
+gboolean
+write_ogg_gjay_tags (const gchar * path, gchar ** comments)
+{
+  FILE * in, * out;
+  ogg_sync_state oy;
+  ogg_stream_state is;
+  ogg_page og;
+  ogg_packet op;
+  GByteArray * header[3] = { NULL, NULL, NULL }, * comment = NULL;
+  GByteArray * pages = NULL, * old_pages;
+  gchar * buf, * temp_path;
+  glong count, delta, pageno, in_bytes = 0;
+  gint serial = 0, got = 0, in_pages = 0, out_pages = 0, result, k;
+  gboolean ok, stream_open = FALSE;
+
+  if (!ogg_write_supported)
+    return FALSE;
+  if ((in = fopen(path, "rb")) == NULL)
+    return FALSE;
+  (*gjogg_sync_init)(&oy);
+
+  /* The identification, comment and setup headers of the first stream,
+     which start the file */
+  while (got < 3) {
+    result = (*gjogg_sync_pageout)(&oy, &og);
+    if (result == 0) {
+      buf = (*gjogg_sync_buffer)(&oy, OGG_READ_SIZE);
+      if ((count = fread(buf, 1, OGG_READ_SIZE, in)) <= 0)
+        break;
+      (*gjogg_sync_wrote)(&oy, count);
+      continue;
+    }
+    if (result < 0)
+      break;
+    if (!stream_open) {
+      serial = (*gjogg_page_serialno)(&og);
+      (*gjogg_stream_init)(&is, serial);
+      stream_open = TRUE;
+    } else if ((*gjogg_page_serialno)(&og) != serial) {
+      break;
+    }
+    (*gjogg_stream_pagein)(&is, &og);
+    in_pages++;
+    in_bytes += og.header_len + og.body_len;
+    while (got < 3 && (*gjogg_stream_packetout)(&is, &op) == 1) {
+      header[got] = g_byte_array_new();
+      g_byte_array_append(header[got], op.packet, op.bytes);
+      got++;
+    }
+  }
+  /* Audio must start on a page of its own */
+  ok = (got == 3 && (*gjogg_stream_packetout)(&is, &op) == 0 &&
+        (comment = vorbis_comment_packet(header[1], comments)) != NULL);
+
+  if (ok && (pages = ogg_header_pages_fit(serial, header, comment,
+                                          in_bytes, in_pages)) != NULL) {
+    /* The same file, with nothing after the headers touched. The old
+       headers go back if the new ones don't read back right. */
+    if ((out = fopen(path, "r+b")) != NULL &&
+        (old_pages = gjay_tags_head_save(out, pages->len)) != NULL) {
+      ok = (fwrite(pages->data, 1, pages->len, out) == pages->len &&
+            fflush(out) == 0 &&
+            ogg_tags_written((gchar *) path, comments));
+      if (ok)
+        g_byte_array_free(old_pages, TRUE);
+      else
+        gjay_tags_head_restore(out, path, old_pages);
+      ok = (fclose(out) == 0) && ok;
+    } else {
+      if (out)
+        fclose(out);
+      ok = FALSE;
+    }
+  } else if (ok && (out = gjay_tags_temp_open(path, &temp_path)) != NULL) {
+    pages = ogg_header_pages(serial, header, comment, OGG_COMMENT_PADDING,
+                             &out_pages);
+    ok = (fwrite(pages->data, 1, pages->len, out) == pages->len);
+
+    delta = out_pages - in_pages;
+    while (ok && read_ogg_page(in, &oy, &og)) {
+      if (delta && (*gjogg_page_serialno)(&og) == serial) {
+        pageno = (*gjogg_page_pageno)(&og) + delta;
+        og.header[18] = pageno & 0xff;
+        og.header[19] = (pageno >> 8) & 0xff;
+        og.header[20] = (pageno >> 16) & 0xff;
+        og.header[21] = (pageno >> 24) & 0xff;
+        (*gjogg_page_checksum_set)(&og);
+      }
+      ok = write_ogg_page(out, &og);
+    }
+    ok = ok && !ferror(in) && fflush(out) == 0;
+    ok = ok && ogg_tags_written(temp_path, comments) &&
+         ogg_audio_same(path, in_bytes, temp_path, pages->len, serial, delta);
+    ok = gjay_tags_temp_replace(out, temp_path, path, ok);
+  } else {
+    ok = FALSE;
+  }
+
+  if (stream_open)
+    (*gjogg_stream_clear)(&is);
+  (*gjogg_sync_clear)(&oy);
+  fclose(in);
+  for (k = 0; k < 3; k++)
+    if (header[k])
+      g_byte_array_free(header[k], TRUE);
+  if (comment)
+    g_byte_array_free(comment, TRUE);
+  if (pages)
+    g_byte_array_free(pages, TRUE);
+  return ok;
+}
+
+/* In-process decoding, see decoder.h */
+static gboolean
+vorbis_decoder_open(GjayDecoder *dec, const gchar *path)
+{
+  OggVorbis_File *vf;
+  vorbis_info *vi;
+
+  if (gjov_fopen == NULL)
+    return FALSE;
+
+  vf = g_malloc0(sizeof(OggVorbis_File));
+  if ((*gjov_fopen)((char *)path, vf) != 0) {
+    g_free(vf);
+    return FALSE;
+  }
+  if ((vi = (*gjov_info)(vf, -1)) == NULL) {
+    (*gjov_clear)(vf);
+    g_free(vf);
+    return FALSE;
+  }
+  dec->channels = vi->channels;
+  dec->rate = vi->rate;
+  dec->handle = vf;
+  return TRUE;
+}
+
+static glong
+vorbis_decoder_read(GjayDecoder *dec, gchar *buf, const gsize len)
+{
+  int bitstream;
+  long result;
+
+  /* Skip over holes in the stream rather than stopping the analysis */
+  do {
+    result = (*gjov_read)((OggVorbis_File *)dec->handle, buf, len,
+        0, 2, 1, &bitstream);
+  } while (result == OV_HOLE);
+  return result;
+}
+
+/* Seeking to the page is close enough for picking out parts of a song
+   and much quicker than an exact seek */
+static gboolean
+vorbis_decoder_seek(GjayDecoder *dec, const guint64 frame)
+{
+  return (*gjov_pcm_seek_page)((OggVorbis_File *)dec->handle,
+      (ogg_int64_t)frame) == 0;
+}
+
+static void
+vorbis_decoder_close(GjayDecoder *dec)
+{
+  (*gjov_clear)((OggVorbis_File *)dec->handle);
+  g_free(dec->handle);
+}
+
+const GjayDecoderBackend vorbis_decoder_backend = {
+  "libvorbisfile",
+  vorbis_decoder_open,
+  vorbis_decoder_read,
+  vorbis_decoder_seek,
+  vorbis_decoder_close
+};
+
 #endif /* HAVE_VORBIS_VORBISFILE_H */
 
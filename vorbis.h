@@ -20,13 +20,21 @@
 #ifndef VORBIS_H
 #define VORBIS_H
 
+#include "decoder.h"
+#include "tags.h"
+
 gboolean gjay_vorbis_dlopen(void);
 gboolean
 read_ogg_file_type( gchar    * path,
                       gint     * length,
                       gchar   ** title,
                       gchar   ** artist,
-                      gchar   ** album);
+                      gchar   ** album,
+                      GjayTags * tags);
+gboolean write_ogg_gjay_tags( const gchar * path,
+                             gchar ** comments );
+
+extern const GjayDecoderBackend vorbis_decoder_backend;
 
 #endif /* VORBIS_H */
 #endif /* HAVE_VORBIS_VORBISFILE_H */
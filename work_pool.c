@@ -0,0 +1,125 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * work_pool.c -- a GThreadPool of its own for an analysis worker, so a
+ * song split over threads hands them a batch at a time rather than
+ * starting threads for each one. The worker pushes a batch, does its
+ * own share, then waits for the rest.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include "work_pool.h"
+#include "i18n.h"
+
+struct _GjayWorkPool {
+  GThreadPool *pool;
+  guint        threads;   /* The pool's and the caller's */
+  GMutex       lock;
+  GCond        done;
+  guint        pending;   /* Pushed and not yet run */
+};
+
+typedef struct {
+  GThreadFunc func;
+  gpointer    data;
+} work_pool_job;
+
+static void
+work_pool_run (gpointer data, gpointer user_data)
+{
+  work_pool_job *job = data;
+  GjayWorkPool *pool = user_data;
+
+  (*job->func)(job->data);
+  g_free(job);
+  g_mutex_lock(&pool->lock);
+  if (--pool->pending == 0)
+    g_cond_signal(&pool->done);
+  g_mutex_unlock(&pool->lock);
+}
+
+GjayWorkPool *
+gjay_work_pool_new (const guint threads)
+{
+  GjayWorkPool *pool;
+  GError *error = NULL;
+
+  if (threads < 2)
+    return NULL;
+  pool = g_new0(GjayWorkPool, 1);
+  g_mutex_init(&pool->lock);
+  g_cond_init(&pool->done);
+  pool->threads = threads;
+  /* Exclusive, so its threads are started now and kept */
+  pool->pool = g_thread_pool_new(work_pool_run, pool, threads - 1, TRUE,
+                                 &error);
+  if (pool->pool == NULL) {
+    g_warning(_("Unable to start analysis threads: %s\n"), error->message);
+    g_error_free(error);
+    g_mutex_clear(&pool->lock);
+    g_cond_clear(&pool->done);
+    g_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+guint
+gjay_work_pool_threads (const GjayWorkPool *pool)
+{
+  return pool ? pool->threads : 1;
+}
+
+void
+gjay_work_pool_push (GjayWorkPool *pool, GThreadFunc func, gpointer data)
+{
+  work_pool_job *job;
+
+  job = g_new(work_pool_job, 1);
+  job->func = func;
+  job->data = data;
+  g_mutex_lock(&pool->lock);
+  pool->pending++;
+  g_mutex_unlock(&pool->lock);
+  g_thread_pool_push(pool->pool, job, NULL);
+}
+
+void
+gjay_work_pool_wait (GjayWorkPool *pool)
+{
+  if (pool == NULL)
+    return;
+  g_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    g_cond_wait(&pool->done, &pool->lock);
+  g_mutex_unlock(&pool->lock);
+}
+
+void
+gjay_work_pool_free (GjayWorkPool *pool)
+{
+  if (pool == NULL)
+    return;
+  /* Runs anything still pushed, then stops the threads */
+  g_thread_pool_free(pool->pool, FALSE, TRUE);
+  g_mutex_clear(&pool->lock);
+  g_cond_clear(&pool->done);
+  g_free(pool);
+}
@@ -0,0 +1,40 @@
+/*
+ * Gjay - Gtk+ DJ music playlist creator
+ * Copyright (C) 2010-2015 Craig Small
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * work_pool.h -- threads kept to split one song's analysis over
+ */
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <glib.h>
+
+typedef struct _GjayWorkPool GjayWorkPool;
+
+/* Threads for the caller and threads - 1 more, which wait for work
+   until the pool is freed. NULL if threads is under 2, or they can't
+   be started; a NULL pool is the caller alone. */
+GjayWorkPool * gjay_work_pool_new     ( const guint threads );
+guint          gjay_work_pool_threads ( const GjayWorkPool *pool );
+/* Run func(data) on one of the pool's threads */
+void           gjay_work_pool_push    ( GjayWorkPool *pool,
+                                        GThreadFunc func,
+                                        gpointer data );
+/* Wait until everything pushed has run */
+void           gjay_work_pool_wait    ( GjayWorkPool *pool );
+void           gjay_work_pool_free    ( GjayWorkPool *pool );
+
+#endif /* WORK_POOL_H */